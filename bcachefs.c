@@ -93,6 +93,7 @@ static void usage(void)
 	     "  list_journal             List contents of journal\n"
 	     "\n"
 	     "Miscellaneous:\n"
+	     "  bench                    Run microbenchmarks\n"
 	     "  version                  Display the version of the invoked bcachefs tool\n");
 }
 
@@ -207,6 +208,8 @@ int main(int argc, char *argv[])
 		return cmd_fsck(argc, argv);
 	if (!strcmp(cmd, "version"))
 		return cmd_version(argc, argv);
+	if (!strcmp(cmd, "bench"))
+		return cmd_bench(argc, argv);
 	if (!strcmp(cmd, "show-super"))
 		return cmd_show_super(argc, argv);
 	if (!strcmp(cmd, "set-option"))
@@ -0,0 +1,745 @@
+#include <getopt.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include <crypto/chacha.h>
+#include <crypto/hash.h>
+#include <crypto/poly1305.h>
+#include <crypto/skcipher.h>
+#include <linux/crc64.h>
+#include <linux/percpu.h>
+#include <linux/random.h>
+#include <linux/preempt.h>
+#include <linux/slab.h>
+#include <linux/sort.h>
+
+#include "cmds.h"
+#include "tools-util.h"
+#include "libbcachefs/bcachefs.h"
+#include "libbcachefs/bset.h"
+#include "libbcachefs/btree_types.h"
+#include "libbcachefs/checksum.h"
+#include "libbcachefs/opts.h"
+#include "libbcachefs/super.h"
+#include "libbcachefs/tests.h"
+
+static void bench_usage(void)
+{
+	puts("bcachefs bench - run microbenchmarks\n"
+	     "Usage: bcachefs bench <benchmark> [OPTION]...\n"
+	     "       bcachefs bench <test>[,<test>...] [OPTION]... <devices>\n"
+	     "\n"
+	     "Benchmarks:\n"
+	     "  percpu                       Percpu counter updates, scaling from 1 to N threads\n"
+	     "  slab                         kmem_cache alloc/free, slab allocator vs. kmalloc\n"
+	     "  checksum                     Throughput of each checksum type, by buffer size\n"
+	     "  encrypt                      ChaCha20 and Poly1305 throughput, by buffer size\n"
+	     "  bset                         Btree node lookups, scalar vs. SIMD, by node size\n"
+	     "\n"
+	     "Btree perf tests, run against an existing filesystem:\n"
+	     "  rand_insert, rand_insert_multi, rand_insert_flush, rand_lookup,\n"
+	     "  rand_mixed, rand_delete,\n"
+	     "  seq_insert, seq_lookup, seq_overwrite, seq_delete\n"
+	     "  (unit tests, e.g. test_iterate, may also be run, but are timed as a single op)\n"
+	     "\n"
+	     "Options:\n"
+	     "  -t, --threads=nr             Maximum number of threads (default: number of cpus)\n"
+	     "  -n, --iterations=nr          Operations per thread\n"
+	     "  -k, --keys=nr                Number of keys for btree tests (default: 1M)\n"
+	     "  -d, --journal-depth=nr[,nr]  Run btree tests with each journal_max_in_flight\n"
+	     "      --json                   Print btree test results as JSON, one object per line\n"
+	     "  -h, --help                   Display this help and exit\n"
+	     "Report bugs to <linux-bcachefs@vger.kernel.org>");
+}
+
+struct bench_opts {
+	unsigned		nr_threads;
+	u64			iterations;
+	u64			nr_keys;
+	bool			json;
+	unsigned		nr_journal_depths;
+	unsigned		journal_depths[JOURNAL_BUF_NR];
+};
+
+typedef void (*bench_thread_fn)(void *, u64);
+
+struct bench_thread {
+	pthread_t		thread;
+	bench_thread_fn		fn;
+	void			*arg;
+	u64			iterations;
+	pthread_barrier_t	*barrier;
+};
+
+static void *bench_thread_fn_wrapper(void *p)
+{
+	struct bench_thread *t = p;
+
+	pthread_barrier_wait(t->barrier);
+	t->fn(t->arg, t->iterations);
+	return NULL;
+}
+
+/* Run @fn on @nr_threads threads at once, returns elapsed ns: */
+static u64 bench_run_threads(unsigned nr_threads, bench_thread_fn fn,
+			     void *arg, u64 iterations)
+{
+	struct bench_thread *threads = xcalloc(nr_threads, sizeof(*threads));
+	pthread_barrier_t barrier;
+	u64 start;
+	unsigned i;
+
+	pthread_barrier_init(&barrier, NULL, nr_threads + 1);
+
+	for (i = 0; i < nr_threads; i++) {
+		threads[i] = (struct bench_thread) {
+			.fn		= fn,
+			.arg		= arg,
+			.iterations	= iterations,
+			.barrier	= &barrier,
+		};
+
+		if (pthread_create(&threads[i].thread, NULL,
+				   bench_thread_fn_wrapper, &threads[i]))
+			die("pthread_create error: %m");
+	}
+
+	start = ktime_get_ns();
+	pthread_barrier_wait(&barrier);
+
+	for (i = 0; i < nr_threads; i++)
+		pthread_join(threads[i].thread, NULL);
+
+	pthread_barrier_destroy(&barrier);
+	free(threads);
+
+	return ktime_get_ns() - start;
+}
+
+static void bench_scaling(const char *name, struct bench_opts *opts,
+			  bench_thread_fn fn, void *arg,
+			  void (*check)(void *, u64))
+{
+	unsigned nr_threads;
+
+	printf("%s: %llu iterations per thread\n", name, opts->iterations);
+	printf("%8s %16s %16s\n", "threads", "total ops/sec", "ops/sec/thread");
+
+	for (nr_threads = 1;; nr_threads = min(nr_threads * 2, opts->nr_threads)) {
+		u64 ns = bench_run_threads(nr_threads, fn, arg, opts->iterations);
+		u64 ops = opts->iterations * nr_threads;
+
+		if (check)
+			check(arg, ops);
+
+		printf("%8u %16llu %16llu\n", nr_threads,
+		       div64_u64(ops * NSEC_PER_SEC, max(ns, 1ULL)),
+		       div64_u64(opts->iterations * NSEC_PER_SEC, max(ns, 1ULL)));
+
+		if (nr_threads == opts->nr_threads)
+			break;
+	}
+}
+
+/* percpu: */
+
+struct bench_percpu_usage {
+	u64			buckets;
+	u64			sectors;
+	u64			fragmented;
+};
+
+struct bench_percpu {
+	u64 __percpu			*counter;
+	struct bench_percpu_usage __percpu *usage;
+};
+
+static void bench_percpu_thread(void *arg, u64 iterations)
+{
+	struct bench_percpu *b = arg;
+
+	while (iterations--) {
+		struct bench_percpu_usage *u;
+
+		/* Single counter, like the c->counters[] updates: */
+		this_cpu_inc(*b->counter);
+
+		/* Multiple fields, like bch2_dev_usage_update(): */
+		preempt_disable();
+		u = this_cpu_ptr(b->usage);
+		u->buckets++;
+		u->sectors += 8;
+		u->fragmented += 1;
+		preempt_enable();
+	}
+}
+
+static void bench_percpu_check(void *arg, u64 ops)
+{
+	struct bench_percpu *b = arg;
+	u64 counter = 0, buckets = 0, sectors = 0;
+	unsigned cpu;
+
+	for_each_possible_cpu(cpu) {
+		counter	+= *per_cpu_ptr(b->counter, cpu);
+		buckets	+= per_cpu_ptr(b->usage, cpu)->buckets;
+		sectors	+= per_cpu_ptr(b->usage, cpu)->sectors;
+
+		*per_cpu_ptr(b->counter, cpu) = 0;
+		memset(per_cpu_ptr(b->usage, cpu), 0, sizeof(*b->usage));
+	}
+
+	if (counter != ops || buckets != ops || sectors != ops * 8)
+		die("percpu counters lost updates: expected %llu got %llu %llu %llu",
+		    ops, counter, buckets, sectors / 8);
+}
+
+static void bench_percpu(struct bench_opts *opts)
+{
+	struct bench_percpu b = {
+		.counter	= alloc_percpu(u64),
+		.usage		= alloc_percpu(struct bench_percpu_usage),
+	};
+
+	if (!b.counter || !b.usage)
+		die("error allocating percpu counters");
+
+	bench_scaling("percpu", opts, bench_percpu_thread, &b, bench_percpu_check);
+
+	free_percpu(b.usage);
+	free_percpu(b.counter);
+}
+
+/* slab: */
+
+/* Objects each thread keeps allocated, like the key cache: */
+#define BENCH_SLAB_WORKING_SET	1024
+
+static void bench_slab_thread(void *arg, u64 iterations)
+{
+	struct kmem_cache *cache = arg;
+	void **objs = xcalloc(BENCH_SLAB_WORKING_SET, sizeof(void *));
+	u32 seed = pthread_self();
+	unsigned i;
+
+	/* Free and reallocate objects at random: */
+	while (iterations--) {
+		seed = seed * 1103515245 + 12345;
+		i = (seed >> 16) % BENCH_SLAB_WORKING_SET;
+
+		kmem_cache_free(cache, objs[i]);
+		objs[i] = kmem_cache_alloc(cache, GFP_KERNEL);
+		if (!objs[i])
+			die("kmem_cache_alloc error");
+
+		*((u64 *) objs[i]) = iterations;
+	}
+
+	for (i = 0; i < BENCH_SLAB_WORKING_SET; i++)
+		kmem_cache_free(cache, objs[i]);
+	free(objs);
+}
+
+static void bench_slab(struct bench_opts *opts)
+{
+	struct kmem_cache_stats stats;
+	struct kmem_cache *cache;
+
+	cache = KMEM_CACHE(bkey_cached, 0);
+	if (!cache)
+		die("error creating kmem_cache");
+
+	bench_scaling("slab (slab allocator, struct bkey_cached)", opts,
+		      bench_slab_thread, cache, NULL);
+
+	kmem_cache_get_stats(cache, &stats);
+	printf("%llu allocs %llu frees %llu refills %llu flushes, %llu slabs (%llu objects per slab)\n",
+	       stats.allocs, stats.frees, stats.refills, stats.flushes,
+	       stats.slabs_allocated, stats.objs_per_slab);
+	kmem_cache_destroy(cache);
+
+	kmem_cache_use_kmalloc = true;
+	cache = KMEM_CACHE(bkey_cached, 0);
+	kmem_cache_use_kmalloc = false;
+	if (!cache)
+		die("error creating kmem_cache");
+
+	printf("\n");
+	bench_scaling("slab (kmalloc, struct bkey_cached)", opts,
+		      bench_slab_thread, cache, NULL);
+	kmem_cache_destroy(cache);
+}
+
+/* checksum, encrypt: */
+
+#define BENCH_CSUM_BYTES	(256ULL << 20)
+
+static const size_t bench_csum_sizes[] = { 512, 4096, 65536, 1 << 20 };
+
+struct bench_csum {
+	struct bch_fs		*c;
+	unsigned		type;
+	void			*data;
+};
+
+/* Returns a value depending on the result, so it can't be thrown away: */
+typedef u64 (*bench_csum_fn)(struct bench_csum *, u64, size_t);
+
+/* Keeps the compiler from throwing away the results: */
+static volatile u64 bench_csum_result;
+
+static u64 bench_csum_checksum(struct bench_csum *b, u64 seed, size_t size)
+{
+	struct nonce nonce = { .d[0] = seed };
+
+	return bch2_checksum(b->c, b->type, nonce, b->data, size).lo;
+}
+
+static u64 bench_csum_crc32c_generic(struct bench_csum *b, u64 seed, size_t size)
+{
+	return crc32c_generic(seed, b->data, size);
+}
+
+static u64 bench_csum_crc64_generic(struct bench_csum *b, u64 seed, size_t size)
+{
+	return crc64_be_generic(seed, b->data, size);
+}
+
+static u64 bench_csum_encrypt(struct bench_csum *b, u64 seed, size_t size)
+{
+	struct nonce nonce = { .d[0] = seed };
+
+	bch2_encrypt(b->c, b->type, nonce, b->data, size);
+	return *((u64 *) b->data);
+}
+
+static u64 bench_csum_poly1305(struct bench_csum *b, u64 seed, size_t size)
+{
+	SHASH_DESC_ON_STACK(desc, b->c->poly1305);
+	u8 key[POLY1305_KEY_SIZE] = { 0 }, digest[POLY1305_DIGEST_SIZE];
+
+	memcpy(key, &seed, sizeof(seed));
+
+	desc->tfm = b->c->poly1305;
+	crypto_shash_init(desc);
+	crypto_shash_update(desc, key, sizeof(key));
+	crypto_shash_update(desc, b->data, size);
+	crypto_shash_final(desc, digest);
+
+	return *((u64 *) digest);
+}
+
+static void bench_csum_row(const char *name, struct bench_csum *b,
+			   bench_csum_fn fn)
+{
+	u64 v = 0;
+	unsigned i;
+
+	printf("%-24s", name);
+
+	for (i = 0; i < ARRAY_SIZE(bench_csum_sizes); i++) {
+		size_t size = bench_csum_sizes[i];
+		u64 loops = max(BENCH_CSUM_BYTES / size, 1ULL), n;
+		u64 start = ktime_get_ns(), ns;
+
+		for (n = 0; n < loops; n++)
+			v ^= fn(b, v + n, size);
+
+		ns = max(ktime_get_ns() - start, 1ULL);
+		printf(" %10llu", div64_u64(loops * size * NSEC_PER_SEC, ns) >> 20);
+		fflush(stdout);
+	}
+
+	bench_csum_result = v;
+	printf("\n");
+}
+
+static void bench_csum_header(const char *name)
+{
+	unsigned i;
+
+	printf("%s throughput, MiB/sec\n", name);
+	printf("%-24s", "buffer size");
+	for (i = 0; i < ARRAY_SIZE(bench_csum_sizes); i++)
+		printf(" %10zu", bench_csum_sizes[i]);
+	printf("\n");
+}
+
+static struct bench_csum bench_csum_init(void)
+{
+	size_t max_size = bench_csum_sizes[ARRAY_SIZE(bench_csum_sizes) - 1];
+	struct bench_csum b = {
+		.c	= xcalloc(1, sizeof(*b.c)),
+		.data	= xmalloc(max_size),
+	};
+	u8 key[32];
+
+	get_random_bytes(b.data, max_size);
+	get_random_bytes(key, sizeof(key));
+
+	b.c->chacha20 = crypto_alloc_sync_skcipher("chacha20", 0, 0);
+	b.c->poly1305 = crypto_alloc_shash("poly1305", 0, 0);
+	if (IS_ERR(b.c->chacha20) || IS_ERR(b.c->poly1305))
+		die("error allocating ciphers");
+
+	if (crypto_skcipher_setkey(&b.c->chacha20->base, key, sizeof(key)))
+		die("error setting key");
+
+	return b;
+}
+
+static void bench_csum_exit(struct bench_csum *b)
+{
+	crypto_free_shash(b->c->poly1305);
+	crypto_free_sync_skcipher(b->c->chacha20);
+	free(b->data);
+	free(b->c);
+}
+
+static void bench_checksum(struct bench_opts *opts)
+{
+	struct bench_csum b = bench_csum_init();
+
+	bench_csum_header("checksum");
+
+	for (b.type = 0; b.type < BCH_CSUM_NR; b.type++)
+		bench_csum_row(bch2_csum_types[b.type], &b, bench_csum_checksum);
+
+	bench_csum_row("crc32c (generic)", &b, bench_csum_crc32c_generic);
+	bench_csum_row("crc64 (generic)", &b, bench_csum_crc64_generic);
+
+	bench_csum_exit(&b);
+}
+
+static void bench_encrypt(struct bench_opts *opts)
+{
+	struct bench_csum b = bench_csum_init();
+
+	b.type = BCH_CSUM_chacha20_poly1305_128;
+
+	bench_csum_header("encrypt");
+
+	/*
+	 * The baseline is libsodium, with whichever of its SIMD versions the
+	 * CPU supports - we only use our own with AVX-512:
+	 */
+	chacha20_use_sodium = true;
+	bench_csum_row("chacha20 (libsodium)", &b, bench_csum_encrypt);
+	chacha20_use_sodium = false;
+#ifdef __x86_64__
+	if (__builtin_cpu_supports("avx512f"))
+		bench_csum_row("chacha20 (avx512)", &b, bench_csum_encrypt);
+#endif
+	bench_csum_row("poly1305", &b, bench_csum_poly1305);
+
+	bench_csum_exit(&b);
+}
+
+/* bset: */
+
+/* A full btree node with a single bset and read-only aux search tree: */
+static struct btree *bench_bset_node_alloc(unsigned node_bytes,
+					   struct bpos *pos, unsigned *nr)
+{
+	struct btree *b = xcalloc(1, sizeof(*b));
+	struct bkey_format_state s;
+	struct bset *i;
+	unsigned n;
+
+	b->byte_order	= ilog2(node_bytes);
+	b->data		= aligned_alloc(PAGE_SIZE, node_bytes);
+	/* The compiled unpack function lives in aux_data: */
+	b->aux_data	= mmap(NULL, btree_aux_data_bytes(b),
+			       PROT_READ|PROT_WRITE|PROT_EXEC,
+			       MAP_PRIVATE|MAP_ANONYMOUS, 0, 0);
+	if (!b->data || b->aux_data == MAP_FAILED)
+		die("error allocating btree node");
+	memset(b->data, 0, node_bytes);
+
+	bch2_btree_keys_init(b);
+	b->data->min_key = pos[0];
+	b->data->max_key = pos[*nr - 1];
+
+	bch2_bkey_format_init(&s);
+	for (n = 0; n < *nr; n++)
+		bch2_bkey_format_add_pos(&s, pos[n]);
+	b->data->format = bch2_bkey_format_done(&s);
+	btree_node_set_format(b, b->data->format);
+
+	i = &b->data->keys;
+	bch2_bset_init_first(b, i);
+
+	for (n = 0; n < *nr; n++) {
+		struct bkey_packed *k = vstruct_last(i);
+		struct bkey_i_cookie c;
+
+		if ((void *) k + sizeof(c) > (void *) b->data + node_bytes)
+			break;
+
+		bkey_cookie_init(&c.k_i);
+		c.k.p = pos[n];
+		if (!bch2_bkey_pack(k, &c.k_i, &b->format))
+			die("error packing key");
+		le16_add_cpu(&i->u64s, k->u64s);
+	}
+	*nr = n;
+	b->data->max_key = pos[n - 1];
+
+	set_btree_bset_end(b, b->set);
+	bch2_bset_build_aux_tree(b, b->set, false);
+	return b;
+}
+
+static void bench_bset_node_free(struct btree *b)
+{
+	munmap(b->aux_data, btree_aux_data_bytes(b));
+	free(b->data);
+	free(b);
+}
+
+static int bench_bset_pos_cmp(const void *l, const void *r)
+{
+	return bpos_cmp(*((struct bpos *) l), *((struct bpos *) r));
+}
+
+static u64 bench_bset_rand(u64 *seed)
+{
+	*seed = *seed * 6364136223846793005ULL + 1442695040888963407ULL;
+	return *seed;
+}
+
+static struct bpos bench_bset_rand_pos(u64 *seed)
+{
+	/* Like dirents: a few inodes, keyed by hash: */
+	return SPOS(4096 + (bench_bset_rand(seed) >> 62),
+		    bench_bset_rand(seed) >> 1, U32_MAX);
+}
+
+static volatile u64 bench_bset_result;
+
+static u64 bench_bset_lookups(struct btree *b, struct bpos *search, u64 nr)
+{
+	u64 start = ktime_get_ns();
+	u64 i;
+
+	for (i = 0; i < nr; i++) {
+		struct btree_node_iter iter;
+
+		bch2_btree_node_iter_init(&iter, b, &search[i]);
+		bench_bset_result ^= iter.data[0].k;
+	}
+
+	return div64_u64(nr * NSEC_PER_SEC, max(ktime_get_ns() - start, 1ULL));
+}
+
+static void bench_bset(struct bench_opts *opts)
+{
+	static const unsigned node_sizes[] = { 64 << 10, 128 << 10, 256 << 10 };
+	/* Enough to fill the biggest node: a packed cookie is about 3 u64s */
+	unsigned max_keys = node_sizes[ARRAY_SIZE(node_sizes) - 1] /
+		(3 * sizeof(u64));
+	struct bpos *pos = xcalloc(max_keys, sizeof(*pos));
+	u64 nr_search = opts->iterations;
+	struct bpos *search = xcalloc(nr_search, sizeof(*search));
+	u64 seed = get_random_u64();
+	unsigned i, nr;
+	u64 j;
+
+	for (i = 0; i < max_keys; i++)
+		pos[i] = bench_bset_rand_pos(&seed);
+	sort(pos, max_keys, sizeof(pos[0]), bench_bset_pos_cmp, NULL);
+
+	printf("bset: %llu lookups, half for existing keys\n", nr_search);
+	printf("%10s %8s %10s %16s %16s\n",
+	       "node size", "keys", "aux nodes", "scalar lookups/s", "SIMD lookups/s");
+
+	for (i = 0; i < ARRAY_SIZE(node_sizes); i++) {
+		struct btree *b;
+		u64 scalar, simd;
+
+		nr = max_keys;
+		b = bench_bset_node_alloc(node_sizes[i], pos, &nr);
+
+		for (j = 0; j < nr_search; j++) {
+			search[j] = j & 1
+				? pos[bench_bset_rand(&seed) % nr]
+				: bench_bset_rand_pos(&seed);
+
+			if (bpos_lt(search[j], b->data->min_key))
+				search[j] = b->data->min_key;
+			if (bpos_gt(search[j], b->data->max_key))
+				search[j] = b->data->max_key;
+		}
+
+		bch2_bset_search_simd_disabled = true;
+		scalar = bench_bset_lookups(b, search, nr_search);
+		bch2_bset_search_simd_disabled = false;
+		simd = bench_bset_lookups(b, search, nr_search);
+
+		printf("%9uk %8u %10u %16llu %16llu\n",
+		       node_sizes[i] >> 10, nr, b->set->size, scalar, simd);
+
+		bench_bset_node_free(b);
+	}
+
+	free(search);
+	free(pos);
+}
+
+/* btree perf tests: */
+
+static void bench_btree_print(const char *test, unsigned journal_depth,
+			      struct bch_perf_test_result *r)
+{
+	u64 time = max(r->time, 1ULL);
+
+	printf("%-20s %llu keys, %u threads, journal depth %u, %llu ms\n"
+	       "%-20s %llu ops/sec, %llu keys/sec\n"
+	       "%-20s p50 %llu p99 %llu p999 %llu max %llu nsec\n"
+	       "%-20s %llu restarts, %llu lock waits, %llu usec waiting on locks\n",
+	       test, r->nr, r->nr_threads, journal_depth,
+	       div_u64(time, NSEC_PER_MSEC),
+	       "", div64_u64(r->nr_ops * NSEC_PER_SEC, time),
+	       div64_u64(r->nr * NSEC_PER_SEC, time),
+	       "", r->latency_p50, r->latency_p99, r->latency_p999, r->latency_max,
+	       "", r->restarts, r->lock_contended,
+	       div_u64(r->lock_contended_time, NSEC_PER_USEC));
+}
+
+static void bench_btree_print_json(const char *test, unsigned journal_depth,
+				   struct bch_perf_test_result *r)
+{
+	u64 time = max(r->time, 1ULL);
+
+	printf("{\"test\": \"%s\", \"keys\": %llu, \"threads\": %u, \"journal_depth\": %u, "
+	       "\"time_ns\": %llu, \"ops\": %llu, \"ops_per_sec\": %llu, "
+	       "\"latency_ns\": {\"p50\": %llu, \"p99\": %llu, \"p999\": %llu, \"max\": %llu}, "
+	       "\"restarts\": %llu, \"lock_contended\": %llu, \"lock_contended_ns\": %llu}\n",
+	       test, r->nr, r->nr_threads, journal_depth,
+	       r->time, r->nr_ops, div64_u64(r->nr_ops * NSEC_PER_SEC, time),
+	       r->latency_p50, r->latency_p99, r->latency_p999, r->latency_max,
+	       r->restarts, r->lock_contended, r->lock_contended_time);
+}
+
+static void bench_btree(struct bench_opts *opts, char *tests,
+			char **devs, unsigned nr_devs)
+{
+	struct bch_opts fs_opts = bch2_opts_empty();
+	struct bch_perf_test_result *r = xmalloc(sizeof(*r));
+	struct bch_fs *c;
+	char *test;
+	unsigned i;
+	int ret;
+
+	if (!nr_devs)
+		die("Please supply device(s) to run btree tests against");
+
+	c = bch2_fs_open(devs, nr_devs, fs_opts);
+	if (IS_ERR(c))
+		die("error opening %s: %s", devs[0], bch2_err_str(PTR_ERR(c)));
+
+	while ((test = strsep(&tests, ",")))
+		for (i = 0; i < max(opts->nr_journal_depths, 1U); i++) {
+			if (opts->nr_journal_depths)
+				c->opts.journal_max_in_flight = opts->journal_depths[i];
+
+			ret = bch2_btree_perf_test_run(c, test, opts->nr_keys,
+						       opts->nr_threads, r);
+			if (ret == -EINVAL && !r->nr)
+				die("Unknown benchmark %s", test);
+			if (ret)
+				die("error running %s: %s", test, bch2_err_str(ret));
+
+			if (opts->json)
+				bench_btree_print_json(test, c->opts.journal_max_in_flight, r);
+			else
+				bench_btree_print(test, c->opts.journal_max_in_flight, r);
+			fflush(stdout);
+		}
+
+	bch2_fs_stop(c);
+	free(r);
+}
+
+int cmd_bench(int argc, char *argv[])
+{
+	static const struct option longopts[] = {
+		{ "threads",		required_argument,	NULL, 't' },
+		{ "iterations",		required_argument,	NULL, 'n' },
+		{ "keys",		required_argument,	NULL, 'k' },
+		{ "journal-depth",	required_argument,	NULL, 'd' },
+		{ "json",		no_argument,		NULL, 'j' },
+		{ "help",		no_argument,		NULL, 'h' },
+		{ NULL }
+	};
+	struct bench_opts opts = {
+		.nr_threads	= num_possible_cpus(),
+		.iterations	= 10000000,
+		.nr_keys	= 1 << 20,
+	};
+	char *bench, *depths, *depth;
+	int opt;
+
+	while ((opt = getopt_long(argc, argv, "t:n:k:d:h",
+				  longopts, NULL)) != -1)
+		switch (opt) {
+		case 't':
+			if (kstrtouint(optarg, 10, &opts.nr_threads) ||
+			    !opts.nr_threads)
+				die("invalid number of threads %s", optarg);
+			break;
+		case 'n':
+			if (kstrtoull(optarg, 10, &opts.iterations))
+				die("invalid number of iterations %s", optarg);
+			break;
+		case 'k':
+			if (bch2_strtoull_h(optarg, &opts.nr_keys) ||
+			    !opts.nr_keys)
+				die("invalid number of keys %s", optarg);
+			break;
+		case 'd':
+			depths = optarg;
+			while ((depth = strsep(&depths, ","))) {
+				unsigned *d = opts.journal_depths +
+					opts.nr_journal_depths;
+
+				if (opts.nr_journal_depths == ARRAY_SIZE(opts.journal_depths) ||
+				    kstrtouint(depth, 10, d) ||
+				    !*d || *d > JOURNAL_BUF_NR)
+					die("invalid journal depth %s (max %u)",
+					    depth, JOURNAL_BUF_NR);
+				opts.nr_journal_depths++;
+			}
+			break;
+		case 'j':
+			opts.json = true;
+			break;
+		case 'h':
+			bench_usage();
+			exit(EXIT_SUCCESS);
+		}
+	args_shift(optind);
+
+	bench = arg_pop();
+	if (!bench) {
+		bench_usage();
+		exit(EXIT_FAILURE);
+	}
+
+	if (!strcmp(bench, "percpu"))
+		bench_percpu(&opts);
+	else if (!strcmp(bench, "slab"))
+		bench_slab(&opts);
+	else if (!strcmp(bench, "checksum"))
+		bench_checksum(&opts);
+	else if (!strcmp(bench, "encrypt"))
+		bench_encrypt(&opts);
+	else if (!strcmp(bench, "bset"))
+		bench_bset(&opts);
+	else
+		bench_btree(&opts, bench, argv, argc);
+
+	return 0;
+}
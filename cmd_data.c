@@ -70,7 +70,8 @@ static void data_job_usage(void)
 	     "\n"
 	     "Kick off a data job and report progress\n"
 	     "\n"
-	     "job: one of scrub, rereplicate, migrate, or rewrite_old_nodes\n"
+	     "job: one of scrub, rereplicate, migrate, rewrite_old_nodes,\n"
+	     "     or rewrite_formats\n"
 	     "\n"
 	     "Options:\n"
 	     "  -b btree                    btree to operate on\n"
@@ -86,6 +87,7 @@ const char * const data_jobs[] = {
 	"rereplicate",
 	"migrate",
 	"rewrite_old_nodes",
+	"rewrite_formats",
 	NULL
 };
 
@@ -18,6 +18,7 @@ static void usage(void)
 	     "  -f                      Force checking even if filesystem is marked clean\n"
 	     "  -r, --ratelimit_errors  Don't display more than 10 errors of a given type\n"
 	     "  -R, --reconstruct_alloc Reconstruct the alloc btree\n"
+	     "      --verify_replicas   Read all replicas of btree nodes and compare them\n"
 	     "  -v                      Be verbose\n"
 	     "  -h, --help              Display this help and exit\n"
 	     "Report bugs to <linux-bcachefs@vger.kernel.org>");
@@ -28,6 +29,7 @@ int cmd_fsck(int argc, char *argv[])
 	static const struct option longopts[] = {
 		{ "ratelimit_errors",	no_argument,		NULL, 'r' },
 		{ "reconstruct_alloc",	no_argument,		NULL, 'R' },
+		{ "verify_replicas",	no_argument,		NULL, 'V' },
 		{ "help",		no_argument,		NULL, 'h' },
 		{ NULL }
 	};
@@ -66,6 +68,9 @@ int cmd_fsck(int argc, char *argv[])
 		case 'R':
 			opt_set(opts, reconstruct_alloc, true);
 			break;
+		case 'V':
+			bch2_verify_all_btree_replicas = true;
+			break;
 		case 'v':
 			opt_set(opts, verbose, true);
 			break;
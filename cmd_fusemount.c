@@ -3,6 +3,7 @@
 #include <errno.h>
 #include <float.h>
 #include <getopt.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <sys/statvfs.h>
 
@@ -22,6 +23,7 @@
 #include "libbcachefs/fs-common.h"
 #include "libbcachefs/inode.h"
 #include "libbcachefs/io.h"
+#include "libbcachefs/journal.h"
 #include "libbcachefs/opts.h"
 #include "libbcachefs/super.h"
 
@@ -29,6 +31,8 @@
 #include "libbcachefs/fs.h"
 
 #include <linux/dcache.h>
+#include <linux/kthread.h>
+#include <linux/shrinker.h>
 
 /* XXX cut and pasted from fsck.c */
 #define QSTR(n) { { { .len = strlen(n) } }, .name = n }
@@ -43,6 +47,144 @@ static inline u64 unmap_root_ino(u64 ino)
 	return ino == 4096 ? 1 : ino;
 }
 
+/*
+ * Per thread state: with the multithreaded session loop, the worker threads
+ * are created by libfuse, so they're set up the first time they handle a
+ * request. Each thread keeps a btree_trans around for the requests it
+ * handles, instead of initializing a new one per request:
+ */
+struct bf_thread {
+	struct list_head	list;
+	bool			own_task;
+	struct bch_fs		*c;
+	struct btree_trans	trans;
+
+	/* Reused for reads that don't go through readahead: */
+	void			*buf;
+	size_t			buf_size;
+};
+
+static pthread_key_t	bf_thread_key;
+static pthread_mutex_t	bf_threads_lock = PTHREAD_MUTEX_INITIALIZER;
+static LIST_HEAD(bf_threads);
+
+static void bf_thread_trans_exit(struct bf_thread *t)
+{
+	if (t->c) {
+		bch2_trans_exit(&t->trans);
+		t->c = NULL;
+	}
+}
+
+/* Called on thread exit: */
+static void bf_thread_exit(void *p)
+{
+	struct bf_thread *t = p;
+
+	pthread_mutex_lock(&bf_threads_lock);
+	list_del(&t->list);
+	bf_thread_trans_exit(t);
+	pthread_mutex_unlock(&bf_threads_lock);
+
+	if (t->own_task)
+		sched_thread_exit();
+	free(t->buf);
+	free(t);
+}
+
+/* Called before the filesystem goes away: */
+static void bf_threads_trans_exit(void)
+{
+	struct bf_thread *t;
+
+	pthread_mutex_lock(&bf_threads_lock);
+	list_for_each_entry(t, &bf_threads, list)
+		bf_thread_trans_exit(t);
+	pthread_mutex_unlock(&bf_threads_lock);
+}
+
+static struct bf_thread *bf_thread_get(struct bch_fs *c)
+{
+	struct bf_thread *t = pthread_getspecific(bf_thread_key);
+
+	if (likely(t && t->c == c))
+		return t;
+
+	if (!t) {
+		t = xcalloc(1, sizeof(*t));
+
+		if (!current) {
+			sched_thread_init();
+			t->own_task = true;
+		}
+
+		if (pthread_setspecific(bf_thread_key, t))
+			die("pthread_setspecific error: %m");
+
+		pthread_mutex_lock(&bf_threads_lock);
+		list_add(&t->list, &bf_threads);
+		pthread_mutex_unlock(&bf_threads_lock);
+	}
+
+	pthread_mutex_lock(&bf_threads_lock);
+	bf_thread_trans_exit(t);
+	bch2_trans_init(&t->trans, c, 0, 0);
+	t->c = c;
+	pthread_mutex_unlock(&bf_threads_lock);
+
+	return t;
+}
+
+static struct bch_fs *bf_req_fs(fuse_req_t req)
+{
+	struct bch_fs *c = fuse_req_userdata(req);
+
+	bf_thread_get(c);
+	return c;
+}
+
+static struct btree_trans *bf_trans_get(struct bch_fs *c)
+{
+	return &bf_thread_get(c)->trans;
+}
+
+static void *bf_thread_buf(struct bch_fs *c, size_t size)
+{
+	struct bf_thread *t = bf_thread_get(c);
+
+	if (t->buf_size < size) {
+		size_t new_size = roundup_pow_of_two(size);
+		void *buf = aligned_alloc(PAGE_SIZE, new_size);
+
+		if (!buf)
+			return NULL;
+
+		free(t->buf);
+		t->buf		= buf;
+		t->buf_size	= new_size;
+	}
+
+	return t->buf;
+}
+
+/* Don't sit on btree node locks while waiting for the next request: */
+static void bf_trans_put(struct btree_trans *trans)
+{
+	bch2_trans_unlock(trans);
+}
+
+/* bch2_trans_do(), with this thread's btree_trans: */
+#define bf_trans_do(_c, _disk_res, _journal_seq, _flags, _do)		\
+({									\
+	struct btree_trans *trans = bf_trans_get(_c);			\
+	int _ret;							\
+									\
+	_ret = commit_do(trans, _disk_res, _journal_seq, _flags, _do);	\
+	bf_trans_put(trans);						\
+									\
+	_ret;								\
+})
+
 static struct stat inode_to_stat(struct bch_fs *c,
 				 struct bch_inode_unpacked *bi)
 {
@@ -74,14 +216,115 @@ static struct fuse_entry_param inode_to_entry(struct bch_fs *c,
 	};
 }
 
+/*
+ * Inode size and io options, cached so that reads and writes don't have to
+ * look up the inode every time: every change to an inode goes through this
+ * process, and invalidates the cached copy.
+ */
+#define BF_INODE_CACHE_SIZE	1024
+
+struct bf_inode_cache_entry {
+	u64			inum;
+	u64			size;
+	struct bch_io_opts	io_opts;
+	/* Bumped on invalidate, so a racing lookup doesn't fill a stale entry: */
+	u64			seq;
+	bool			valid;
+	/*
+	 * Bumped on every write to an inode in this slot, so readahead buffers
+	 * know when they're stale; not protected by bf_inode_cache_lock:
+	 */
+	atomic64_t		write_seq;
+};
+
+static pthread_mutex_t			bf_inode_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct bf_inode_cache_entry	bf_inode_cache[BF_INODE_CACHE_SIZE];
+
+static int bf_writeback_flush_inum(struct bch_fs *, u64, bool);
+static int bf_writeback_init(struct bch_fs *);
+static void bf_writeback_exit(struct bch_fs *);
+
+static struct bf_inode_cache_entry *bf_inode_cache_slot(u64 inum)
+{
+	return &bf_inode_cache[hash_64(inum, ilog2(BF_INODE_CACHE_SIZE))];
+}
+
+static int bf_inode_get(struct bch_fs *c, u64 inum, u64 *size,
+			struct bch_io_opts *io_opts)
+{
+	struct bf_inode_cache_entry *e = bf_inode_cache_slot(inum);
+	struct bch_inode_unpacked inode;
+	u64 seq;
+	int ret;
+
+	pthread_mutex_lock(&bf_inode_cache_lock);
+	if (e->valid && e->inum == inum) {
+		*size		= e->size;
+		*io_opts	= e->io_opts;
+		pthread_mutex_unlock(&bf_inode_cache_lock);
+		return 0;
+	}
+	seq = e->seq;
+	pthread_mutex_unlock(&bf_inode_cache_lock);
+
+	ret = bch2_inode_find_by_inum(c, inum, &inode);
+	if (ret)
+		return ret;
+
+	*size		= inode.bi_size;
+	*io_opts	= bch2_opts_to_inode_opts(c->opts);
+	bch2_io_opts_apply(io_opts, bch2_inode_opts_get(&inode));
+
+	pthread_mutex_lock(&bf_inode_cache_lock);
+	if (e->seq == seq) {
+		e->inum		= inum;
+		e->size		= *size;
+		e->io_opts	= *io_opts;
+		e->valid	= true;
+	}
+	pthread_mutex_unlock(&bf_inode_cache_lock);
+
+	return 0;
+}
+
+static void bf_inode_invalidate(u64 inum)
+{
+	struct bf_inode_cache_entry *e = bf_inode_cache_slot(inum);
+
+	pthread_mutex_lock(&bf_inode_cache_lock);
+	e->seq++;
+	if (e->inum == inum)
+		e->valid = false;
+	pthread_mutex_unlock(&bf_inode_cache_lock);
+}
+
+static u64 bf_write_seq_read(u64 inum)
+{
+	return atomic64_read(&bf_inode_cache_slot(inum)->write_seq);
+}
+
+static void bf_write_seq_inc(u64 inum)
+{
+	atomic64_inc(&bf_inode_cache_slot(inum)->write_seq);
+}
+
 static void bcachefs_fuse_init(void *arg, struct fuse_conn_info *conn)
 {
+	struct bch_fs *c = arg;
+
+	if (bf_writeback_init(c))
+		fuse_log(FUSE_LOG_ERR, "fuse_init: error starting writeback\n");
+
 	if (conn->capable & FUSE_CAP_WRITEBACK_CACHE) {
 		fuse_log(FUSE_LOG_DEBUG, "fuse_init: activating writeback\n");
 		conn->want |= FUSE_CAP_WRITEBACK_CACHE;
 	} else
 		fuse_log(FUSE_LOG_DEBUG, "fuse_init: writeback not capable\n");
 
+	/* Let fuse_reply_data() splice read data to the kernel: */
+	if (conn->capable & FUSE_CAP_SPLICE_WRITE)
+		conn->want |= FUSE_CAP_SPLICE_WRITE;
+
 	//conn->want |= FUSE_CAP_POSIX_ACL;
 }
 
@@ -89,13 +332,15 @@ static void bcachefs_fuse_destroy(void *arg)
 {
 	struct bch_fs *c = arg;
 
+	bf_writeback_exit(c);
+	bf_threads_trans_exit();
 	bch2_fs_stop(c);
 }
 
 static void bcachefs_fuse_lookup(fuse_req_t req, fuse_ino_t dir,
 				 const char *name)
 {
-	struct bch_fs *c = fuse_req_userdata(req);
+	struct bch_fs *c = bf_req_fs(req);
 	struct bch_inode_unpacked bi;
 	struct qstr qstr = QSTR(name);
 	u64 inum;
@@ -142,7 +387,7 @@ err:
 static void bcachefs_fuse_getattr(fuse_req_t req, fuse_ino_t inum,
 				  struct fuse_file_info *fi)
 {
-	struct bch_fs *c = fuse_req_userdata(req);
+	struct bch_fs *c = bf_req_fs(req);
 	struct bch_inode_unpacked bi;
 	struct stat attr;
 	int ret;
@@ -152,7 +397,8 @@ static void bcachefs_fuse_getattr(fuse_req_t req, fuse_ino_t inum,
 
 	inum = map_root_ino(inum);
 
-	ret = bch2_inode_find_by_inum(c, inum, &bi);
+	ret   = bf_writeback_flush_inum(c, inum, false) ?:
+		bch2_inode_find_by_inum(c, inum, &bi);
 	if (ret) {
 		fuse_log(FUSE_LOG_DEBUG, "fuse_getattr error %i\n", ret);
 		fuse_reply_err(req, -ret);
@@ -169,9 +415,9 @@ static void bcachefs_fuse_setattr(fuse_req_t req, fuse_ino_t inum,
 				  struct stat *attr, int to_set,
 				  struct fuse_file_info *fi)
 {
-	struct bch_fs *c = fuse_req_userdata(req);
+	struct bch_fs *c = bf_req_fs(req);
 	struct bch_inode_unpacked inode_u;
-	struct btree_trans trans;
+	struct btree_trans *trans;
 	struct btree_iter iter;
 	u64 now;
 	int ret;
@@ -181,12 +427,19 @@ static void bcachefs_fuse_setattr(fuse_req_t req, fuse_ino_t inum,
 
 	inum = map_root_ino(inum);
 
-	bch2_trans_init(&trans, c, 0, 0);
+	/* Dirty data past a new i_size mustn't get written afterwards: */
+	ret = bf_writeback_flush_inum(c, inum, false);
+	if (ret) {
+		fuse_reply_err(req, -ret);
+		return;
+	}
+
+	trans = bf_trans_get(c);
 retry:
-	bch2_trans_begin(&trans);
+	bch2_trans_begin(trans);
 	now = bch2_current_time(c);
 
-	ret = bch2_inode_peek(&trans, &iter, &inode_u, inum, BTREE_ITER_INTENT);
+	ret = bch2_inode_peek(trans, &iter, &inode_u, inum, BTREE_ITER_INTENT);
 	if (ret)
 		goto err;
 
@@ -208,15 +461,19 @@ retry:
 		inode_u.bi_mtime = now;
 	/* TODO: CTIME? */
 
-	ret   = bch2_inode_write(&trans, &iter, &inode_u) ?:
-		bch2_trans_commit(&trans, NULL, NULL,
+	ret   = bch2_inode_write(trans, &iter, &inode_u) ?:
+		bch2_trans_commit(trans, NULL, NULL,
 				  BTREE_INSERT_NOFAIL);
 err:
-        bch2_trans_iter_exit(&trans, &iter);
+        bch2_trans_iter_exit(trans, &iter);
 	if (ret == -EINTR)
 		goto retry;
 
-	bch2_trans_exit(&trans);
+	bf_trans_put(trans);
+
+	bf_inode_invalidate(inum);
+	if (to_set & FUSE_SET_ATTR_SIZE)
+		bf_write_seq_inc(inum);
 
 	if (!ret) {
 		*attr = inode_to_stat(c, &inode_u);
@@ -237,8 +494,8 @@ static int do_create(struct bch_fs *c, u64 dir,
 
 	bch2_inode_init_early(c, new_inode);
 
-	return bch2_trans_do(c, NULL, NULL, 0,
-			bch2_create_trans(&trans,
+	return bf_trans_do(c, NULL, NULL, 0,
+			bch2_create_trans(trans,
 				dir, &dir_u,
 				new_inode, &qstr,
 				0, 0, mode, rdev, NULL, NULL));
@@ -248,7 +505,7 @@ static void bcachefs_fuse_mknod(fuse_req_t req, fuse_ino_t dir,
 				const char *name, mode_t mode,
 				dev_t rdev)
 {
-	struct bch_fs *c = fuse_req_userdata(req);
+	struct bch_fs *c = bf_req_fs(req);
 	struct bch_inode_unpacked new_inode;
 	int ret;
 
@@ -280,7 +537,7 @@ static void bcachefs_fuse_mkdir(fuse_req_t req, fuse_ino_t dir,
 static void bcachefs_fuse_unlink(fuse_req_t req, fuse_ino_t dir,
 				 const char *name)
 {
-	struct bch_fs *c = fuse_req_userdata(req);
+	struct bch_fs *c = bf_req_fs(req);
 	struct bch_inode_unpacked dir_u, inode_u;
 	struct qstr qstr = QSTR(name);
 	int ret;
@@ -289,9 +546,15 @@ static void bcachefs_fuse_unlink(fuse_req_t req, fuse_ino_t dir,
 
 	dir = map_root_ino(dir);
 
-	ret = bch2_trans_do(c, NULL, NULL, BTREE_INSERT_NOFAIL,
-			    bch2_unlink_trans(&trans, dir, &dir_u,
+	ret = bf_trans_do(c, NULL, NULL, BTREE_INSERT_NOFAIL,
+			    bch2_unlink_trans(trans, dir, &dir_u,
 					      &inode_u, &qstr));
+	/*
+	 * An unlinked inode's dirty range is still written out normally: the
+	 * file may still be open, and readable through those handles:
+	 */
+	if (!ret)
+		bf_inode_invalidate(inode_u.bi_inum);
 
 	fuse_reply_err(req, -ret);
 }
@@ -311,7 +574,7 @@ static void bcachefs_fuse_rename(fuse_req_t req,
 				 fuse_ino_t dst_dir, const char *dstname,
 				 unsigned flags)
 {
-	struct bch_fs *c = fuse_req_userdata(req);
+	struct bch_fs *c = bf_req_fs(req);
 	struct bch_inode_unpacked dst_dir_u, src_dir_u;
 	struct bch_inode_unpacked src_inode_u, dst_inode_u;
 	struct qstr dst_name = QSTR(srcname);
@@ -326,8 +589,8 @@ static void bcachefs_fuse_rename(fuse_req_t req,
 	dst_dir = map_root_ino(dst_dir);
 
 	/* XXX handle overwrites */
-	ret = bch2_trans_do(c, NULL, NULL, 0,
-		bch2_rename_trans(&trans,
+	ret = bf_trans_do(c, NULL, NULL, 0,
+		bch2_rename_trans(trans,
 				  src_dir, &src_dir_u,
 				  dst_dir, &dst_dir_u,
 				  &src_inode_u, &dst_inode_u,
@@ -340,7 +603,7 @@ static void bcachefs_fuse_rename(fuse_req_t req,
 static void bcachefs_fuse_link(fuse_req_t req, fuse_ino_t inum,
 			       fuse_ino_t newparent, const char *newname)
 {
-	struct bch_fs *c = fuse_req_userdata(req);
+	struct bch_fs *c = bf_req_fs(req);
 	struct bch_inode_unpacked dir_u, inode_u;
 	struct qstr qstr = QSTR(newname);
 	int ret;
@@ -350,8 +613,8 @@ static void bcachefs_fuse_link(fuse_req_t req, fuse_ino_t inum,
 
 	newparent = map_root_ino(newparent);
 
-	ret = bch2_trans_do(c, NULL, NULL, 0,
-			    bch2_link_trans(&trans, newparent,
+	ret = bf_trans_do(c, NULL, NULL, 0,
+			    bch2_link_trans(trans, newparent,
 					    inum, &dir_u, &inode_u, &qstr));
 
 	if (!ret) {
@@ -362,16 +625,6 @@ static void bcachefs_fuse_link(fuse_req_t req, fuse_ino_t inum,
 	}
 }
 
-static void bcachefs_fuse_open(fuse_req_t req, fuse_ino_t inum,
-			       struct fuse_file_info *fi)
-{
-	fi->direct_io		= false;
-	fi->keep_cache		= true;
-	fi->cache_readdir	= true;
-
-	fuse_reply_open(req, fi);
-}
-
 static void userbio_init(struct bio *bio, struct bio_vec *bv,
 			 void *buf, size_t size)
 {
@@ -385,12 +638,11 @@ static void userbio_init(struct bio *bio, struct bio_vec *bv,
 static int get_inode_io_opts(struct bch_fs *c, u64 inum,
 			     struct bch_io_opts *opts)
 {
-	struct bch_inode_unpacked inode;
-	if (bch2_inode_find_by_inum(c, inum, &inode))
+	u64 size;
+
+	if (bf_inode_get(c, inum, &size, opts))
 		return -EINVAL;
 
-	*opts = bch2_opts_to_inode_opts(c->opts);
-	bch2_io_opts_apply(opts, bch2_inode_opts_get(&inode));
 	return 0;
 }
 
@@ -445,66 +697,292 @@ static size_t align_fix_up_bytes(const struct fuse_align_io *align,
 	return bytes;
 }
 
+static void read_aligned_start(struct bch_fs *c, fuse_ino_t inum,
+			       struct bch_io_opts io_opts,
+			       struct bch_read_bio *rbio, struct bio_vec *bv,
+			       struct closure *cl,
+			       size_t aligned_size, off_t aligned_offset,
+			       void *buf)
+{
+	BUG_ON(aligned_size & (block_bytes(c) - 1));
+	BUG_ON(aligned_offset & (block_bytes(c) - 1));
+
+	userbio_init(&rbio->bio, bv, buf, aligned_size);
+	bio_set_op_attrs(&rbio->bio, REQ_OP_READ, REQ_SYNC);
+	rbio->bio.bi_iter.bi_sector	= aligned_offset >> 9;
+
+	closure_get(cl);
+	rbio->bio.bi_end_io		= bcachefs_fuse_read_endio;
+	rbio->bio.bi_private		= cl;
+
+	bch2_read(c, rbio_init(&rbio->bio, io_opts), inum);
+}
+
 /*
  * Read aligned data.
  */
 static int read_aligned(struct bch_fs *c, fuse_ino_t inum, size_t aligned_size,
 			off_t aligned_offset, void *buf)
 {
-	BUG_ON(aligned_size & (block_bytes(c) - 1));
-	BUG_ON(aligned_offset & (block_bytes(c) - 1));
-
 	struct bch_io_opts io_opts;
 	if (get_inode_io_opts(c, inum, &io_opts))
 		return -ENOENT;
 
 	struct bch_read_bio rbio;
 	struct bio_vec bv;
-	userbio_init(&rbio.bio, &bv, buf, aligned_size);
-	bio_set_op_attrs(&rbio.bio, REQ_OP_READ, REQ_SYNC);
-	rbio.bio.bi_iter.bi_sector	= aligned_offset >> 9;
-
 	struct closure cl;
 	closure_init_stack(&cl);
 
-	closure_get(&cl);
-	rbio.bio.bi_end_io		= bcachefs_fuse_read_endio;
-	rbio.bio.bi_private		= &cl;
-
-	bch2_read(c, rbio_init(&rbio.bio, io_opts), inum);
+	read_aligned_start(c, inum, io_opts, &rbio, &bv, &cl,
+			   aligned_size, aligned_offset, buf);
 
 	closure_sync(&cl);
 
 	return -blk_status_to_errno(rbio.bio.bi_status);
 }
 
+/*
+ * Per open file state, for readahead: when a file is being read sequentially,
+ * we read a window of BF_READAHEAD_BYTES at a time into one buffer, and start
+ * reading the next window into the other buffer as soon as we start returning
+ * data from the first.
+ */
+#define BF_READAHEAD_BYTES	(1U << 20)
+
+struct bf_readahead {
+	void			*buf;
+	off_t			start;
+	size_t			size;
+	u64			write_seq;
+	bool			valid;
+	bool			in_flight;
+
+	struct bch_read_bio	rbio;
+	struct bio_vec		bv;
+	struct closure		cl;
+};
+
+struct bf_file {
+	u64			inum;
+	pthread_mutex_t		lock;
+	/* Where the last read ended, for detecting sequential reads: */
+	off_t			next_offset;
+	struct bf_readahead	ra[2];
+};
+
+static void bf_readahead_wait(struct bf_readahead *ra)
+{
+	if (ra->in_flight) {
+		closure_sync(&ra->cl);
+		ra->in_flight	= false;
+		ra->valid	= !ra->rbio.bio.bi_status;
+	}
+}
+
+static struct bf_file *bf_file_alloc(u64 inum)
+{
+	struct bf_file *f = calloc(1, sizeof(*f));
+
+	if (f) {
+		f->inum = inum;
+		pthread_mutex_init(&f->lock, NULL);
+	}
+	return f;
+}
+
+static void bf_file_free(struct bf_file *f)
+{
+	unsigned i;
+
+	if (!f)
+		return;
+
+	for (i = 0; i < ARRAY_SIZE(f->ra); i++) {
+		bf_readahead_wait(&f->ra[i]);
+		free(f->ra[i].buf);
+	}
+	pthread_mutex_destroy(&f->lock);
+	free(f);
+}
+
+/* Start reading the window at @start into @ra, if it's not already there: */
+static void bf_readahead_start(struct bch_fs *c, struct bf_file *f,
+			       struct bf_readahead *ra,
+			       struct bch_io_opts io_opts,
+			       u64 i_size, off_t start)
+{
+	u64 write_seq = bf_write_seq_read(f->inum);
+	off_t end = min_t(u64, round_up(i_size, block_bytes(c)),
+			  start + BF_READAHEAD_BYTES);
+
+	if (end <= start)
+		return;
+
+	bf_readahead_wait(ra);
+
+	if (ra->valid &&
+	    ra->start == start &&
+	    ra->write_seq == write_seq)
+		return;
+
+	if (!ra->buf) {
+		ra->buf = aligned_alloc(PAGE_SIZE, BF_READAHEAD_BYTES);
+		if (!ra->buf)
+			return;
+	}
+
+	ra->start	= start;
+	ra->size	= end - start;
+	ra->write_seq	= write_seq;
+	ra->valid	= false;
+	ra->in_flight	= true;
+
+	closure_init_stack(&ra->cl);
+	read_aligned_start(c, f->inum, io_opts, &ra->rbio, &ra->bv, &ra->cl,
+			   ra->size, ra->start, ra->buf);
+}
+
+/* Returns the readahead buffer with [offset, end), if we have it: */
+static struct bf_readahead *bf_readahead_find(struct bf_file *f,
+					      off_t offset, off_t end)
+{
+	u64 write_seq = bf_write_seq_read(f->inum);
+	unsigned i;
+
+	for (i = 0; i < ARRAY_SIZE(f->ra); i++) {
+		struct bf_readahead *ra = &f->ra[i];
+
+		if ((!ra->valid && !ra->in_flight) ||
+		    ra->write_seq != write_seq ||
+		    offset < ra->start ||
+		    end > ra->start + ra->size)
+			continue;
+
+		bf_readahead_wait(ra);
+		if (ra->valid)
+			return ra;
+	}
+
+	return NULL;
+}
+
+static void bf_reply_buf(fuse_req_t req, void *buf, size_t size)
+{
+	struct fuse_bufvec bufv = FUSE_BUFVEC_INIT(size);
+
+	bufv.buf[0].mem = buf;
+
+	/*
+	 * fuse_reply_data() can splice from our buffer to the fuse device
+	 * (FUSE_CAP_SPLICE_WRITE); it's done with the buffer when it returns:
+	 */
+	fuse_reply_data(req, &bufv, 0);
+}
+
+/*
+ * Sequential reads are served from the readahead buffers: returns true if we
+ * replied to the request.
+ */
+static bool bf_read_readahead(fuse_req_t req, struct bch_fs *c,
+			      struct bf_file *f, struct bch_io_opts io_opts,
+			      u64 i_size, off_t offset, off_t end)
+{
+	struct bf_readahead *ra;
+	bool sequential;
+
+	if (end - offset > BF_READAHEAD_BYTES / 2)
+		return false;
+
+	pthread_mutex_lock(&f->lock);
+	sequential = offset == f->next_offset;
+	f->next_offset = end;
+
+	ra = bf_readahead_find(f, offset, end);
+	if (!ra && sequential) {
+		ra = &f->ra[0];
+		bf_readahead_start(c, f, ra, io_opts, i_size,
+				   round_down(offset, block_bytes(c)));
+		ra = bf_readahead_find(f, offset, end);
+	}
+
+	if (!ra) {
+		pthread_mutex_unlock(&f->lock);
+		return false;
+	}
+
+	/* Keep the next window in flight while we're returning this one: */
+	if (sequential)
+		bf_readahead_start(c, f, ra == &f->ra[0] ? &f->ra[1] : &f->ra[0],
+				   io_opts, i_size, ra->start + ra->size);
+
+	bf_reply_buf(req, ra->buf + (offset - ra->start), end - offset);
+	pthread_mutex_unlock(&f->lock);
+	return true;
+}
+
+static void bcachefs_fuse_open(fuse_req_t req, fuse_ino_t inum,
+			       struct fuse_file_info *fi)
+{
+	struct bf_file *f = bf_file_alloc(inum);
+
+	if (!f) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+
+	fi->fh			= (unsigned long) f;
+	fi->direct_io		= false;
+	fi->keep_cache		= true;
+	fi->cache_readdir	= true;
+
+	/* Interrupted, we won't get a release: */
+	if (fuse_reply_open(req, fi) == -ENOENT)
+		bf_file_free(f);
+}
+
+static void bcachefs_fuse_release(fuse_req_t req, fuse_ino_t inum,
+				  struct fuse_file_info *fi)
+{
+	struct bch_fs *c = bf_req_fs(req);
+	int ret = bf_writeback_flush_inum(c, inum, true);
+
+	bf_file_free((void *) fi->fh);
+	fuse_reply_err(req, -ret);
+}
+
 static void bcachefs_fuse_read(fuse_req_t req, fuse_ino_t inum,
 			       size_t size, off_t offset,
 			       struct fuse_file_info *fi)
 {
-	struct bch_fs *c = fuse_req_userdata(req);
+	struct bch_fs *c = bf_req_fs(req);
+	struct bf_file *f = (void *) fi->fh;
+	struct bch_io_opts io_opts;
+	u64 i_size;
 
 	fuse_log(FUSE_LOG_DEBUG, "bcachefs_fuse_read(%llu, %zd, %lld)\n",
 		 inum, size, offset);
 
 	/* Check inode size. */
-	struct bch_inode_unpacked bi;
-	int ret = bch2_inode_find_by_inum(c, inum, &bi);
+	int ret = bf_writeback_flush_inum(c, inum, false) ?:
+		bf_inode_get(c, inum, &i_size, &io_opts);
 	if (ret) {
 		fuse_reply_err(req, -ret);
 		return;
 	}
 
-	off_t end = min_t(u64, bi.bi_size, offset + size);
+	off_t end = min_t(u64, i_size, offset + size);
 	if (end <= offset) {
 		fuse_reply_buf(req, NULL, 0);
 		return;
 	}
 	size = end - offset;
 
+	if (f && bf_read_readahead(req, c, f, io_opts, i_size, offset, end))
+		return;
+
 	struct fuse_align_io align = align_io(c, size, offset);
 
-	void *buf = aligned_alloc(PAGE_SIZE, align.size);
+	void *buf = bf_thread_buf(c, align.size);
 	if (!buf) {
 		fuse_reply_err(req, ENOMEM);
 		return;
@@ -513,46 +991,44 @@ static void bcachefs_fuse_read(fuse_req_t req, fuse_ino_t inum,
 	ret = read_aligned(c, inum, align.size, align.start, buf);
 
 	if (likely(!ret))
-		fuse_reply_buf(req, buf + align.pad_start, size);
+		bf_reply_buf(req, buf + align.pad_start, size);
 	else
 		fuse_reply_err(req, -ret);
-
-	free(buf);
 }
 
 static int inode_update_times(struct bch_fs *c, fuse_ino_t inum)
 {
-	struct btree_trans trans;
+	struct btree_trans *trans;
 	struct btree_iter iter;
 	struct bch_inode_unpacked inode_u;
 	int ret = 0;
 	u64 now;
 
-	bch2_trans_init(&trans, c, 0, 0);
+	trans = bf_trans_get(c);
 retry:
-	bch2_trans_begin(&trans);
+	bch2_trans_begin(trans);
 	now = bch2_current_time(c);
 
-	ret = bch2_inode_peek(&trans, &iter, &inode_u, inum, BTREE_ITER_INTENT);
+	ret = bch2_inode_peek(trans, &iter, &inode_u, inum, BTREE_ITER_INTENT);
 	if (ret)
 		goto err;
 
 	inode_u.bi_mtime = now;
 	inode_u.bi_ctime = now;
 
-	ret = bch2_inode_write(&trans, &iter, &inode_u);
+	ret = bch2_inode_write(trans, &iter, &inode_u);
 	if (ret)
 		goto err;
 
-	ret = bch2_trans_commit(&trans, NULL, NULL,
+	ret = bch2_trans_commit(trans, NULL, NULL,
 				BTREE_INSERT_NOFAIL);
 
 err:
-        bch2_trans_iter_exit(&trans, &iter);
+        bch2_trans_iter_exit(trans, &iter);
 	if (ret == -EINTR)
 		goto retry;
 
-	bch2_trans_exit(&trans);
+	bf_trans_put(trans);
 	return ret;
 }
 
@@ -591,24 +1067,24 @@ static int write_aligned(struct bch_fs *c, fuse_ino_t inum,
 	closure_call(&op.cl, bch2_write, NULL, &cl);
 	closure_sync(&cl);
 
+	bf_inode_invalidate(inum);
+	bf_write_seq_inc(inum);
+
 	if (!op.error)
 		*written_out = op.written << 9;
 
 	return op.error;
 }
 
-static void bcachefs_fuse_write(fuse_req_t req, fuse_ino_t inum,
-				const char *buf, size_t size,
-				off_t offset,
-				struct fuse_file_info *fi)
+static int bf_write_direct(struct bch_fs *c, fuse_ino_t inum,
+			   const char *buf, size_t size, off_t offset,
+			   size_t *written)
 {
-	struct bch_fs *c	= fuse_req_userdata(req);
 	struct bch_io_opts	io_opts;
 	size_t			aligned_written;
 	int			ret = 0;
 
-	fuse_log(FUSE_LOG_DEBUG, "bcachefs_fuse_write(%llu, %zd, %lld)\n",
-		 inum, size, offset);
+	*written = 0;
 
 	struct fuse_align_io align = align_io(c, size, offset);
 	void *aligned_buf = aligned_alloc(PAGE_SIZE, align.size);
@@ -657,13 +1133,10 @@ static void bcachefs_fuse_write(fuse_req_t req, fuse_ino_t inum,
 			    offset + size, &aligned_written);
 
 	/* Figure out how many unaligned bytes were written. */
-	size_t written = align_fix_up_bytes(&align, aligned_written);
-	BUG_ON(written > size);
+	*written = align_fix_up_bytes(&align, aligned_written);
+	BUG_ON(*written > size);
 
-	fuse_log(FUSE_LOG_DEBUG, "bcachefs_fuse_write: wrote %zd bytes\n",
-		 written);
-
-	if (written > 0)
+	if (*written > 0)
 		ret = 0;
 
 	/*
@@ -672,23 +1145,421 @@ static void bcachefs_fuse_write(fuse_req_t req, fuse_ino_t inum,
 	 */
 	if (!ret)
 		ret = inode_update_times(c, inum);
+err:
+	free(aligned_buf);
+	return ret;
+}
+
+/*
+ * Write-back buffering:
+ *
+ * With the writeback cache enabled the kernel hands us dirty pages a few at a
+ * time, so writing each one through means a read-modify-write of the edge
+ * blocks, a btree update and an inode update per page. Instead we keep one
+ * dirty range per inode, block aligned, and merge writes into it for as long
+ * as they're contiguous with it; the range is written out with a single
+ * bch2_write() - which also updates i_size - preceded by a single update of
+ * mtime and ctime.
+ *
+ * Dirty ranges are written out on fsync, flush and release, when a write isn't
+ * contiguous with the range, before anything that looks at the inode's size or
+ * data, when we go over BF_DIRTY_LIMIT bytes in total, and by a background
+ * thread - periodically, and when the shrinkers see memory pressure.
+ *
+ * Errors from writing out a range are kept and returned by the next fsync or
+ * flush of that inode, the same as a local filesystem would.
+ */
+#define BF_DIRTY_MAX		(1U << 20)
+#define BF_DIRTY_LIMIT		(64ULL << 20)
+#define BF_DIRTY_HASH_SIZE	256
+#define BF_WRITEBACK_INTERVAL	(5 * HZ)
+
+struct bf_dirty {
+	/* On bf_dirty_list, oldest write first: */
+	struct list_head	list;
+	/* On bf_dirty_table, for lookups by inum: */
+	struct hlist_node	hash;
+	u64			inum;
+	/* Protected by bf_dirty_lock: */
+	unsigned		ref;
+
+	pthread_mutex_t		lock;
+	struct bch_io_opts	io_opts;
+	/* i_size when the range was started, and what the writes extend it to: */
+	u64			disk_size;
+	u64			i_size;
+	/* Dirty range - block aligned, all of it valid in @buf: */
+	off_t			start;
+	size_t			size;
+	int			err;
+	/* Grown on demand, up to BF_DIRTY_MAX: */
+	void			*buf;
+	size_t			buf_size;
+};
+
+static pthread_mutex_t		bf_dirty_lock = PTHREAD_MUTEX_INITIALIZER;
+static LIST_HEAD(bf_dirty_list);
+static struct hlist_head	bf_dirty_table[BF_DIRTY_HASH_SIZE];
+static atomic64_t		bf_dirty_bytes;
+static struct task_struct	*bf_writeback_task;
+static struct shrinker		bf_writeback_shrinker;
+
+static struct hlist_head *bf_dirty_slot(u64 inum)
+{
+	return &bf_dirty_table[hash_64(inum, ilog2(BF_DIRTY_HASH_SIZE))];
+}
+
+static struct bf_dirty *bf_dirty_get(u64 inum, bool create)
+{
+	struct hlist_head *slot = bf_dirty_slot(inum);
+	struct bf_dirty *d;
+
+	pthread_mutex_lock(&bf_dirty_lock);
+	hlist_for_each_entry(d, slot, hash)
+		if (d->inum == inum)
+			goto found;
+
+	d = NULL;
+	if (!create)
+		goto out;
+
+	d = calloc(1, sizeof(*d));
+	if (!d)
+		goto out;
+
+	d->inum = inum;
+	pthread_mutex_init(&d->lock, NULL);
+	list_add_tail(&d->list, &bf_dirty_list);
+	hlist_add_head(&d->hash, slot);
+found:
+	d->ref++;
+	if (create)
+		list_move_tail(&d->list, &bf_dirty_list);
+out:
+	pthread_mutex_unlock(&bf_dirty_lock);
+	return d;
+}
+
+static void bf_dirty_put(struct bf_dirty *d)
+{
+	pthread_mutex_lock(&bf_dirty_lock);
+	/* With no refs nobody can hold d->lock, so size and err are stable: */
+	if (!--d->ref && !d->size && !d->err) {
+		list_del(&d->list);
+		hlist_del(&d->hash);
+		pthread_mutex_destroy(&d->lock);
+		free(d->buf);
+		free(d);
+	}
+	pthread_mutex_unlock(&bf_dirty_lock);
+}
+
+static int bf_dirty_flush(struct bch_fs *c, struct bf_dirty *d)
+{
+	size_t written;
+	int ret;
+
+	if (!d->size)
+		return 0;
+
+	fuse_log(FUSE_LOG_DEBUG, "bf_dirty_flush(%llu, %zu, %lld)\n",
+		 d->inum, d->size, (long long) d->start);
+
+	/*
+	 * The data goes in with its own transactions - one per extent - so the
+	 * times can't be part of them; update them first. Recovery replays a
+	 * prefix of the journal, so after a crash either the data was written
+	 * with mtime/ctime updated, or the times moved and the data didn't -
+	 * never new data with the old times:
+	 */
+	ret = inode_update_times(c, d->inum);
+	if (!ret)
+		ret = write_aligned(c, d->inum, d->io_opts, d->buf, d->size,
+				    d->start, d->i_size, &written);
+	if (!ret && written != d->size)
+		ret = -EIO;
+
+	atomic64_sub(d->size, &bf_dirty_bytes);
+	d->size = 0;
+
+	if (ret && !d->err)
+		d->err = ret;
+	return ret;
+}
+
+/* Make sure @buf can hold @size bytes of dirty range: */
+static int bf_dirty_buf_resize(struct bf_dirty *d, size_t size)
+{
+	size_t new_size;
+	void *n;
+
+	if (size <= d->buf_size)
+		return 0;
+
+	new_size = min_t(size_t, roundup_pow_of_two(max_t(size_t, size, PAGE_SIZE)),
+			 BF_DIRTY_MAX);
+	n = aligned_alloc(PAGE_SIZE, new_size);
+	if (!n)
+		return -ENOMEM;
+
+	if (d->size)
+		memcpy(n, d->buf, d->size);
+	free(d->buf);
+	d->buf		= n;
+	d->buf_size	= new_size;
+	return 0;
+}
+
+/* Fill in a block of the dirty range that the write won't entirely cover: */
+static int bf_dirty_fill_block(struct bch_fs *c, struct bf_dirty *d, off_t pos)
+{
+	void *p = d->buf + (pos - d->start);
+
+	memset(p, 0, block_bytes(c));
+
+	return pos < d->disk_size
+		? read_aligned(c, d->inum, block_bytes(c), pos, p)
+		: 0;
+}
+
+static int bf_dirty_write(struct bch_fs *c, struct bf_dirty *d,
+			  const char *buf, size_t size, off_t offset)
+{
+	unsigned block	= block_bytes(c);
+	off_t end	= offset + size;
+	off_t new_end	= round_up(end, block);
+	off_t old_end;
+	int ret;
+
+	if (d->size &&
+	    (offset < d->start ||
+	     offset > d->start + d->size ||
+	     new_end - d->start > BF_DIRTY_MAX)) {
+		ret = bf_dirty_flush(c, d);
+		if (ret)
+			return ret;
+	}
+
+	if (!d->size) {
+		ret = bf_inode_get(c, d->inum, &d->disk_size, &d->io_opts);
+		if (ret)
+			return ret;
+
+		d->start	= round_down(offset, block);
+		d->i_size	= d->disk_size;
+	}
+
+	old_end = d->start + d->size;
+
+	if (new_end > old_end) {
+		ret = bf_dirty_buf_resize(d, new_end - d->start);
+		if (ret)
+			return ret;
+
+		/* Only possible when starting a new range: */
+		if (offset > old_end) {
+			ret = bf_dirty_fill_block(c, d, old_end);
+			if (ret)
+				return ret;
+		}
+
+		if (end != new_end &&
+		    new_end - block >= old_end &&
+		    !(offset > old_end && new_end - block == old_end)) {
+			ret = bf_dirty_fill_block(c, d, new_end - block);
+			if (ret)
+				return ret;
+		}
+
+		atomic64_add(new_end - old_end, &bf_dirty_bytes);
+		d->size = new_end - d->start;
+	}
+
+	memcpy(d->buf + (offset - d->start), buf, size);
+	d->i_size = max_t(u64, d->i_size, end);
+	return 0;
+}
+
+/*
+ * Write out @inum's dirty range, if it has one; for fsync and flush, also
+ * return (and clear) any error from a previous write out:
+ */
+static int bf_writeback_flush_inum(struct bch_fs *c, u64 inum, bool sync)
+{
+	struct bf_dirty *d = bf_dirty_get(inum, false);
+	int ret;
+
+	if (!d)
+		return 0;
+
+	pthread_mutex_lock(&d->lock);
+	ret = bf_dirty_flush(c, d);
+	if (sync) {
+		ret = ret ?: d->err;
+		d->err = 0;
+	}
+	pthread_mutex_unlock(&d->lock);
+
+	bf_dirty_put(d);
+	return ret;
+}
+
+/* Write out the oldest dirty range; returns false if there weren't any: */
+static bool bf_writeback_one(struct bch_fs *c)
+{
+	struct bf_dirty *d;
+
+	pthread_mutex_lock(&bf_dirty_lock);
+	list_for_each_entry(d, &bf_dirty_list, list)
+		if (READ_ONCE(d->size))
+			goto found;
+	pthread_mutex_unlock(&bf_dirty_lock);
+	return false;
+found:
+	d->ref++;
+	list_move_tail(&d->list, &bf_dirty_list);
+	pthread_mutex_unlock(&bf_dirty_lock);
+
+	pthread_mutex_lock(&d->lock);
+	bf_dirty_flush(c, d);
+	pthread_mutex_unlock(&d->lock);
+
+	bf_dirty_put(d);
+	return true;
+}
+
+static void bf_writeback_all(struct bch_fs *c)
+{
+	struct bf_dirty *d;
+	unsigned nr = 0;
+
+	pthread_mutex_lock(&bf_dirty_lock);
+	list_for_each_entry(d, &bf_dirty_list, list)
+		nr++;
+	pthread_mutex_unlock(&bf_dirty_lock);
 
+	while (nr-- && bf_writeback_one(c))
+		;
+}
+
+static int bf_writeback_thread(void *arg)
+{
+	struct bch_fs *c = arg;
+
+	while (!kthread_should_stop()) {
+		set_current_state(TASK_INTERRUPTIBLE);
+		if (kthread_should_stop()) {
+			__set_current_state(TASK_RUNNING);
+			break;
+		}
+		schedule_timeout(BF_WRITEBACK_INTERVAL);
+
+		bf_writeback_all(c);
+	}
+
+	return 0;
+}
+
+static unsigned long bf_writeback_shrinker_count(struct shrinker *shrink,
+						 struct shrink_control *sc)
+{
+	return atomic64_read(&bf_dirty_bytes) >> PAGE_SHIFT;
+}
+
+/*
+ * Writing out dirty data allocates, so we can't do it from the shrinker -
+ * kick the writeback thread instead:
+ */
+static unsigned long bf_writeback_shrinker_scan(struct shrinker *shrink,
+						struct shrink_control *sc)
+{
+	if (atomic64_read(&bf_dirty_bytes) && bf_writeback_task)
+		wake_up_process(bf_writeback_task);
+	return SHRINK_STOP;
+}
+
+static int bf_writeback_init(struct bch_fs *c)
+{
+	struct task_struct *p;
+
+	p = kthread_run(bf_writeback_thread, c, "bcachefs_fuse_wb");
+	if (IS_ERR(p))
+		return PTR_ERR(p);
+
+	get_task_struct(p);
+	bf_writeback_task = p;
+
+	bf_writeback_shrinker.count_objects	= bf_writeback_shrinker_count;
+	bf_writeback_shrinker.scan_objects	= bf_writeback_shrinker_scan;
+	bf_writeback_shrinker.seeks		= 1;
+	return register_shrinker(&bf_writeback_shrinker, "bcachefs-fuse-writeback");
+}
+
+static void bf_writeback_exit(struct bch_fs *c)
+{
+	if (bf_writeback_shrinker.list.next)
+		unregister_shrinker(&bf_writeback_shrinker);
+
+	if (bf_writeback_task) {
+		kthread_stop(bf_writeback_task);
+		put_task_struct(bf_writeback_task);
+		bf_writeback_task = NULL;
+	}
+
+	bf_writeback_all(c);
+}
+
+static void bcachefs_fuse_write(fuse_req_t req, fuse_ino_t inum,
+				const char *buf, size_t size,
+				off_t offset,
+				struct fuse_file_info *fi)
+{
+	struct bch_fs *c	= bf_req_fs(req);
+	struct bf_dirty		*d;
+	size_t			written = size;
+	int			ret;
+
+	fuse_log(FUSE_LOG_DEBUG, "bcachefs_fuse_write(%llu, %zd, %lld)\n",
+		 inum, size, offset);
+
+	if (round_up(offset + size, block_bytes(c)) -
+	    round_down(offset, block_bytes(c)) > BF_DIRTY_MAX) {
+		/* Too big to buffer, write it through: */
+		ret   = bf_writeback_flush_inum(c, inum, false) ?:
+			bf_write_direct(c, inum, buf, size, offset, &written);
+	} else {
+		d = bf_dirty_get(inum, true);
+		if (!d) {
+			ret = -ENOMEM;
+			goto err;
+		}
+
+		pthread_mutex_lock(&d->lock);
+		ret = bf_dirty_write(c, d, buf, size, offset);
+		pthread_mutex_unlock(&d->lock);
+
+		bf_dirty_put(d);
+	}
+
+	fuse_log(FUSE_LOG_DEBUG, "bcachefs_fuse_write: wrote %zd bytes\n",
+		 written);
+err:
 	if (!ret) {
 		BUG_ON(written == 0);
 		fuse_reply_write(req, written);
-		free(aligned_buf);
-		return;
+	} else {
+		fuse_reply_err(req, -ret);
 	}
 
-err:
-	fuse_reply_err(req, -ret);
-	free(aligned_buf);
+	while (atomic64_read(&bf_dirty_bytes) > BF_DIRTY_LIMIT &&
+	       bf_writeback_one(c))
+		;
 }
 
 static void bcachefs_fuse_symlink(fuse_req_t req, const char *link,
 				  fuse_ino_t dir, const char *name)
 {
-	struct bch_fs *c = fuse_req_userdata(req);
+	struct bch_fs *c = bf_req_fs(req);
 	struct bch_inode_unpacked new_inode;
 	size_t link_len = strlen(link);
 	int ret;
@@ -743,7 +1614,7 @@ err:
 
 static void bcachefs_fuse_readlink(fuse_req_t req, fuse_ino_t inum)
 {
-	struct bch_fs *c = fuse_req_userdata(req);
+	struct bch_fs *c = bf_req_fs(req);
 	char *buf = NULL;
 
 	fuse_log(FUSE_LOG_DEBUG, "bcachefs_fuse_readlink(%llu)\n", inum);
@@ -775,36 +1646,42 @@ err:
 	free(buf);
 }
 
-#if 0
 /*
  * FUSE flush is essentially the close() call, however it is not guaranteed
  * that one flush happens per open/create.
  *
- * It doesn't have to do anything, and is mostly relevant for NFS-style
- * filesystems where close has some relationship to caching.
+ * We write out buffered writes here, so that close() sees write errors.
  */
 static void bcachefs_fuse_flush(fuse_req_t req, fuse_ino_t inum,
 				struct fuse_file_info *fi)
 {
-	struct bch_fs *c = fuse_req_userdata(req);
-}
+	struct bch_fs *c = bf_req_fs(req);
 
-static void bcachefs_fuse_release(fuse_req_t req, fuse_ino_t inum,
-				  struct fuse_file_info *fi)
-{
-	struct bch_fs *c = fuse_req_userdata(req);
+	fuse_log(FUSE_LOG_DEBUG, "bcachefs_fuse_flush(%llu)\n", inum);
+
+	fuse_reply_err(req, -bf_writeback_flush_inum(c, inum, true));
 }
 
 static void bcachefs_fuse_fsync(fuse_req_t req, fuse_ino_t inum, int datasync,
 				struct fuse_file_info *fi)
 {
-	struct bch_fs *c = fuse_req_userdata(req);
+	struct bch_fs *c = bf_req_fs(req);
+	int ret;
+
+	fuse_log(FUSE_LOG_DEBUG, "bcachefs_fuse_fsync(%llu, %i)\n",
+		 inum, datasync);
+
+	ret   = bf_writeback_flush_inum(c, inum, true) ?:
+		bch2_journal_flush(&c->journal);
+
+	fuse_reply_err(req, -ret);
 }
 
+#if 0
 static void bcachefs_fuse_opendir(fuse_req_t req, fuse_ino_t inum,
 				  struct fuse_file_info *fi)
 {
-	struct bch_fs *c = fuse_req_userdata(req);
+	struct bch_fs *c = bf_req_fs(req);
 }
 #endif
 
@@ -902,7 +1779,7 @@ static void bcachefs_fuse_readdir(fuse_req_t req, fuse_ino_t dir,
 				  size_t size, off_t off,
 				  struct fuse_file_info *fi)
 {
-	struct bch_fs *c = fuse_req_userdata(req);
+	struct bch_fs *c = bf_req_fs(req);
 	struct bch_inode_unpacked bi;
 	char *buf = calloc(size, 1);
 	struct fuse_dir_context ctx = {
@@ -955,19 +1832,19 @@ static void bcachefs_fuse_readdirplus(fuse_req_t req, fuse_ino_t dir,
 static void bcachefs_fuse_releasedir(fuse_req_t req, fuse_ino_t inum,
 				     struct fuse_file_info *fi)
 {
-	struct bch_fs *c = fuse_req_userdata(req);
+	struct bch_fs *c = bf_req_fs(req);
 }
 
 static void bcachefs_fuse_fsyncdir(fuse_req_t req, fuse_ino_t inum, int datasync,
 				   struct fuse_file_info *fi)
 {
-	struct bch_fs *c = fuse_req_userdata(req);
+	struct bch_fs *c = bf_req_fs(req);
 }
 #endif
 
 static void bcachefs_fuse_statfs(fuse_req_t req, fuse_ino_t inum)
 {
-	struct bch_fs *c = fuse_req_userdata(req);
+	struct bch_fs *c = bf_req_fs(req);
 	struct bch_fs_usage_short usage = bch2_fs_usage_read_short(c);
 	unsigned shift = c->block_bits;
 	struct statvfs statbuf = {
@@ -989,26 +1866,26 @@ static void bcachefs_fuse_setxattr(fuse_req_t req, fuse_ino_t inum,
 				   const char *name, const char *value,
 				   size_t size, int flags)
 {
-	struct bch_fs *c = fuse_req_userdata(req);
+	struct bch_fs *c = bf_req_fs(req);
 }
 
 static void bcachefs_fuse_getxattr(fuse_req_t req, fuse_ino_t inum,
 				   const char *name, size_t size)
 {
-	struct bch_fs *c = fuse_req_userdata(req);
+	struct bch_fs *c = bf_req_fs(req);
 
 	fuse_reply_xattr(req, );
 }
 
 static void bcachefs_fuse_listxattr(fuse_req_t req, fuse_ino_t inum, size_t size)
 {
-	struct bch_fs *c = fuse_req_userdata(req);
+	struct bch_fs *c = bf_req_fs(req);
 }
 
 static void bcachefs_fuse_removexattr(fuse_req_t req, fuse_ino_t inum,
 				      const char *name)
 {
-	struct bch_fs *c = fuse_req_userdata(req);
+	struct bch_fs *c = bf_req_fs(req);
 }
 #endif
 
@@ -1016,7 +1893,7 @@ static void bcachefs_fuse_create(fuse_req_t req, fuse_ino_t dir,
 				 const char *name, mode_t mode,
 				 struct fuse_file_info *fi)
 {
-	struct bch_fs *c = fuse_req_userdata(req);
+	struct bch_fs *c = bf_req_fs(req);
 	struct bch_inode_unpacked new_inode;
 	int ret;
 
@@ -1027,8 +1904,16 @@ static void bcachefs_fuse_create(fuse_req_t req, fuse_ino_t dir,
 	if (ret)
 		goto err;
 
+	struct bf_file *f = bf_file_alloc(new_inode.bi_inum);
+	if (!f) {
+		ret = -ENOMEM;
+		goto err;
+	}
+	fi->fh = (unsigned long) f;
+
 	struct fuse_entry_param e = inode_to_entry(c, &new_inode);
-	fuse_reply_create(req, &e, fi);
+	if (fuse_reply_create(req, &e, fi) == -ENOENT)
+		bf_file_free(f);
 	return;
 err:
 	fuse_reply_err(req, -ret);
@@ -1040,14 +1925,14 @@ static void bcachefs_fuse_write_buf(fuse_req_t req, fuse_ino_t inum,
 				    struct fuse_bufvec *bufv, off_t off,
 				    struct fuse_file_info *fi)
 {
-	struct bch_fs *c = fuse_req_userdata(req);
+	struct bch_fs *c = bf_req_fs(req);
 }
 
 static void bcachefs_fuse_fallocate(fuse_req_t req, fuse_ino_t inum, int mode,
 				    off_t offset, off_t length,
 				    struct fuse_file_info *fi)
 {
-	struct bch_fs *c = fuse_req_userdata(req);
+	struct bch_fs *c = bf_req_fs(req);
 }
 #endif
 
@@ -1068,9 +1953,9 @@ static const struct fuse_lowlevel_ops bcachefs_fuse_ops = {
 	.open		= bcachefs_fuse_open,
 	.read		= bcachefs_fuse_read,
 	.write		= bcachefs_fuse_write,
-	//.flush	= bcachefs_fuse_flush,
-	//.release	= bcachefs_fuse_release,
-	//.fsync	= bcachefs_fuse_fsync,
+	.flush		= bcachefs_fuse_flush,
+	.release	= bcachefs_fuse_release,
+	.fsync		= bcachefs_fuse_fsync,
 	//.opendir	= bcachefs_fuse_opendir,
 	.readdir	= bcachefs_fuse_readdir,
 	//.readdirplus	= bcachefs_fuse_readdirplus,
@@ -1175,7 +2060,11 @@ static void usage(char *argv[])
 {
 	printf("Usage: %s fusemount [options] <dev>[:dev2:...] <mountpoint>\n",
 	       argv[0]);
-	printf("\n");
+	printf("\n"
+	       "Requests are handled by multiple worker threads, unless -s is given;\n"
+	       "-o max_idle_threads=N sets the number of worker threads kept around,\n"
+	       "-o clone_fd gives each worker its own /dev/fuse file descriptor.\n"
+	       "\n");
 }
 
 int cmd_fusemount(int argc, char *argv[])
@@ -1250,7 +2139,19 @@ int cmd_fusemount(int argc, char *argv[])
 
 	fuse_daemonize(fuse_opts.foreground);
 
-	ret = fuse_session_loop(se);
+	if (pthread_key_create(&bf_thread_key, bf_thread_exit))
+		die("pthread_key_create err: %m");
+
+	if (fuse_opts.singlethread) {
+		ret = fuse_session_loop(se);
+	} else {
+		struct fuse_loop_config loop_config = {
+			.clone_fd		= fuse_opts.clone_fd,
+			.max_idle_threads	= fuse_opts.max_idle_threads,
+		};
+
+		ret = fuse_session_loop_mt(se, &loop_config);
+	}
 
 	/* Cleanup */
 	fuse_session_unmount(se);
@@ -51,6 +51,7 @@ int cmd_migrate(int argc, char *argv[]);
 int cmd_migrate_superblock(int argc, char *argv[]);
 
 int cmd_version(int argc, char *argv[]);
+int cmd_bench(int argc, char *argv[]);
 
 int cmd_setattr(int argc, char *argv[]);
 
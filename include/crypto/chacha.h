@@ -12,4 +12,7 @@
 #define CHACHA_KEY_SIZE	32
 #define CHACHA_BLOCK_SIZE	64
 
+/* Skip our own SIMD implementation, for benchmarking against libsodium's: */
+extern bool chacha20_use_sodium;
+
 #endif
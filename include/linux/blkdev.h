@@ -66,6 +66,22 @@ static inline struct inode *file_inode(const struct file *f)
 void generic_make_request(struct bio *);
 int submit_bio_wait(struct bio *);
 
+/*
+ * Plugging: reads and writes submitted while a plug is held are queued on it
+ * and submitted as a batch, with adjacent bios merged, when the plug is
+ * finished, when it fills up or when the task blocks in schedule():
+ */
+#define BLK_MAX_REQUEST_COUNT	32
+
+struct blk_plug {
+	struct bio		*bios;
+	unsigned		nr;
+};
+
+void blk_start_plug(struct blk_plug *);
+void blk_finish_plug(struct blk_plug *);
+void blk_flush_plug(struct blk_plug *);
+
 static inline void submit_bio(struct bio *bio)
 {
 	generic_make_request(bio);
@@ -1,23 +1,35 @@
 #ifndef __LINUX_CPUMASK_H
 #define __LINUX_CPUMASK_H
 
-#define num_online_cpus()	1U
-#define num_possible_cpus()	1U
-#define num_present_cpus()	1U
-#define num_active_cpus()	1U
-#define cpu_online(cpu)		((cpu) == 0)
-#define cpu_possible(cpu)	((cpu) == 0)
-#define cpu_present(cpu)	((cpu) == 0)
-#define cpu_active(cpu)		((cpu) == 0)
+/*
+ * Userspace has no CPUs to speak of: "CPUs" here are the percpu slots that
+ * preempt_disable() hands out, one per CPU in the system (see linux/preempt.c).
+ * There's no hotplug, so every possible CPU is online and every mask is full.
+ */
+#define NR_CPUS			256
 
-#define raw_smp_processor_id()	0U
+extern unsigned nr_cpu_ids;
+extern __thread unsigned current_pcpu;
+
+#define num_online_cpus()	nr_cpu_ids
+#define num_possible_cpus()	nr_cpu_ids
+#define num_present_cpus()	nr_cpu_ids
+#define num_active_cpus()	nr_cpu_ids
+#define cpu_online(cpu)		((cpu) < nr_cpu_ids)
+#define cpu_possible(cpu)	((cpu) < nr_cpu_ids)
+#define cpu_present(cpu)	((cpu) < nr_cpu_ids)
+#define cpu_active(cpu)		((cpu) < nr_cpu_ids)
+
+/* Only stable with preemption disabled, as in the kernel: */
+#define raw_smp_processor_id()	current_pcpu
+#define smp_processor_id()	raw_smp_processor_id()
 
 #define for_each_cpu(cpu, mask)			\
-	for ((cpu) = 0; (cpu) < 1; (cpu)++, (void)mask)
+	for ((cpu) = 0; (cpu) < nr_cpu_ids; (cpu)++, (void)mask)
 #define for_each_cpu_not(cpu, mask)		\
-	for ((cpu) = 0; (cpu) < 1; (cpu)++, (void)mask)
+	for ((cpu) = 0; (cpu) < 0; (cpu)++, (void)mask)
 #define for_each_cpu_and(cpu, mask, and)	\
-	for ((cpu) = 0; (cpu) < 1; (cpu)++, (void)mask, (void)and)
+	for ((cpu) = 0; (cpu) < nr_cpu_ids; (cpu)++, (void)mask, (void)and)
 
 #define for_each_possible_cpu(cpu) for_each_cpu((cpu), 1)
 #define for_each_online_cpu(cpu)   for_each_cpu((cpu), 1)
@@ -8,4 +8,5 @@
 #include <linux/types.h>
 
 u64 __pure crc64_be(u64 crc, const void *p, size_t len);
+u64 __pure crc64_be_generic(u64 crc, const void *p, size_t len);
 #endif /* _LINUX_CRC64_H */
@@ -6,50 +6,53 @@
 #include <pthread.h>
 #include <linux/preempt.h>
 
+/* Readers don't exclude each other, so readers of percpu data mustn't either: */
 struct percpu_rw_semaphore {
-	pthread_mutex_t		lock;
+	pthread_rwlock_t	lock;
 };
 
-static inline void percpu_down_read_preempt_disable(struct percpu_rw_semaphore *sem)
+static inline void percpu_down_read(struct percpu_rw_semaphore *sem)
 {
-	pthread_mutex_lock(&sem->lock);
+	pthread_rwlock_rdlock(&sem->lock);
 }
 
-static inline void percpu_down_read(struct percpu_rw_semaphore *sem)
+static inline void percpu_down_read_preempt_disable(struct percpu_rw_semaphore *sem)
 {
-	pthread_mutex_lock(&sem->lock);
+	percpu_down_read(sem);
+	preempt_disable();
 }
 
 static inline int percpu_down_read_trylock(struct percpu_rw_semaphore *sem)
 {
-	return !pthread_mutex_trylock(&sem->lock);
+	return !pthread_rwlock_tryrdlock(&sem->lock);
 }
 
-static inline void percpu_up_read_preempt_enable(struct percpu_rw_semaphore *sem)
+static inline void percpu_up_read(struct percpu_rw_semaphore *sem)
 {
-	pthread_mutex_unlock(&sem->lock);
+	pthread_rwlock_unlock(&sem->lock);
 }
 
-static inline void percpu_up_read(struct percpu_rw_semaphore *sem)
+static inline void percpu_up_read_preempt_enable(struct percpu_rw_semaphore *sem)
 {
-	pthread_mutex_unlock(&sem->lock);
+	preempt_enable();
+	percpu_up_read(sem);
 }
 
 static inline void percpu_down_write(struct percpu_rw_semaphore *sem)
 {
-	pthread_mutex_lock(&sem->lock);
+	pthread_rwlock_wrlock(&sem->lock);
 }
 
 static inline void percpu_up_write(struct percpu_rw_semaphore *sem)
 {
-	pthread_mutex_unlock(&sem->lock);
+	pthread_rwlock_unlock(&sem->lock);
 }
 
 static inline void percpu_free_rwsem(struct percpu_rw_semaphore *sem) {}
 
 static inline int percpu_init_rwsem(struct percpu_rw_semaphore *sem)
 {
-	pthread_mutex_init(&sem->lock, NULL);
+	pthread_rwlock_init(&sem->lock, NULL);
 	return 0;
 }
 
@@ -1,6 +1,7 @@
 #ifndef __LINUX_PREEMPT_H
 #define __LINUX_PREEMPT_H
 
+/* Checks out a percpu slot, see linux/preempt.c: */
 extern void preempt_disable(void);
 extern void preempt_enable(void);
 
@@ -90,6 +90,7 @@ struct task_struct {
 	pid_t			pid;
 
 	struct bio_list		*bio_list;
+	struct blk_plug		*plug;
 
 	struct signal_struct	{
 		struct rw_semaphore exec_update_lock;
@@ -122,6 +123,9 @@ static inline void cond_resched(void) {}
 
 void schedule(void);
 
+void sched_thread_init(void);
+void sched_thread_exit(void);
+
 #define	MAX_SCHEDULE_TIMEOUT	LONG_MAX
 long schedule_timeout(long timeout);
 
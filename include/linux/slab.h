@@ -172,41 +172,48 @@ static inline void *kmemdup(const void *src, size_t len, gfp_t gfp)
 	return p;
 }
 
-struct kmem_cache {
-	size_t		    obj_size;
+#define SLAB_HWCACHE_ALIGN	((slab_flags_t __force)0x00002000U)
+#define SLAB_PANIC		((slab_flags_t __force)0x00040000U)
+#define SLAB_RECLAIM_ACCOUNT	((slab_flags_t __force)0x00020000U)
+#define SLAB_ACCOUNT		((slab_flags_t __force)0x04000000U)
+#define SLAB_NOLEAKTRACE	((slab_flags_t __force)0x00800000U)
+
+struct kmem_cache;
+
+struct kmem_cache_stats {
+	u64			allocs;
+	u64			frees;
+	/* magazine refills from, and flushes back to, the slabs: */
+	u64			refills;
+	u64			flushes;
+	u64			slabs;
+	u64			slabs_allocated;
+	u64			objs_per_slab;
 };
 
-static inline void *kmem_cache_alloc(struct kmem_cache *c, gfp_t gfp)
-{
-	return kmalloc(c->obj_size, gfp);
-}
+/*
+ * Caches created while this is set bypass the slab allocator and use plain
+ * kmalloc(), for benchmarking:
+ */
+extern bool kmem_cache_use_kmalloc;
 
-static inline void *kmem_cache_zalloc(struct kmem_cache *c, gfp_t gfp)
-{
-	return kzalloc(c->obj_size, gfp);
-}
+struct kmem_cache *kmem_cache_create(const char *, unsigned, unsigned,
+				     slab_flags_t, void (*)(void *));
+void kmem_cache_destroy(struct kmem_cache *);
 
-static inline void kmem_cache_free(struct kmem_cache *c, void *p)
-{
-	kfree(p);
-}
+void *kmem_cache_alloc(struct kmem_cache *, gfp_t);
+void kmem_cache_free(struct kmem_cache *, void *);
 
-static inline void kmem_cache_destroy(struct kmem_cache *p)
-{
-	kfree(p);
-}
+void kmem_cache_get_stats(struct kmem_cache *, struct kmem_cache_stats *);
 
-static inline struct kmem_cache *kmem_cache_create(size_t obj_size)
+static inline void *kmem_cache_zalloc(struct kmem_cache *c, gfp_t gfp)
 {
-	struct kmem_cache *p = kmalloc(sizeof(*p), GFP_KERNEL);
-	if (!p)
-		return NULL;
-
-	p->obj_size = obj_size;
-	return p;
+	return kmem_cache_alloc(c, gfp|__GFP_ZERO);
 }
 
-#define KMEM_CACHE(_struct, _flags)	kmem_cache_create(sizeof(struct _struct))
+#define KMEM_CACHE(_struct, _flags)					\
+	kmem_cache_create(#_struct, sizeof(struct _struct),		\
+			  __alignof__(struct _struct), (_flags), NULL)
 
 #define PAGE_KERNEL		0
 #define PAGE_KERNEL_EXEC	1
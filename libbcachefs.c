@@ -214,6 +214,10 @@ struct bch_sb *bch2_format(struct bch_opt_strs	fs_opt_strs,
 		__bch2_opt_set_sb(sb.sb, &bch2_opt_table[opt_id], v);
 	}
 
+	if (BCH_SB_METADATA_COMPRESSION_TYPE(sb.sb))
+		sb.sb->features[0] |=
+			cpu_to_le64(BIT_ULL(BCH_FEATURE_btree_node_compression));
+
 	struct timespec now;
 	if (clock_gettime(CLOCK_REALTIME, &now))
 		die("error getting current time: %m");
@@ -487,10 +491,16 @@ int bchu_data(struct bchfs_handle fs, struct bch_ioctl_data cmd)
 	int progress_fd = xioctl(fs.ioctl_fd, BCH_IOCTL_DATA, &cmd);
 
 	while (1) {
+		struct {
+			struct bch_ioctl_data_event		e;
+			struct bch_ioctl_data_shard_progress	shards[U8_MAX];
+		} buf;
 		struct bch_ioctl_data_event e;
+		ssize_t ret = read(progress_fd, &buf, sizeof(buf));
 
-		if (read(progress_fd, &e, sizeof(e)) != sizeof(e))
+		if (ret < (ssize_t) sizeof(e))
 			die("error reading from progress fd %m");
+		e = buf.e;
 
 		if (e.type)
 			continue;
@@ -515,6 +525,9 @@ int bchu_data(struct bchfs_handle fs, struct bch_ioctl_data cmd)
 			       e.p.pos.offset);
 		}
 
+		if (e.p.nr_shards)
+			printf(" (%u shards)", e.p.nr_shards);
+
 		fflush(stdout);
 		sleep(1);
 	}
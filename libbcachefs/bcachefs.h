@@ -328,7 +328,10 @@ do {									\
 		"compare them")						\
 	BCH_DEBUG_PARAM(backpointers_no_use_write_buffer,		\
 		"Don't use the write buffer for backpointers, enabling "\
-		"extra runtime checks")
+		"extra runtime checks")					\
+	BCH_DEBUG_PARAM(bset_search_simd_disabled,			\
+		"Disables the SIMD version of the bset auxiliary search "\
+		"tree lookup")
 
 /* Parameters that should only be compiled in debug mode: */
 #define BCH_DEBUG_PARAMS_DEBUG()					\
@@ -394,7 +397,10 @@ BCH_DEBUG_PARAMS_DEBUG()
 	x(blocked_journal)			\
 	x(blocked_allocate)			\
 	x(blocked_allocate_open_bucket)		\
-	x(nocow_lock_contended)
+	x(nocow_lock_contended)			\
+	x(btree_lock_contended_read)		\
+	x(btree_lock_contended_intent)		\
+	x(btree_lock_contended_write)
 
 enum bch_time_stats {
 #define x(name) BCH_TIME_##name,
@@ -452,6 +458,9 @@ enum gc_phase {
 	GC_PHASE_BTREE_backpointers,
 	GC_PHASE_BTREE_bucket_gens,
 	GC_PHASE_BTREE_snapshot_trees,
+	GC_PHASE_BTREE_deleted_inodes,
+	GC_PHASE_BTREE_logged_ops,
+	GC_PHASE_BTREE_rebalance_work,
 
 	GC_PHASE_PENDING_DELETE,
 };
@@ -514,6 +523,11 @@ struct bch_dev {
 	u8			*oldest_gen;
 	unsigned long		*buckets_nouse;
 	struct rw_semaphore	bucket_lock;
+	/*
+	 * Allocated by copygc, freed by resize and device teardown; readers
+	 * hold rcu_read_lock:
+	 */
+	struct copygc_frag_histogram __rcu *copygc_frag;
 
 	struct bch_dev_usage		*usage_base;
 	struct bch_dev_usage __percpu	*usage[JOURNAL_BUF_NR];
@@ -532,6 +546,14 @@ struct bch_dev {
 
 	atomic64_t		rebalance_work;
 
+	/*
+	 * Data moves in flight that read from (READ) or write to (WRITE) this
+	 * device, and the adaptive limit on each - see move.c:
+	 */
+	atomic_t		move_ios_in_flight[2];
+	unsigned		move_queue_depth;
+	u64			move_queue_depth_reduced;
+
 	struct journal_device	journal;
 	u64			prev_journal_sector;
 
@@ -969,6 +991,8 @@ struct bch_fs {
 	struct mutex		moving_context_lock;
 
 	struct list_head	data_progress_list;
+	/* Woken when moves complete on any device: */
+	wait_queue_head_t	move_dev_wait;
 	struct mutex		data_progress_lock;
 
 	/* REBALANCE */
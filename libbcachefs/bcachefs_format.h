@@ -1789,6 +1789,8 @@ LE64_BITMASK(BCH_SB_BACKGROUND_COMPRESSION_TYPE_HI,
 
 LE64_BITMASK(BCH_SB_VERSION_UPGRADE_COMPLETE,
 					struct bch_sb, flags[5],  0, 16);
+LE64_BITMASK(BCH_SB_METADATA_COMPRESSION_TYPE,
+					struct bch_sb, flags[5], 16, 24);
 
 static inline __u64 BCH_SB_COMPRESSION_TYPE(const struct bch_sb *sb)
 {
@@ -1821,6 +1823,7 @@ static inline void SET_BCH_SB_BACKGROUND_COMPRESSION_TYPE(struct bch_sb *sb, __u
  * inline_data:			gates KEY_TYPE_inline_data
  * new_siphash:			gates BCH_STR_HASH_siphash
  * new_extent_overwrite:	gates BTREE_NODE_NEW_EXTENT_OVERWRITE
+ * btree_node_compression:	gates BSET_COMPRESSION_TYPE
  */
 #define BCH_SB_FEATURES()			\
 	x(lz4,				0)	\
@@ -1841,7 +1844,8 @@ static inline void SET_BCH_SB_BACKGROUND_COMPRESSION_TYPE(struct bch_sb *sb, __u
 	x(new_varint,			15)	\
 	x(journal_no_flush,		16)	\
 	x(alloc_v2,			17)	\
-	x(extents_across_btree_nodes,	18)
+	x(extents_across_btree_nodes,	18)	\
+	x(btree_node_compression,	19)
 
 #define BCH_SB_FEATURES_ALWAYS				\
 	((1ULL << BCH_FEATURE_new_extent_overwrite)|	\
@@ -1864,11 +1868,18 @@ enum bch_sb_feature {
 	BCH_FEATURE_NR,
 };
 
+/*
+ * rebalance_work_index:	every extent that needs rebalancing is in the
+ *				rebalance_work btree. Not an upstream bit:
+ *				code that doesn't know it clears it, since it
+ *				won't keep the index up to date.
+ */
 #define BCH_SB_COMPAT()					\
 	x(alloc_info,				0)	\
 	x(alloc_metadata,			1)	\
 	x(extents_above_btree_updates_done,	2)	\
-	x(bformat_overflow_done,		3)
+	x(bformat_overflow_done,		3)	\
+	x(rebalance_work_index,			4)
 
 enum bch_sb_compat {
 #define x(f, n) BCH_COMPAT_##f,
@@ -2194,6 +2205,10 @@ LE32_BITMASK(JSET_NO_FLUSH,	struct jset, flags, 5, 6);
 
 /* Btree: */
 
+/*
+ * deleted_inodes and logged_ops are allocated upstream, and aren't used here:
+ * they're listed so that btree IDs stay in sync.
+ */
 #define BCH_BTREE_IDS()				\
 	x(extents,		0)		\
 	x(inodes,		1)		\
@@ -2210,7 +2225,10 @@ LE32_BITMASK(JSET_NO_FLUSH,	struct jset, flags, 5, 6);
 	x(need_discard,		12)		\
 	x(backpointers,		13)		\
 	x(bucket_gens,		14)		\
-	x(snapshot_trees,	15)
+	x(snapshot_trees,	15)		\
+	x(deleted_inodes,	16)		\
+	x(logged_ops,		17)		\
+	x(rebalance_work,	18)
 
 enum btree_id {
 #define x(kwd, val) BTREE_ID_##kwd = val,
@@ -2257,9 +2275,26 @@ LE32_BITMASK(BSET_BIG_ENDIAN,	struct bset, flags, 4, 5);
 LE32_BITMASK(BSET_SEPARATE_WHITEOUTS,
 				struct bset, flags, 5, 6);
 
+/* enum bch_compression_type, if the keys in this bset are compressed: */
+LE32_BITMASK(BSET_COMPRESSION_TYPE,
+				struct bset, flags, 6, 10);
+
 /* Sector offset within the btree node: */
 LE32_BITMASK(BSET_OFFSET,	struct bset, flags, 16, 32);
 
+/*
+ * For compressed bsets, u64s is the size of the compressed payload, which starts
+ * with this header. The bset still occupies as many sectors within the btree
+ * node as it would uncompressed - compression saves write bandwidth, it doesn't
+ * change the node layout. The header itself is never encrypted:
+ */
+struct bset_compressed {
+	__le32			compressed_bytes;
+	__le16			uncompressed_u64s;
+	__le16			pad;
+	__u8			data[];
+} __packed __aligned(8);
+
 struct btree_node {
 	struct bch_csum		csum;
 	__le64			magic;
@@ -178,7 +178,8 @@ enum bch_data_ops {
 	BCH_DATA_OP_REREPLICATE		= 1,
 	BCH_DATA_OP_MIGRATE		= 2,
 	BCH_DATA_OP_REWRITE_OLD_NODES	= 3,
-	BCH_DATA_OP_NR			= 4,
+	BCH_DATA_OP_REWRITE_FORMATS	= 4,
+	BCH_DATA_OP_NR			= 5,
 };
 
 /*
@@ -219,13 +220,27 @@ enum bch_data_event {
 struct bch_ioctl_data_progress {
 	__u8			data_type;
 	__u8			btree_id;
-	__u8			pad[2];
+	__u8			nr_shards;
+	__u8			pad[1];
 	struct bpos		pos;
 
 	__u64			sectors_done;
 	__u64			sectors_total;
 } __packed __aligned(8);
 
+/*
+ * Jobs that move data may be split into shards that run in parallel: if the
+ * buffer passed to read() has room, a progress event is followed by
+ * bch_ioctl_data_event.p.nr_shards of these:
+ */
+struct bch_ioctl_data_shard_progress {
+	__u8			btree_id;
+	__u8			pad[3];
+	struct bpos		pos;
+
+	__u64			sectors_done;
+} __packed __aligned(8);
+
 struct bch_ioctl_data_event {
 	__u8			type;
 	__u8			pad[7];
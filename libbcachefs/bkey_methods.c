@@ -208,6 +208,14 @@ static unsigned bch2_key_types_allowed[] = {
 	[BKEY_TYPE_snapshot_trees] =
 		(1U << KEY_TYPE_deleted)|
 		(1U << KEY_TYPE_snapshot_tree),
+	[BKEY_TYPE_deleted_inodes] =
+		(1U << KEY_TYPE_deleted)|
+		(1U << KEY_TYPE_set),
+	[BKEY_TYPE_logged_ops] =
+		(1U << KEY_TYPE_deleted),
+	[BKEY_TYPE_rebalance_work] =
+		(1U << KEY_TYPE_deleted)|
+		(1U << KEY_TYPE_set),
 	[BKEY_TYPE_btree] =
 		(1U << KEY_TYPE_deleted)|
 		(1U << KEY_TYPE_btree_ptr)|
@@ -6,65 +6,166 @@
 #include "bset.h"
 #include "extents.h"
 
+/*
+ * Merging bsets, with a tournament (loser) tree:
+ *
+ * Node reads merge up to one bset per block, so we want each key we output to
+ * cost log2(nr inputs) comparisons - and for those comparisons each input
+ * caches the most significant 64 bits of its current key, so that most of them
+ * are a single integer comparison that doesn't touch the keys.
+ *
+ * iter->data[n].loser is internal node n of the tree - the input that lost the
+ * match played there; node 0 is the overall winner. Input i is leaf used + i,
+ * and exhausted inputs compare greater than everything.
+ *
+ * sort_cmp_fn breaks ties between keys at the same position; remaining ties are
+ * broken by input order, older bsets first.
+ */
 typedef int (*sort_cmp_fn)(struct btree *,
 			   struct bkey_packed *,
 			   struct bkey_packed *);
 
-static inline bool sort_iter_end(struct sort_iter *iter)
+#define SORT_ITER_NO_LOSER	UINT_MAX
+
+/* The first word __bkey_cmp_bits() compares: */
+static __always_inline u64 bkey_packed_prefix(const struct btree *b,
+					      const struct bkey_packed *k)
+{
+	unsigned nr_key_bits = b->nr_key_bits + high_bit_offset;
+	u64 v = *high_word(&b->format, k) & (~0ULL >> high_bit_offset);
+
+	if (!b->nr_key_bits)
+		return 0;
+
+	return nr_key_bits < 64 ? v >> (64 - nr_key_bits) : v;
+}
+
+static __always_inline void sort_iter_set_prefix(struct btree *b,
+						 struct sort_iter_set *i)
+{
+	i->packed = bkey_packed(i->k);
+	if (i->packed)
+		i->prefix = bkey_packed_prefix(b, i->k);
+}
+
+static __always_inline bool sort_iter_set_end(struct sort_iter_set *i)
+{
+	return i->k == i->end;
+}
+
+static __always_inline int sort_iter_set_cmp(struct btree *b,
+					     struct sort_iter_set *l,
+					     struct sort_iter_set *r)
 {
-	return !iter->used;
+	return likely(l->packed && r->packed && l->prefix != r->prefix)
+		? cmp_int(l->prefix, r->prefix)
+		: bch2_bkey_cmp_packed_inlined(b, l->k, r->k);
 }
 
-static inline void sort_iter_sift(struct sort_iter *iter, unsigned from,
-				  sort_cmp_fn cmp)
+static __always_inline bool sort_iter_less(struct sort_iter *iter,
+					   unsigned l, unsigned r,
+					   sort_cmp_fn cmp)
 {
-	unsigned i;
+	struct sort_iter_set *sl = iter->data + l;
+	struct sort_iter_set *sr = iter->data + r;
+
+	if (unlikely(sort_iter_set_end(sr)))
+		return !sort_iter_set_end(sl);
+	if (unlikely(sort_iter_set_end(sl)))
+		return false;
 
-	for (i = from;
-	     i + 1 < iter->used &&
-	     cmp(iter->b, iter->data[i].k, iter->data[i + 1].k) > 0;
-	     i++)
-		swap(iter->data[i], iter->data[i + 1]);
+	return (sort_iter_set_cmp(iter->b, sl, sr) ?:
+		cmp(iter->b, sl->k, sr->k) ?:
+		cmp_int(l, r)) < 0;
+}
+
+static __always_inline struct sort_iter_set *sort_iter_winner(struct sort_iter *iter)
+{
+	return iter->data + iter->data[0].loser;
+}
+
+static inline bool sort_iter_end(struct sort_iter *iter)
+{
+	return !iter->used || sort_iter_set_end(sort_iter_winner(iter));
 }
 
-static inline void sort_iter_sort(struct sort_iter *iter, sort_cmp_fn cmp)
+static __always_inline void sort_iter_sort(struct sort_iter *iter, sort_cmp_fn cmp)
 {
-	unsigned i = iter->used;
+	unsigned i, n, w;
+
+	for (i = 0; i < iter->used; i++) {
+		sort_iter_set_prefix(iter->b, iter->data + i);
+		iter->data[i].loser = SORT_ITER_NO_LOSER;
+	}
+
+	/*
+	 * Add the inputs one at a time: the first to arrive at a node waits
+	 * there, the second plays the match and the winner carries on up:
+	 */
+	for (i = 0; i < iter->used; i++) {
+		w = i;
 
-	while (i--)
-		sort_iter_sift(iter, i, cmp);
+		for (n = (iter->used + i) >> 1; n; n >>= 1) {
+			if (iter->data[n].loser == SORT_ITER_NO_LOSER) {
+				iter->data[n].loser = w;
+				goto next;
+			}
+
+			if (sort_iter_less(iter, iter->data[n].loser, w, cmp))
+				swap(iter->data[n].loser, w);
+		}
+
+		iter->data[0].loser = w;
+next:
+		;
+	}
 }
 
 static inline struct bkey_packed *sort_iter_peek(struct sort_iter *iter)
 {
-	return !sort_iter_end(iter) ? iter->data->k : NULL;
+	return !sort_iter_end(iter) ? sort_iter_winner(iter)->k : NULL;
+}
+
+/* Is the next key at the same position as @prev, a previous winner? */
+static inline bool sort_iter_peek_same_pos(struct sort_iter *iter,
+					   struct sort_iter_set *prev)
+{
+	return !sort_iter_end(iter) &&
+		!sort_iter_set_cmp(iter->b, prev, sort_iter_winner(iter));
 }
 
-static inline void sort_iter_advance(struct sort_iter *iter, sort_cmp_fn cmp)
+static __always_inline void sort_iter_advance(struct sort_iter *iter, sort_cmp_fn cmp)
 {
-	struct sort_iter_set *i = iter->data;
+	unsigned w = iter->data[0].loser, n;
+	struct sort_iter_set *i = iter->data + w;
 
-	BUG_ON(!iter->used);
+	BUG_ON(sort_iter_set_end(i));
 
 	i->k = bkey_p_next(i->k);
 
 	BUG_ON(i->k > i->end);
 
-	if (i->k == i->end)
-		array_remove_item(iter->data, iter->used, 0);
-	else
-		sort_iter_sift(iter, 0, cmp);
+	if (!sort_iter_set_end(i))
+		sort_iter_set_prefix(iter->b, i);
+
+	/* Replay the matches on the path from the winner's leaf to the root: */
+	for (n = (iter->used + w) >> 1; n; n >>= 1)
+		if (sort_iter_less(iter, iter->data[n].loser, w, cmp))
+			swap(iter->data[n].loser, w);
+
+	iter->data[0].loser = w;
 }
 
-static inline struct bkey_packed *sort_iter_next(struct sort_iter *iter,
-						 sort_cmp_fn cmp)
+static __always_inline struct bkey_packed *sort_iter_next(struct sort_iter *iter,
+							  struct sort_iter_set *ret,
+							  sort_cmp_fn cmp)
 {
-	struct bkey_packed *ret = sort_iter_peek(iter);
-
-	if (ret)
-		sort_iter_advance(iter, cmp);
+	if (sort_iter_end(iter))
+		return NULL;
 
-	return ret;
+	*ret = *sort_iter_winner(iter);
+	sort_iter_advance(iter, cmp);
+	return ret->k;
 }
 
 /*
@@ -74,21 +175,7 @@ static inline int key_sort_fix_overlapping_cmp(struct btree *b,
 					       struct bkey_packed *l,
 					       struct bkey_packed *r)
 {
-	return bch2_bkey_cmp_packed(b, l, r) ?:
-		cmp_int((unsigned long) l, (unsigned long) r);
-}
-
-static inline bool should_drop_next_key(struct sort_iter *iter)
-{
-	/*
-	 * key_sort_cmp() ensures that when keys compare equal the older key
-	 * comes first; so if l->k compares equal to r->k then l->k is older
-	 * and should be dropped.
-	 */
-	return iter->used >= 2 &&
-		!bch2_bkey_cmp_packed(iter->b,
-				 iter->data[0].k,
-				 iter->data[1].k);
+	return cmp_int((unsigned long) l, (unsigned long) r);
 }
 
 struct btree_nr_keys
@@ -97,21 +184,25 @@ bch2_key_sort_fix_overlapping(struct bch_fs *c, struct bset *dst,
 {
 	struct bkey_packed *out = dst->start;
 	struct bkey_packed *k;
+	struct sort_iter_set prev;
 	struct btree_nr_keys nr;
 
 	memset(&nr, 0, sizeof(nr));
 
 	sort_iter_sort(iter, key_sort_fix_overlapping_cmp);
 
-	while ((k = sort_iter_peek(iter))) {
+	while ((k = sort_iter_next(iter, &prev, key_sort_fix_overlapping_cmp))) {
+		/*
+		 * When keys compare equal the older key comes first; so if the
+		 * next key is at the same position, k is older and should be
+		 * dropped:
+		 */
 		if (!bkey_deleted(k) &&
-		    !should_drop_next_key(iter)) {
+		    !sort_iter_peek_same_pos(iter, &prev)) {
 			bkey_copy(out, k);
 			btree_keys_account_key_add(&nr, 0, out);
 			out = bkey_p_next(out);
 		}
-
-		sort_iter_advance(iter, key_sort_fix_overlapping_cmp);
 	}
 
 	dst->u64s = cpu_to_le16((u64 *) out - dst->_data);
@@ -154,12 +245,12 @@ bch2_sort_repack(struct bset *dst, struct btree *src,
 	return nr;
 }
 
+/* Keys at the same position: */
 static inline int sort_keys_cmp(struct btree *b,
 				struct bkey_packed *l,
 				struct bkey_packed *r)
 {
-	return bch2_bkey_cmp_packed_inlined(b, l, r) ?:
-		(int) bkey_deleted(r) - (int) bkey_deleted(l) ?:
+	return (int) bkey_deleted(r) - (int) bkey_deleted(l) ?:
 		(int) l->needs_whiteout - (int) r->needs_whiteout;
 }
 
@@ -169,22 +260,23 @@ unsigned bch2_sort_keys(struct bkey_packed *dst,
 {
 	const struct bkey_format *f = &iter->b->format;
 	struct bkey_packed *in, *next, *out = dst;
+	struct sort_iter_set prev;
 
 	sort_iter_sort(iter, sort_keys_cmp);
 
-	while ((in = sort_iter_next(iter, sort_keys_cmp))) {
+	while ((in = sort_iter_next(iter, &prev, sort_keys_cmp))) {
 		bool needs_whiteout = false;
 
 		if (bkey_deleted(in) &&
 		    (filter_whiteouts || !in->needs_whiteout))
 			continue;
 
-		while ((next = sort_iter_peek(iter)) &&
-		       !bch2_bkey_cmp_packed_inlined(iter->b, in, next)) {
+		while (sort_iter_peek_same_pos(iter, &prev)) {
+			next = sort_iter_peek(iter);
 			BUG_ON(in->needs_whiteout &&
 			       next->needs_whiteout);
 			needs_whiteout |= in->needs_whiteout;
-			in = sort_iter_next(iter, sort_keys_cmp);
+			in = sort_iter_next(iter, &prev, sort_keys_cmp);
 		}
 
 		if (bkey_deleted(in)) {
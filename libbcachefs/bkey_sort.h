@@ -9,6 +9,11 @@ struct sort_iter {
 
 	struct sort_iter_set {
 		struct bkey_packed *k, *end;
+		/* Most significant 64 bits of @k, if packed: */
+		u64		prefix;
+		bool		packed;
+		/* Node of the loser tree, not related to this set: */
+		unsigned	loser;
 	} data[MAX_BSETS + 1];
 };
 
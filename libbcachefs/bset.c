@@ -18,6 +18,11 @@
 #include <linux/random.h>
 #include <linux/prefetch.h>
 
+#if defined(CONFIG_X86_64) && !defined(__KERNEL__)
+#include <immintrin.h>
+#define HAVE_BSET_SEARCH_AVX2
+#endif
+
 static inline void __bch2_btree_node_iter_advance(struct btree_node_iter *,
 						  struct btree *);
 
@@ -1104,6 +1109,66 @@ static inline bool bkey_mantissa_bits_dropped(const struct btree *b,
 #endif
 }
 
+/*
+ * One step of the search: compare against node *n, and descend. Returns the
+ * node's key if it compared equal to the search key:
+ */
+static __always_inline
+struct bkey_packed *bset_search_tree_step(const struct btree *b,
+				const struct bset_tree *t,
+				const struct bpos *search,
+				const struct bkey_packed *packed_search,
+				unsigned *n)
+{
+	struct bkey_float *f = bkey_float(b, t, *n);
+	struct bkey_packed *k;
+	unsigned l, r;
+	int cmp;
+
+	if (unlikely(f->exponent >= BFLOAT_FAILED))
+		goto slowpath;
+
+	l = f->mantissa;
+	r = bkey_mantissa(packed_search, f, *n);
+
+	if (unlikely(l == r) && bkey_mantissa_bits_dropped(b, f, *n))
+		goto slowpath;
+
+	*n = *n * 2 + (l < r);
+	return NULL;
+slowpath:
+	k = tree_to_bkey(b, t, *n);
+	cmp = bkey_cmp_p_or_unp(b, k, packed_search, search);
+	if (!cmp)
+		return k;
+
+	*n = *n * 2 + (cmp < 0);
+	return NULL;
+}
+
+/*
+ * n is the node we would have recursed to - the low bit tells us if we recursed
+ * left or recursed right:
+ */
+static __always_inline
+struct bkey_packed *bset_search_tree_end(const struct btree *b,
+				const struct bset_tree *t,
+				unsigned n)
+{
+	struct bkey_float *f = bkey_float(b, t, n >> 1);
+	unsigned inorder = __eytzinger1_to_inorder(n >> 1, t->size - 1, t->extra);
+
+	if (likely(!(n & 1))) {
+		--inorder;
+		if (unlikely(!inorder))
+			return btree_bkey_first(b, t);
+
+		f = bkey_float(b, t, eytzinger1_prev(n >> 1, t->size - 1));
+	}
+
+	return cacheline_to_bkey(b, t, inorder, f->key_offset);
+}
+
 __flatten
 static struct bkey_packed *bset_search_tree(const struct btree *b,
 				const struct bset_tree *t,
@@ -1111,53 +1176,152 @@ static struct bkey_packed *bset_search_tree(const struct btree *b,
 				const struct bkey_packed *packed_search)
 {
 	struct ro_aux_tree *base = ro_aux_tree_base(b, t);
-	struct bkey_float *f;
 	struct bkey_packed *k;
-	unsigned inorder, n = 1, l, r;
-	int cmp;
+	unsigned n = 1;
 
 	do {
 		if (likely(n << 4 < t->size))
 			prefetch(&base->f[n << 4]);
 
-		f = &base->f[n];
-		if (unlikely(f->exponent >= BFLOAT_FAILED))
-			goto slowpath;
+		k = bset_search_tree_step(b, t, search, packed_search, &n);
+		if (k)
+			return k;
+	} while (n < t->size);
 
-		l = f->mantissa;
-		r = bkey_mantissa(packed_search, f, n);
+	return bset_search_tree_end(b, t, n);
+}
 
-		if (unlikely(l == r) && bkey_mantissa_bits_dropped(b, f, n))
-			goto slowpath;
+#ifdef HAVE_BSET_SEARCH_AVX2
 
-		n = n * 2 + (l < r);
-		continue;
-slowpath:
-		k = tree_to_bkey(b, t, n);
-		cmp = bkey_cmp_p_or_unp(b, k, packed_search, search);
-		if (!cmp)
-			return k;
+/*
+ * AVX2 version of bset_search_tree(), which evaluates four levels of the tree -
+ * the 15 node subtree under n - at once:
+ *
+ * Each level of a subtree is contiguous in the eytzinger layout, so loading the
+ * subtree's bkey_floats is four loads. Each node has its own exponent; with the
+ * search key in a register (as eight 32 bit words) we extract the search key's
+ * mantissa for every node with two permutes and two variable shifts, and then
+ * descending through the subtree is just bit operations on the comparison
+ * masks.
+ *
+ * Nodes where comparing mantissas isn't sufficient - failed bfloats, or equal
+ * mantissas with key bits dropped - are flagged, and if they're on our path we
+ * do a full key comparison for that node, as bset_search_tree_step() would.
+ */
+#define BSET_SEARCH_SIMD_LEVELS		4
 
-		n = n * 2 + (cmp < 0);
-	} while (n < t->size);
+/*
+ * Compare the search key against eight bkey_floats: returns a mask of the nodes
+ * where we go right, and a mask of the nodes that need a full key comparison:
+ */
+static __always_inline __attribute__((target("avx2")))
+void bset_search_avx2_cmp(__m256i v, __m256i key_words, __m256i key_bits_start,
+			  unsigned *right, unsigned *slowpath)
+{
+	const __m256i byte_mask = _mm256_set1_epi32(U8_MAX);
+	__m256i e	= _mm256_and_si256(v, byte_mask);
+	__m256i l	= _mm256_srli_epi32(v, 16);
+	__m256i w	= _mm256_srli_epi32(e, 5);
+	__m256i sh	= _mm256_and_si256(e, _mm256_set1_epi32(31));
+	__m256i r, eq;
+
+	/*
+	 * The 32 bits of the search key starting at bit e: a failed bfloat's
+	 * exponent indexes off the end of key_words, but the permute wraps and
+	 * we don't use the result:
+	 */
+	r = _mm256_or_si256(
+		_mm256_srlv_epi32(_mm256_permutevar8x32_epi32(key_words, w), sh),
+		_mm256_sllv_epi32(_mm256_permutevar8x32_epi32(key_words,
+				_mm256_add_epi32(w, _mm256_set1_epi32(1))),
+			_mm256_sub_epi32(_mm256_set1_epi32(32), sh)));
+	r = _mm256_and_si256(r, _mm256_set1_epi32(U16_MAX));
+
+	eq = _mm256_and_si256(_mm256_cmpeq_epi32(l, r),
+			      _mm256_cmpgt_epi32(e, key_bits_start));
 
-	inorder = __eytzinger1_to_inorder(n >> 1, t->size - 1, t->extra);
+	*right		= _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(r, l)));
+	*slowpath	= _mm256_movemask_ps(_mm256_castsi256_ps(
+				_mm256_or_si256(_mm256_cmpeq_epi32(e, byte_mask), eq)));
+}
+
+__attribute__((target("avx2")))
+static struct bkey_packed *bset_search_tree_avx2(const struct btree *b,
+				const struct bset_tree *t,
+				const struct bpos *search,
+				const struct bkey_packed *packed_search)
+{
+	struct ro_aux_tree *base = ro_aux_tree_base(b, t);
+	const u32 *f = (const u32 *) base->f;
+	const __m256i key_bits_start =
+		_mm256_set1_epi32(b->format.key_u64s * 64 - b->nr_key_bits);
+	__m256i key_words;
+	struct bkey_packed *k;
+	unsigned n = 1;
+
+	BUILD_BUG_ON(sizeof(struct bkey_float) != sizeof(u32));
+	BUILD_BUG_ON(sizeof(struct bkey_packed) < sizeof(__m256i));
 
 	/*
-	 * n would have been the node we recursed to - the low bit tells us if
-	 * we recursed left or recursed right.
+	 * Bits past the end of the key only end up in bits we mask off, or in
+	 * results for failed bfloats:
 	 */
-	if (likely(!(n & 1))) {
-		--inorder;
-		if (unlikely(!inorder))
-			return btree_bkey_first(b, t);
+	key_words = _mm256_loadu_si256((void *) packed_search);
+
+	/* While the bottom level of the subtree is within the tree: */
+	while (((n + 1) << (BSET_SEARCH_SIMD_LEVELS - 1)) <= t->size) {
+		unsigned right[2], slowpath[2], right_mask, slowpath_mask, j = 1, lvl;
+
+		prefetch(&base->f[n << BSET_SEARCH_SIMD_LEVELS]);
+
+		/* lane 0 is unused, so that lane j is node j of the subtree: */
+		bset_search_avx2_cmp(_mm256_set_m128i(_mm_loadu_si128((void *) &f[n * 4]),
+					_mm_set_epi32(f[n * 2 + 1], f[n * 2], f[n], 0)),
+				     key_words, key_bits_start,
+				     &right[0], &slowpath[0]);
+		bset_search_avx2_cmp(_mm256_loadu_si256((void *) &f[n * 8]),
+				     key_words, key_bits_start,
+				     &right[1], &slowpath[1]);
+
+		right_mask	= right[0]    | (right[1] << 8);
+		slowpath_mask	= slowpath[0] | (slowpath[1] << 8);
+
+		for (lvl = 0; lvl < BSET_SEARCH_SIMD_LEVELS; lvl++) {
+			if (unlikely(slowpath_mask & (1U << j))) {
+				unsigned node = (n << lvl) + j - (1U << lvl);
+
+				k = bset_search_tree_step(b, t, search, packed_search, &node);
+				if (k)
+					return k;
+
+				j = j * 2 + (node & 1);
+			} else {
+				j = j * 2 + ((right_mask >> j) & 1);
+			}
+		}
 
-		f = &base->f[eytzinger1_prev(n >> 1, t->size - 1)];
+		n = (n << BSET_SEARCH_SIMD_LEVELS) + j - (1U << BSET_SEARCH_SIMD_LEVELS);
 	}
 
-	return cacheline_to_bkey(b, t, inorder, f->key_offset);
+	/* Bottom levels, where the subtree would run off the end of the tree: */
+	while (n < t->size) {
+		k = bset_search_tree_step(b, t, search, packed_search, &n);
+		if (k)
+			return k;
+	}
+
+	return bset_search_tree_end(b, t, n);
 }
 
+/* The search key has to fit in a single AVX2 register: */
+static inline bool bset_search_use_avx2(const struct btree *b)
+{
+	return !bch2_bset_search_simd_disabled &&
+		b->format.key_u64s <= 4 &&
+		__builtin_cpu_supports("avx2");
+}
+#endif /* HAVE_BSET_SEARCH_AVX2 */
+
 static __always_inline __flatten
 struct bkey_packed *__bch2_bset_search(struct btree *b,
 				struct bset_tree *t,
@@ -1186,6 +1350,10 @@ struct bkey_packed *__bch2_bset_search(struct btree *b,
 	case BSET_RW_AUX_TREE:
 		return bset_search_write_set(b, t, search);
 	case BSET_RO_AUX_TREE:
+#ifdef HAVE_BSET_SEARCH_AVX2
+		if (bset_search_use_avx2(b))
+			return bset_search_tree_avx2(b, t, search, lossy_packed_search);
+#endif
 		return bset_search_tree(b, t, search, lossy_packed_search);
 	default:
 		unreachable();
@@ -11,10 +11,13 @@
 #include "error.h"
 #include "trace.h"
 
+#include <linux/hash.h>
 #include <linux/prefetch.h>
 #include <linux/sched/mm.h>
 #include <linux/seq_buf.h>
 
+#define BTREE_CACHE_GHOST_BITS	12
+
 #define BTREE_CACHE_NOT_FREED_INCREMENT(counter) \
 do {						 \
 	if (shrinker_counter)			 \
@@ -45,6 +48,22 @@ void bch2_recalc_btree_reserve(struct bch_fs *c)
 	c->btree_cache.reserve = reserve;
 }
 
+static inline u64 *btree_cache_ghost(struct btree_cache *bc, u64 hash_val)
+{
+	return bc->ghosts + hash_64(hash_val, BTREE_CACHE_GHOST_BITS);
+}
+
+static inline void btree_cache_hit(struct btree_cache *bc, struct btree *b,
+				   bool scan)
+{
+	/* avoid atomic set bit if it's not needed: */
+	if (!scan && !btree_node_accessed(b))
+		set_btree_node_accessed(b);
+
+	if (b->c.btree_id < BTREE_ID_NR)
+		this_cpu_inc(bc->stats->hit[b->c.btree_id]);
+}
+
 static inline unsigned btree_cache_can_free(struct btree_cache *bc)
 {
 	return max_t(int, 0, bc->used - bc->reserve);
@@ -195,6 +214,40 @@ int bch2_btree_node_hash_insert(struct btree_cache *bc, struct btree *b,
 	return ret;
 }
 
+/*
+ * Nodes being read in start out on probation - except interior nodes, and
+ * nodes we only recently reclaimed from probation, unless this is a scan:
+ */
+static int btree_node_hash_insert_fill(struct btree_cache *bc, struct btree *b,
+				       unsigned level, enum btree_id id,
+				       bool scan)
+{
+	bool live = level;
+	int ret;
+
+	b->c.level	= level;
+	b->c.btree_id	= id;
+
+	mutex_lock(&bc->lock);
+	ret = __bch2_btree_node_hash_insert(bc, b);
+	if (!ret) {
+		u64 *ghost = btree_cache_ghost(bc, b->hash_val);
+
+		if (*ghost == b->hash_val) {
+			*ghost = 0;
+			live |= !scan;
+
+			if (id < BTREE_ID_NR)
+				this_cpu_inc(bc->stats->ghost_hit[id]);
+		}
+
+		list_add_tail(&b->list, live ? &bc->live : &bc->probation);
+	}
+	mutex_unlock(&bc->lock);
+
+	return ret;
+}
+
 __flatten
 static inline struct btree *btree_cache_find(struct btree_cache *bc,
 				     const struct bkey_i *k)
@@ -369,6 +422,31 @@ static unsigned long bch2_btree_cache_scan(struct shrinker *shrink,
 			bc->freed++;
 		}
 	}
+
+	list_for_each_entry_safe(b, t, &bc->probation, list) {
+		touched++;
+
+		if (btree_node_accessed(b)) {
+			clear_btree_node_accessed(b);
+			list_move_tail(&b->list, &bc->live);
+			bc->promoted++;
+		} else if (!btree_node_reclaim(c, b, true)) {
+			freed++;
+			btree_node_data_free(c, b);
+			bc->freed++;
+
+			*btree_cache_ghost(bc, b->hash_val) = b->hash_val;
+			bch2_btree_node_hash_remove(bc, b);
+			six_unlock_write(&b->c.lock);
+			six_unlock_intent(&b->c.lock);
+
+			if (freed == nr)
+				goto out;
+		}
+
+		if (touched >= nr)
+			goto out;
+	}
 restart:
 	list_for_each_entry_safe(b, t, &bc->live, list) {
 		touched++;
@@ -466,6 +544,7 @@ void bch2_fs_btree_cache_exit(struct bch_fs *c)
 			list_add(&r->b->list, &bc->live);
 	}
 
+	list_splice(&bc->probation, &bc->live);
 	list_splice(&bc->freeable, &bc->live);
 
 	while (!list_empty(&bc->live)) {
@@ -497,6 +576,9 @@ void bch2_fs_btree_cache_exit(struct bch_fs *c)
 
 	if (bc->table_init_done)
 		rhashtable_destroy(&bc->table);
+
+	free_percpu(bc->stats);
+	kvpfree(bc->ghosts, sizeof(u64) << BTREE_CACHE_GHOST_BITS);
 }
 
 int bch2_fs_btree_cache_init(struct bch_fs *c)
@@ -511,6 +593,12 @@ int bch2_fs_btree_cache_init(struct bch_fs *c)
 
 	bc->table_init_done = true;
 
+	bc->ghosts = kvpmalloc(sizeof(u64) << BTREE_CACHE_GHOST_BITS,
+			       GFP_KERNEL|__GFP_ZERO);
+	bc->stats = alloc_percpu(struct btree_cache_stats);
+	if (!bc->ghosts || !bc->stats)
+		goto err;
+
 	bch2_recalc_btree_reserve(c);
 
 	for (i = 0; i < bc->reserve; i++)
@@ -538,6 +626,7 @@ void bch2_fs_btree_cache_init_early(struct btree_cache *bc)
 {
 	mutex_init(&bc->lock);
 	INIT_LIST_HEAD(&bc->live);
+	INIT_LIST_HEAD(&bc->probation);
 	INIT_LIST_HEAD(&bc->freeable);
 	INIT_LIST_HEAD(&bc->freed_pcpu);
 	INIT_LIST_HEAD(&bc->freed_nonpcpu);
@@ -597,11 +686,19 @@ static struct btree *btree_node_cannibalize(struct bch_fs *c)
 	struct btree_cache *bc = &c->btree_cache;
 	struct btree *b;
 
+	list_for_each_entry(b, &bc->probation, list)
+		if (!btree_node_reclaim(c, b, false))
+			return b;
+
 	list_for_each_entry_reverse(b, &bc->live, list)
 		if (!btree_node_reclaim(c, b, false))
 			return b;
 
 	while (1) {
+		list_for_each_entry(b, &bc->probation, list)
+			if (!btree_node_write_and_reclaim(c, b))
+				return b;
+
 		list_for_each_entry_reverse(b, &bc->live, list)
 			if (!btree_node_write_and_reclaim(c, b))
 				return b;
@@ -738,7 +835,7 @@ static noinline struct btree *bch2_btree_node_fill(struct btree_trans *trans,
 				enum btree_id btree_id,
 				unsigned level,
 				enum six_lock_type lock_type,
-				bool sync)
+				bool sync, bool scan)
 {
 	struct bch_fs *c = trans->c;
 	struct btree_cache *bc = &c->btree_cache;
@@ -773,7 +870,7 @@ static noinline struct btree *bch2_btree_node_fill(struct btree_trans *trans,
 	clear_btree_node_accessed(b);
 
 	bkey_copy(&b->key, k);
-	if (bch2_btree_node_hash_insert(bc, b, level, btree_id)) {
+	if (btree_node_hash_insert_fill(bc, b, level, btree_id, scan)) {
 		/* raced with another fill: */
 
 		/* mark as unhashed... */
@@ -790,6 +887,9 @@ static noinline struct btree *bch2_btree_node_fill(struct btree_trans *trans,
 
 	set_btree_node_read_in_flight(b);
 
+	if (sync && btree_id < BTREE_ID_NR)
+		this_cpu_inc(bc->stats->miss[btree_id]);
+
 	six_unlock_write(&b->c.lock);
 	seq = six_lock_seq(&b->c.lock);
 	six_unlock_intent(&b->c.lock);
@@ -861,7 +961,7 @@ static inline void btree_check_header(struct bch_fs *c, struct btree *b)
 
 static struct btree *__bch2_btree_node_get(struct btree_trans *trans, struct btree_path *path,
 					   const struct bkey_i *k, unsigned level,
-					   enum six_lock_type lock_type,
+					   enum six_lock_type lock_type, bool scan,
 					   unsigned long trace_ip)
 {
 	struct bch_fs *c = trans->c;
@@ -881,7 +981,7 @@ retry:
 		 * freed:
 		 */
 		b = bch2_btree_node_fill(trans, path, k, path->btree_id,
-					 level, lock_type, true);
+					 level, lock_type, true, scan);
 		need_relock = true;
 
 		/* We raced and found the btree node in the cache */
@@ -911,9 +1011,7 @@ retry:
 			return ERR_PTR(btree_trans_restart(trans, BCH_ERR_transaction_restart_lock_node_reused));
 		}
 
-		/* avoid atomic set bit if it's not needed: */
-		if (!btree_node_accessed(b))
-			set_btree_node_accessed(b);
+		btree_cache_hit(bc, b, scan);
 	}
 
 	if (unlikely(btree_node_read_in_flight(b))) {
@@ -973,7 +1071,7 @@ retry:
  */
 struct btree *bch2_btree_node_get(struct btree_trans *trans, struct btree_path *path,
 				  const struct bkey_i *k, unsigned level,
-				  enum six_lock_type lock_type,
+				  enum six_lock_type lock_type, bool scan,
 				  unsigned long trace_ip)
 {
 	struct bch_fs *c = trans->c;
@@ -993,7 +1091,7 @@ struct btree *bch2_btree_node_get(struct btree_trans *trans, struct btree_path *
 	if (unlikely(!c->opts.btree_node_mem_ptr_optimization ||
 		     !b ||
 		     b->hash_val != btree_ptr_hash_val(k)))
-		return __bch2_btree_node_get(trans, path, k, level, lock_type, trace_ip);
+		return __bch2_btree_node_get(trans, path, k, level, lock_type, scan, trace_ip);
 
 	if (btree_node_read_locked(path, level + 1))
 		btree_node_unlock(trans, path, level + 1);
@@ -1009,7 +1107,7 @@ struct btree *bch2_btree_node_get(struct btree_trans *trans, struct btree_path *
 		     race_fault())) {
 		six_unlock_type(&b->c.lock, lock_type);
 		if (bch2_btree_node_relock(trans, path, level + 1))
-			return __bch2_btree_node_get(trans, path, k, level, lock_type, trace_ip);
+			return __bch2_btree_node_get(trans, path, k, level, lock_type, scan, trace_ip);
 
 		trace_and_count(c, trans_restart_btree_node_reused, trans, trace_ip, path);
 		return ERR_PTR(btree_trans_restart(trans, BCH_ERR_transaction_restart_lock_node_reused));
@@ -1037,7 +1135,7 @@ struct btree *bch2_btree_node_get(struct btree_trans *trans, struct btree_path *
 		}
 
 		if (!six_relock_type(&b->c.lock, lock_type, seq))
-			return __bch2_btree_node_get(trans, path, k, level, lock_type, trace_ip);
+			return __bch2_btree_node_get(trans, path, k, level, lock_type, scan, trace_ip);
 	}
 
 	prefetch(b->aux_data);
@@ -1050,9 +1148,7 @@ struct btree *bch2_btree_node_get(struct btree_trans *trans, struct btree_path *
 		prefetch(p + L1_CACHE_BYTES * 2);
 	}
 
-	/* avoid atomic set bit if it's not needed: */
-	if (!btree_node_accessed(b))
-		set_btree_node_accessed(b);
+	btree_cache_hit(&c->btree_cache, b, scan);
 
 	if (unlikely(btree_node_read_error(b))) {
 		six_unlock_type(&b->c.lock, lock_type);
@@ -1092,7 +1188,7 @@ retry:
 			goto out;
 
 		b = bch2_btree_node_fill(trans, NULL, k, btree_id,
-					 level, SIX_LOCK_read, true);
+					 level, SIX_LOCK_read, true, true);
 
 		/* We raced and found the btree node in the cache */
 		if (!b)
@@ -1118,6 +1214,9 @@ lock_node:
 			six_unlock_read(&b->c.lock);
 			goto retry;
 		}
+
+		/* Only btree gc and fsck walk nodes without an iterator: */
+		btree_cache_hit(bc, b, true);
 	}
 
 	/* XXX: waiting on IO with btree locks held: */
@@ -1133,10 +1232,6 @@ lock_node:
 		prefetch(p + L1_CACHE_BYTES * 2);
 	}
 
-	/* avoid atomic set bit if it's not needed: */
-	if (!btree_node_accessed(b))
-		set_btree_node_accessed(b);
-
 	if (unlikely(btree_node_read_error(b))) {
 		six_unlock_read(&b->c.lock);
 		b = ERR_PTR(-EIO);
@@ -1168,10 +1263,34 @@ int bch2_btree_node_prefetch(struct btree_trans *trans,
 		return 0;
 
 	b = bch2_btree_node_fill(trans, path, k, btree_id,
-				 level, SIX_LOCK_read, false);
+				 level, SIX_LOCK_read, false, true);
 	return PTR_ERR_OR_ZERO(b);
 }
 
+/*
+ * For readahead: returns the node @k points to, read locked, if it's cached,
+ * been read in, and can be locked without blocking:
+ */
+struct btree *bch2_btree_node_trylock_cached(struct bch_fs *c,
+					     const struct bkey_i *k,
+					     unsigned level)
+{
+	struct btree *b = btree_cache_find(&c->btree_cache, k);
+
+	if (!b || !six_trylock_read(&b->c.lock))
+		return NULL;
+
+	if (unlikely(b->hash_val != btree_ptr_hash_val(k) ||
+		     b->c.level != level ||
+		     btree_node_read_in_flight(b) ||
+		     btree_node_read_error(b))) {
+		six_unlock_read(&b->c.lock);
+		return NULL;
+	}
+
+	return b;
+}
+
 void bch2_btree_node_evict(struct btree_trans *trans, const struct bkey_i *k)
 {
 	struct bch_fs *c = trans->c;
@@ -1259,6 +1378,8 @@ void bch2_btree_node_to_text(struct printbuf *out, struct bch_fs *c,
 
 void bch2_btree_cache_to_text(struct printbuf *out, const struct btree_cache *bc)
 {
+	unsigned i;
+
 	prt_printf(out, "nr nodes:\t\t%u\n", bc->used);
 	prt_printf(out, "nr dirty:\t\t%u\n", atomic_read(&bc->dirty));
 	prt_printf(out, "cannibalize lock:\t%p\n", bc->alloc_lock);
@@ -1273,5 +1394,24 @@ void bch2_btree_cache_to_text(struct printbuf *out, const struct btree_cache *bc
 	prt_printf(out, "not freed, no evict failed:\t%u\n", bc->not_freed_noevict);
 	prt_printf(out, "not freed, write blocked:\t%u\n", bc->not_freed_write_blocked);
 	prt_printf(out, "not freed, will make reachable:\t%u\n", bc->not_freed_will_make_reachable);
+	prt_printf(out, "promoted from probation:\t%u\n", bc->promoted);
+
+	prt_printf(out, "\nbtree\t\t\thit\tmiss\tghost hit\n");
 
+	for (i = 0; i < BTREE_ID_NR; i++) {
+		u64 hit = 0, miss = 0, ghost_hit = 0;
+		int cpu;
+
+		for_each_possible_cpu(cpu) {
+			struct btree_cache_stats *s = per_cpu_ptr(bc->stats, cpu);
+
+			hit		+= s->hit[i];
+			miss		+= s->miss[i];
+			ghost_hit	+= s->ghost_hit[i];
+		}
+
+		if (hit || miss)
+			prt_printf(out, "%s:\t\t\t%llu\t%llu\t%llu\n",
+				   bch2_btree_ids[i], hit, miss, ghost_hit);
+	}
 }
@@ -25,7 +25,7 @@ struct btree *bch2_btree_node_mem_alloc(struct btree_trans *, bool);
 
 struct btree *bch2_btree_node_get(struct btree_trans *, struct btree_path *,
 				  const struct bkey_i *, unsigned,
-				  enum six_lock_type, unsigned long);
+				  enum six_lock_type, bool, unsigned long);
 
 struct btree *bch2_btree_node_get_noiter(struct btree_trans *, const struct bkey_i *,
 					 enum btree_id, unsigned, bool);
@@ -33,6 +33,8 @@ struct btree *bch2_btree_node_get_noiter(struct btree_trans *, const struct bkey
 int bch2_btree_node_prefetch(struct btree_trans *, struct btree_path *,
 			     const struct bkey_i *, enum btree_id, unsigned);
 
+struct btree *bch2_btree_node_trylock_cached(struct bch_fs *,
+					     const struct bkey_i *, unsigned);
 void bch2_btree_node_evict(struct btree_trans *, const struct bkey_i *);
 
 void bch2_fs_btree_cache_exit(struct bch_fs *);
@@ -11,6 +11,7 @@
 #include "btree_update_interior.h"
 #include "buckets.h"
 #include "checksum.h"
+#include "compress.h"
 #include "debug.h"
 #include "error.h"
 #include "extents.h"
@@ -125,6 +126,90 @@ static void *btree_bounce_alloc_noprof(struct bch_fs *c, size_t size,
 #define btree_bounce_alloc(_c, _size, _used_mempool)		\
 	alloc_hooks(btree_bounce_alloc_noprof(_c, _size, _used_mempool))
 
+/*
+ * Compressed bsets: the keys are replaced with a struct bset_compressed, but the
+ * bset still takes up the same number of sectors within the node - so offsets
+ * within the node, and the in memory layout that mirrors it, don't change.
+ *
+ * Returns true if we compressed, i.e. if we'll be writing at least one block
+ * less:
+ */
+static bool bset_compress(struct bch_fs *c, struct bset *i,
+			  unsigned compression_opt)
+{
+	struct bset_compressed *h = (void *) i->_data;
+	size_t src_bytes = le16_to_cpu(i->u64s) * sizeof(u64);
+	size_t dst_bytes;
+	void *buf;
+
+	if (src_bytes <= block_bytes(c) + sizeof(*h))
+		return false;
+
+	buf = kvpmalloc(src_bytes, GFP_NOFS|__GFP_NOWARN);
+	if (!buf)
+		return false;
+
+	dst_bytes = bch2_compress_buf(c, buf,
+				      src_bytes - block_bytes(c) - sizeof(*h),
+				      i->_data, src_bytes, compression_opt);
+	if (dst_bytes) {
+		h->compressed_bytes	= cpu_to_le32(dst_bytes);
+		h->uncompressed_u64s	= i->u64s;
+		h->pad			= 0;
+		memcpy(h->data, buf, dst_bytes);
+		memset(h->data + dst_bytes, 0,
+		       round_up(dst_bytes, sizeof(u64)) - dst_bytes);
+
+		i->u64s = cpu_to_le16(DIV_ROUND_UP(sizeof(*h) + dst_bytes,
+						   sizeof(u64)));
+		SET_BSET_COMPRESSION_TYPE(i,
+			bch2_compression_opt_to_type(compression_opt));
+	}
+
+	kvpfree(buf, src_bytes);
+	return dst_bytes != 0;
+}
+
+/* Decompress a bset in place, within the node buffer @bn: */
+int bch2_bset_decompress(struct bch_fs *c, struct btree_node *bn,
+			   struct bset *i)
+{
+	struct bset_compressed *h = (void *) i->_data;
+	size_t src_bytes, dst_bytes;
+	bool used_mempool;
+	void *buf;
+	int ret;
+
+	if (le16_to_cpu(i->u64s) * sizeof(u64) < sizeof(*h))
+		return -EIO;
+
+	src_bytes = le32_to_cpu(h->compressed_bytes);
+	dst_bytes = le16_to_cpu(h->uncompressed_u64s) * sizeof(u64);
+
+	if (src_bytes > le16_to_cpu(i->u64s) * sizeof(u64) - sizeof(*h) ||
+	    (void *) i->_data + dst_bytes > (void *) bn + btree_bytes(c))
+		return -EIO;
+
+	buf = btree_bounce_alloc(c, src_bytes, &used_mempool);
+	memcpy(buf, h->data, src_bytes);
+
+	ret = bch2_uncompress_buf(c, i->_data, dst_bytes, buf, src_bytes,
+				  BSET_COMPRESSION_TYPE(i));
+	if (!ret) {
+		i->u64s = cpu_to_le16(dst_bytes / sizeof(u64));
+		SET_BSET_COMPRESSION_TYPE(i, 0);
+	}
+
+	btree_bounce_free(c, src_bytes, used_mempool, buf);
+	return ret;
+}
+
+/* Sectors of a bset that were actually written: */
+static unsigned bset_written_sectors(struct bch_fs *c, void *start, struct bset *i)
+{
+	return round_up(vstruct_end(i) - start, block_bytes(c)) >> 9;
+}
+
 static void sort_bkey_ptrs(const struct btree *bt,
 			   struct bkey_packed **ptrs, unsigned nr)
 {
@@ -993,12 +1078,17 @@ int bch2_btree_node_read_done(struct bch_fs *c, struct bch_dev *ca,
 					"error decrypting btree node: %i", ret))
 				goto fsck_err;
 
+			btree_err_on(BSET_COMPRESSION_TYPE(i) &&
+				     bch2_bset_decompress(c, b->data, i),
+				     BTREE_ERR_WANT_RETRY, c, ca, b, i,
+				     "error decompressing bset");
+
 			btree_err_on(btree_node_type_is_extents(btree_node_type(b)) &&
 				     !BTREE_NODE_NEW_EXTENT_OVERWRITE(b->data),
 				     BTREE_ERR_INCOMPATIBLE, c, NULL, b, NULL,
 				     "btree node does not have NEW_EXTENT_OVERWRITE set");
 
-			sectors = vstruct_sectors(b->data, c->block_bits);
+			sectors = bset_span_sectors(c, b->data, i);
 		} else {
 			bne = write_block(b);
 			i = &bne->keys;
@@ -1023,7 +1113,12 @@ int bch2_btree_node_read_done(struct bch_fs *c, struct bch_dev *ca,
 					"error decrypting btree node: %i\n", ret))
 				goto fsck_err;
 
-			sectors = vstruct_sectors(bne, c->block_bits);
+			btree_err_on(BSET_COMPRESSION_TYPE(i) &&
+				     bch2_bset_decompress(c, b->data, i),
+				     BTREE_ERR_WANT_RETRY, c, ca, b, i,
+				     "error decompressing bset");
+
+			sectors = bset_span_sectors(c, bne, i);
 		}
 
 		b->version_ondisk = min(b->version_ondisk,
@@ -1300,18 +1395,44 @@ static unsigned btree_node_sectors_written(struct bch_fs *c, void *data)
 
 	while (offset < btree_sectors(c)) {
 		if (!offset) {
-			offset += vstruct_sectors(bn, c->block_bits);
+			offset += bset_span_sectors(c, bn, &bn->keys);
 		} else {
 			bne = data + (offset << 9);
 			if (bne->keys.seq != bn->keys.seq)
 				break;
-			offset += vstruct_sectors(bne, c->block_bits);
+			offset += bset_span_sectors(c, bne, &bne->keys);
 		}
 	}
 
 	return offset;
 }
 
+/*
+ * Compare two replicas, up to @written sectors: the unwritten tails of
+ * compressed bsets are skipped, they're whatever was on disk before:
+ */
+static bool btree_node_replicas_differ(struct bch_fs *c, void *a, void *b,
+				       unsigned written)
+{
+	unsigned offset = 0;
+
+	while (offset < written) {
+		struct btree_node_entry *bne = a + (offset << 9);
+		struct bset *i = offset ? &bne->keys : &((struct btree_node *) a)->keys;
+		unsigned span	= bset_span_sectors(c, bne, i);
+		unsigned bytes	= min(bset_written_sectors(c, bne, i),
+				      written - offset) << 9;
+
+		if (!span ||
+		    memcmp(a + (offset << 9), b + (offset << 9), bytes))
+			return true;
+
+		offset += span;
+	}
+
+	return false;
+}
+
 static bool btree_node_has_extra_bsets(struct bch_fs *c, unsigned offset, void *data)
 {
 	struct btree_node *bn = data;
@@ -1369,7 +1490,7 @@ static void btree_node_read_all_replicas_done(struct closure *cl)
 		    btree_err_on(btree_node_has_extra_bsets(c, written2, ra->buf[i]),
 				 BTREE_ERR_FIXABLE, c, NULL, b, NULL,
 				 "found bset signature after last bset") ||
-		    btree_err_on(memcmp(ra->buf[best], ra->buf[i], written << 9),
+		    btree_err_on(btree_node_replicas_differ(c, ra->buf[best], ra->buf[i], written),
 				 BTREE_ERR_FIXABLE, c, NULL, b, NULL,
 				 "btree node replicas content mismatch"))
 			dump_bset_maps = true;
@@ -1394,12 +1515,12 @@ fsck_err:
 
 			while (offset < btree_sectors(c)) {
 				if (!offset) {
-					sectors = vstruct_sectors(bn, c->block_bits);
+					sectors = bset_span_sectors(c, bn, &bn->keys);
 				} else {
 					bne = ra->buf[i] + (offset << 9);
 					if (bne->keys.seq != bn->keys.seq)
 						break;
-					sectors = vstruct_sectors(bne, c->block_bits);
+					sectors = bset_span_sectors(c, bne, &bne->keys);
 				}
 
 				prt_printf(&buf, " %u-%u", offset, offset + sectors);
@@ -1416,7 +1537,7 @@ fsck_err:
 						prt_printf(&buf, " GAP");
 					gap = true;
 
-					sectors = vstruct_sectors(bne, c->block_bits);
+					sectors = bset_span_sectors(c, bne, &bne->keys);
 					prt_printf(&buf, " %u-%u", offset, offset + sectors);
 					if (bch2_journal_seq_is_blacklisted(c,
 							le64_to_cpu(bne->keys.journal_seq), false))
@@ -1881,6 +2002,7 @@ void __bch2_btree_node_write(struct bch_fs *c, struct btree *b, unsigned flags)
 	bool used_mempool;
 	unsigned long old, new;
 	bool validate_before_checksum = false;
+	bool compress = false;
 	enum btree_write_type type = flags & BTREE_WRITE_TYPE_MASK;
 	void *data;
 	int ret;
@@ -2027,18 +2149,33 @@ do_write:
 	SET_BSET_OFFSET(i, b->written);
 	SET_BSET_CSUM_TYPE(i, bch2_meta_checksum_type(c));
 
-	if (bch2_csum_type_is_encryption(BSET_CSUM_TYPE(i)))
+	if (c->opts.metadata_compression &&
+	    (c->sb.features & BIT_ULL(BCH_FEATURE_btree_node_compression)))
+		compress = true;
+
+	if (bch2_csum_type_is_encryption(BSET_CSUM_TYPE(i)) || compress)
 		validate_before_checksum = true;
 
 	/* validate_bset will be modifying: */
 	if (le16_to_cpu(i->version) < bcachefs_metadata_version_current)
 		validate_before_checksum = true;
 
-	/* if we're going to be encrypting, check metadata validity first: */
+	/* if we're going to be encrypting or compressing, check metadata validity first: */
 	if (validate_before_checksum &&
 	    validate_bset_for_write(c, b, i, sectors_to_write))
 		goto err;
 
+	/*
+	 * A compressed bset still uses sectors_to_write sectors of the node, we
+	 * just don't write all of them:
+	 */
+	if (compress &&
+	    bset_compress(c, i, c->opts.metadata_compression)) {
+		bytes_to_write = vstruct_end(i) - data;
+		memset(data + bytes_to_write, 0,
+		       round_up(bytes_to_write, block_bytes(c)) - bytes_to_write);
+	}
+
 	ret = bset_encrypt(c, i, b->written << 9);
 	if (bch2_fs_fatal_err_on(ret, c,
 			"error encrypting btree node: %i\n", ret))
@@ -2081,7 +2218,7 @@ do_write:
 	trace_and_count(c, btree_node_write, b, bytes_to_write, sectors_to_write);
 
 	wbio = container_of(bio_alloc_bioset(NULL,
-				buf_pages(data, sectors_to_write << 9),
+				buf_pages(data, round_up(bytes_to_write, block_bytes(c))),
 				REQ_OP_WRITE|REQ_META,
 				GFP_NOFS,
 				&c->btree_bio),
@@ -2096,7 +2233,7 @@ do_write:
 	wbio->wbio.bio.bi_end_io	= btree_node_write_endio;
 	wbio->wbio.bio.bi_private	= b;
 
-	bch2_bio_map(&wbio->wbio.bio, data, sectors_to_write << 9);
+	bch2_bio_map(&wbio->wbio.bio, data, round_up(bytes_to_write, block_bytes(c)));
 
 	bkey_copy(&wbio->key, &b->key);
 
@@ -103,6 +103,7 @@ static inline struct nonce btree_nonce(struct bset *i, unsigned offset)
 static inline int bset_encrypt(struct bch_fs *c, struct bset *i, unsigned offset)
 {
 	struct nonce nonce = btree_nonce(i, offset);
+	void *start;
 	int ret;
 
 	if (!offset) {
@@ -117,10 +118,39 @@ static inline int bset_encrypt(struct bch_fs *c, struct bset *i, unsigned offset
 		nonce = nonce_add(nonce, round_up(bytes, CHACHA_BLOCK_SIZE));
 	}
 
-	return bch2_encrypt(c, BSET_CSUM_TYPE(i), nonce, i->_data,
-			    vstruct_end(i) - (void *) i->_data);
+	/*
+	 * The header of a compressed bset stays in the clear, so the size of
+	 * the bset within the node can be found without decrypting it:
+	 */
+	start = (void *) i->_data;
+	if (BSET_COMPRESSION_TYPE(i) &&
+	    vstruct_end(i) - start >= sizeof(struct bset_compressed))
+		start += sizeof(struct bset_compressed);
+
+	return bch2_encrypt(c, BSET_CSUM_TYPE(i), nonce, start,
+			    vstruct_end(i) - start);
 }
 
+/*
+ * Sectors a bset occupies within the node, starting from @start - the
+ * btree_node or btree_node_entry containing it. For compressed bsets that's the
+ * span of the uncompressed keys, not what was written:
+ */
+static inline unsigned bset_span_sectors(struct bch_fs *c, void *start, struct bset *i)
+{
+	struct bset_compressed *h = (void *) i->_data;
+	unsigned u64s = le16_to_cpu(i->u64s);
+
+	if (BSET_COMPRESSION_TYPE(i) &&
+	    u64s * sizeof(u64) >= sizeof(*h))
+		u64s = le16_to_cpu(h->uncompressed_u64s);
+
+	return round_up((void *) (i->_data + u64s) - start,
+			block_bytes(c)) >> 9;
+}
+
+int bch2_bset_decompress(struct bch_fs *, struct btree_node *, struct bset *);
+
 void bch2_btree_sort_into(struct bch_fs *, struct btree *, struct btree *);
 
 void bch2_btree_node_drop_keys_outside_node(struct btree *);
@@ -785,36 +785,152 @@ static inline int btree_path_lock_root(struct btree_trans *trans,
 	}
 }
 
+#define BTREE_PREFETCH_MAX	64U
+
+/*
+ * Readahead window for leaves, with BTREE_ITER_PREFETCH: it doubles each time
+ * we descend into a leaf we read ahead - i.e. while we're going through the
+ * leaves in order - and halves when we descend anywhere else. Returns the
+ * number of leaves we want to have read ahead of @pos:
+ */
+static unsigned btree_path_prefetch_window(struct bch_fs *c, struct btree_path *path,
+					   struct bpos pos)
+{
+	unsigned min_nr = test_bit(BCH_FS_STARTED, &c->flags) ? 2 : 16;
+	unsigned nr;
+
+	if (bpos_gt(pos, path->prefetch_last) &&
+	    bpos_le(pos, path->prefetch_end)) {
+		nr = path->prefetch_nr * 2;
+	} else {
+		nr = path->prefetch_nr / 2;
+		path->prefetch_end = pos;
+	}
+
+	path->prefetch_nr	= clamp_t(unsigned, nr, min_nr, BTREE_PREFETCH_MAX);
+	path->prefetch_last	= pos;
+	return path->prefetch_nr;
+}
+
+/*
+ * For reading ahead past the end of the current parent: returns the next node
+ * at path->level, read locked, if it's cached and can be locked without
+ * blocking - otherwise starts reading it in:
+ */
+static struct btree *btree_path_next_node_trylock(struct btree_trans *trans,
+						  struct btree_path *path,
+						  struct bkey_buf *tmp)
+{
+	struct bch_fs *c = trans->c;
+	unsigned level = path->level + 1;
+	struct btree_path_level *l = &path->l[level];
+	struct btree_node_iter node_iter;
+	struct bkey_packed *k;
+	struct btree *b;
+	int ret;
+
+	if (level >= BTREE_MAX_DEPTH ||
+	    !bch2_btree_node_relock(trans, path, level))
+		return NULL;
+
+	node_iter = l->iter;
+	bch2_btree_node_iter_advance(&node_iter, l->b);
+	k = bch2_btree_node_iter_peek(&node_iter, l->b);
+	if (!k)
+		return NULL;
+
+	bch2_bkey_buf_unpack(tmp, c, l->b, k);
+
+	b = bch2_btree_node_trylock_cached(c, tmp->k, path->level);
+	if (b)
+		return b;
+
+	ret = bch2_btree_node_prefetch(trans, path, tmp->k, path->btree_id,
+				       path->level);
+	return ret ? ERR_PTR(ret) : NULL;
+}
+
 noinline
 static int btree_path_prefetch(struct btree_trans *trans, struct btree_path *path)
 {
 	struct bch_fs *c = trans->c;
 	struct btree_path_level *l = path_l(path);
 	struct btree_node_iter node_iter = l->iter;
+	struct btree *b = l->b, *next_parent = NULL;
 	struct bkey_packed *k;
 	struct bkey_buf tmp;
-	unsigned nr = test_bit(BCH_FS_STARTED, &c->flags)
-		? (path->level > 1 ? 0 :  2)
-		: (path->level > 1 ? 1 : 16);
+	struct blk_plug plug;
+	bool leaves = path->level == 1;
+	unsigned nr, ahead = 0, window = 0;
 	bool was_locked = btree_node_locked(path, path->level);
+	bool parent_was_locked = path->level + 1 < BTREE_MAX_DEPTH &&
+		btree_node_locked(path, path->level + 1);
 	int ret = 0;
 
+	if (leaves) {
+		k = bch2_btree_node_iter_peek(&node_iter, b);
+		if (!k)
+			return 0;
+
+		nr = window = btree_path_prefetch_window(c, path, bkey_unpack_pos(b, k));
+	} else {
+		nr = test_bit(BCH_FS_STARTED, &c->flags) ? 0 : 1;
+	}
+
 	bch2_bkey_buf_init(&tmp);
+	blk_start_plug(&plug);
 
-	while (nr-- && !ret) {
+	bch2_btree_node_iter_advance(&node_iter, b);
+
+	while (nr && !ret) {
 		if (!bch2_btree_node_relock(trans, path, path->level))
 			break;
 
-		bch2_btree_node_iter_advance(&node_iter, l->b);
-		k = bch2_btree_node_iter_peek(&node_iter, l->b);
-		if (!k)
-			break;
+		k = bch2_btree_node_iter_peek(&node_iter, b);
+		if (!k) {
+			if (!leaves || next_parent)
+				break;
 
-		bch2_bkey_buf_unpack(&tmp, c, l->b, k);
+			next_parent = btree_path_next_node_trylock(trans, path, &tmp);
+			ret = PTR_ERR_OR_ZERO(next_parent);
+			if (IS_ERR_OR_NULL(next_parent)) {
+				next_parent = NULL;
+				break;
+			}
+
+			b = next_parent;
+			bch2_btree_node_iter_init_from_start(&node_iter, b);
+			continue;
+		}
+
+		bch2_btree_node_iter_advance(&node_iter, b);
+		nr--;
+
+		if (leaves &&
+		    bpos_le(bkey_unpack_pos(b, k), path->prefetch_end)) {
+			/* Already read ahead - is there enough ahead of us? */
+			if (++ahead >= window / 2)
+				break;
+			continue;
+		}
+
+		bch2_bkey_buf_unpack(&tmp, c, b, k);
 		ret = bch2_btree_node_prefetch(trans, path, tmp.k, path->btree_id,
 					       path->level - 1);
+		if (leaves)
+			path->prefetch_end = tmp.k->k.p;
 	}
 
+	blk_finish_plug(&plug);
+
+	if (next_parent)
+		six_unlock_read(&next_parent->c.lock);
+
+	if (!parent_was_locked &&
+	    path->level + 1 < BTREE_MAX_DEPTH &&
+	    btree_node_locked(path, path->level + 1))
+		btree_node_unlock(trans, path, path->level + 1);
+
 	if (!was_locked)
 		btree_node_unlock(trans, path, path->level);
 
@@ -828,6 +944,7 @@ static int btree_path_prefetch_j(struct btree_trans *trans, struct btree_path *p
 	struct bch_fs *c = trans->c;
 	struct bkey_s_c k;
 	struct bkey_buf tmp;
+	struct blk_plug plug;
 	unsigned nr = test_bit(BCH_FS_STARTED, &c->flags)
 		? (path->level > 1 ? 0 :  2)
 		: (path->level > 1 ? 1 : 16);
@@ -835,6 +952,7 @@ static int btree_path_prefetch_j(struct btree_trans *trans, struct btree_path *p
 	int ret = 0;
 
 	bch2_bkey_buf_init(&tmp);
+	blk_start_plug(&plug);
 
 	while (nr-- && !ret) {
 		if (!bch2_btree_node_relock(trans, path, path->level))
@@ -850,6 +968,8 @@ static int btree_path_prefetch_j(struct btree_trans *trans, struct btree_path *p
 					       path->level - 1);
 	}
 
+	blk_finish_plug(&plug);
+
 	if (!was_locked)
 		btree_node_unlock(trans, path, path->level);
 
@@ -935,7 +1055,8 @@ static __always_inline int btree_path_down(struct btree_trans *trans,
 		}
 	}
 
-	b = bch2_btree_node_get(trans, path, tmp.k, level, lock_type, trace_ip);
+	b = bch2_btree_node_get(trans, path, tmp.k, level, lock_type,
+				flags & BTREE_ITER_PREFETCH, trace_ip);
 	ret = PTR_ERR_OR_ZERO(b);
 	if (unlikely(ret))
 		goto err;
@@ -1585,6 +1706,9 @@ struct btree_path *bch2_path_get(struct btree_trans *trans,
 		path->level			= level;
 		path->locks_want		= locks_want;
 		path->nodes_locked		= 0;
+		path->prefetch_nr		= 0;
+		path->prefetch_last		= POS_MIN;
+		path->prefetch_end		= POS_MIN;
 		for (i = 0; i < ARRAY_SIZE(path->l); i++)
 			path->l[i].b		= ERR_PTR(-BCH_ERR_no_btree_node_init);
 #ifdef TRACK_PATH_ALLOCATED
@@ -1839,7 +1963,8 @@ inline bool bch2_btree_iter_rewind(struct btree_iter *iter)
 }
 
 static noinline
-struct bkey_i *__bch2_btree_trans_peek_updates(struct btree_iter *iter)
+struct bkey_i *__bch2_btree_trans_peek_updates(struct btree_iter *iter,
+					       struct bpos pos)
 {
 	struct btree_insert_entry *i;
 	struct bkey_i *ret = NULL;
@@ -1849,7 +1974,7 @@ struct bkey_i *__bch2_btree_trans_peek_updates(struct btree_iter *iter)
 			continue;
 		if (i->btree_id > iter->btree_id)
 			break;
-		if (bpos_lt(i->k->k.p, iter->path->pos))
+		if (bpos_lt(i->k->k.p, pos))
 			continue;
 		if (i->key_cache_already_flushed)
 			continue;
@@ -1863,7 +1988,7 @@ struct bkey_i *__bch2_btree_trans_peek_updates(struct btree_iter *iter)
 static inline struct bkey_i *btree_trans_peek_updates(struct btree_iter *iter)
 {
 	return iter->flags & BTREE_ITER_WITH_UPDATES
-		? __bch2_btree_trans_peek_updates(iter)
+		? __bch2_btree_trans_peek_updates(iter, iter->path->pos)
 		: NULL;
 }
 
@@ -2195,6 +2320,223 @@ end:
 	goto out_no_locked;
 }
 
+/*
+ * Returns the next key in the leaf @b that's visible to @iter, at or after
+ * @search_key and no further than @end - the same key __bch2_btree_iter_peek()
+ * and bch2_btree_iter_peek_upto() would return, but without re-traversing the
+ * path or re-searching the journal overlay and pending updates for every key:
+ * the next journal key and update are cached in @journal and @update.
+ *
+ * Returns bkey_s_c_null at the end of the leaf, or if we'd have to stop and
+ * let bch2_btree_iter_peek_upto() handle the next key.
+ */
+static struct bkey_s_c btree_iter_peek_in_leaf(struct btree_iter *iter,
+					       struct btree *b,
+					       struct btree_node_iter *node_iter,
+					       struct bpos search_key,
+					       struct bpos end,
+					       size_t *journal_idx,
+					       struct bkey_i **journal,
+					       struct bkey_i **update,
+					       struct bkey *u)
+{
+	struct btree_trans *trans = iter->trans;
+	struct bkey_packed *_k;
+	struct bkey_s_c k;
+	struct bpos iter_pos;
+
+	while (1) {
+		if (bpos_gt(search_key, b->key.k.p))
+			return bkey_s_c_null;
+
+		while ((_k = bch2_btree_node_iter_peek_all(node_iter, b)) &&
+		       bkey_iter_pos_cmp(b, _k, &search_key) < 0)
+			bch2_btree_node_iter_advance(node_iter, b);
+
+		k = _k ? bkey_disassemble(b, _k, u) : bkey_s_c_null;
+
+		if (*journal) {
+			if (bpos_lt((*journal)->k.p, search_key))
+				*journal = bch2_journal_keys_peek_upto(trans->c, iter->btree_id,
+							iter->path->level, search_key,
+							b->key.k.p, journal_idx);
+
+			if (*journal &&
+			    (!k.k || bpos_le((*journal)->k.p, k.k->p))) {
+				*u = (*journal)->k;
+				k = (struct bkey_s_c) { u, &(*journal)->v };
+			}
+		}
+
+		if (*update && bpos_lt((*update)->k.p, search_key))
+			*update = __bch2_btree_trans_peek_updates(iter, search_key);
+
+		if (*update &&
+		    bpos_le((*update)->k.p, k.k ? k.k->p : b->key.k.p)) {
+			*u = (*update)->k;
+			k = (struct bkey_s_c) { u, &(*update)->v };
+		}
+
+		if (!k.k)
+			return bkey_s_c_null;
+
+		if (bkey_deleted(k.k)) {
+			search_key = !bpos_eq(search_key, k.k->p)
+				? k.k->p
+				: bpos_successor(k.k->p);
+			continue;
+		}
+
+		iter_pos = !(iter->flags & BTREE_ITER_IS_EXTENTS)
+			? k.k->p
+			: bkey_start_pos(k.k);
+
+		if (!(iter->flags & BTREE_ITER_IS_EXTENTS)
+		    ? bkey_gt(iter_pos, end)
+		    : bkey_ge(iter_pos, end))
+			return bkey_s_c_null;
+
+		if ((iter->flags & BTREE_ITER_FILTER_SNAPSHOTS) &&
+		    !bch2_snapshot_is_ancestor(trans->c,
+					       iter->snapshot,
+					       k.k->p.snapshot)) {
+			search_key = bpos_successor(k.k->p);
+			continue;
+		}
+
+		if (bkey_whiteout(k.k) &&
+		    !(iter->flags & BTREE_ITER_ALL_SNAPSHOTS)) {
+			search_key = bkey_successor(iter, k.k->p);
+			continue;
+		}
+
+		return k;
+	}
+}
+
+/**
+ * bch2_btree_iter_peek_many_upto: returns up to @nr keys, starting with the
+ * first key greater than or equal to iterator's current position
+ *
+ * Keys are returned in @k, unpacked into @u; they're the same keys repeated
+ * calls to bch2_btree_iter_peek_upto() and bch2_btree_iter_advance() would
+ * return, merged with the journal overlay and pending updates, but stopping at
+ * the end of the current leaf. The iterator is left pointing at the last key
+ * returned, as if by bch2_btree_iter_peek_upto().
+ *
+ * Keys point into the btree node, and are only valid until the transaction is
+ * unlocked or the btree is modified.
+ *
+ * Returns the number of keys returned, 0 at the end, or an error.
+ */
+int bch2_btree_iter_peek_many_upto(struct btree_iter *iter, struct bpos end,
+				   struct bkey_s_c *k, struct bkey *u,
+				   unsigned nr)
+{
+	struct btree_trans *trans = iter->trans;
+	struct btree_path_level *l;
+	struct btree_node_iter node_iter;
+	struct bkey_i *journal = NULL, *update = NULL;
+	size_t journal_idx = 0;
+	struct bpos search_key;
+	struct bkey_s_c n;
+	unsigned i = 0;
+	int ret;
+
+	EBUG_ON(!nr);
+
+	n = bch2_btree_iter_peek_upto(iter, end);
+	ret = bkey_err(n);
+	if (unlikely(ret))
+		return ret;
+	if (!n.k)
+		return 0;
+
+	u[i] = *n.k;
+	k[i++] = (struct bkey_s_c) { &u[0], n.v };
+
+	/*
+	 * Keys from the key cache, and snapshot filtering with an update path,
+	 * need the slowpath for every key:
+	 */
+	if ((iter->flags & BTREE_ITER_WITH_KEY_CACHE) ||
+	    iter->update_path)
+		return i;
+
+	l = path_l(iter->path);
+	node_iter = l->iter;
+
+	while (i < nr) {
+		struct bpos pos = k[i - 1].k->p;
+
+		if (!(iter->flags & BTREE_ITER_ALL_SNAPSHOTS)
+		    ? bkey_eq(pos, SPOS_MAX)
+		    : bpos_eq(pos, SPOS_MAX))
+			break;
+
+		search_key = bkey_successor(iter, pos);
+
+		if (i == 1) {
+			if (unlikely(iter->flags & BTREE_ITER_WITH_JOURNAL))
+				journal = bch2_journal_keys_peek_upto(trans->c, iter->btree_id,
+							iter->path->level, search_key,
+							l->b->key.k.p, &journal_idx);
+			if (iter->flags & BTREE_ITER_WITH_UPDATES)
+				update = __bch2_btree_trans_peek_updates(iter, search_key);
+		}
+
+		n = btree_iter_peek_in_leaf(iter, l->b, &node_iter, search_key, end,
+					    &journal_idx, &journal, &update, &u[i]);
+		if (!n.k)
+			break;
+
+		/*
+		 * A key from an ancestor snapshot needs an update path for an
+		 * intent iterator - leave it for the slowpath:
+		 */
+		if ((iter->flags & BTREE_ITER_INTENT) &&
+		    (iter->flags & BTREE_ITER_FILTER_SNAPSHOTS) &&
+		    n.k->p.snapshot != iter->snapshot)
+			break;
+
+		k[i++] = n;
+	}
+
+	if (i > 1) {
+		struct bkey_s_c last = k[i - 1];
+
+		iter->k		= *last.k;
+		iter->pos	= !(iter->flags & BTREE_ITER_IS_EXTENTS)
+			? last.k->p
+			: bkey_start_pos(last.k);
+		if (!(iter->flags & BTREE_ITER_ALL_SNAPSHOTS))
+			iter->pos.snapshot = iter->snapshot;
+
+		iter->path = bch2_btree_path_set_pos(trans, iter->path, last.k->p,
+					iter->flags & BTREE_ITER_INTENT,
+					btree_iter_ip_allocated(iter));
+		btree_path_set_should_be_locked(iter->path);
+	}
+
+	return i;
+}
+
+int bch2_btree_iter_peek_many_and_restart_outlined(struct btree_iter *iter,
+						   struct bpos end,
+						   struct bkey_s_c *k,
+						   struct bkey *u,
+						   unsigned nr)
+{
+	int ret;
+
+	while (btree_trans_too_many_iters(iter->trans) ||
+	       bch2_err_matches(ret = bch2_btree_iter_peek_many_upto(iter, end, k, u, nr),
+				BCH_ERR_transaction_restart))
+		bch2_trans_begin(iter->trans);
+
+	return ret;
+}
+
 /**
  * bch2_btree_iter_peek_all_levels: returns the first key greater than or equal
  * to iterator's current position, returning keys from every level of the btree.
@@ -327,6 +327,8 @@ struct btree *bch2_btree_iter_peek_node_and_restart(struct btree_iter *);
 struct btree *bch2_btree_iter_next_node(struct btree_iter *);
 
 struct bkey_s_c bch2_btree_iter_peek_upto(struct btree_iter *, struct bpos);
+int bch2_btree_iter_peek_many_upto(struct btree_iter *, struct bpos,
+				   struct bkey_s_c *, struct bkey *, unsigned);
 struct bkey_s_c bch2_btree_iter_next(struct btree_iter *);
 
 struct bkey_s_c bch2_btree_iter_peek_all_levels(struct btree_iter *);
@@ -622,6 +624,9 @@ static inline int btree_trans_too_many_iters(struct btree_trans *trans)
 }
 
 struct bkey_s_c bch2_btree_iter_peek_and_restart_outlined(struct btree_iter *);
+int bch2_btree_iter_peek_many_and_restart_outlined(struct btree_iter *, struct bpos,
+						   struct bkey_s_c *, struct bkey *,
+						   unsigned);
 
 static inline struct bkey_s_c
 __bch2_btree_iter_peek_and_restart(struct btree_trans *trans,
@@ -80,6 +80,35 @@ static void bkey_cached_evict(struct btree_key_cache *c,
 	atomic_long_dec(&c->nr_keys);
 }
 
+#define BKEY_CACHED_DIRTY_BATCH		64
+
+static void bkey_cached_nr_dirty_add(struct btree_key_cache *bc, long v)
+{
+	struct btree_key_cache_pcpu *p;
+
+	preempt_disable();
+	p = this_cpu_ptr(bc->pcpu);
+	p->nr_dirty += v;
+
+	if (p->nr_dirty >=  BKEY_CACHED_DIRTY_BATCH ||
+	    p->nr_dirty <= -BKEY_CACHED_DIRTY_BATCH) {
+		atomic_long_add(p->nr_dirty, &bc->nr_dirty);
+		p->nr_dirty = 0;
+	}
+	preempt_enable();
+}
+
+long bch2_btree_key_cache_nr_dirty(struct btree_key_cache *bc)
+{
+	long ret = atomic_long_read(&bc->nr_dirty);
+	int cpu;
+
+	if (bc->pcpu)
+		for_each_possible_cpu(cpu)
+			ret += READ_ONCE(per_cpu_ptr(bc->pcpu, cpu)->nr_dirty);
+	return ret;
+}
+
 static void bkey_cached_free(struct btree_key_cache *bc,
 			     struct bkey_cached *ck)
 {
@@ -90,10 +119,9 @@ static void bkey_cached_free(struct btree_key_cache *bc,
 	ck->btree_trans_barrier_seq =
 		start_poll_synchronize_srcu(&c->btree_trans_barrier);
 
-	if (ck->c.lock.readers)
-		list_move_tail(&ck->list, &bc->freed_pcpu);
-	else
-		list_move_tail(&ck->list, &bc->freed_nonpcpu);
+	llist_add(&ck->freed, ck->c.lock.readers
+		  ? &bc->freed_pcpu
+		  : &bc->freed_nonpcpu);
 	atomic_long_inc(&bc->nr_freed);
 
 	kfree(ck->k);
@@ -104,67 +132,34 @@ static void bkey_cached_free(struct btree_key_cache *bc,
 	six_unlock_intent(&ck->c.lock);
 }
 
-#ifdef __KERNEL__
-static void __bkey_cached_move_to_freelist_ordered(struct btree_key_cache *bc,
-						   struct bkey_cached *ck)
-{
-	struct bkey_cached *pos;
-
-	list_for_each_entry_reverse(pos, &bc->freed_nonpcpu, list) {
-		if (ULONG_CMP_GE(ck->btree_trans_barrier_seq,
-				 pos->btree_trans_barrier_seq)) {
-			list_move(&ck->list, &pos->list);
-			return;
-		}
-	}
-
-	list_move(&ck->list, &bc->freed_nonpcpu);
-}
-#endif
-
 static void bkey_cached_move_to_freelist(struct btree_key_cache *bc,
 					 struct bkey_cached *ck)
 {
 	BUG_ON(test_bit(BKEY_CACHED_DIRTY, &ck->flags));
 
 	if (!ck->c.lock.readers) {
-#ifdef __KERNEL__
-		struct btree_key_cache_freelist *f;
-		bool freed = false;
+		struct btree_key_cache_pcpu *p;
+		struct llist_node *first = NULL, *last = NULL;
 
 		preempt_disable();
-		f = this_cpu_ptr(bc->pcpu_freed);
+		p = this_cpu_ptr(bc->pcpu);
 
-		if (f->nr < ARRAY_SIZE(f->objs)) {
-			f->objs[f->nr++] = ck;
-			freed = true;
-		}
-		preempt_enable();
-
-		if (!freed) {
-			mutex_lock(&bc->lock);
-			preempt_disable();
-			f = this_cpu_ptr(bc->pcpu_freed);
+		if (p->nr == ARRAY_SIZE(p->objs))
+			while (p->nr > ARRAY_SIZE(p->objs) / 2) {
+				struct bkey_cached *ck2 = p->objs[--p->nr];
 
-			while (f->nr > ARRAY_SIZE(f->objs) / 2) {
-				struct bkey_cached *ck2 = f->objs[--f->nr];
-
-				__bkey_cached_move_to_freelist_ordered(bc, ck2);
+				ck2->freed.next = first;
+				first = &ck2->freed;
+				last = last ?: first;
 			}
-			preempt_enable();
 
-			__bkey_cached_move_to_freelist_ordered(bc, ck);
-			mutex_unlock(&bc->lock);
-		}
-#else
-		mutex_lock(&bc->lock);
-		list_move_tail(&ck->list, &bc->freed_nonpcpu);
-		mutex_unlock(&bc->lock);
-#endif
+		p->objs[p->nr++] = ck;
+		preempt_enable();
+
+		if (first)
+			llist_add_batch(first, last, &bc->freed_nonpcpu);
 	} else {
-		mutex_lock(&bc->lock);
-		list_move_tail(&ck->list, &bc->freed_pcpu);
-		mutex_unlock(&bc->lock);
+		llist_add(&ck->freed, &bc->freed_pcpu);
 	}
 }
 
@@ -176,7 +171,6 @@ static void bkey_cached_free_fast(struct btree_key_cache *bc,
 	ck->btree_trans_barrier_seq =
 		start_poll_synchronize_srcu(&c->btree_trans_barrier);
 
-	list_del_init(&ck->list);
 	atomic_long_inc(&bc->nr_freed);
 
 	kfree(ck->k);
@@ -189,6 +183,27 @@ static void bkey_cached_free_fast(struct btree_key_cache *bc,
 	six_unlock_intent(&ck->c.lock);
 }
 
+/*
+ * Take one entry off a shared freelist: since we may race with other
+ * consumers, we can't use llist_del_first() - take the whole list and push
+ * back what we don't use:
+ */
+static struct bkey_cached *bkey_cached_freelist_pop(struct llist_head *list)
+{
+	struct llist_node *n = llist_del_all(list), *last;
+
+	if (!n)
+		return NULL;
+
+	if (n->next) {
+		for (last = n->next; last->next; last = last->next)
+			;
+		llist_add_batch(n->next, last, list);
+	}
+
+	return llist_entry(n, struct bkey_cached, freed);
+}
+
 static struct bkey_cached *
 bkey_cached_alloc(struct btree_trans *trans, struct btree_path *path,
 		  bool *was_new)
@@ -200,46 +215,49 @@ bkey_cached_alloc(struct btree_trans *trans, struct btree_path *path,
 	int ret;
 
 	if (!pcpu_readers) {
-#ifdef __KERNEL__
-		struct btree_key_cache_freelist *f;
+		struct btree_key_cache_pcpu *p;
 
 		preempt_disable();
-		f = this_cpu_ptr(bc->pcpu_freed);
-		if (f->nr)
-			ck = f->objs[--f->nr];
-		preempt_enable();
+		p = this_cpu_ptr(bc->pcpu);
+
+		if (!p->nr) {
+			/*
+			 * Refill half the magazine from our spare chain, or
+			 * failing that take the entire shared freelist - up to
+			 * a magazine's worth of what doesn't fit becomes the
+			 * new spare chain, the rest goes back:
+			 */
+			struct llist_node *n = p->spare ?:
+				llist_del_all(&bc->freed_nonpcpu);
+			struct llist_node *surplus, *last;
+			unsigned nr_spare;
+
+			while (n && p->nr < ARRAY_SIZE(p->objs) / 2) {
+				p->objs[p->nr++] = llist_entry(n, struct bkey_cached, freed);
+				n = n->next;
+			}
+			p->spare = n;
 
-		if (!ck) {
-			mutex_lock(&bc->lock);
-			preempt_disable();
-			f = this_cpu_ptr(bc->pcpu_freed);
+			for (nr_spare = 1;
+			     n && n->next && nr_spare < ARRAY_SIZE(p->objs);
+			     nr_spare++)
+				n = n->next;
 
-			while (!list_empty(&bc->freed_nonpcpu) &&
-			       f->nr < ARRAY_SIZE(f->objs) / 2) {
-				ck = list_last_entry(&bc->freed_nonpcpu, struct bkey_cached, list);
-				list_del_init(&ck->list);
-				f->objs[f->nr++] = ck;
-			}
+			if (n && n->next) {
+				surplus = n->next;
+				n->next = NULL;
 
-			ck = f->nr ? f->objs[--f->nr] : NULL;
-			preempt_enable();
-			mutex_unlock(&bc->lock);
-		}
-#else
-		mutex_lock(&bc->lock);
-		if (!list_empty(&bc->freed_nonpcpu)) {
-			ck = list_last_entry(&bc->freed_nonpcpu, struct bkey_cached, list);
-			list_del_init(&ck->list);
+				for (last = surplus; last->next; last = last->next)
+					;
+				llist_add_batch(surplus, last, &bc->freed_nonpcpu);
+			}
 		}
-		mutex_unlock(&bc->lock);
-#endif
+
+		if (p->nr)
+			ck = p->objs[--p->nr];
+		preempt_enable();
 	} else {
-		mutex_lock(&bc->lock);
-		if (!list_empty(&bc->freed_pcpu)) {
-			ck = list_last_entry(&bc->freed_pcpu, struct bkey_cached, list);
-			list_del_init(&ck->list);
-		}
-		mutex_unlock(&bc->lock);
+		ck = bkey_cached_freelist_pop(&bc->freed_pcpu);
 	}
 
 	if (ck) {
@@ -275,7 +293,6 @@ bkey_cached_alloc(struct btree_trans *trans, struct btree_path *path,
 	if (!ck)
 		return NULL;
 
-	INIT_LIST_HEAD(&ck->list);
 	bch2_btree_lock_init(&ck->c, pcpu_readers ? SIX_LOCK_INIT_PCPU : 0);
 
 	ck->c.cached = true;
@@ -293,7 +310,6 @@ bkey_cached_reuse(struct btree_key_cache *c)
 	struct bkey_cached *ck;
 	unsigned i;
 
-	mutex_lock(&c->lock);
 	rcu_read_lock();
 	tbl = rht_dereference_rcu(c->table.tbl, &c->table);
 	for (i = 0; i < tbl->size; i++)
@@ -307,7 +323,6 @@ bkey_cached_reuse(struct btree_key_cache *c)
 	ck = NULL;
 out:
 	rcu_read_unlock();
-	mutex_unlock(&c->lock);
 	return ck;
 }
 
@@ -672,7 +687,7 @@ static int btree_key_cache_flush_pos(struct btree_trans *trans,
 	if (!evict) {
 		if (test_bit(BKEY_CACHED_DIRTY, &ck->flags)) {
 			clear_bit(BKEY_CACHED_DIRTY, &ck->flags);
-			atomic_long_dec(&c->btree_key_cache.nr_dirty);
+			bkey_cached_nr_dirty_add(&c->btree_key_cache, -1);
 		}
 	} else {
 		struct btree_path *path2;
@@ -685,7 +700,7 @@ evict:
 
 		if (test_bit(BKEY_CACHED_DIRTY, &ck->flags)) {
 			clear_bit(BKEY_CACHED_DIRTY, &ck->flags);
-			atomic_long_dec(&c->btree_key_cache.nr_dirty);
+			bkey_cached_nr_dirty_add(&c->btree_key_cache, -1);
 		}
 
 		mark_btree_node_locked_noreset(c_iter.path, 0, BTREE_NODE_UNLOCKED);
@@ -783,7 +798,7 @@ bool bch2_btree_insert_key_cached(struct btree_trans *trans,
 	if (!test_bit(BKEY_CACHED_DIRTY, &ck->flags)) {
 		EBUG_ON(test_bit(BCH_FS_CLEAN_SHUTDOWN, &c->flags));
 		set_bit(BKEY_CACHED_DIRTY, &ck->flags);
-		atomic_long_inc(&c->btree_key_cache.nr_dirty);
+		bkey_cached_nr_dirty_add(&c->btree_key_cache, 1);
 
 		if (bch2_nr_btree_keys_need_flush(c))
 			kick_reclaim = true;
@@ -827,13 +842,50 @@ void bch2_btree_key_cache_drop(struct btree_trans *trans,
 	 */
 	if (test_bit(BKEY_CACHED_DIRTY, &ck->flags)) {
 		clear_bit(BKEY_CACHED_DIRTY, &ck->flags);
-		atomic_long_dec(&c->btree_key_cache.nr_dirty);
+		bkey_cached_nr_dirty_add(&c->btree_key_cache, -1);
 		bch2_journal_pin_drop(&c->journal, &ck->journal);
 	}
 
 	ck->valid = false;
 }
 
+/*
+ * Free entries on a shared freelist whose SRCU grace period has elapsed, up to
+ * @nr; the rest go back on the list:
+ */
+static size_t bkey_cached_freelist_shrink(struct bch_fs *c,
+					  struct llist_head *list,
+					  size_t nr)
+{
+	struct btree_key_cache *bc = &c->btree_key_cache;
+	struct llist_node *n = llist_del_all(list), *next;
+	struct llist_node *keep = NULL, *keep_last = NULL;
+	size_t freed = 0;
+
+	for (; n; n = next) {
+		struct bkey_cached *ck = llist_entry(n, struct bkey_cached, freed);
+
+		next = n->next;
+
+		if (freed < nr &&
+		    poll_state_synchronize_srcu(&c->btree_trans_barrier,
+						ck->btree_trans_barrier_seq)) {
+			six_lock_exit(&ck->c.lock);
+			kmem_cache_free(bch2_key_cache, ck);
+			atomic_long_dec(&bc->nr_freed);
+			freed++;
+		} else {
+			n->next = keep;
+			keep = n;
+			keep_last = keep_last ?: n;
+		}
+	}
+
+	if (keep)
+		llist_add_batch(keep, keep_last, list);
+	return freed;
+}
+
 static unsigned long bch2_btree_key_cache_scan(struct shrinker *shrink,
 					   struct shrink_control *sc)
 {
@@ -841,64 +893,42 @@ static unsigned long bch2_btree_key_cache_scan(struct shrinker *shrink,
 					btree_key_cache.shrink);
 	struct btree_key_cache *bc = &c->btree_key_cache;
 	struct bucket_table *tbl;
-	struct bkey_cached *ck, *t;
+	struct bkey_cached *ck;
 	size_t scanned = 0, freed = 0, nr = sc->nr_to_scan;
-	unsigned start, flags;
+	unsigned iter, start, flags;
 	int srcu_idx;
 
-	mutex_lock(&bc->lock);
 	srcu_idx = srcu_read_lock(&c->btree_trans_barrier);
 	flags = memalloc_nofs_save();
 
-	/*
-	 * Newest freed entries are at the end of the list - once we hit one
-	 * that's too new to be freed, we can bail out:
-	 */
-	list_for_each_entry_safe(ck, t, &bc->freed_nonpcpu, list) {
-		if (!poll_state_synchronize_srcu(&c->btree_trans_barrier,
-						 ck->btree_trans_barrier_seq))
-			break;
-
-		list_del(&ck->list);
-		six_lock_exit(&ck->c.lock);
-		kmem_cache_free(bch2_key_cache, ck);
-		atomic_long_dec(&bc->nr_freed);
-		scanned++;
-		freed++;
-	}
-
+	freed += bkey_cached_freelist_shrink(c, &bc->freed_nonpcpu, nr);
+	scanned = freed;
 	if (scanned >= nr)
 		goto out;
 
-	list_for_each_entry_safe(ck, t, &bc->freed_pcpu, list) {
-		if (!poll_state_synchronize_srcu(&c->btree_trans_barrier,
-						 ck->btree_trans_barrier_seq))
-			break;
-
-		list_del(&ck->list);
-		six_lock_exit(&ck->c.lock);
-		kmem_cache_free(bch2_key_cache, ck);
-		atomic_long_dec(&bc->nr_freed);
-		scanned++;
-		freed++;
-	}
-
+	freed += bkey_cached_freelist_shrink(c, &bc->freed_pcpu, nr - scanned);
+	scanned = freed;
 	if (scanned >= nr)
 		goto out;
 
+	/*
+	 * Concurrent shrinkers may walk the same buckets; that's harmless, we
+	 * only trylock what we evict:
+	 */
 	rcu_read_lock();
 	tbl = rht_dereference_rcu(bc->table.tbl, &bc->table);
-	if (bc->shrink_iter >= tbl->size)
-		bc->shrink_iter = 0;
-	start = bc->shrink_iter;
+	iter = READ_ONCE(bc->shrink_iter);
+	if (iter >= tbl->size)
+		iter = 0;
+	start = iter;
 
 	do {
 		struct rhash_head *pos, *next;
 
-		pos = rht_ptr_rcu(rht_bucket(tbl, bc->shrink_iter));
+		pos = rht_ptr_rcu(rht_bucket(tbl, iter));
 
 		while (!rht_is_a_nulls(pos)) {
-			next = rht_dereference_bucket_rcu(pos->next, tbl, bc->shrink_iter);
+			next = rht_dereference_bucket_rcu(pos->next, tbl, iter);
 			ck = container_of(pos, struct bkey_cached, hash);
 
 			if (test_bit(BKEY_CACHED_DIRTY, &ck->flags))
@@ -918,16 +948,16 @@ next:
 			pos = next;
 		}
 
-		bc->shrink_iter++;
-		if (bc->shrink_iter >= tbl->size)
-			bc->shrink_iter = 0;
-	} while (scanned < nr && bc->shrink_iter != start);
+		iter++;
+		if (iter >= tbl->size)
+			iter = 0;
+	} while (scanned < nr && iter != start);
 
+	WRITE_ONCE(bc->shrink_iter, iter);
 	rcu_read_unlock();
 out:
 	memalloc_nofs_restore(flags);
 	srcu_read_unlock(&c->btree_trans_barrier, srcu_idx);
-	mutex_unlock(&bc->lock);
 
 	return freed;
 }
@@ -944,22 +974,28 @@ static unsigned long bch2_btree_key_cache_count(struct shrinker *shrink,
 	return max(0L, nr);
 }
 
+static void bkey_cached_chain_add(struct llist_node *n, struct llist_head *items)
+{
+	struct llist_node *next;
+
+	for (; n; n = next) {
+		next = n->next;
+		llist_add(n, items);
+	}
+}
+
 void bch2_fs_btree_key_cache_exit(struct btree_key_cache *bc)
 {
 	struct bch_fs *c = container_of(bc, struct bch_fs, btree_key_cache);
 	struct bucket_table *tbl;
 	struct bkey_cached *ck, *n;
 	struct rhash_head *pos;
-	LIST_HEAD(items);
+	LLIST_HEAD(items);
 	unsigned i;
-#ifdef __KERNEL__
 	int cpu;
-#endif
 
 	unregister_shrinker(&bc->shrink);
 
-	mutex_lock(&bc->lock);
-
 	/*
 	 * The loop is needed to guard against racing with rehash:
 	 */
@@ -970,45 +1006,42 @@ void bch2_fs_btree_key_cache_exit(struct btree_key_cache *bc)
 			for (i = 0; i < tbl->size; i++)
 				rht_for_each_entry_rcu(ck, pos, tbl, i, hash) {
 					bkey_cached_evict(bc, ck);
-					list_add(&ck->list, &items);
+					llist_add(&ck->freed, &items);
 				}
 		rcu_read_unlock();
 	}
 
-#ifdef __KERNEL__
-	for_each_possible_cpu(cpu) {
-		struct btree_key_cache_freelist *f =
-			per_cpu_ptr(bc->pcpu_freed, cpu);
+	if (bc->pcpu)
+		for_each_possible_cpu(cpu) {
+			struct btree_key_cache_pcpu *p = per_cpu_ptr(bc->pcpu, cpu);
 
-		for (i = 0; i < f->nr; i++) {
-			ck = f->objs[i];
-			list_add(&ck->list, &items);
-		}
-	}
-#endif
+			for (i = 0; i < p->nr; i++)
+				llist_add(&p->objs[i]->freed, &items);
+			p->nr = 0;
 
-	list_splice(&bc->freed_pcpu,	&items);
-	list_splice(&bc->freed_nonpcpu,	&items);
+			bkey_cached_chain_add(p->spare, &items);
+			p->spare = NULL;
+		}
 
-	mutex_unlock(&bc->lock);
+	bkey_cached_chain_add(llist_del_all(&bc->freed_pcpu),	 &items);
+	bkey_cached_chain_add(llist_del_all(&bc->freed_nonpcpu), &items);
 
-	list_for_each_entry_safe(ck, n, &items, list) {
+	llist_for_each_entry_safe(ck, n, llist_del_all(&items), freed) {
 		cond_resched();
 
 		bch2_journal_pin_drop(&c->journal, &ck->journal);
 		bch2_journal_preres_put(&c->journal, &ck->res);
 
-		list_del(&ck->list);
 		kfree(ck->k);
 		six_lock_exit(&ck->c.lock);
 		kmem_cache_free(bch2_key_cache, ck);
 	}
 
-	if (atomic_long_read(&bc->nr_dirty) &&
+	if (bch2_btree_key_cache_nr_dirty(bc) &&
 	    !bch2_journal_error(&c->journal) &&
 	    test_bit(BCH_FS_WAS_RW, &c->flags))
 		panic("btree key cache shutdown error: nr_dirty nonzero (%li)\n",
-		      atomic_long_read(&bc->nr_dirty));
+		      bch2_btree_key_cache_nr_dirty(bc));
 
 	if (atomic_long_read(&bc->nr_keys))
 		panic("btree key cache shutdown error: nr_keys nonzero (%li)\n",
@@ -1017,14 +1050,13 @@ void bch2_fs_btree_key_cache_exit(struct btree_key_cache *bc)
 	if (bc->table_init_done)
 		rhashtable_destroy(&bc->table);
 
-	free_percpu(bc->pcpu_freed);
+	free_percpu(bc->pcpu);
 }
 
 void bch2_fs_btree_key_cache_init_early(struct btree_key_cache *c)
 {
-	mutex_init(&c->lock);
-	INIT_LIST_HEAD(&c->freed_pcpu);
-	INIT_LIST_HEAD(&c->freed_nonpcpu);
+	init_llist_head(&c->freed_pcpu);
+	init_llist_head(&c->freed_nonpcpu);
 }
 
 static void bch2_btree_key_cache_shrinker_to_text(struct seq_buf *s, struct shrinker *shrink)
@@ -1043,11 +1075,9 @@ int bch2_fs_btree_key_cache_init(struct btree_key_cache *bc)
 {
 	struct bch_fs *c = container_of(bc, struct bch_fs, btree_key_cache);
 
-#ifdef __KERNEL__
-	bc->pcpu_freed = alloc_percpu(struct btree_key_cache_freelist);
-	if (!bc->pcpu_freed)
+	bc->pcpu = alloc_percpu(struct btree_key_cache_pcpu);
+	if (!bc->pcpu)
 		return -BCH_ERR_ENOMEM_fs_btree_cache_init;
-#endif
 
 	if (rhashtable_init(&bc->table, &bch2_btree_key_cache_params))
 		return -BCH_ERR_ENOMEM_fs_btree_cache_init;
@@ -1069,7 +1099,7 @@ void bch2_btree_key_cache_to_text(struct printbuf *out, struct btree_key_cache *
 	prt_newline(out);
 	prt_printf(out, "nr_keys:\t%lu",	atomic_long_read(&c->nr_keys));
 	prt_newline(out);
-	prt_printf(out, "nr_dirty:\t%lu",	atomic_long_read(&c->nr_dirty));
+	prt_printf(out, "nr_dirty:\t%lu",	bch2_btree_key_cache_nr_dirty(c));
 	prt_newline(out);
 }
 
@@ -2,9 +2,19 @@
 #ifndef _BCACHEFS_BTREE_KEY_CACHE_H
 #define _BCACHEFS_BTREE_KEY_CACHE_H
 
+/*
+ * Dirty counts are sharded percpu and only periodically folded into
+ * btree_key_cache.nr_dirty; that's plenty accurate for reclaim heuristics, but
+ * may be transiently negative:
+ */
+static inline long bch2_btree_key_cache_nr_dirty_approx(struct bch_fs *c)
+{
+	return max(0L, atomic_long_read(&c->btree_key_cache.nr_dirty));
+}
+
 static inline size_t bch2_nr_btree_keys_need_flush(struct bch_fs *c)
 {
-	size_t nr_dirty = atomic_long_read(&c->btree_key_cache.nr_dirty);
+	size_t nr_dirty = bch2_btree_key_cache_nr_dirty_approx(c);
 	size_t nr_keys = atomic_long_read(&c->btree_key_cache.nr_keys);
 	size_t max_dirty = 1024 + nr_keys  / 2;
 
@@ -13,13 +23,15 @@ static inline size_t bch2_nr_btree_keys_need_flush(struct bch_fs *c)
 
 static inline bool bch2_btree_key_cache_must_wait(struct bch_fs *c)
 {
-	size_t nr_dirty = atomic_long_read(&c->btree_key_cache.nr_dirty);
+	size_t nr_dirty = bch2_btree_key_cache_nr_dirty_approx(c);
 	size_t nr_keys = atomic_long_read(&c->btree_key_cache.nr_keys);
 	size_t max_dirty = 4096 + (nr_keys * 3) / 4;
 
 	return nr_dirty > max_dirty;
 }
 
+long bch2_btree_key_cache_nr_dirty(struct btree_key_cache *);
+
 int bch2_btree_key_cache_journal_flush(struct journal *,
 				struct journal_entry_pin *, u64);
 
@@ -210,6 +210,12 @@ static inline int __btree_node_lock_nopath(struct btree_trans *trans,
 
 	ret = six_lock_ip_waiter(&b->lock, type, &trans->locking_wait,
 				 bch2_six_check_for_deadlock, trans, ip);
+
+	/* start_time is only set if we had to wait: */
+	if (unlikely(trans->locking_wait.start_time))
+		bch2_time_stats_update(&trans->c->times[BCH_TIME_btree_lock_contended_read + type],
+				       trans->locking_wait.start_time);
+
 	WRITE_ONCE(trans->locking, NULL);
 	WRITE_ONCE(trans->locking_wait.start_time, 0);
 	return ret;
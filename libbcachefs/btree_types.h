@@ -3,6 +3,7 @@
 #define _BCACHEFS_BTREE_TYPES_H
 
 #include <linux/list.h>
+#include <linux/llist.h>
 #include <linux/rhashtable.h>
 #include <linux/six.h>
 
@@ -137,6 +138,12 @@ struct btree {
 	struct list_head	list;
 };
 
+struct btree_cache_stats {
+	u64			hit[BTREE_ID_NR];
+	u64			miss[BTREE_ID_NR];
+	u64			ghost_hit[BTREE_ID_NR];
+};
+
 struct btree_cache {
 	struct rhashtable	table;
 	bool			table_init_done;
@@ -154,7 +161,14 @@ struct btree_cache {
 	 * should never grow past ~2-3 nodes in practice.
 	 */
 	struct mutex		lock;
+	/*
+	 * Nodes are read in on @probation, and only move to @live once they've
+	 * been accessed again by something other than a scan - so a scan of a
+	 * whole btree only displaces other nodes on probation. The shrinker
+	 * reclaims from @probation first, then @live in CLOCK order:
+	 */
 	struct list_head	live;
+	struct list_head	probation;
 	struct list_head	freeable;
 	struct list_head	freed_pcpu;
 	struct list_head	freed_nonpcpu;
@@ -172,9 +186,18 @@ struct btree_cache {
 	unsigned		not_freed_write_blocked;
 	unsigned		not_freed_will_make_reachable;
 	unsigned		not_freed_access_bit;
+	unsigned		promoted;
 	atomic_t		dirty;
 	struct shrinker		shrink;
 
+	/*
+	 * Hashes of nodes recently reclaimed from probation, indexed by hash: a
+	 * node that's read back in while it's still here goes straight to the
+	 * live list:
+	 */
+	u64			*ghosts;
+	struct btree_cache_stats __percpu *stats;
+
 	/*
 	 * If we need to allocate memory for a new btree node and that
 	 * allocation fails, we can cannibalize another node in the btree cache
@@ -255,6 +278,11 @@ struct btree_path {
 				locks_want:3;
 	u8			nodes_locked;
 
+	/* Leaf readahead window, for BTREE_ITER_PREFETCH: */
+	u8			prefetch_nr;
+	struct bpos		prefetch_last;
+	struct bpos		prefetch_end;
+
 	struct btree_path_level {
 		struct btree	*b;
 		struct btree_node_iter iter;
@@ -320,20 +348,33 @@ struct btree_iter {
 #endif
 };
 
-struct btree_key_cache_freelist {
+/*
+ * Freed bkey_cached objects go to a small per cpu magazine first; overflow is
+ * pushed in batches onto a lockless list, and refill takes the whole lockless
+ * list with one xchg, keeping up to a magazine's worth of what doesn't fit as
+ * a per cpu spare chain and giving the rest back, so that the shrinker still
+ * sees it. No global lock is taken for alloc, free or shrinking.
+ *
+ * Dirty counts are sharded the same way: each cpu accumulates a delta and only
+ * folds it into @nr_dirty once it exceeds BKEY_CACHED_DIRTY_BATCH, so
+ * @nr_dirty is approximate - use bch2_btree_key_cache_nr_dirty() for an exact
+ * count.
+ */
+struct btree_key_cache_pcpu {
 	struct bkey_cached	*objs[16];
 	unsigned		nr;
+	struct llist_node	*spare;
+	long			nr_dirty;
 };
 
 struct btree_key_cache {
-	struct mutex		lock;
 	struct rhashtable	table;
 	bool			table_init_done;
-	struct list_head	freed_pcpu;
-	struct list_head	freed_nonpcpu;
+	struct llist_head	freed_pcpu;
+	struct llist_head	freed_nonpcpu;
 	struct shrinker		shrink;
 	unsigned		shrink_iter;
-	struct btree_key_cache_freelist __percpu *pcpu_freed;
+	struct btree_key_cache_pcpu __percpu *pcpu;
 
 	atomic_long_t		nr_freed;
 	atomic_long_t		nr_keys;
@@ -358,7 +399,7 @@ struct bkey_cached {
 	struct bkey_cached_key	key;
 
 	struct rhash_head	hash;
-	struct list_head	list;
+	struct llist_node	freed;
 
 	struct journal_preres	res;
 	struct journal_entry_pin journal;
@@ -156,6 +156,18 @@ bool bch2_btree_node_format_fits(struct bch_fs *c, struct btree *b,
 	return __vstruct_bytes(struct btree_node, u64s) < btree_bytes(c);
 }
 
+/*
+ * How many u64s we'd save by rewriting @b with a freshly computed format - i.e.
+ * how far its current format has drifted from the keys it now contains:
+ */
+size_t bch2_btree_node_format_savings(struct btree *b)
+{
+	struct bkey_format new_f = bch2_btree_calc_format(b);
+	size_t u64s = btree_node_u64s_with_format(b, &new_f);
+
+	return b->nr.live_u64s > u64s ? b->nr.live_u64s - u64s : 0;
+}
+
 /* Btree node freeing/allocation: */
 
 static void __btree_node_free(struct bch_fs *c, struct btree *b)
@@ -309,20 +321,12 @@ mem_alloc:
 	return b;
 }
 
-static struct btree *bch2_btree_node_alloc(struct btree_update *as,
-					   struct btree_trans *trans,
-					   unsigned level)
+static void btree_node_init_new(struct btree_trans *trans, struct btree *b,
+				enum btree_id btree_id, unsigned level)
 {
-	struct bch_fs *c = as->c;
-	struct btree *b;
-	struct prealloc_nodes *p = &as->prealloc_nodes[!!level];
+	struct bch_fs *c = trans->c;
 	int ret;
 
-	BUG_ON(level >= BTREE_MAX_DEPTH);
-	BUG_ON(!p->nr);
-
-	b = p->b[--p->nr];
-
 	btree_node_lock_nopath_nofail(trans, &b->c, SIX_LOCK_intent);
 	btree_node_lock_nopath_nofail(trans, &b->c, SIX_LOCK_write);
 
@@ -332,14 +336,14 @@ static struct btree *bch2_btree_node_alloc(struct btree_update *as,
 
 	bch2_bset_init_first(b, &b->data->keys);
 	b->c.level	= level;
-	b->c.btree_id	= as->btree_id;
+	b->c.btree_id	= btree_id;
 	b->version_ondisk = c->sb.version;
 
 	memset(&b->nr, 0, sizeof(b->nr));
 	b->data->magic = cpu_to_le64(bset_magic(c));
 	memset(&b->data->_ptr, 0, sizeof(b->data->_ptr));
 	b->data->flags = 0;
-	SET_BTREE_NODE_ID(b->data, as->btree_id);
+	SET_BTREE_NODE_ID(b->data, btree_id);
 	SET_BTREE_NODE_LEVEL(b->data, level);
 
 	if (b->key.k.type == KEY_TYPE_btree_ptr_v2) {
@@ -354,11 +358,26 @@ static struct btree *bch2_btree_node_alloc(struct btree_update *as,
 
 	bch2_btree_build_aux_trees(b);
 
-	ret = bch2_btree_node_hash_insert(&c->btree_cache, b, level, as->btree_id);
+	ret = bch2_btree_node_hash_insert(&c->btree_cache, b, level, btree_id);
 	BUG_ON(ret);
 
 	trace_and_count(c, btree_node_alloc, c, b);
 	bch2_increment_clock(c, btree_sectors(c), WRITE);
+}
+
+static struct btree *bch2_btree_node_alloc(struct btree_update *as,
+					   struct btree_trans *trans,
+					   unsigned level)
+{
+	struct btree *b;
+	struct prealloc_nodes *p = &as->prealloc_nodes[!!level];
+
+	BUG_ON(level >= BTREE_MAX_DEPTH);
+	BUG_ON(!p->nr);
+
+	b = p->b[--p->nr];
+
+	btree_node_init_new(trans, b, as->btree_id, level);
 	return b;
 }
 
@@ -2311,6 +2330,479 @@ out:
 	return ret;
 }
 
+/* Bulk loading: */
+
+/*
+ * A bulk load doesn't go through the transaction machinery at all: keys are
+ * packed straight into new leaf nodes, with a format calculated for just the
+ * keys in each node, and pointers to those nodes are packed into interior nodes
+ * the same way, one level at a time.
+ *
+ * Nodes are written out as they're filled, but nothing is reachable until
+ * bch2_btree_bulk_load_finish() swaps in the new root with a single interior
+ * update - if we crash partway through, the btree is still empty. Triggers for
+ * the new node pointers, and for the keys themselves unless
+ * BTREE_TRIGGER_NORUN was passed, are run before the new nodes are reachable;
+ * space used by a bulk load that doesn't complete is leaked until the next
+ * fsck.
+ */
+
+#define BULK_LOAD_TRIGGERS_BATCH	64
+
+static struct btree *bulk_load_old_root(struct btree_bulk_load *bulk,
+					struct btree_iter *iter)
+{
+	struct btree_trans *trans = bulk->trans;
+	struct bch_fs *c = trans->c;
+	struct btree *b = bch2_btree_id_root(c, bulk->btree_id)->b;
+
+	bch2_trans_node_iter_init(trans, iter, bulk->btree_id, POS_MIN, 0,
+				  b ? b->c.level : 0, BTREE_ITER_INTENT);
+	if (!b)
+		return ERR_PTR(-BCH_ERR_btree_bulk_load_not_empty);
+
+	b = bch2_btree_iter_peek_node(iter);
+	if (IS_ERR_OR_NULL(b))
+		return b ?: ERR_PTR(-BCH_ERR_btree_bulk_load_not_empty);
+
+	if (b != btree_node_root(c, b) ||
+	    b->c.level ||
+	    b->nr.live_u64s)
+		return ERR_PTR(-BCH_ERR_btree_bulk_load_not_empty);
+
+	return b;
+}
+
+static int bulk_load_check_empty(struct btree_bulk_load *bulk)
+{
+	struct btree_iter iter;
+	int ret = PTR_ERR_OR_ZERO(bulk_load_old_root(bulk, &iter));
+
+	bch2_trans_iter_exit(bulk->trans, &iter);
+	return ret;
+}
+
+static int bulk_load_set_root(struct btree_bulk_load *bulk, struct btree *n)
+{
+	struct btree_trans *trans = bulk->trans;
+	struct btree_iter iter;
+	struct btree_update *as;
+	struct btree *b;
+	int ret;
+
+	b = bulk_load_old_root(bulk, &iter);
+	ret = PTR_ERR_OR_ZERO(b);
+	if (ret)
+		goto err;
+
+	as = bch2_btree_update_start(trans, iter.path, b->c.level,
+				     false, bulk->flags);
+	ret = PTR_ERR_OR_ZERO(as);
+	if (ret)
+		goto err;
+
+	bch2_btree_interior_update_will_free_node(as, b);
+	bch2_btree_set_root(as, trans, iter.path, n);
+	bch2_btree_node_free_inmem(trans, iter.path, b);
+	bch2_btree_update_done(as, trans);
+err:
+	bch2_trans_iter_exit(trans, &iter);
+	return ret;
+}
+
+static int bulk_load_node_alloc(struct btree_bulk_load *bulk, unsigned level,
+				struct btree **ret_b)
+{
+	struct btree_trans *trans = bulk->trans;
+	struct bch_fs *c = trans->c;
+	struct closure cl;
+	struct btree *b = NULL;
+	int ret;
+
+	ret = bch2_disk_reservation_add(c, &bulk->disk_res,
+			btree_sectors(c) * c->opts.metadata_replicas,
+			bulk->flags & BTREE_INSERT_NOFAIL
+			? BCH_DISK_RESERVATION_NOFAIL : 0);
+	if (ret)
+		return ret;
+
+	closure_init_stack(&cl);
+
+	do {
+		ret = bch2_btree_cache_cannibalize_lock(c, &cl);
+		if (!ret) {
+			b = __bch2_btree_node_alloc(trans, &bulk->disk_res, &cl,
+						    level != 0, bulk->flags);
+			ret = PTR_ERR_OR_ZERO(b);
+			bch2_btree_cache_cannibalize_unlock(c);
+		}
+
+		bch2_trans_unlock(trans);
+		closure_sync(&cl);
+	} while (bch2_err_matches(ret, BCH_ERR_operation_blocked));
+
+	if (ret)
+		return ret;
+
+	btree_node_init_new(trans, b, bulk->btree_id, level);
+	*ret_b = b;
+	return 0;
+}
+
+/*
+ * Called once @b has been written: account for it, and release our reference
+ * on its open buckets now that its pointer is marked:
+ */
+static int bulk_load_node_written(struct btree_bulk_load *bulk, struct btree *b)
+{
+	struct btree_trans *trans = bulk->trans;
+	int ret;
+
+	bch2_btree_node_wait_on_write(b);
+
+	ret = commit_do(trans, &bulk->disk_res, NULL, bulk->flags,
+			bch2_trans_mark_new(trans, bulk->btree_id,
+					    b->c.level + 1, &b->key, 0));
+
+	bch2_open_buckets_put(trans->c, &b->ob);
+	six_unlock_intent(&b->c.lock);
+	return ret;
+}
+
+static int bulk_load_write_node(struct btree_bulk_load *bulk, struct btree *b)
+{
+	int ret = 0;
+
+	bch2_btree_node_write(bulk->trans->c, b, SIX_LOCK_intent, 0);
+
+	if (bulk->nr_in_flight == ARRAY_SIZE(bulk->in_flight)) {
+		ret = bulk_load_node_written(bulk, bulk->in_flight[0]);
+		array_remove_item(bulk->in_flight, bulk->nr_in_flight, 0);
+	}
+
+	bulk->in_flight[bulk->nr_in_flight++] = b;
+	return ret;
+}
+
+static int __bulk_load_run_triggers(struct btree_trans *trans,
+				    struct btree_bulk_load *bulk,
+				    struct bkey_i *start, struct bkey_i *end)
+{
+	struct bkey_i *k;
+	int ret = 0;
+
+	for (k = start; k != end && !ret; k = bkey_next(k))
+		ret = bch2_trans_mark_new(trans, bulk->btree_id, 0, k,
+					  bulk->trigger_flags);
+	return ret;
+}
+
+static int bulk_load_run_triggers(struct btree_bulk_load *bulk,
+				  struct bkey_i *start, struct bkey_i *end)
+{
+	struct btree_trans *trans = bulk->trans;
+
+	while (start != end) {
+		struct bkey_i *batch_end = start;
+		unsigned nr = 0;
+		int ret;
+
+		while (batch_end != end && nr++ < BULK_LOAD_TRIGGERS_BATCH)
+			batch_end = bkey_next(batch_end);
+
+		ret = commit_do(trans, &bulk->disk_res, NULL, bulk->flags,
+				__bulk_load_run_triggers(trans, bulk, start, batch_end));
+		if (ret)
+			return ret;
+
+		start = batch_end;
+	}
+
+	return 0;
+}
+
+static int bulk_load_push(struct btree_bulk_load *, unsigned, struct bkey_i *);
+
+/*
+ * Pack as many keys from the front of @level's buffer as will fit into a new
+ * node - if @last is false, only if we have enough to fill a node:
+ */
+static int bulk_load_emit_node(struct btree_bulk_load *bulk, unsigned level,
+			       bool last)
+{
+	struct btree_trans *trans = bulk->trans;
+	struct bch_fs *c = trans->c;
+	struct btree_bulk_load_level *l = &bulk->l[level];
+	struct bkey_i *start	= (void *) l->keys.data;
+	struct bkey_i *end	= (void *) (l->keys.data + l->keys.nr);
+	struct bkey_i *k, *prev = NULL;
+	struct bkey_format_state s;
+	struct bkey_format f;
+	struct bkey_packed *out, packed;
+	struct bpos max_key;
+	struct btree *b;
+	struct bset *i;
+	size_t u64s = 0, max_u64s = btree_max_u64s(c) - 1;
+	int ret;
+
+	/*
+	 * A format calculated for everything we have buffered will pack any
+	 * prefix of it - use it to find how many keys fit in this node:
+	 */
+	bch2_bkey_format_init(&s);
+	bch2_bkey_format_add_pos(&s, l->min_key);
+	if (last)
+		bch2_bkey_format_add_pos(&s, SPOS_MAX);
+	for (k = start; k != end; k = bkey_next(k))
+		bch2_bkey_format_add_key(&s, &k->k);
+	f = bch2_bkey_format_done(&s);
+
+	for (k = start; k != end; prev = k, k = bkey_next(k)) {
+		unsigned k_u64s = bkey_val_u64s(&k->k) +
+			(bch2_bkey_pack_key(&packed, &k->k, &f)
+			 ? f.key_u64s : BKEY_U64s);
+
+		if (u64s + k_u64s > max_u64s)
+			break;
+		u64s += k_u64s;
+	}
+
+	if (k == end && !last) {
+		l->flush_u64s = l->keys.nr + btree_max_u64s(c) / 2;
+		return 0;
+	}
+
+	BUG_ON(!prev);
+	max_key = k == end ? SPOS_MAX : prev->k.p;
+
+	/* Now the format for just the keys going into this node: */
+	bch2_bkey_format_init(&s);
+	bch2_bkey_format_add_pos(&s, l->min_key);
+	bch2_bkey_format_add_pos(&s, max_key);
+	for (prev = start; prev != k; prev = bkey_next(prev))
+		bch2_bkey_format_add_key(&s, &prev->k);
+	f = bch2_bkey_format_done(&s);
+
+	/* Triggers may modify the keys they're run on, so run them first: */
+	if (!level && !(bulk->trigger_flags & BTREE_TRIGGER_NORUN)) {
+		ret = bulk_load_run_triggers(bulk, start, k);
+		if (ret)
+			return ret;
+	}
+
+	ret = bulk_load_node_alloc(bulk, level, &b);
+	if (ret)
+		return ret;
+
+	btree_set_min(b, l->min_key);
+	btree_set_max(b, max_key);
+	b->data->format = f;
+	btree_node_set_format(b, f);
+
+	i = btree_bset_first(b);
+	out = i->start;
+
+	for (prev = start; prev != k; prev = bkey_next(prev)) {
+		if (!bch2_bkey_pack(out, prev, &b->format))
+			bkey_copy((struct bkey_i *) out, prev);
+
+		out->needs_whiteout = false;
+		btree_keys_account_key_add(&b->nr, 0, out);
+		out = bkey_p_next(out);
+	}
+
+	i->u64s = cpu_to_le16((u64 *) out - i->_data);
+	set_btree_bset_end(b, b->set);
+	btree_node_reset_sib_u64s(b);
+	bch2_btree_build_aux_trees(b);
+	bch2_verify_btree_nr_keys(b);
+
+	if (b->key.k.type == KEY_TYPE_btree_ptr_v2) {
+		unsigned bytes = vstruct_end(&b->data->keys) - (void *) b->data;
+
+		bkey_i_to_btree_ptr_v2(&b->key)->v.sectors_written =
+			cpu_to_le16(round_up(bytes, block_bytes(c)) >> 9);
+	}
+
+	six_unlock_write(&b->c.lock);
+
+	l->keys.nr -= (u64 *) k - l->keys.data;
+	memmove(l->keys.data, k, l->keys.nr * sizeof(u64));
+	l->flush_u64s = l->keys.nr + btree_max_u64s(c);
+
+	if (!bpos_eq(max_key, SPOS_MAX))
+		l->min_key = bpos_successor(max_key);
+	l->nr_nodes++;
+
+	if (l->last)
+		six_unlock_intent(&l->last->c.lock);
+	six_lock_increment(&b->c.lock, SIX_LOCK_intent);
+	l->last = b;
+
+	return  bulk_load_write_node(bulk, b) ?:
+		bulk_load_push(bulk, level + 1, &b->key);
+}
+
+static int bulk_load_push(struct btree_bulk_load *bulk, unsigned level,
+			  struct bkey_i *k)
+{
+	struct btree_bulk_load_level *l = &bulk->l[level];
+	int ret;
+
+	BUG_ON(level >= BTREE_MAX_DEPTH);
+
+	ret = darray_make_room(&l->keys, k->k.u64s);
+	if (ret)
+		return ret;
+
+	bkey_copy((struct bkey_i *) &darray_top(l->keys), k);
+	l->keys.nr += k->k.u64s;
+
+	return l->keys.nr >= l->flush_u64s
+		? bulk_load_emit_node(bulk, level, false)
+		: 0;
+}
+
+/**
+ * bch2_btree_bulk_load_add - add the next key to a bulk load
+ *
+ * Keys must be added in strictly increasing order; deleted keys are skipped.
+ */
+int bch2_btree_bulk_load_add(struct btree_bulk_load *bulk, struct bkey_i *k)
+{
+	if (bkey_deleted(&k->k))
+		return 0;
+
+	if (bulk->nr_keys && !bpos_gt(k->k.p, bulk->last_pos))
+		return -BCH_ERR_btree_bulk_load_unsorted;
+
+	bulk->last_pos = k->k.p;
+	bulk->nr_keys++;
+
+	return bulk_load_push(bulk, 0, k);
+}
+
+/**
+ * bch2_btree_bulk_load_finish - write out the remaining nodes, and make the
+ * new btree visible
+ */
+int bch2_btree_bulk_load_finish(struct btree_bulk_load *bulk)
+{
+	struct btree *root = NULL;
+	unsigned level;
+	int ret = 0;
+
+	if (!bulk->nr_keys)
+		return 0;
+
+	for (level = 0; level < BTREE_MAX_DEPTH; level++) {
+		struct btree_bulk_load_level *l = &bulk->l[level];
+
+		while (l->keys.nr) {
+			ret = bulk_load_emit_node(bulk, level, true);
+			if (ret)
+				return ret;
+		}
+
+		if (l->nr_nodes == 1) {
+			root = l->last;
+			l->last = NULL;
+			break;
+		}
+	}
+
+	BUG_ON(!root);
+
+	/* The new root's pointer isn't going in a parent node: */
+	if (level + 1 < BTREE_MAX_DEPTH)
+		bulk->l[level + 1].keys.nr = 0;
+
+	while (!ret && bulk->nr_in_flight) {
+		ret = bulk_load_node_written(bulk, bulk->in_flight[0]);
+		array_remove_item(bulk->in_flight, bulk->nr_in_flight, 0);
+	}
+
+	if (!ret)
+		ret = lockrestart_do(bulk->trans, bulk_load_set_root(bulk, root));
+
+	six_unlock_intent(&root->c.lock);
+	return ret;
+}
+
+void bch2_btree_bulk_load_exit(struct btree_bulk_load *bulk)
+{
+	struct bch_fs *c = bulk->trans->c;
+	unsigned i;
+
+	/* After an error, nodes we've written are left unreachable: */
+	while (bulk->nr_in_flight) {
+		struct btree *b = bulk->in_flight[--bulk->nr_in_flight];
+
+		bch2_btree_node_wait_on_write(b);
+		bch2_open_buckets_put(c, &b->ob);
+		six_unlock_intent(&b->c.lock);
+	}
+
+	for (i = 0; i < BTREE_MAX_DEPTH; i++) {
+		if (bulk->l[i].last)
+			six_unlock_intent(&bulk->l[i].last->c.lock);
+		darray_exit(&bulk->l[i].keys);
+	}
+
+	bch2_disk_reservation_put(c, &bulk->disk_res);
+
+	if (bulk->took_gc_lock)
+		up_read(&c->gc_lock);
+	bulk->took_gc_lock = false;
+}
+
+/**
+ * bch2_btree_bulk_load_start - start loading keys into an empty btree
+ *
+ * The caller is responsible for there being no other updates to @btree_id -
+ * including dirty keys in the key cache - until the bulk load has finished.
+ * @trigger_flags are passed to the triggers run on each key: pass
+ * BTREE_TRIGGER_NORUN for keys whose side effects are already accounted for.
+ */
+int bch2_btree_bulk_load_start(struct btree_trans *trans,
+			       struct btree_bulk_load *bulk,
+			       enum btree_id btree_id,
+			       unsigned flags,
+			       unsigned trigger_flags)
+{
+	struct bch_fs *c = trans->c;
+	unsigned i;
+	int ret;
+
+	if ((flags & BCH_WATERMARK_MASK) < BCH_WATERMARK_btree) {
+		flags &= ~BCH_WATERMARK_MASK;
+		flags |= BCH_WATERMARK_btree;
+	}
+
+	memset(bulk, 0, sizeof(*bulk));
+	bulk->trans		= trans;
+	bulk->btree_id		= btree_id;
+	bulk->flags		= flags|BTREE_INSERT_GC_LOCK_HELD;
+	bulk->trigger_flags	= trigger_flags;
+	bulk->disk_res		= bch2_disk_reservation_init(c, c->opts.metadata_replicas);
+
+	for (i = 0; i < BTREE_MAX_DEPTH; i++)
+		bulk->l[i].flush_u64s = btree_max_u64s(c);
+
+	/*
+	 * Nodes we've written and accounted for aren't reachable until we're
+	 * done - gc mustn't run until then:
+	 */
+	bch2_trans_unlock(trans);
+	down_read(&c->gc_lock);
+	bulk->took_gc_lock = true;
+
+	ret = lockrestart_do(trans, bulk_load_check_empty(bulk));
+	if (ret)
+		bch2_btree_bulk_load_exit(bulk);
+	return ret;
+}
+
 /* Init code: */
 
 /*
@@ -9,6 +9,7 @@
 void __bch2_btree_calc_format(struct bkey_format_state *, struct btree *);
 bool bch2_btree_node_format_fits(struct bch_fs *c, struct btree *,
 				struct bkey_format *);
+size_t bch2_btree_node_format_savings(struct btree *);
 
 #define BTREE_UPDATE_NODES_MAX		((BTREE_MAX_DEPTH - 2) * 2 + GC_MERGE_NODES)
 
@@ -157,6 +158,50 @@ static inline int bch2_foreground_maybe_merge(struct btree_trans *trans,
 void bch2_btree_set_root_for_read(struct bch_fs *, struct btree *);
 void bch2_btree_root_alloc(struct bch_fs *, enum btree_id);
 
+/*
+ * Bulk loading: builds a btree bottom up from a stream of keys in sorted order,
+ * then swaps it in as the new root of a btree that must be empty:
+ */
+struct btree_bulk_load_level {
+	/* Keys (child pointers, for interior levels) not yet in a node: */
+	darray_u64		keys;
+	/* Try to emit a node when we have this many u64s buffered: */
+	size_t			flush_u64s;
+	struct bpos		min_key;
+	u64			nr_nodes;
+	/* Most recent node emitted at this level, intent locked: */
+	struct btree		*last;
+};
+
+struct btree_bulk_load {
+	struct btree_trans	*trans;
+	enum btree_id		btree_id;
+	unsigned		flags;
+	unsigned		trigger_flags;
+	bool			took_gc_lock;
+
+	u64			nr_keys;
+	struct bpos		last_pos;
+
+	/*
+	 * Reserved for new btree nodes as they're allocated; callers loading
+	 * keys whose triggers account for disk space should add to it:
+	 */
+	struct disk_reservation	disk_res;
+
+	struct btree_bulk_load_level l[BTREE_MAX_DEPTH];
+
+	/* Nodes being written, oldest first: */
+	struct btree		*in_flight[16];
+	unsigned		nr_in_flight;
+};
+
+int bch2_btree_bulk_load_add(struct btree_bulk_load *, struct bkey_i *);
+int bch2_btree_bulk_load_finish(struct btree_bulk_load *);
+void bch2_btree_bulk_load_exit(struct btree_bulk_load *);
+int bch2_btree_bulk_load_start(struct btree_trans *, struct btree_bulk_load *,
+			       enum btree_id, unsigned, unsigned);
+
 static inline unsigned btree_update_reserve_required(struct bch_fs *c,
 						     struct btree *b)
 {
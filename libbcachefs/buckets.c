@@ -17,6 +17,7 @@
 #include "error.h"
 #include "inode.h"
 #include "movinggc.h"
+#include "rebalance.h"
 #include "recovery.h"
 #include "reflink.h"
 #include "replicas.h"
@@ -563,6 +564,10 @@ int bch2_mark_alloc(struct btree_trans *trans,
 
 	bch2_dev_usage_update(c, ca, *old_a, *new_a, journal_seq, gc);
 
+	if (!gc && old_a->fragmentation_lru != new_a->fragmentation_lru)
+		bch2_copygc_frag_update(ca, new.k->p.offset,
+					new_a->fragmentation_lru);
+
 	if (gc) {
 		struct bucket *g = gc_bucket(ca, new.k->p.offset);
 
@@ -1515,6 +1520,10 @@ int bch2_trans_mark_extent(struct btree_trans *trans,
 	if (r.e.nr_devs)
 		ret = update_replicas_list(trans, &r.e, dirty_sectors);
 
+	if (!ret && !level &&
+	    (btree_id == BTREE_ID_extents || btree_id == BTREE_ID_reflink))
+		ret = bch2_trans_mark_rebalance_work(trans, btree_id, k, flags);
+
 	return ret;
 }
 
@@ -2056,6 +2065,9 @@ int bch2_dev_buckets_resize(struct bch_fs *c, struct bch_dev *ca, u64 nbuckets)
 
 	swap(ca->buckets_nouse, buckets_nouse);
 
+	/* copygc will rebuild it at the new size: */
+	bch2_dev_copygc_frag_free(ca);
+
 	nbuckets = ca->mi.nbuckets;
 
 	if (resize) {
@@ -2078,6 +2090,7 @@ void bch2_dev_buckets_free(struct bch_dev *ca)
 {
 	unsigned i;
 
+	bch2_dev_copygc_frag_free(ca);
 	kvpfree(ca->buckets_nouse,
 		BITS_TO_LONGS(ca->mi.nbuckets) * sizeof(unsigned long));
 	kvpfree(rcu_dereference_protected(ca->bucket_gens, 1),
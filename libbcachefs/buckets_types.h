@@ -32,6 +32,27 @@ struct bucket_gens {
 	u8			b[];
 };
 
+/*
+ * Buckets copygc might want to evacuate, binned by fragmentation_lru (i.e. by
+ * dirty sectors) so that copygc can take the emptiest without walking the LRU
+ * btree: each bin is a list threaded through per bucket next/prev arrays.
+ * Kept up to date by bch2_mark_alloc(), see movinggc.c:
+ */
+#define COPYGC_FRAG_BINS	64
+
+struct copygc_frag_histogram {
+	struct rcu_head		rcu;
+	spinlock_t		lock;
+	size_t			bytes;
+	size_t			nbuckets;
+	u64			nr[COPYGC_FRAG_BINS];
+	u32			head[COPYGC_FRAG_BINS];
+	u32			*next;
+	u32			*prev;
+	/* 0 if not present, else bin + 1; high bit set if held by copygc */
+	u8			*bin;
+};
+
 struct bch_dev_usage {
 	u64			buckets_ec;
 
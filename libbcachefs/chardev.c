@@ -328,17 +328,32 @@ static ssize_t bch2_data_job_read(struct file *file, char __user *buf,
 	struct bch_fs *c = ctx->c;
 	struct bch_ioctl_data_event e = {
 		.type			= BCH_DATA_EVENT_PROGRESS,
-		.p.data_type		= ctx->stats.data_type,
-		.p.btree_id		= ctx->stats.btree_id,
-		.p.pos			= ctx->stats.pos,
-		.p.sectors_done		= atomic64_read(&ctx->stats.sectors_seen),
 		.p.sectors_total	= bch2_fs_usage_read_short(c).used,
 	};
+	struct bch_ioctl_data_shard_progress *shards;
+	unsigned nr_shards;
+	size_t bytes;
+	int ret;
 
 	if (len < sizeof(e))
 		return -EINVAL;
 
-	return copy_to_user(buf, &e, sizeof(e)) ?: sizeof(e);
+	/* Per shard progress, if there's room: */
+	nr_shards = (len - sizeof(e)) / sizeof(*shards);
+	nr_shards = min_t(unsigned, nr_shards, U8_MAX);
+
+	shards = kcalloc(nr_shards, sizeof(*shards), GFP_KERNEL);
+	if (!shards && nr_shards)
+		return -ENOMEM;
+
+	nr_shards = bch2_data_job_progress(c, &ctx->stats, &e.p, shards, nr_shards);
+	bytes = sizeof(*shards) * nr_shards;
+
+	ret = copy_to_user(buf, &e, sizeof(e)) ?:
+		copy_to_user(buf + sizeof(e), shards, bytes) ?:
+		sizeof(e) + bytes;
+	kfree(shards);
+	return ret;
 }
 
 static const struct file_operations bcachefs_data_ops = {
@@ -150,28 +150,25 @@ static inline void zlib_set_workspace(z_stream *strm, void *workspace)
 #endif
 }
 
-static int __bio_uncompress(struct bch_fs *c, struct bio *src,
-			    void *dst_data, struct bch_extent_crc_unpacked crc)
+static int __uncompress(struct bch_fs *c,
+			void *dst_data, size_t dst_len,
+			void *src_data, size_t src_len,
+			enum bch_compression_type type)
 {
-	struct bbuf src_data = { NULL };
-	size_t src_len = src->bi_iter.bi_size;
-	size_t dst_len = crc.uncompressed_size << 9;
 	void *workspace;
 	int ret;
 
-	src_data = bio_map_or_bounce(c, src, READ);
-
-	switch (crc.compression_type) {
+	switch (type) {
 	case BCH_COMPRESSION_TYPE_lz4_old:
 	case BCH_COMPRESSION_TYPE_lz4:
-		ret = LZ4_decompress_safe_partial(src_data.b, dst_data,
+		ret = LZ4_decompress_safe_partial(src_data, dst_data,
 						  src_len, dst_len, dst_len);
 		if (ret != dst_len)
-			goto err;
+			return -EIO;
 		break;
 	case BCH_COMPRESSION_TYPE_gzip: {
 		z_stream strm = {
-			.next_in	= src_data.b,
+			.next_in	= src_data,
 			.avail_in	= src_len,
 			.next_out	= dst_data,
 			.avail_out	= dst_len,
@@ -186,39 +183,54 @@ static int __bio_uncompress(struct bch_fs *c, struct bio *src,
 		mempool_free(workspace, &c->decompress_workspace);
 
 		if (ret != Z_STREAM_END)
-			goto err;
+			return -EIO;
 		break;
 	}
 	case BCH_COMPRESSION_TYPE_zstd: {
 		ZSTD_DCtx *ctx;
-		size_t real_src_len = le32_to_cpup(src_data.b);
+		size_t real_src_len;
+
+		if (src_len < 4)
+			return -EIO;
 
+		real_src_len = le32_to_cpup(src_data);
 		if (real_src_len > src_len - 4)
-			goto err;
+			return -EIO;
 
 		workspace = mempool_alloc(&c->decompress_workspace, GFP_NOFS);
 		ctx = zstd_init_dctx(workspace, zstd_dctx_workspace_bound());
 
 		ret = zstd_decompress_dctx(ctx,
 				dst_data,	dst_len,
-				src_data.b + 4, real_src_len);
+				src_data + 4,	real_src_len);
 
 		mempool_free(workspace, &c->decompress_workspace);
 
 		if (ret != dst_len)
-			goto err;
+			return -EIO;
 		break;
 	}
 	default:
 		BUG();
 	}
-	ret = 0;
-out:
+
+	return 0;
+}
+
+static int __bio_uncompress(struct bch_fs *c, struct bio *src,
+			    void *dst_data, struct bch_extent_crc_unpacked crc)
+{
+	struct bbuf src_data = { NULL };
+	int ret;
+
+	src_data = bio_map_or_bounce(c, src, READ);
+
+	ret = __uncompress(c, dst_data, crc.uncompressed_size << 9,
+			   src_data.b, src->bi_iter.bi_size,
+			   crc.compression_type);
+
 	bio_unmap_or_unbounce(c, src_data);
 	return ret;
-err:
-	ret = -EIO;
-	goto out;
 }
 
 int bch2_bio_uncompress_inplace(struct bch_fs *c, struct bio *bio,
@@ -505,6 +517,53 @@ unsigned bch2_bio_compress(struct bch_fs *c,
 	return compression_type;
 }
 
+/*
+ * Compression of plain buffers, for metadata (btree node bsets) - unlike the
+ * bio paths, if the result doesn't fit in @dst_len we just return 0, and the
+ * caller writes it uncompressed:
+ */
+size_t bch2_compress_buf(struct bch_fs *c,
+			 void *dst, size_t dst_len,
+			 void *src, size_t src_len,
+			 unsigned compression_opt)
+{
+	struct bch_compression_opt opt = bch2_compression_decode(compression_opt);
+	enum bch_compression_type type = __bch2_compression_opt_to_type[opt.type];
+	void *workspace;
+	int ret;
+
+	if (type == BCH_COMPRESSION_TYPE_none ||
+	    !mempool_initialized(&c->compress_workspace[type]))
+		return 0;
+
+	workspace = mempool_alloc(&c->compress_workspace[type], GFP_NOFS);
+	ret = attempt_compress(c, workspace, dst, dst_len, src, src_len, opt);
+	mempool_free(workspace, &c->compress_workspace[type]);
+
+	return max(ret, 0);
+}
+
+int bch2_uncompress_buf(struct bch_fs *c,
+			void *dst, size_t dst_len,
+			void *src, size_t src_len,
+			enum bch_compression_type type)
+{
+	switch (type) {
+	case BCH_COMPRESSION_TYPE_lz4_old:
+	case BCH_COMPRESSION_TYPE_lz4:
+		break;
+	case BCH_COMPRESSION_TYPE_gzip:
+	case BCH_COMPRESSION_TYPE_zstd:
+		if (!mempool_initialized(&c->decompress_workspace))
+			return -EIO;
+		break;
+	default:
+		return -EIO;
+	}
+
+	return __uncompress(c, dst, dst_len, src, src_len, type);
+}
+
 static int __bch2_fs_compress_init(struct bch_fs *, u64);
 
 #define BCH_FEATURE_none	0
@@ -652,6 +711,7 @@ int bch2_fs_compress_init(struct bch_fs *c)
 
 	f |= compression_opt_to_feature(c->opts.compression);
 	f |= compression_opt_to_feature(c->opts.background_compression);
+	f |= compression_opt_to_feature(c->opts.metadata_compression);
 
 	return __bch2_fs_compress_init(c, f);
 }
@@ -40,6 +40,11 @@ int bch2_bio_uncompress(struct bch_fs *, struct bio *, struct bio *,
 unsigned bch2_bio_compress(struct bch_fs *, struct bio *, size_t *,
 			   struct bio *, size_t *, unsigned);
 
+size_t bch2_compress_buf(struct bch_fs *, void *, size_t,
+			 void *, size_t, unsigned);
+int bch2_uncompress_buf(struct bch_fs *, void *, size_t,
+			void *, size_t, enum bch_compression_type);
+
 int bch2_check_set_has_compressed_data(struct bch_fs *, unsigned);
 void bch2_fs_compress_exit(struct bch_fs *);
 int bch2_fs_compress_init(struct bch_fs *);
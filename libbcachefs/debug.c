@@ -85,15 +85,22 @@ static bool bch2_btree_verify_replica(struct bch_fs *c, struct btree *b,
 		while (offset < v->written) {
 			if (!offset) {
 				i = &n_ondisk->keys;
-				sectors = vstruct_blocks(n_ondisk, c->block_bits) <<
-					c->block_bits;
+				sectors = bset_span_sectors(c, n_ondisk, i);
 			} else {
 				struct btree_node_entry *bne =
 					(void *) n_ondisk + (offset << 9);
 				i = &bne->keys;
 
-				sectors = vstruct_blocks(bne, c->block_bits) <<
-					c->block_bits;
+				sectors = bset_span_sectors(c, bne, i);
+			}
+
+			if (BSET_COMPRESSION_TYPE(i) &&
+			    (bset_encrypt(c, i, offset << 9) ||
+			     bch2_bset_decompress(c, n_ondisk, i))) {
+				printk(KERN_ERR "*** on disk block %u: error decompressing\n",
+				       offset);
+				offset += sectors;
+				continue;
 			}
 
 			printk(KERN_ERR "*** on disk block %u:\n", offset);
@@ -248,7 +255,7 @@ void bch2_btree_node_ondisk_to_text(struct printbuf *out, struct bch_fs *c,
 
 			bset_encrypt(c, i, offset << 9);
 
-			sectors = vstruct_sectors(n_ondisk, c->block_bits);
+			sectors = bset_span_sectors(c, n_ondisk, i);
 		} else {
 			struct btree_node_entry *bne = (void *) n_ondisk + (offset << 9);
 
@@ -273,15 +280,28 @@ void bch2_btree_node_ondisk_to_text(struct printbuf *out, struct bch_fs *c,
 
 			bset_encrypt(c, i, offset << 9);
 
-			sectors = vstruct_sectors(bne, c->block_bits);
+			sectors = bset_span_sectors(c, bne, i);
 		}
 
-		prt_printf(out, "  offset %u version %u, journal seq %llu\n",
+		prt_printf(out, "  offset %u version %u, journal seq %llu",
 			   offset,
 			   le16_to_cpu(i->version),
 			   le64_to_cpu(i->journal_seq));
+		if (BSET_COMPRESSION_TYPE(i))
+			prt_printf(out, ", compressed %zu bytes",
+				   vstruct_bytes(i));
+		prt_newline(out);
 		offset += sectors;
 
+		if (BSET_COMPRESSION_TYPE(i)) {
+			ret = bch2_bset_decompress(c, n_ondisk, i);
+			if (ret) {
+				prt_printf(out, "error decompressing bset: %s\n",
+					   bch2_err_str(ret));
+				goto out;
+			}
+		}
+
 		printbuf_indent_add(out, 4);
 
 		for (k = i->start; k != vstruct_last(i); k = bkey_p_next(k)) {
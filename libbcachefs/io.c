@@ -668,6 +668,7 @@ void bch2_submit_wbio_replicas(struct bch_write_bio *wbio, struct bch_fs *c,
 			n->split		= true;
 			n->bounce		= false;
 			n->put_bio		= true;
+			n->move			= wbio->move;
 			n->bio.bi_opf		= wbio->bio.bi_opf;
 			bio_inc_remaining(&wbio->bio);
 		} else {
@@ -688,6 +689,9 @@ void bch2_submit_wbio_replicas(struct bch_write_bio *wbio, struct bch_fs *c,
 			this_cpu_add(ca->io_done->sectors[WRITE][type],
 				     bio_sectors(&n->bio));
 
+			if (n->move)
+				atomic_inc(&ca->move_ios_in_flight[WRITE]);
+
 			bio_set_dev(&n->bio, ca->disk_sb.bdev);
 
 			if (type != BCH_DATA_btree && unlikely(c->opts.no_data_io)) {
@@ -770,6 +774,8 @@ static void __bch2_write_index(struct bch_write_op *op)
 	 * probably not the ideal place to hook this in, but I don't
 	 * particularly want to plumb io_opts all the way through the btree
 	 * update stack right now
+	 *
+	 * The rebalance_work index itself is updated by the extent trigger:
 	 */
 	for_each_keylist_key(keys, k)
 		bch2_rebalance_add_key(c, bkey_i_to_s_c(k), &op->opts);
@@ -918,6 +924,8 @@ static void bch2_write_endio(struct bio *bio)
 
 	if (wbio->have_ioref) {
 		bch2_latency_acct(ca, wbio->submit_time, WRITE);
+		if (wbio->move)
+			bch2_move_dev_io_done(c, ca, WRITE);
 		percpu_ref_put(&ca->io_ref);
 	}
 
@@ -1589,6 +1597,7 @@ retry:
 		bio->bi_private	= &op->cl;
 		bio->bi_opf |= REQ_OP_WRITE;
 		closure_get(&op->cl);
+		to_wbio(bio)->move = (op->flags & BCH_WRITE_MOVE) != 0;
 		bch2_submit_wbio_replicas(to_wbio(bio), c, BCH_DATA_user,
 					  op->insert_keys.top, true);
 
@@ -1735,6 +1744,7 @@ err:
 		key_to_write = (void *) (op->insert_keys.keys_p +
 					 key_to_write_offset);
 
+		to_wbio(bio)->move = (op->flags & BCH_WRITE_MOVE) != 0;
 		bch2_submit_wbio_replicas(to_wbio(bio), c, BCH_DATA_user,
 					  key_to_write, false);
 	} while (ret);
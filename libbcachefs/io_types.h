@@ -99,7 +99,8 @@ struct bch_write_bio {
 				have_ioref:1,
 				nocow:1,
 				used_mempool:1,
-				first_btree_write:1;
+				first_btree_write:1,
+				move:1;
 	);
 
 	struct bio		bio;
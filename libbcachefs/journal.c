@@ -133,10 +133,32 @@ journal_error_check_stuck(struct journal *j, int error, unsigned flags)
 
 /* journal entry close/open: */
 
-void __bch2_journal_buf_put(struct journal *j)
+static int journal_buf_refs(struct journal *j, unsigned idx)
+{
+	union journal_res_state s = READ_ONCE(j->reservations);
+
+	return s.idx == idx ? s.buf_count : atomic_read(&j->buf[idx].res_count);
+}
+
+/*
+ * Journal writes are issued one at a time, in order: start the write of the
+ * oldest unwritten entry, if it's been closed and all its references have been
+ * released:
+ */
+void bch2_journal_write_next(struct journal *j)
 {
 	struct bch_fs *c = container_of(j, struct bch_fs, journal);
+	u64 seq = journal_last_unwritten_seq(j);
+	struct journal_buf *w = j->buf + (seq & JOURNAL_BUF_MASK);
 
+	lockdep_assert_held(&j->lock);
+
+	if (seq > journal_cur_seq(j) ||
+	    w->write_started ||
+	    journal_buf_refs(j, seq & JOURNAL_BUF_MASK))
+		return;
+
+	w->write_started = true;
 	closure_call(&j->io, bch2_journal_write, c->io_complete_wq, NULL);
 }
 
@@ -209,7 +231,8 @@ static void __journal_entry_close(struct journal *j, unsigned closed_val)
 
 	bch2_journal_space_available(j);
 
-	bch2_journal_buf_put(j, old.idx);
+	if (__bch2_journal_buf_put(j, old.idx))
+		bch2_journal_write_next(j);
 }
 
 void bch2_journal_halt(struct journal *j)
@@ -282,7 +305,9 @@ static int journal_entry_open(struct journal *j)
 	if (!fifo_free(&j->pin))
 		return JOURNAL_ERR_journal_pin_full;
 
-	if (nr_unwritten_journal_entries(j) == ARRAY_SIZE(j->buf))
+	if (nr_unwritten_journal_entries(j) >=
+	    min_t(unsigned, READ_ONCE(c->opts.journal_max_in_flight),
+		  ARRAY_SIZE(j->buf)))
 		return JOURNAL_ERR_max_in_flight;
 
 	BUG_ON(!j->cur_entry_sectors);
@@ -316,7 +341,10 @@ static int journal_entry_open(struct journal *j)
 
 	BUG_ON(j->buf + (journal_cur_seq(j) & JOURNAL_BUF_MASK) != buf);
 
+	BUG_ON(atomic_read(&buf->res_count));
+
 	bkey_extent_init(&buf->key);
+	buf->write_started = false;
 	buf->noflush	= false;
 	buf->must_flush	= false;
 	buf->separate_flush = false;
@@ -344,16 +372,21 @@ static int journal_entry_open(struct journal *j)
 		BUG_ON(old.cur_entry_offset == JOURNAL_ENTRY_ERROR_VAL);
 
 		new.idx++;
-		BUG_ON(journal_state_count(new, new.idx));
 		BUG_ON(new.idx != (journal_cur_seq(j) & JOURNAL_BUF_MASK));
 
-		journal_state_inc(&new);
+		/* The open entry holds a ref, dropped when it's closed: */
+		new.buf_count = 1;
 
 		/* Handle any already added entries */
 		new.cur_entry_offset = le32_to_cpu(buf->data->u64s);
 	} while ((v = atomic64_cmpxchg(&j->reservations.counter,
 				       old.v, new.v)) != old.v);
 
+	/* Puts on the previous buf now go to its res_count: */
+	if (old.buf_count &&
+	    !atomic_add_return(old.buf_count, &j->buf[old.idx].res_count))
+		bch2_journal_write_next(j);
+
 	if (j->res_get_blocked_start)
 		bch2_time_stats_update(j->blocked_time,
 				       j->res_get_blocked_start);
@@ -1131,8 +1164,7 @@ int bch2_fs_journal_start(struct journal *j, u64 cur_seq)
 	set_bit(JOURNAL_STARTED, &j->flags);
 	j->last_flush_write = jiffies;
 
-	j->reservations.idx = j->reservations.unwritten_idx = journal_cur_seq(j);
-	j->reservations.unwritten_idx++;
+	j->reservations.idx = journal_cur_seq(j);
 
 	c->last_bucket_seq_cleanup = journal_cur_seq(j);
 
@@ -1317,7 +1349,7 @@ void __bch2_journal_debug_to_text(struct printbuf *out, struct journal *j)
 
 		prt_printf(out, "refcount:");
 		prt_tab(out);
-		prt_printf(out, "%u", journal_state_count(s, i));
+		prt_printf(out, "%i", journal_buf_refs(j, i));
 		prt_newline(out);
 
 		prt_printf(out, "sectors:");
@@ -146,25 +146,6 @@ static inline u64 journal_last_unwritten_seq(struct journal *j)
 	return j->seq_ondisk + 1;
 }
 
-static inline int journal_state_count(union journal_res_state s, int idx)
-{
-	switch (idx) {
-	case 0: return s.buf0_count;
-	case 1: return s.buf1_count;
-	case 2: return s.buf2_count;
-	case 3: return s.buf3_count;
-	}
-	BUG();
-}
-
-static inline void journal_state_inc(union journal_res_state *s)
-{
-	s->buf0_count += s->idx == 0;
-	s->buf1_count += s->idx == 1;
-	s->buf2_count += s->idx == 2;
-	s->buf3_count += s->idx == 3;
-}
-
 /*
  * Amount of space that will be taken up by some keys in the journal (i.e.
  * including the jset header)
@@ -252,21 +233,41 @@ static inline bool journal_entry_empty(struct jset *j)
 	return true;
 }
 
-void __bch2_journal_buf_put(struct journal *);
+void bch2_journal_write_next(struct journal *);
 
-static inline void bch2_journal_buf_put(struct journal *j, unsigned idx)
+/*
+ * Drop a reference on a journal_buf, returns true if it was the last one:
+ *
+ * While @idx is the current journal_buf its refcount lives in j->reservations;
+ * journal_entry_open() moves it to journal_buf->res_count after switching to
+ * the next buf. Puts that land in between take res_count negative, and the
+ * transfer brings it back to zero if they were the last references.
+ */
+static inline bool __bch2_journal_buf_put(struct journal *j, unsigned idx)
 {
-	union journal_res_state s;
+	union journal_res_state old, new;
+	u64 v = atomic64_read(&j->reservations.counter);
+
+	do {
+		old.v = new.v = v;
+
+		if (old.idx != idx)
+			return atomic_dec_and_test(&j->buf[idx].res_count);
+
+		new.buf_count--;
+	} while ((v = atomic64_cmpxchg(&j->reservations.counter,
+				       old.v, new.v)) != old.v);
 
-	s.v = atomic64_sub_return(((union journal_res_state) {
-				    .buf0_count = idx == 0,
-				    .buf1_count = idx == 1,
-				    .buf2_count = idx == 2,
-				    .buf3_count = idx == 3,
-				    }).v, &j->reservations.counter);
+	return !new.buf_count;
+}
 
-	if (!journal_state_count(s, idx) && idx == s.unwritten_idx)
-		__bch2_journal_buf_put(j);
+static inline void bch2_journal_buf_put(struct journal *j, unsigned idx)
+{
+	if (__bch2_journal_buf_put(j, idx)) {
+		spin_lock(&j->lock);
+		bch2_journal_write_next(j);
+		spin_unlock(&j->lock);
+	}
 }
 
 /*
@@ -320,19 +321,19 @@ static inline int journal_res_get_fast(struct journal *j,
 		if (new.cur_entry_offset + res->u64s > j->cur_entry_u64s)
 			return 0;
 
-		EBUG_ON(!journal_state_count(new, new.idx));
+		EBUG_ON(!new.buf_count);
 
 		if ((flags & BCH_WATERMARK_MASK) < j->watermark)
 			return 0;
 
 		new.cur_entry_offset += res->u64s;
-		journal_state_inc(&new);
+		new.buf_count++;
 
 		/*
 		 * If the refcount would overflow, we have to wait:
 		 * XXX - tracepoint this:
 		 */
-		if (!journal_state_count(new, new.idx))
+		if (!new.buf_count)
 			return 0;
 
 		if (flags & JOURNAL_RES_GET_CHECK)
@@ -1306,6 +1306,29 @@ fsck_err:
 
 /* journal write: */
 
+/*
+ * Journal writes go to devices round robin, starting after the last device the
+ * previous write went to, so that journal IO is spread evenly across devices:
+ */
+static struct dev_alloc_list journal_dev_alloc_list(struct journal *j,
+						    struct bch_devs_mask *devs)
+{
+	struct dev_alloc_list ret = { .nr = 0 };
+	unsigned i;
+
+	for_each_set_bit(i, devs->d, BCH_SB_MEMBERS_MAX)
+		if (i >= j->next_dev)
+			ret.devs[ret.nr++] = i;
+
+	for_each_set_bit(i, devs->d, BCH_SB_MEMBERS_MAX) {
+		if (i >= j->next_dev)
+			break;
+		ret.devs[ret.nr++] = i;
+	}
+
+	return ret;
+}
+
 static void __journal_write_alloc(struct journal *j,
 				  struct journal_buf *w,
 				  struct dev_alloc_list *devs_sorted,
@@ -1339,7 +1362,7 @@ static void __journal_write_alloc(struct journal *j,
 		    sectors > ja->sectors_free)
 			continue;
 
-		bch2_dev_stripe_increment(ca, &j->wp.stripe);
+		j->next_dev = ca->dev_idx + 1;
 
 		bch2_bkey_append_ptr(&w->key,
 			(struct bch_extent_ptr) {
@@ -1380,7 +1403,7 @@ static int journal_write_alloc(struct journal *j, struct journal_buf *w,
 retry:
 	devs = target_rw_devs(c, BCH_DATA_journal, target);
 
-	devs_sorted = bch2_dev_alloc_list(c, &j->wp.stripe, &devs);
+	devs_sorted = journal_dev_alloc_list(j, &devs);
 
 	__journal_write_alloc(j, w, &devs_sorted,
 			      sectors, &replicas, replicas_want);
@@ -1459,8 +1482,7 @@ static void journal_write_done(struct closure *cl)
 	struct journal *j = container_of(cl, struct journal, io);
 	struct bch_fs *c = container_of(j, struct bch_fs, journal);
 	struct journal_buf *w = journal_last_unwritten_buf(j);
-	union journal_res_state old, new;
-	u64 v, seq;
+	u64 seq;
 	int err = 0;
 
 	bch2_time_stats_update(!JSET_NO_FLUSH(w->data)
@@ -1508,25 +1530,15 @@ static void journal_write_done(struct closure *cl)
 	/* also must come before signalling write completion: */
 	closure_debug_destroy(cl);
 
-	v = atomic64_read(&j->reservations.counter);
-	do {
-		old.v = new.v = v;
-		BUG_ON(journal_state_count(new, new.unwritten_idx));
-
-		new.unwritten_idx++;
-	} while ((v = atomic64_cmpxchg(&j->reservations.counter,
-				       old.v, new.v)) != old.v);
-
 	bch2_journal_space_available(j);
 
 	closure_wake_up(&w->wait);
 	journal_wake(j);
 
-	if (!journal_state_count(new, new.unwritten_idx) &&
-	    journal_last_unwritten_seq(j) <= journal_cur_seq(j)) {
-		closure_call(&j->io, bch2_journal_write, c->io_complete_wq, NULL);
-	} else if (journal_last_unwritten_seq(j) == journal_cur_seq(j) &&
-		   new.cur_entry_offset < JOURNAL_ENTRY_CLOSED_VAL) {
+	bch2_journal_write_next(j);
+
+	if (journal_last_unwritten_seq(j) == journal_cur_seq(j) &&
+	    j->reservations.cur_entry_offset < JOURNAL_ENTRY_CLOSED_VAL) {
 		struct journal_buf *buf = journal_cur_buf(j);
 		long delta = buf->expires - jiffies;
 
@@ -653,7 +653,7 @@ static int __bch2_journal_reclaim(struct journal *j, bool direct, bool kicked)
 				j->prereserved.remaining,
 				atomic_read(&c->btree_cache.dirty),
 				c->btree_cache.used,
-				atomic_long_read(&c->btree_key_cache.nr_dirty),
+				bch2_btree_key_cache_nr_dirty_approx(c),
 				atomic_long_read(&c->btree_key_cache.nr_keys));
 
 		nr_flushed = journal_flush_pins(j, seq_to_flush,
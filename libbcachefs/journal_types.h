@@ -9,7 +9,8 @@
 #include "super_types.h"
 #include "fifo.h"
 
-#define JOURNAL_BUF_BITS	2
+/* Upper bound on the journal_max_in_flight option: */
+#define JOURNAL_BUF_BITS	3
 #define JOURNAL_BUF_NR		(1U << JOURNAL_BUF_BITS)
 #define JOURNAL_BUF_MASK	(JOURNAL_BUF_NR - 1)
 
@@ -33,6 +34,12 @@ struct journal_buf {
 	unsigned		disk_sectors;	/* maximum size entry could have been, if
 						   buf_size was bigger */
 	unsigned		u64s_reserved;
+	/*
+	 * References held on this buffer once it's no longer the current
+	 * journal_buf: may go transiently negative, see bch2_journal_buf_put()
+	 */
+	atomic_t		res_count;
+	bool			write_started;
 	bool			noflush;	/* write has already been kicked off, and was noflush */
 	bool			must_flush;	/* something wants a flush */
 	bool			separate_flush;
@@ -93,14 +100,15 @@ union journal_res_state {
 		u64		v;
 	};
 
+	/*
+	 * Only the current journal_buf's refcount lives here, so that getting a
+	 * reservation is a single cmpxchg; when the next entry is opened it's
+	 * moved to journal_buf->res_count:
+	 */
 	struct {
 		u64		cur_entry_offset:20,
-				idx:2,
-				unwritten_idx:2,
-				buf0_count:10,
-				buf1_count:10,
-				buf2_count:10,
-				buf3_count:10;
+				idx:JOURNAL_BUF_BITS,
+				buf_count:20;
 	};
 };
 
@@ -208,8 +216,9 @@ struct journal {
 	darray_u64		early_journal_entries;
 
 	/*
-	 * Two journal entries -- one is currently open for new entries, the
-	 * other is possibly being written out.
+	 * Up to journal_max_in_flight journal entries -- one is currently open
+	 * for new entries, the others are waiting on reservations to be
+	 * released or are being written out (one at a time, in order).
 	 */
 	struct journal_buf	buf[JOURNAL_BUF_NR];
 
@@ -262,7 +271,8 @@ struct journal {
 	u64			replay_journal_seq;
 	u64			replay_journal_seq_end;
 
-	struct write_point	wp;
+	/* Journal writes go to devices round robin, starting here: */
+	unsigned		next_dev;
 	spinlock_t		err_lock;
 
 	struct mutex		reclaim_lock;
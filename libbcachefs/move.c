@@ -19,6 +19,7 @@
 #include "keylist.h"
 #include "move.h"
 #include "replicas.h"
+#include "super.h"
 #include "super-io.h"
 #include "trace.h"
 
@@ -82,6 +83,9 @@ struct moving_io {
 	unsigned			read_sectors;
 	unsigned			write_sectors;
 
+	/* Devices we're moving data off of, for per device queue depth: */
+	struct bch_devs_list		src_devs;
+
 	struct bch_read_bio		rbio;
 
 	struct data_update		write;
@@ -142,16 +146,109 @@ struct moving_io *bch2_moving_ctxt_next_pending_write(struct moving_context *ctx
 	return io && io->read_completed ? io : NULL;
 }
 
+/*
+ * Per device queue depth for moves, shared by everything that moves data:
+ *
+ * Moves are charged to the devices they read from (the pointers being
+ * rewritten) while the read is in flight, and to the devices they write to
+ * while the write is in flight. The limit starts at move_ios_in_flight; it's
+ * halved, at most every 100ms, when the device is congested (see
+ * bch2_congested_acct()), and grows by one per completion otherwise.
+ */
+static unsigned move_dev_queue_depth(struct bch_fs *c, struct bch_dev *ca)
+{
+	return READ_ONCE(ca->move_queue_depth) ?: c->opts.move_ios_in_flight;
+}
+
+void bch2_move_dev_io_done(struct bch_fs *c, struct bch_dev *ca, int rw)
+{
+	unsigned depth = move_dev_queue_depth(c, ca);
+	u64 now = local_clock();
+
+	atomic_dec(&ca->move_ios_in_flight[rw]);
+
+	if (atomic_read(&ca->congested) > CONGESTED_MAX / 4) {
+		if (time_after64(now, READ_ONCE(ca->move_queue_depth_reduced) +
+				 100 * NSEC_PER_MSEC)) {
+			WRITE_ONCE(ca->move_queue_depth_reduced, now);
+			WRITE_ONCE(ca->move_queue_depth, max(depth / 2, 1U));
+		}
+	} else if (depth < c->opts.move_ios_in_flight) {
+		WRITE_ONCE(ca->move_queue_depth, depth + 1);
+	}
+
+	wake_up(&c->move_dev_wait);
+}
+
+/*
+ * We don't know which devices a write will go to until it's allocated, so
+ * writes are limited by the total queue depth of the devices in the target:
+ */
+static bool move_devs_have_room(struct bch_fs *c,
+				struct bch_devs_list *src, u16 target)
+{
+	struct bch_devs_mask devs;
+	struct bch_dev *ca;
+	unsigned i, in_flight = 0, depth = 0;
+
+	for (i = 0; i < src->nr; i++) {
+		ca = bch_dev_bkey_exists(c, src->devs[i]);
+
+		if (atomic_read(&ca->move_ios_in_flight[READ]) >=
+		    move_dev_queue_depth(c, ca))
+			return false;
+	}
+
+	rcu_read_lock();
+	devs = target_rw_devs(c, BCH_DATA_user, target);
+
+	for_each_set_bit(i, devs.d, BCH_SB_MEMBERS_MAX) {
+		ca = rcu_dereference(c->devs[i]);
+		if (!ca)
+			continue;
+
+		in_flight	+= atomic_read(&ca->move_ios_in_flight[WRITE]);
+		depth		+= move_dev_queue_depth(c, ca);
+	}
+	rcu_read_unlock();
+
+	return !depth || in_flight < depth;
+}
+
+static void move_wait_for_devs(struct moving_context *ctxt,
+			       struct btree_trans *trans,
+			       struct bch_devs_list *src, u16 target)
+{
+	struct bch_fs *c = ctxt->c;
+
+	while (1) {
+		bch2_moving_ctxt_do_pending_writes(ctxt, trans);
+
+		if (move_devs_have_room(c, src, target))
+			break;
+
+		wait_event(c->move_dev_wait,
+			   move_devs_have_room(c, src, target) ||
+			   bch2_moving_ctxt_next_pending_write(ctxt));
+	}
+}
+
 static void move_read_endio(struct bio *bio)
 {
 	struct moving_io *io = container_of(bio, struct moving_io, rbio.bio);
 	struct moving_context *ctxt = io->write.ctxt;
+	struct bch_fs *c = ctxt->c;
+	unsigned i;
 
 	atomic_sub(io->read_sectors, &ctxt->read_sectors);
 	atomic_dec(&ctxt->read_ios);
 	io->read_completed = true;
 
+	for (i = 0; i < io->src_devs.nr; i++)
+		bch2_move_dev_io_done(c, bch_dev_bkey_exists(c, io->src_devs.devs[i]), READ);
+
 	wake_up(&ctxt->wait);
+	wake_up(&c->move_dev_wait);
 	closure_put(&ctxt->cl);
 }
 
@@ -298,8 +395,10 @@ static int bch2_move_extent(struct btree_trans *trans,
 	struct bkey_ptrs_c ptrs = bch2_bkey_ptrs_c(k);
 	struct moving_io *io;
 	const union bch_extent_entry *entry;
+	const struct bch_extent_ptr *ptr;
 	struct extent_ptr_decoded p;
-	unsigned sectors = k.k->size, pages;
+	struct bch_devs_list src_devs = { 0 };
+	unsigned sectors = k.k->size, pages, i;
 	int ret = -ENOMEM;
 
 	trace_move_extent2(c, k);
@@ -319,6 +418,15 @@ static int bch2_move_extent(struct btree_trans *trans,
 	 */
 	bch2_trans_unlock(trans);
 
+	i = 0;
+	bkey_for_each_ptr(ptrs, ptr) {
+		if (data_opts.rewrite_ptrs & (1U << i))
+			bch2_dev_list_add_dev(&src_devs, ptr->dev);
+		i++;
+	}
+
+	move_wait_for_devs(ctxt, trans, &src_devs, data_opts.target);
+
 	/* write path might have to decompress data: */
 	bkey_for_each_ptr_decode(k.k, ptrs, p, entry)
 		sectors = max_t(unsigned, sectors, p.crc.uncompressed_size);
@@ -383,6 +491,10 @@ static int bch2_move_extent(struct btree_trans *trans,
 	this_cpu_add(c->counters[BCH_COUNTER_move_extent_read], k.k->size);
 	trace_move_extent_read2(c, k);
 
+	io->src_devs = src_devs;
+	for (i = 0; i < src_devs.nr; i++)
+		atomic_inc(&bch_dev_bkey_exists(c, src_devs.devs[i])->move_ios_in_flight[READ]);
+
 	mutex_lock(&ctxt->lock);
 	atomic_add(io->read_sectors, &ctxt->read_sectors);
 	atomic_inc(&ctxt->read_ios);
@@ -560,7 +672,13 @@ static int __bch2_move_data(struct moving_context *ctxt,
 		if (ret)
 			break;
 
-		if (bkey_ge(bkey_start_pos(k.k), end))
+		/*
+		 * The range is of key positions, [start, end): with snapshots,
+		 * extents in different snapshots overlap and aren't sorted by
+		 * start position, so this is the only way to split the keyspace
+		 * into shards that see every key exactly once:
+		 */
+		if (bpos_ge(k.k->p, end))
 			break;
 
 		if (ctxt->stats)
@@ -645,7 +763,7 @@ int bch2_move_data(struct bch_fs *c,
 
 		ret = __bch2_move_data(&ctxt,
 				       id == start_btree_id ? start_pos : POS_MIN,
-				       id == end_btree_id   ? end_pos   : POS_MAX,
+				       id == end_btree_id   ? end_pos   : SPOS_MAX,
 				       pred, arg, id);
 		if (ret)
 			break;
@@ -656,6 +774,384 @@ int bch2_move_data(struct bch_fs *c,
 	return ret;
 }
 
+/*
+ * Parallel moves, for data jobs:
+ *
+ * The extents and reflink btrees are split into shards at leaf node boundaries,
+ * found from the keys in the level 1 nodes, so shards are roughly equal amounts
+ * of metadata. Each shard is walked by its own thread with its own moving
+ * context; the per device queue depth limits keep them from swamping any one
+ * device.
+ */
+
+#define MOVE_SHARDS_MAX		16
+
+static const enum btree_id move_shard_btrees[] = {
+	BTREE_ID_extents,
+	BTREE_ID_reflink,
+};
+
+struct move_shards;
+
+struct move_shard {
+	struct move_shards	*m;
+	unsigned		idx;
+	struct task_struct	*thread;
+	int			ret;
+};
+
+struct move_shards {
+	struct bch_fs		*c;
+	enum btree_id		start_btree;
+	struct bpos		start_pos;
+	enum btree_id		end_btree;
+	struct bpos		end_pos;
+	struct write_point_specifier wp;
+	move_pred_fn		pred;
+	void			*arg;
+
+	unsigned		nr;
+	struct bpos		bounds[ARRAY_SIZE(move_shard_btrees)][MOVE_SHARDS_MAX + 1];
+
+	atomic_t		running;
+	wait_queue_head_t	wait;
+
+	struct move_shard	shard[MOVE_SHARDS_MAX];
+	struct bch_move_stats	stats[MOVE_SHARDS_MAX];
+};
+
+static int __move_shard_bounds(struct btree_trans *trans, enum btree_id id,
+			       struct bpos *bounds, unsigned nr)
+{
+	DARRAY(struct bpos) leaves = { 0 };
+	struct btree_iter iter;
+	struct btree *b;
+	unsigned i;
+	int ret;
+
+	__for_each_btree_node(trans, iter, id, POS_MIN, 0, 1, 0, b, ret) {
+		struct btree_node_iter node_iter;
+		struct bkey unpacked;
+		struct bkey_s_c k;
+
+		for_each_btree_node_key_unpack(b, k, &node_iter, &unpacked) {
+			ret = darray_push(&leaves, k.k->p);
+			if (ret)
+				break;
+		}
+		if (ret)
+			break;
+	}
+	bch2_trans_iter_exit(trans, &iter);
+
+	if (!ret && leaves.nr)
+		for (i = 1; i < nr; i++)
+			bounds[i] = leaves.data[i * leaves.nr / nr];
+
+	darray_exit(&leaves);
+	return ret;
+}
+
+static int move_shard_bounds(struct btree_trans *trans, enum btree_id id,
+			     struct bpos *bounds, unsigned nr)
+{
+	struct btree_root *r = bch2_btree_id_root(trans->c, id);
+	unsigned i;
+
+	/* Shards past the last boundary we find are empty: */
+	bounds[0] = POS_MIN;
+	for (i = 1; i <= nr; i++)
+		bounds[i] = SPOS_MAX;
+
+	if (!r->b || !r->level)
+		return 0;
+
+	return lockrestart_do(trans, __move_shard_bounds(trans, id, bounds, nr));
+}
+
+static int bch2_move_shard_thread(void *arg)
+{
+	struct move_shard *s = arg;
+	struct move_shards *m = s->m;
+	struct bch_fs *c = m->c;
+	struct bch_move_stats *stats = &m->stats[s->idx];
+	struct moving_context ctxt;
+	unsigned i;
+
+	bch2_moving_ctxt_init(&ctxt, c, NULL, stats, m->wp, true);
+
+	for (i = 0; i < ARRAY_SIZE(move_shard_btrees) && !s->ret; i++) {
+		enum btree_id id = move_shard_btrees[i];
+		struct bpos start	= m->bounds[i][s->idx];
+		struct bpos end		= m->bounds[i][s->idx + 1];
+
+		if (id < m->start_btree || id > m->end_btree ||
+		    !bch2_btree_id_root(c, id)->b)
+			continue;
+
+		if (id == m->start_btree)
+			start = bpos_max(start, m->start_pos);
+		if (id == m->end_btree)
+			end = bpos_min(end, m->end_pos);
+
+		if (bpos_ge(start, end))
+			continue;
+
+		stats->btree_id = id;
+		s->ret = __bch2_move_data(&ctxt, start, end, m->pred, m->arg, id);
+	}
+
+	bch2_moving_ctxt_exit(&ctxt);
+
+	if (atomic_dec_and_test(&m->running))
+		wake_up(&m->wait);
+	return 0;
+}
+
+/*
+ * Like bch2_move_data(), but split into shards that are moved in parallel -
+ * without ratelimiting, and progress is reported per shard:
+ */
+int bch2_move_data_parallel(struct bch_fs *c,
+			    enum btree_id start_btree_id, struct bpos start_pos,
+			    enum btree_id end_btree_id,   struct bpos end_pos,
+			    struct bch_move_stats *stats,
+			    struct write_point_specifier wp,
+			    move_pred_fn pred, void *arg)
+{
+	struct move_shards *m;
+	struct btree_trans trans;
+	struct bch_dev *ca;
+	unsigned i, nr_devs = 0;
+	int ret = 0;
+
+	m = kvzalloc(sizeof(*m), GFP_KERNEL);
+	if (!m)
+		return -ENOMEM;
+
+	for_each_rw_member(ca, c, i)
+		nr_devs++;
+
+	m->c		= c;
+	m->start_btree	= start_btree_id;
+	m->start_pos	= start_pos;
+	m->end_btree	= end_btree_id;
+	m->end_pos	= end_pos;
+	m->wp		= wp;
+	m->pred		= pred;
+	m->arg		= arg;
+	m->nr		= clamp_t(unsigned, nr_devs, 1,
+				  min_t(unsigned, num_online_cpus(), MOVE_SHARDS_MAX));
+	init_waitqueue_head(&m->wait);
+
+	bch2_trans_init(&trans, c, 0, 0);
+	for (i = 0; i < ARRAY_SIZE(move_shard_btrees) && !ret; i++)
+		ret = move_shard_bounds(&trans, move_shard_btrees[i],
+					m->bounds[i], m->nr);
+	bch2_trans_exit(&trans);
+	if (ret)
+		goto err;
+
+	for (i = 0; i < m->nr; i++) {
+		struct move_shard *s = &m->shard[i];
+		char name[32];
+
+		scnprintf(name, sizeof(name), "%s/%u", stats->name, i);
+		bch2_move_stats_init(&m->stats[i], name);
+
+		s->m	= m;
+		s->idx	= i;
+		s->thread = kthread_create(bch2_move_shard_thread, s,
+					   "bch-move/%s/%u", c->name, i);
+		ret = PTR_ERR_OR_ZERO(s->thread);
+		if (ret) {
+			s->thread = NULL;
+			break;
+		}
+		get_task_struct(s->thread);
+	}
+
+	mutex_lock(&c->data_progress_lock);
+	stats->data_type	= BCH_DATA_user;
+	stats->shards		= m->stats;
+	stats->nr_shards	= i;
+	mutex_unlock(&c->data_progress_lock);
+
+	atomic_set(&m->running, i);
+	for (i = 0; i < stats->nr_shards; i++)
+		wake_up_process(m->shard[i].thread);
+
+	/* We're stopped when the fd for the data job is closed: */
+	while (!wait_event_timeout(m->wait, !atomic_read(&m->running), HZ))
+		if (kthread_should_stop())
+			break;
+
+	for (i = 0; i < stats->nr_shards; i++) {
+		kthread_stop(m->shard[i].thread);
+		put_task_struct(m->shard[i].thread);
+		ret = ret ?: m->shard[i].ret;
+	}
+
+	mutex_lock(&c->data_progress_lock);
+	for (i = 0; i < stats->nr_shards; i++)
+		atomic64_add(atomic64_read(&m->stats[i].sectors_seen),
+			     &stats->sectors_seen);
+	stats->shards		= NULL;
+	stats->nr_shards	= 0;
+	mutex_unlock(&c->data_progress_lock);
+err:
+	kvfree(m);
+	return ret;
+}
+
+/*
+ * Index btrees (BTREE_ID_rebalance_work) have KEY_TYPE_set entries at the
+ * position of the extents they refer to: inode 0 is never used in the extents
+ * btree, so entries there refer to the reflink btree.
+ */
+static int move_indexed_extents(struct btree_trans *trans,
+				struct moving_context *ctxt,
+				struct bpos pos,
+				struct bch_io_opts *io_opts, u64 *cur_inum,
+				struct bkey_buf *sk, bool *moved,
+				move_pred_fn pred, void *arg)
+{
+	struct bch_fs *c = trans->c;
+	enum btree_id btree_id = pos.inode ? BTREE_ID_extents : BTREE_ID_reflink;
+	struct btree_iter iter;
+	struct data_update_opts data_opts;
+	struct bkey_s_c k;
+	int ret;
+
+	if (ctxt->stats) {
+		ctxt->stats->btree_id	= btree_id;
+		ctxt->stats->pos	= pos;
+	}
+
+	for_each_btree_key_upto_norestart(trans, iter, btree_id, pos, pos,
+				BTREE_ITER_ALL_SNAPSHOTS, k, ret) {
+		if (!bkey_extent_is_direct_data(k.k))
+			continue;
+
+		ret = move_get_io_opts(trans, io_opts, k, cur_inum);
+		if (ret)
+			break;
+
+		memset(&data_opts, 0, sizeof(data_opts));
+		if (!pred(c, arg, k, io_opts, &data_opts))
+			continue;
+
+		bch2_bkey_buf_reassemble(sk, c, k);
+		k = bkey_i_to_s_c(sk->k);
+
+		ret = bch2_move_extent(trans, &iter, ctxt, NULL,
+				       *io_opts, btree_id, k, data_opts);
+		if (ret)
+			break;
+
+		*moved = true;
+
+		if (ctxt->rate)
+			bch2_ratelimit_increment(ctxt->rate, k.k->size);
+		if (ctxt->stats)
+			atomic64_add(k.k->size, &ctxt->stats->sectors_seen);
+	}
+	bch2_trans_iter_exit(trans, &iter);
+
+	return ret;
+}
+
+/*
+ * Like bch2_move_data(), but only visits the extents listed in @index_btree -
+ * so the cost is proportional to the amount of work, not the size of the
+ * filesystem. Entries for extents we move are updated by the extent trigger
+ * when the move completes; entries for extents that didn't need moving are
+ * deleted here:
+ */
+int bch2_move_data_indexed(struct bch_fs *c,
+			   enum btree_id index_btree,
+			   struct bch_ratelimit *rate,
+			   struct bch_move_stats *stats,
+			   struct write_point_specifier wp,
+			   bool wait_on_copygc,
+			   move_pred_fn pred, void *arg)
+{
+	struct moving_context ctxt;
+	struct bch_io_opts io_opts = bch2_opts_to_inode_opts(c->opts);
+	struct btree_trans trans;
+	struct btree_iter iter;
+	struct bkey_buf sk;
+	struct bkey_s_c k;
+	struct bpos pos;
+	u64 cur_inum = U64_MAX;
+	bool moved;
+	int ret = 0;
+
+	bch2_moving_ctxt_init(&ctxt, c, rate, stats, wp, wait_on_copygc);
+	bch2_bkey_buf_init(&sk);
+	bch2_trans_init(&trans, c, 0, 0);
+
+	stats->data_type = BCH_DATA_user;
+
+	/* Deletions from the previous pass went through the write buffer: */
+	ret = bch2_btree_write_buffer_flush_sync(&trans);
+	if (ret)
+		goto out;
+
+	bch2_trans_iter_init(&trans, &iter, index_btree, POS_MIN,
+			     BTREE_ITER_PREFETCH);
+
+	if (ctxt.rate)
+		bch2_ratelimit_reset(ctxt.rate);
+
+	while (!move_ratelimit(&trans, &ctxt)) {
+		bch2_trans_begin(&trans);
+
+		k = bch2_btree_iter_peek(&iter);
+		if (!k.k)
+			break;
+
+		ret = bkey_err(k);
+		if (bch2_err_matches(ret, BCH_ERR_transaction_restart))
+			continue;
+		if (ret)
+			break;
+
+		pos	= k.k->p;
+		moved	= false;
+
+		ret = move_indexed_extents(&trans, &ctxt, pos, &io_opts,
+					   &cur_inum, &sk, &moved, pred, arg);
+		if (bch2_err_matches(ret, BCH_ERR_transaction_restart))
+			continue;
+		if (ret == -ENOMEM) {
+			/* memory allocation failure, wait for some IO to finish */
+			bch2_move_ctxt_wait_for_io(&ctxt, &trans);
+			continue;
+		}
+		/* Leave the entry, so it's retried on the next pass: */
+		if (ret)
+			break;
+
+		ret = !moved
+			? commit_do(&trans, NULL, NULL, BTREE_INSERT_NOFAIL,
+				    bch2_btree_bit_mod(&trans, index_btree, pos, false))
+			: 0;
+		if (ret)
+			break;
+
+		bch2_btree_iter_set_pos(&iter, bpos_successor(pos));
+	}
+
+	bch2_trans_iter_exit(&trans, &iter);
+out:
+	bch2_trans_exit(&trans);
+	bch2_bkey_buf_exit(&sk, c);
+	bch2_moving_ctxt_exit(&ctxt);
+
+	return ret;
+}
+
 int __bch2_evacuate_bucket(struct btree_trans *trans,
 			   struct moving_context *ctxt,
 			   struct move_bucket_in_flight *bucket_in_flight,
@@ -842,11 +1338,14 @@ int bch2_evacuate_bucket(struct bch_fs *c,
 typedef bool (*move_btree_pred)(struct bch_fs *, void *,
 				struct btree *, struct bch_io_opts *,
 				struct data_update_opts *);
+/* Called after a node @pred picked has been successfully rewritten: */
+typedef void (*move_btree_done)(struct bch_fs *, void *);
 
 static int bch2_move_btree(struct bch_fs *c,
 			   enum btree_id start_btree_id, struct bpos start_pos,
 			   enum btree_id end_btree_id,   struct bpos end_pos,
-			   move_btree_pred pred, void *arg,
+			   move_btree_pred pred, move_btree_done done,
+			   void *arg,
 			   struct bch_move_stats *stats)
 {
 	bool kthread = (current->flags & PF_KTHREAD) != 0;
@@ -895,6 +1394,9 @@ retry:
 				continue;
 			if (ret)
 				break;
+
+			if (done)
+				done(c, arg);
 next:
 			bch2_btree_iter_next_node(&iter);
 		}
@@ -1025,7 +1527,7 @@ int bch2_scan_old_btree_nodes(struct bch_fs *c, struct bch_move_stats *stats)
 	ret = bch2_move_btree(c,
 			      0,		POS_MIN,
 			      BTREE_ID_NR,	SPOS_MAX,
-			      rewrite_old_nodes_pred, c, stats);
+			      rewrite_old_nodes_pred, NULL, c, stats);
 	if (!ret) {
 		mutex_lock(&c->sb_lock);
 		c->disk_sb.sb->compat[0] |= cpu_to_le64(1ULL << BCH_COMPAT_extents_above_btree_updates_done);
@@ -1040,6 +1542,128 @@ int bch2_scan_old_btree_nodes(struct bch_fs *c, struct bch_move_stats *stats)
 	return ret;
 }
 
+/*
+ * Packed formats are picked when a node is written; after enough churn the keys
+ * a node holds may no longer match its format, so keys end up unpacked (or
+ * packed with more bits than they need) and the node holds fewer of them.
+ * Rewrite nodes where recomputing the format would shrink them by more than
+ * REWRITE_FORMATS_MIN_GAIN_PERCENT:
+ */
+#define REWRITE_FORMATS_MIN_GAIN_PERCENT	10
+
+struct rewrite_formats_stats {
+	u64			nodes_seen[BTREE_ID_NR];
+	u64			nodes_rewritten[BTREE_ID_NR];
+	u64			packed_keys[BTREE_ID_NR];
+	u64			unpacked_keys[BTREE_ID_NR];
+	u64			u64s_saved[BTREE_ID_NR];
+
+	/*
+	 * The node the predicate last looked at: only accounted once we know
+	 * we're done with it, since a rewrite that's restarted sees the same
+	 * node again:
+	 */
+	unsigned		cur_id;
+	u64			cur_packed_keys;
+	u64			cur_unpacked_keys;
+	u64			cur_u64s_saved;
+};
+
+static void rewrite_formats_account(struct rewrite_formats_stats *s,
+				    bool rewritten)
+{
+	unsigned id = s->cur_id;
+
+	s->nodes_seen[id]++;
+	s->packed_keys[id]	+= s->cur_packed_keys;
+	s->unpacked_keys[id]	+= s->cur_unpacked_keys;
+
+	if (rewritten) {
+		s->nodes_rewritten[id]++;
+		s->u64s_saved[id] += s->cur_u64s_saved;
+	}
+}
+
+static bool rewrite_formats_pred(struct bch_fs *c, void *arg,
+				 struct btree *b,
+				 struct bch_io_opts *io_opts,
+				 struct data_update_opts *data_opts)
+{
+	struct rewrite_formats_stats *s = arg;
+
+	s->cur_id		= b->c.btree_id;
+	s->cur_packed_keys	= b->nr.packed_keys;
+	s->cur_unpacked_keys	= b->nr.unpacked_keys;
+	s->cur_u64s_saved	= b->nr.live_u64s
+		? bch2_btree_node_format_savings(b)
+		: 0;
+
+	if (!b->nr.live_u64s ||
+	    s->cur_u64s_saved * 100 <
+	    (u64) b->nr.live_u64s * REWRITE_FORMATS_MIN_GAIN_PERCENT) {
+		rewrite_formats_account(s, false);
+		return false;
+	}
+
+	data_opts->target		= 0;
+	data_opts->extra_replicas	= 0;
+	data_opts->btree_insert_flags	= 0;
+	return true;
+}
+
+static void rewrite_formats_done(struct bch_fs *c, void *arg)
+{
+	rewrite_formats_account(arg, true);
+}
+
+static void rewrite_formats_stats_to_text(struct printbuf *out,
+					  struct rewrite_formats_stats *s)
+{
+	unsigned id;
+
+	for (id = 0; id < BTREE_ID_NR; id++) {
+		u64 nr_keys = s->packed_keys[id] + s->unpacked_keys[id];
+
+		if (!s->nodes_seen[id])
+			continue;
+
+		prt_printf(out, "%s: nodes %llu rewritten %llu packed key ratio %llu%% u64s saved %llu",
+			   bch2_btree_ids[id],
+			   s->nodes_seen[id],
+			   s->nodes_rewritten[id],
+			   nr_keys ? div64_u64(s->packed_keys[id] * 100, nr_keys) : 100,
+			   s->u64s_saved[id]);
+		prt_newline(out);
+	}
+}
+
+static int bch2_rewrite_btree_formats(struct bch_fs *c,
+				      struct bch_move_stats *stats,
+				      struct bch_ioctl_data *op)
+{
+	struct rewrite_formats_stats *s = kzalloc(sizeof(*s), GFP_KERNEL);
+	struct printbuf buf = PRINTBUF;
+	int ret;
+
+	if (!s)
+		return -ENOMEM;
+
+	/* Per btree stats are only kept for the static btrees: */
+	ret = bch2_move_btree(c,
+			      op->start_btree,	op->start_pos,
+			      min_t(unsigned, op->end_btree, BTREE_ID_NR - 1),
+			      op->end_pos,
+			      rewrite_formats_pred, rewrite_formats_done, s, stats);
+
+	rewrite_formats_stats_to_text(&buf, s);
+	if (buf.pos)
+		bch_info(c, "btree node format rewrite:\n%s", buf.buf);
+
+	printbuf_exit(&buf);
+	kfree(s);
+	return ret;
+}
+
 int bch2_data_job(struct bch_fs *c,
 		  struct bch_move_stats *stats,
 		  struct bch_ioctl_data op)
@@ -1055,16 +1679,14 @@ int bch2_data_job(struct bch_fs *c,
 		ret = bch2_move_btree(c,
 				      op.start_btree,	op.start_pos,
 				      op.end_btree,	op.end_pos,
-				      rereplicate_btree_pred, c, stats) ?: ret;
+				      rereplicate_btree_pred, NULL, c, stats) ?: ret;
 		ret = bch2_replicas_gc2(c) ?: ret;
 
-		ret = bch2_move_data(c,
+		ret = bch2_move_data_parallel(c,
 				     op.start_btree,	op.start_pos,
 				     op.end_btree,	op.end_pos,
-				     NULL,
 				     stats,
 				     writepoint_hashed((unsigned long) current),
-				     true,
 				     rereplicate_pred, c) ?: ret;
 		ret = bch2_replicas_gc2(c) ?: ret;
 		break;
@@ -1079,16 +1701,14 @@ int bch2_data_job(struct bch_fs *c,
 		ret = bch2_move_btree(c,
 				      op.start_btree,	op.start_pos,
 				      op.end_btree,	op.end_pos,
-				      migrate_btree_pred, &op, stats) ?: ret;
+				      migrate_btree_pred, NULL, &op, stats) ?: ret;
 		ret = bch2_replicas_gc2(c) ?: ret;
 
-		ret = bch2_move_data(c,
+		ret = bch2_move_data_parallel(c,
 				     op.start_btree,	op.start_pos,
 				     op.end_btree,	op.end_pos,
-				     NULL,
 				     stats,
 				     writepoint_hashed((unsigned long) current),
-				     true,
 				     migrate_pred, &op) ?: ret;
 		ret = bch2_replicas_gc2(c) ?: ret;
 		break;
@@ -1096,6 +1716,10 @@ int bch2_data_job(struct bch_fs *c,
 		bch2_move_stats_init(stats, "rewrite_old_nodes");
 		ret = bch2_scan_old_btree_nodes(c, stats);
 		break;
+	case BCH_DATA_OP_REWRITE_FORMATS:
+		bch2_move_stats_init(stats, "rewrite_formats");
+		ret = bch2_rewrite_btree_formats(c, stats, &op);
+		break;
 	default:
 		ret = -EINVAL;
 	}
@@ -1114,11 +1738,48 @@ void bch2_data_jobs_to_text(struct printbuf *out, struct bch_fs *c)
 		       bch2_data_types[stats->data_type],
 		       bch2_btree_ids[stats->btree_id]);
 		bch2_bpos_to_text(out, stats->pos);
+		prt_printf(out, " sectors seen %llu",
+			   atomic64_read(&stats->sectors_seen));
 		prt_printf(out, "%s", "\n");
 	}
 	mutex_unlock(&c->data_progress_lock);
 }
 
+/*
+ * Progress for BCH_IOCTL_DATA, including any shards the job has been split
+ * into: returns the number of entries in @shards filled in
+ */
+unsigned bch2_data_job_progress(struct bch_fs *c, struct bch_move_stats *stats,
+				struct bch_ioctl_data_progress *p,
+				struct bch_ioctl_data_shard_progress *shards,
+				unsigned nr)
+{
+	unsigned i, ret = 0;
+
+	mutex_lock(&c->data_progress_lock);
+	p->data_type	= stats->data_type;
+	p->btree_id	= stats->btree_id;
+	p->pos		= stats->pos;
+	p->sectors_done	= atomic64_read(&stats->sectors_seen);
+	p->nr_shards	= stats->nr_shards;
+
+	for (i = 0; i < stats->nr_shards; i++) {
+		struct bch_move_stats *s = &stats->shards[i];
+
+		p->sectors_done += atomic64_read(&s->sectors_seen);
+
+		if (ret < nr) {
+			shards[ret].btree_id	 = s->btree_id;
+			shards[ret].pos		 = s->pos;
+			shards[ret].sectors_done = atomic64_read(&s->sectors_seen);
+			ret++;
+		}
+	}
+	mutex_unlock(&c->data_progress_lock);
+
+	return ret;
+}
+
 static void bch2_moving_ctxt_to_text(struct printbuf *out, struct moving_context *ctxt)
 {
 	struct moving_io *io;
@@ -1165,4 +1826,5 @@ void bch2_fs_move_init(struct bch_fs *c)
 
 	INIT_LIST_HEAD(&c->data_progress_list);
 	mutex_init(&c->data_progress_lock);
+	init_waitqueue_head(&c->move_dev_wait);
 }
@@ -53,6 +53,8 @@ do {									\
 typedef bool (*move_pred_fn)(struct bch_fs *, void *, struct bkey_s_c,
 			     struct bch_io_opts *, struct data_update_opts *);
 
+void bch2_move_dev_io_done(struct bch_fs *, struct bch_dev *, int);
+
 void bch2_moving_ctxt_exit(struct moving_context *);
 void bch2_moving_ctxt_init(struct moving_context *, struct bch_fs *,
 			   struct bch_ratelimit *, struct bch_move_stats *,
@@ -71,6 +73,18 @@ int bch2_move_data(struct bch_fs *,
 		   struct write_point_specifier,
 		   bool,
 		   move_pred_fn, void *);
+int bch2_move_data_parallel(struct bch_fs *,
+			    enum btree_id, struct bpos,
+			    enum btree_id, struct bpos,
+			    struct bch_move_stats *,
+			    struct write_point_specifier,
+			    move_pred_fn, void *);
+int bch2_move_data_indexed(struct bch_fs *, enum btree_id,
+			   struct bch_ratelimit *,
+			   struct bch_move_stats *,
+			   struct write_point_specifier,
+			   bool,
+			   move_pred_fn, void *);
 
 int __bch2_evacuate_bucket(struct btree_trans *,
 			   struct moving_context *,
@@ -89,6 +103,10 @@ int bch2_data_job(struct bch_fs *,
 
 void bch2_move_stats_init(struct bch_move_stats *stats, char *name);
 void bch2_data_jobs_to_text(struct printbuf *, struct bch_fs *);
+unsigned bch2_data_job_progress(struct bch_fs *, struct bch_move_stats *,
+				struct bch_ioctl_data_progress *,
+				struct bch_ioctl_data_shard_progress *,
+				unsigned);
 void bch2_fs_moving_ctxts_to_text(struct printbuf *, struct bch_fs *);
 
 void bch2_fs_move_init(struct bch_fs *);
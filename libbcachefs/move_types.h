@@ -14,6 +14,10 @@ struct bch_move_stats {
 	atomic64_t		sectors_moved;
 	atomic64_t		sectors_seen;
 	atomic64_t		sectors_raced;
+
+	/* If this job has been split into shards, their stats: */
+	struct bch_move_stats	*shards;
+	unsigned		nr_shards;
 };
 
 struct move_bucket_key {
@@ -77,6 +77,257 @@ move_bucket_in_flight_add(struct buckets_in_flight *list, struct move_bucket b)
 	return new;
 }
 
+/*
+ * Fragmentation histogram: see struct copygc_frag_histogram.
+ *
+ * Buckets copygc has taken are unlinked and marked held, so that they're not
+ * returned again while they're in flight; updates to a held bucket only
+ * record its new bin, and it goes back on its list when it's released.
+ *
+ * The histogram is only a hint - entries added when it's rebuilt from the LRU
+ * btree may race with updates - so buckets are still checked against the alloc
+ * btree before they're moved.
+ */
+
+#define FRAG_BIN_HELD		(1U << 7)
+#define FRAG_NIL		U32_MAX
+
+static inline unsigned frag_to_bin(u64 frag)
+{
+	return min_t(u64, frag >> (31 - ilog2(COPYGC_FRAG_BINS)),
+		     COPYGC_FRAG_BINS - 1);
+}
+
+static void frag_link(struct copygc_frag_histogram *h, u32 b, unsigned bin)
+{
+	h->prev[b] = FRAG_NIL;
+	h->next[b] = h->head[bin];
+	if (h->head[bin] != FRAG_NIL)
+		h->prev[h->head[bin]] = b;
+	h->head[bin] = b;
+	h->nr[bin]++;
+}
+
+static void frag_unlink(struct copygc_frag_histogram *h, u32 b, unsigned bin)
+{
+	u32 next = h->next[b], prev = h->prev[b];
+
+	if (prev != FRAG_NIL)
+		h->next[prev] = next;
+	else
+		h->head[bin] = next;
+	if (next != FRAG_NIL)
+		h->prev[next] = prev;
+	h->nr[bin]--;
+}
+
+static void __frag_set(struct copygc_frag_histogram *h, u32 b, u64 frag)
+{
+	unsigned old = h->bin[b];
+	unsigned new = frag ? frag_to_bin(frag) + 1 : 0;
+
+	if (old & FRAG_BIN_HELD) {
+		h->bin[b] = FRAG_BIN_HELD|new;
+		return;
+	}
+
+	if (old == new)
+		return;
+
+	if (old)
+		frag_unlink(h, b, old - 1);
+	if (new)
+		frag_link(h, b, new - 1);
+	h->bin[b] = new;
+}
+
+/* Called by bch2_mark_alloc(), with mark_lock held: */
+void bch2_copygc_frag_update(struct bch_dev *ca, u64 bucket, u64 frag)
+{
+	struct copygc_frag_histogram *h;
+
+	rcu_read_lock();
+	h = rcu_dereference(ca->copygc_frag);
+	if (h && bucket < h->nbuckets) {
+		spin_lock(&h->lock);
+		__frag_set(h, bucket, frag);
+		spin_unlock(&h->lock);
+	}
+	rcu_read_unlock();
+}
+
+/* Take a bucket from @bin, marking it held: */
+static bool frag_pop(struct bch_dev *ca, unsigned bin, u64 *bucket)
+{
+	struct copygc_frag_histogram *h;
+	u32 b = FRAG_NIL;
+
+	rcu_read_lock();
+	h = rcu_dereference(ca->copygc_frag);
+	if (h) {
+		spin_lock(&h->lock);
+		b = h->head[bin];
+		if (b != FRAG_NIL) {
+			frag_unlink(h, b, bin);
+			h->bin[b] |= FRAG_BIN_HELD;
+		}
+		spin_unlock(&h->lock);
+	}
+	rcu_read_unlock();
+
+	*bucket = b;
+	return b != FRAG_NIL;
+}
+
+static void frag_release(struct bch_fs *c, struct bpos bucket, bool drop)
+{
+	struct copygc_frag_histogram *h;
+	unsigned bin;
+
+	if (!bch2_dev_exists2(c, bucket.inode))
+		return;
+
+	rcu_read_lock();
+	h = rcu_dereference(bch_dev_bkey_exists(c, bucket.inode)->copygc_frag);
+	if (h && bucket.offset < h->nbuckets) {
+		spin_lock(&h->lock);
+		bin = h->bin[bucket.offset];
+		if (bin & FRAG_BIN_HELD) {
+			bin = drop ? 0 : bin & ~FRAG_BIN_HELD;
+			h->bin[bucket.offset] = bin;
+			if (bin)
+				frag_link(h, bucket.offset, bin - 1);
+		}
+		spin_unlock(&h->lock);
+	}
+	rcu_read_unlock();
+}
+
+static struct copygc_frag_histogram *frag_alloc(struct bch_dev *ca)
+{
+	struct copygc_frag_histogram *h;
+	size_t nbuckets = ca->mi.nbuckets;
+	size_t bytes = sizeof(*h) + nbuckets * (sizeof(u32) * 2 + sizeof(u8));
+	unsigned i;
+
+	if (nbuckets >= FRAG_NIL)
+		return NULL;
+
+	h = kvpmalloc(bytes, GFP_KERNEL);
+	if (!h)
+		return NULL;
+
+	memset(h, 0, sizeof(*h));
+	spin_lock_init(&h->lock);
+	h->bytes	= bytes;
+	h->nbuckets	= nbuckets;
+	h->next		= (void *) (h + 1);
+	h->prev		= h->next + nbuckets;
+	h->bin		= (void *) (h->prev + nbuckets);
+
+	for (i = 0; i < COPYGC_FRAG_BINS; i++)
+		h->head[i] = FRAG_NIL;
+	memset(h->bin, 0, nbuckets);
+	return h;
+}
+
+static void frag_free_rcu(struct rcu_head *rcu)
+{
+	struct copygc_frag_histogram *h =
+		container_of(rcu, struct copygc_frag_histogram, rcu);
+
+	kvpfree(h, h->bytes);
+}
+
+/*
+ * Copygc may still be running (e.g. on device resize): readers hold
+ * rcu_read_lock, so the histogram is freed after a grace period:
+ */
+void bch2_dev_copygc_frag_free(struct bch_dev *ca)
+{
+	struct copygc_frag_histogram *h =
+		rcu_dereference_protected(ca->copygc_frag, 1);
+
+	RCU_INIT_POINTER(ca->copygc_frag, NULL);
+	if (h)
+		call_rcu(&h->rcu, frag_free_rcu);
+}
+
+/*
+ * Allocate histograms for devices that don't have one yet - on mount, or after
+ * a resize - and fill them in from the LRU btree. Returns 1 if every rw device
+ * has a histogram, 0 if we have to fall back to walking the LRU btree:
+ */
+static int bch2_copygc_frag_init(struct btree_trans *trans)
+{
+	struct bch_fs *c = trans->c;
+	struct bch_devs_mask rebuild = { 0 };
+	struct btree_iter iter;
+	struct bkey_s_c k;
+	struct bch_dev *ca;
+	unsigned i;
+	bool have_all = true;
+	int ret;
+
+	for_each_rw_member(ca, c, i)
+		if (!rcu_access_pointer(ca->copygc_frag)) {
+			struct copygc_frag_histogram *h = frag_alloc(ca);
+
+			if (!h) {
+				have_all = false;
+				continue;
+			}
+
+			/* Resize frees the histogram with mark_lock held for write: */
+			percpu_down_read(&c->mark_lock);
+			if (!rcu_access_pointer(ca->copygc_frag) &&
+			    h->nbuckets == ca->mi.nbuckets) {
+				rcu_assign_pointer(ca->copygc_frag, h);
+				__set_bit(i, rebuild.d);
+				h = NULL;
+			}
+			percpu_up_read(&c->mark_lock);
+
+			if (h) {
+				kvpfree(h, h->bytes);
+				have_all = false;
+			}
+		}
+
+	if (bitmap_empty(rebuild.d, BCH_SB_MEMBERS_MAX))
+		return have_all;
+
+	ret = bch2_btree_write_buffer_flush(trans);
+	if (bch2_fs_fatal_err_on(ret, c, "%s: error %s from bch2_btree_write_buffer_flush()",
+				 __func__, bch2_err_str(ret)))
+		return ret;
+
+	ret = for_each_btree_key2_upto(trans, iter, BTREE_ID_lru,
+				  lru_pos(BCH_LRU_FRAGMENTATION_START, 0, 0),
+				  lru_pos(BCH_LRU_FRAGMENTATION_START, U64_MAX, LRU_TIME_MAX),
+				  0, k, ({
+		struct bpos bucket = u64_to_bucket(k.k->p.offset);
+		struct copygc_frag_histogram *h;
+
+		if (bucket.inode < BCH_SB_MEMBERS_MAX &&
+		    test_bit(bucket.inode, rebuild.d)) {
+			rcu_read_lock();
+			h = rcu_dereference(bch_dev_bkey_exists(c, bucket.inode)->copygc_frag);
+			if (h && bucket.offset < h->nbuckets) {
+				/* Don't clobber updates from bch2_mark_alloc(): */
+				spin_lock(&h->lock);
+				if (!h->bin[bucket.offset])
+					__frag_set(h, bucket.offset, lru_pos_time(k.k->p));
+				spin_unlock(&h->lock);
+			}
+			rcu_read_unlock();
+		}
+		0;
+	}));
+
+	return ret ?: have_all;
+}
+
 static int bch2_bucket_is_movable(struct btree_trans *trans,
 				  struct move_bucket *b, u64 time)
 {
@@ -131,6 +382,8 @@ static void move_buckets_wait(struct btree_trans *trans,
 		list->nr--;
 		list->sectors -= i->bucket.sectors;
 
+		frag_release(trans->c, i->bucket.k.bucket, false);
+
 		ret = rhashtable_remove_fast(&list->table, &i->hash,
 					     bch_move_bucket_params);
 		BUG_ON(ret);
@@ -148,6 +401,56 @@ static bool bucket_in_flight(struct buckets_in_flight *list,
 
 typedef DARRAY(struct move_bucket) move_buckets;
 
+/* Take the emptiest movable buckets from the fragmentation histograms: */
+static int bch2_copygc_pop_buckets(struct btree_trans *trans,
+				   move_buckets *buckets, size_t nr_to_get)
+{
+	struct bch_fs *c = trans->c;
+	struct bch_dev *ca;
+	size_t saw = 0, not_movable = 0, sectors = 0;
+	unsigned bin, i;
+	u64 bucket;
+	int ret = 0;
+
+	for (bin = 0; bin < COPYGC_FRAG_BINS && buckets->nr < nr_to_get; bin++)
+		for_each_rw_member(ca, c, i) {
+			while (!ret &&
+			       buckets->nr < nr_to_get &&
+			       frag_pop(ca, bin, &bucket)) {
+				struct move_bucket b = {
+					.k.bucket = POS(ca->dev_idx, bucket)
+				};
+
+				saw++;
+
+				ret = lockrestart_do(trans,
+					bch2_bucket_is_movable(trans, &b, LRU_TIME_MAX));
+				if (ret <= 0) {
+					frag_release(c, b.k.bucket, !ret);
+					not_movable += !ret;
+					continue;
+				}
+
+				ret = darray_push(buckets, b);
+				if (ret) {
+					frag_release(c, b.k.bucket, false);
+					continue;
+				}
+
+				sectors += b.sectors;
+			}
+
+			if (ret) {
+				percpu_ref_put(&ca->io_ref);
+				goto out;
+			}
+		}
+out:
+	pr_debug("saw %zu not movable %zu got %zu (%zu)/%zu buckets ret %i",
+		 saw, not_movable, buckets->nr, sectors, nr_to_get, ret);
+	return ret;
+}
+
 static int bch2_copygc_get_buckets(struct btree_trans *trans,
 			struct moving_context *ctxt,
 			struct buckets_in_flight *buckets_in_flight,
@@ -162,6 +465,13 @@ static int bch2_copygc_get_buckets(struct btree_trans *trans,
 
 	move_buckets_wait(trans, ctxt, buckets_in_flight, false);
 
+	ret = bch2_copygc_frag_init(trans);
+	if (ret < 0)
+		return ret;
+	if (ret)
+		return bch2_copygc_pop_buckets(trans, buckets, nr_to_get);
+
+	/* Fall back to walking the LRU btree if we couldn't allocate: */
 	ret = bch2_btree_write_buffer_flush(trans);
 	if (bch2_fs_fatal_err_on(ret, c, "%s: error %s from bch2_btree_write_buffer_flush()",
 				 __func__, bch2_err_str(ret)))
@@ -211,6 +521,7 @@ static int bch2_copygc(struct btree_trans *trans,
 	int ret = 0;
 
 	ret = bch2_copygc_get_buckets(trans, ctxt, buckets_in_flight, &buckets);
+	i = buckets.data;
 	if (ret)
 		goto err;
 
@@ -229,10 +540,15 @@ static int bch2_copygc(struct btree_trans *trans,
 
 		ret = __bch2_evacuate_bucket(trans, ctxt, f, f->bucket.k.bucket,
 					     f->bucket.k.gen, data_opts);
-		if (ret)
+		if (ret) {
+			i++;
 			goto err;
+		}
 	}
 err:
+	/* Buckets we didn't get to go back in the histogram: */
+	for (; i && i < buckets.data + buckets.nr; i++)
+		frag_release(c, i->k.bucket, false);
 	darray_exit(&buckets);
 
 	/* no entries in LRU btree found, or got to end: */
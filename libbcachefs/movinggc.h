@@ -2,6 +2,9 @@
 #ifndef _BCACHEFS_MOVINGGC_H
 #define _BCACHEFS_MOVINGGC_H
 
+void bch2_copygc_frag_update(struct bch_dev *, u64, u64);
+void bch2_dev_copygc_frag_free(struct bch_dev *);
+
 unsigned long bch2_copygc_wait_amount(struct bch_fs *);
 void bch2_copygc_wait_to_text(struct printbuf *, struct bch_fs *);
 
@@ -409,6 +409,11 @@ int bch2_opt_check_may_set(struct bch_fs *c, int id, u64 v)
 	case Opt_background_compression:
 		ret = bch2_check_set_has_compressed_data(c, v);
 		break;
+	case Opt_metadata_compression:
+		ret = bch2_check_set_has_compressed_data(c, v);
+		if (!ret && v)
+			bch2_check_set_feature(c, BCH_FEATURE_btree_node_compression);
+		break;
 	case Opt_erasure_code:
 		if (v)
 			bch2_check_set_feature(c, BCH_FEATURE_ec);
@@ -182,6 +182,11 @@ enum fsck_err_opts {
 	  OPT_FN(bch2_opt_compression),					\
 	  BCH_SB_BACKGROUND_COMPRESSION_TYPE,BCH_COMPRESSION_OPT_none,	\
 	  NULL,		NULL)						\
+	x(metadata_compression,		u8,				\
+	  OPT_FS|OPT_FORMAT|OPT_MOUNT|OPT_RUNTIME,			\
+	  OPT_FN(bch2_opt_compression),					\
+	  BCH_SB_METADATA_COMPRESSION_TYPE,BCH_COMPRESSION_OPT_none,	\
+	  NULL,		"Compression for btree node writes")		\
 	x(str_hash,			u8,				\
 	  OPT_FS|OPT_FORMAT|OPT_MOUNT|OPT_RUNTIME,			\
 	  OPT_STR(bch2_str_hash_opts),					\
@@ -321,6 +326,12 @@ enum fsck_err_opts {
 	  OPT_UINT(0, U32_MAX),						\
 	  BCH_SB_JOURNAL_RECLAIM_DELAY,	100,				\
 	  NULL,		"Delay in milliseconds before automatic journal reclaim")\
+	x(journal_max_in_flight,	u8,				\
+	  OPT_FS|OPT_MOUNT|OPT_RUNTIME,					\
+	  OPT_UINT(1, JOURNAL_BUF_NR),					\
+	  BCH2_NO_SB_OPT,		4,				\
+	  NULL,		"Maximum number of journal entries open or\n"	\
+			"waiting to be written")			\
 	x(move_bytes_in_flight,		u32,				\
 	  OPT_HUMAN_READABLE|OPT_FS|OPT_MOUNT|OPT_RUNTIME,		\
 	  OPT_UINT(1024, U32_MAX),					\
@@ -331,6 +342,18 @@ enum fsck_err_opts {
 	  OPT_UINT(1, 1024),						\
 	  BCH2_NO_SB_OPT,		32,				\
 	  NULL,		"Maximum number of IOs to keep in flight by the move path")\
+	x(rebalance_bandwidth_percent,	u8,				\
+	  OPT_FS|OPT_MOUNT|OPT_RUNTIME,					\
+	  OPT_UINT(1, 100),						\
+	  BCH2_NO_SB_OPT,		25,				\
+	  "%",		"Maximum share of device IO for rebalance to use,\n"\
+			"when there is foreground IO")			\
+	x(rebalance_latency_target_us,	u32,				\
+	  OPT_FS|OPT_MOUNT|OPT_RUNTIME,					\
+	  OPT_UINT(0, U32_MAX),						\
+	  BCH2_NO_SB_OPT,		0,				\
+	  NULL,		"Throttle rebalance when device write latency\n"\
+			"exceeds this many microseconds (0 to disable)")\
 	x(fsck,				u8,				\
 	  OPT_FS|OPT_MOUNT,						\
 	  OPT_BOOL(),							\
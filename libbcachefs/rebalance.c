@@ -3,12 +3,14 @@
 #include "bcachefs.h"
 #include "alloc_foreground.h"
 #include "btree_iter.h"
+#include "btree_update.h"
 #include "buckets.h"
 #include "clock.h"
 #include "compress.h"
 #include "disk_groups.h"
 #include "errcode.h"
 #include "extents.h"
+#include "inode.h"
 #include "io.h"
 #include "move.h"
 #include "rebalance.h"
@@ -19,10 +21,92 @@
 #include <linux/kthread.h>
 #include <linux/sched/cputime.h>
 
+/* minimum 1 mb/sec: */
+#define REBALANCE_MIN_RATE	(1U << 11)
+
+static u64 rebalance_max_write_latency(struct bch_fs *c)
+{
+	struct bch_dev *ca;
+	unsigned i;
+	u64 ret = 0;
+
+	rcu_read_lock();
+	for_each_member_device_rcu(ca, c, i, &c->rw_devs[BCH_DATA_user])
+		ret = max_t(u64, ret, atomic64_read(&ca->cur_latency[WRITE]));
+	rcu_read_unlock();
+
+	return ret;
+}
+
+/*
+ * Rate controller: once a second, compare how fast we're moving data against
+ * how fast we're allowed to.
+ *
+ * Everything rebalance moves shows up on both the read and write io clocks, so
+ * the rest of the io clock is foreground IO; rebalance gets at most
+ * rebalance_bandwidth_percent of the total, or everything if there's no
+ * foreground IO. If write latency on the target devices is over
+ * rebalance_latency_target_us, the allowed rate is scaled down in proportion.
+ *
+ * The rate is never allowed to get more than 2x ahead of what we're actually
+ * achieving, so that it can come back down quickly when foreground IO starts.
+ */
+static void rebalance_update_rate(struct bch_fs *c, struct bch_move_stats *stats)
+{
+	struct bch_fs_rebalance *r = &c->rebalance;
+	unsigned long elapsed = jiffies - r->pd.last_update;
+	unsigned percent = c->opts.rebalance_bandwidth_percent;
+	u64 latency_target = (u64) c->opts.rebalance_latency_target_us * NSEC_PER_USEC;
+	u64 io[2], moved, total, bg, fg, target = U32_MAX;
+
+	if (elapsed < HZ)
+		return;
+
+	io[READ]	= atomic64_read(&c->io_clock[READ].now);
+	io[WRITE]	= atomic64_read(&c->io_clock[WRITE].now);
+	moved		= atomic64_read(&stats->sectors_moved);
+
+	total	= (io[READ]  - r->rate_last_io[READ]) +
+		  (io[WRITE] - r->rate_last_io[WRITE]);
+	bg	= min(moved - r->rate_last_moved, total / 2);
+	fg	= total - bg * 2;
+
+	r->rate_last_io[READ]	= io[READ];
+	r->rate_last_io[WRITE]	= io[WRITE];
+	r->rate_last_moved	= moved;
+
+	/* sectors/sec: */
+	bg = div_u64(bg * HZ, elapsed);
+	fg = div_u64(fg * HZ, elapsed);
+
+	r->rate_fg_sectors	= fg;
+	r->rate_write_latency	= rebalance_max_write_latency(c);
+	r->rate_limited_by	= REBALANCE_LIMIT_NONE;
+
+	if (fg && percent < 100) {
+		target = div_u64(fg * percent, (100 - percent) * 2);
+		r->rate_limited_by = REBALANCE_LIMIT_BANDWIDTH;
+	}
+
+	if (latency_target && r->rate_write_latency > latency_target) {
+		u64 latency_limited = div64_u64(bg * latency_target,
+						r->rate_write_latency);
+
+		if (latency_limited < target) {
+			target = latency_limited;
+			r->rate_limited_by = REBALANCE_LIMIT_LATENCY;
+		}
+	}
+
+	bch2_pd_controller_update(&r->pd, target, bg, 1);
+
+	r->pd.rate.rate = clamp_t(u64, r->pd.rate.rate, REBALANCE_MIN_RATE,
+				  max_t(u64, bg * 2, REBALANCE_MIN_RATE));
+}
+
 /*
- * Check if an extent should be moved:
- * returns -1 if it should not be moved, or
- * device of pointer that should be moved, if known, or INT_MAX if unknown
+ * Check if an extent should be moved - @arg is the rebalance thread's
+ * bch_move_stats, or NULL if we're not called from the rebalance thread:
  */
 static bool rebalance_pred(struct bch_fs *c, void *arg,
 			   struct bkey_s_c k,
@@ -32,6 +116,10 @@ static bool rebalance_pred(struct bch_fs *c, void *arg,
 	struct bkey_ptrs_c ptrs = bch2_bkey_ptrs_c(k);
 	unsigned i;
 
+	/* We're called for every extent we look at, often enough to drive this: */
+	if (arg)
+		rebalance_update_rate(c, arg);
+
 	data_opts->rewrite_ptrs		= 0;
 	data_opts->target		= io_opts->background_target;
 	data_opts->extra_replicas	= 0;
@@ -83,7 +171,7 @@ void bch2_rebalance_add_key(struct bch_fs *c,
 	i = 0;
 	ptrs = bch2_bkey_ptrs_c(k);
 	bkey_for_each_ptr(ptrs, ptr) {
-		if ((1U << i) && update_opts.rewrite_ptrs)
+		if ((1U << i) & update_opts.rewrite_ptrs)
 			if (atomic64_add_return(k.k->size,
 					&bch_dev_bkey_exists(c, ptr->dev)->rebalance_work) ==
 			    k.k->size)
@@ -92,6 +180,71 @@ void bch2_rebalance_add_key(struct bch_fs *c,
 	}
 }
 
+static int rebalance_io_opts_get(struct btree_trans *trans,
+				 enum btree_id btree, struct bkey_s_c k,
+				 struct bch_io_opts *io_opts)
+{
+	struct bch_fs *c = trans->c;
+	struct btree_iter iter;
+	struct bkey_s_c inode_k;
+	struct bch_inode_unpacked inode;
+	int ret;
+
+	*io_opts = bch2_opts_to_inode_opts(c->opts);
+
+	if (btree != BTREE_ID_extents)
+		return 0;
+
+	/*
+	 * Not a cached lookup: the inode may only exist in an ancestor of the
+	 * extent's snapshot, and we want the version visible from it:
+	 */
+	inode_k = bch2_bkey_get_iter(trans, &iter, BTREE_ID_inodes,
+				     SPOS(0, k.k->p.inode, k.k->p.snapshot), 0);
+	ret = bkey_err(inode_k);
+	if (ret)
+		return ret;
+
+	if (bkey_is_inode(inode_k.k) &&
+	    !bch2_inode_unpack(inode_k, &inode))
+		bch2_inode_opts_get(io_opts, c, &inode);
+
+	bch2_trans_iter_exit(trans, &iter);
+	return 0;
+}
+
+/*
+ * Extent trigger: keeps the rebalance_work index in sync with the extents
+ * btrees. Entries are at the extent's position, so when an extent is trimmed,
+ * split or merged, the overwrite deletes the old entry and the insert adds an
+ * entry for the new key if it still needs work. Overwrite triggers run first,
+ * and write buffer updates to the same position within a transaction are
+ * coalesced, so an extent that's replaced in place keeps its entry:
+ */
+int bch2_trans_mark_rebalance_work(struct btree_trans *trans,
+				   enum btree_id btree, struct bkey_s_c k,
+				   unsigned flags)
+{
+	struct bch_io_opts io_opts;
+	struct data_update_opts data_opts;
+	int ret;
+
+	if (!bkey_extent_is_direct_data(k.k))
+		return 0;
+
+	if (flags & BTREE_TRIGGER_OVERWRITE)
+		return bch2_btree_bit_mod(trans, BTREE_ID_rebalance_work,
+					  k.k->p, false);
+
+	ret = rebalance_io_opts_get(trans, btree, k, &io_opts);
+	if (ret)
+		return ret;
+
+	return rebalance_pred(trans->c, NULL, k, &io_opts, &data_opts)
+		? bch2_btree_bit_mod(trans, BTREE_ID_rebalance_work, k.k->p, true)
+		: 0;
+}
+
 void bch2_rebalance_add_work(struct bch_fs *c, u64 sectors)
 {
 	if (atomic64_add_return(sectors, &c->rebalance.work_unknown_dev) ==
@@ -99,6 +252,12 @@ void bch2_rebalance_add_work(struct bch_fs *c, u64 sectors)
 		rebalance_wakeup(c);
 }
 
+static const char * const bch2_rebalance_limit_strs[] = {
+	[REBALANCE_LIMIT_NONE]		= "none",
+	[REBALANCE_LIMIT_BANDWIDTH]	= "bandwidth",
+	[REBALANCE_LIMIT_LATENCY]	= "latency",
+};
+
 struct rebalance_work {
 	int		dev_most_full_idx;
 	unsigned	dev_most_full_percent;
@@ -176,8 +335,9 @@ static int bch2_rebalance_thread(void *arg)
 	struct bch_fs *c = arg;
 	struct bch_fs_rebalance *r = &c->rebalance;
 	struct io_clock *clock = &c->io_clock[WRITE];
-	struct rebalance_work w, p;
+	struct rebalance_work w;
 	struct bch_move_stats move_stats;
+	bool walk_index = true, scan;
 	unsigned long start, prev_start;
 	unsigned long prev_run_time, prev_run_cputime;
 	unsigned long cputime, prev_cputime;
@@ -187,7 +347,6 @@ static int bch2_rebalance_thread(void *arg)
 	set_freezable();
 
 	io_start	= atomic64_read(&clock->now);
-	p		= rebalance_work(c);
 	prev_start	= jiffies;
 	prev_cputime	= curr_cputime();
 
@@ -204,7 +363,11 @@ static int bch2_rebalance_thread(void *arg)
 		w			= rebalance_work(c);
 		BUG_ON(!w.dev_most_full_capacity);
 
-		if (!w.total_work) {
+		/*
+		 * Always walk the index once at startup: it may have entries
+		 * from before we were last shut down
+		 */
+		if (!w.total_work && !walk_index) {
 			r->state = REBALANCE_WAITING;
 			kthread_wait_freezable(rebalance_work(c).total_work);
 			continue;
@@ -235,31 +398,46 @@ static int bch2_rebalance_thread(void *arg)
 			}
 		}
 
-		/* minimum 1 mb/sec: */
-		r->pd.rate.rate =
-			max_t(u64, 1 << 11,
-			      r->pd.rate.rate *
-			      max(p.dev_most_full_percent, 1U) /
-			      max(w.dev_most_full_percent, 1U));
-
 		io_start	= atomic64_read(&clock->now);
-		p		= w;
 		prev_start	= start;
 		prev_cputime	= cputime;
 
 		r->state = REBALANCE_RUNNING;
 		memset(&move_stats, 0, sizeof(move_stats));
+		r->rate_last_moved = 0;
+		walk_index = false;
+		scan = atomic64_read(&r->work_unknown_dev) != 0;
 		rebalance_work_reset(c);
 
-		bch2_move_data(c,
-			       0,		POS_MIN,
-			       BTREE_ID_NR,	POS_MAX,
-			       /* ratelimiting disabled for now */
-			       NULL, /*  &r->pd.rate, */
-			       &move_stats,
-			       writepoint_ptr(&c->rebalance_write_point),
-			       true,
-			       rebalance_pred, NULL);
+		/*
+		 * Work we can't find from the index - options changed, or
+		 * extents written before the index existed - means a full scan:
+		 */
+		if (scan &&
+		    !bch2_move_data(c,
+				    0,		POS_MIN,
+				    BTREE_ID_NR,	POS_MAX,
+				    &r->pd.rate,
+				    &move_stats,
+				    writepoint_ptr(&c->rebalance_write_point),
+				    true,
+				    rebalance_pred, &move_stats) &&
+		    !kthread_should_stop() &&
+		    !(c->sb.compat & (1ULL << BCH_COMPAT_rebalance_work_index))) {
+			/* Everything the index didn't have has now been moved: */
+			mutex_lock(&c->sb_lock);
+			c->disk_sb.sb->compat[0] |=
+				cpu_to_le64(1ULL << BCH_COMPAT_rebalance_work_index);
+			bch2_write_super(c);
+			mutex_unlock(&c->sb_lock);
+		}
+
+		bch2_move_data_indexed(c, BTREE_ID_rebalance_work,
+				       &r->pd.rate,
+				       &move_stats,
+				       writepoint_ptr(&c->rebalance_write_point),
+				       true,
+				       rebalance_pred, &move_stats);
 	}
 
 	return 0;
@@ -289,11 +467,29 @@ void bch2_rebalance_work_to_text(struct printbuf *out, struct bch_fs *c)
 	prt_human_readable_u64(out, c->capacity << 9);
 	prt_newline(out);
 
-	prt_printf(out, "rate:");
+	prt_printf(out, "full scan pending:");
+	prt_tab(out);
+	prt_printf(out, "%s", atomic64_read(&c->rebalance.work_unknown_dev) ? "yes" : "no");
+	prt_newline(out);
+
+	prt_printf(out, "rate limited by:");
 	prt_tab(out);
-	prt_printf(out, "%u", r->pd.rate.rate);
+	prt_printf(out, "%s", bch2_rebalance_limit_strs[r->rate_limited_by]);
 	prt_newline(out);
 
+	prt_printf(out, "foreground io:");
+	prt_tab(out);
+	prt_human_readable_u64(out, r->rate_fg_sectors << 9);
+	prt_printf(out, "/sec");
+	prt_newline(out);
+
+	prt_printf(out, "write latency:");
+	prt_tab(out);
+	prt_printf(out, "%llu us", div_u64(r->rate_write_latency, NSEC_PER_USEC));
+	prt_newline(out);
+
+	bch2_pd_controller_debug_to_text(out, &r->pd);
+
 	switch (r->state) {
 	case REBALANCE_WAITING:
 		prt_printf(out, "waiting");
@@ -359,6 +555,18 @@ int bch2_rebalance_start(struct bch_fs *c)
 void bch2_fs_rebalance_init(struct bch_fs *c)
 {
 	bch2_pd_controller_init(&c->rebalance.pd);
-
-	atomic64_set(&c->rebalance.work_unknown_dev, S64_MAX);
+	/*
+	 * The defaults are tuned for inputs that change slowly; our target
+	 * tracks foreground IO, so correct by half the error every second:
+	 */
+	c->rebalance.pd.p_term_inverse	= 2;
+	c->rebalance.pd.d_term		= 1;
+	c->rebalance.pd.d_smooth	= 1;
+
+	/*
+	 * Extents needing work are found via the rebalance_work index, which the
+	 * extent trigger keeps up to date; recovery requests a full scan when
+	 * upgrading from a version without the index:
+	 */
+	atomic64_set(&c->rebalance.work_unknown_dev, 0);
 }
@@ -17,6 +17,8 @@ static inline void rebalance_wakeup(struct bch_fs *c)
 
 void bch2_rebalance_add_key(struct bch_fs *, struct bkey_s_c,
 			    struct bch_io_opts *);
+int bch2_trans_mark_rebalance_work(struct btree_trans *, enum btree_id,
+				   struct bkey_s_c, unsigned);
 void bch2_rebalance_add_work(struct bch_fs *, u64);
 
 void bch2_rebalance_work_to_text(struct printbuf *, struct bch_fs *);
@@ -10,10 +10,23 @@ enum rebalance_state {
 	REBALANCE_RUNNING,
 };
 
+enum rebalance_limit {
+	REBALANCE_LIMIT_NONE,
+	REBALANCE_LIMIT_BANDWIDTH,
+	REBALANCE_LIMIT_LATENCY,
+};
+
 struct bch_fs_rebalance {
 	struct task_struct __rcu *thread;
 	struct bch_pd_controller pd;
 
+	/* Rate controller inputs, sampled when the controller is updated: */
+	u64			rate_last_io[2];
+	u64			rate_last_moved;
+	u64			rate_fg_sectors;
+	u64			rate_write_latency;
+	enum rebalance_limit	rate_limited_by;
+
 	atomic64_t		work_unknown_dev;
 
 	enum rebalance_state	state;
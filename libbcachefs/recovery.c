@@ -21,6 +21,7 @@
 #include "lru.h"
 #include "move.h"
 #include "quota.h"
+#include "rebalance.h"
 #include "recovery.h"
 #include "replicas.h"
 #include "subvolume.h"
@@ -627,6 +628,99 @@ out:
 	return ret;
 }
 
+/*
+ * Btrees that are still empty on disk - e.g. if we crashed before their first
+ * node was written - are bulk loaded from their journal keys, instead of
+ * replaying them one transaction at a time:
+ */
+#define JOURNAL_REPLAY_BULK_LOAD_MIN	1024
+
+/*
+ * A bulk load needs there to be no other updates to the btree until it's done:
+ * the triggers it runs for new nodes update alloc keys through the key cache,
+ * so btrees with a key cache or triggers of their own are replayed normally:
+ */
+static bool journal_replay_can_bulk_load(struct bch_fs *c, enum btree_id btree)
+{
+	return  !btree_id_cached(c, btree) &&
+		!btree_node_type_needs_gc(__btree_node_type(0, btree));
+}
+
+static int journal_replay_bulk_load_btree(struct btree_trans *trans,
+					  struct journal_key *start,
+					  struct journal_key *end)
+{
+	struct btree_bulk_load bulk;
+	struct journal_key *k;
+	int ret;
+
+	ret = bch2_btree_bulk_load_start(trans, &bulk, start->btree_id,
+					 BTREE_INSERT_NOFAIL|
+					 BCH_WATERMARK_reclaim,
+					 BTREE_TRIGGER_NORUN);
+	if (ret == -BCH_ERR_btree_bulk_load_not_empty)
+		return 0;
+	if (ret)
+		return ret;
+
+	for (k = start; k < end && !ret; k++)
+		if (!k->overwritten)
+			ret = bch2_btree_bulk_load_add(&bulk, k->k);
+
+	ret = ret ?: bch2_btree_bulk_load_finish(&bulk);
+	bch2_btree_bulk_load_exit(&bulk);
+
+	/*
+	 * Something else updated the btree before we could swap in the new
+	 * root: the new nodes are leaked until fsck, and the keys are replayed
+	 * normally:
+	 */
+	if (ret == -BCH_ERR_btree_bulk_load_not_empty)
+		return 0;
+
+	if (!ret) {
+		bch_verbose(trans->c, "journal replay: bulk loaded %llu keys into btree %s",
+			    bulk.nr_keys, bch2_btree_ids[start->btree_id]);
+
+		for (k = start; k < end; k++)
+			k->overwritten = true;
+	}
+
+	return ret;
+}
+
+static int journal_replay_bulk_load(struct bch_fs *c)
+{
+	struct journal_keys *keys = &c->journal_keys;
+	struct journal_key *start, *end;
+	int ret = 0;
+
+	for (start = keys->d; start < keys->d + keys->nr && !ret; start = end) {
+		bool leaf_only = true;
+
+		for (end = start;
+		     end < keys->d + keys->nr && end->btree_id == start->btree_id;
+		     end++)
+			leaf_only &= !end->level;
+
+		if (!leaf_only ||
+		    end - start < JOURNAL_REPLAY_BULK_LOAD_MIN ||
+		    !journal_replay_can_bulk_load(c, start->btree_id))
+			continue;
+
+		if (!test_bit(BCH_FS_RW, &c->flags)) {
+			ret = bch2_fs_read_write_early(c);
+			if (ret)
+				break;
+		}
+
+		ret = bch2_trans_run(c,
+			journal_replay_bulk_load_btree(&trans, start, end));
+	}
+
+	return ret;
+}
+
 static int journal_sort_seq_cmp(const void *_l, const void *_r)
 {
 	const struct journal_key *l = *((const struct journal_key **)_l);
@@ -638,7 +732,7 @@ static int journal_sort_seq_cmp(const void *_l, const void *_r)
 static int bch2_journal_replay(struct bch_fs *c)
 {
 	struct journal_keys *keys = &c->journal_keys;
-	struct journal_key **keys_sorted, *k;
+	struct journal_key **keys_sorted = NULL, *k;
 	struct journal *j = &c->journal;
 	u64 start_seq	= c->journal_replay_seq_start;
 	u64 end_seq	= c->journal_replay_seq_start;
@@ -648,6 +742,10 @@ static int bch2_journal_replay(struct bch_fs *c)
 	move_gap(keys->d, keys->nr, keys->size, keys->gap, keys->nr);
 	keys->gap = keys->nr;
 
+	ret = journal_replay_bulk_load(c);
+	if (ret)
+		goto err;
+
 	keys_sorted = kvmalloc_array(sizeof(*keys_sorted), keys->nr, GFP_KERNEL);
 	if (!keys_sorted)
 		return -BCH_ERR_ENOMEM_journal_replay;
@@ -673,6 +771,10 @@ static int bch2_journal_replay(struct bch_fs *c)
 
 		replay_now_at(j, k->journal_seq);
 
+		/* Skip keys that were bulk loaded, or otherwise overwritten: */
+		if (k->overwritten)
+			continue;
+
 		ret = bch2_trans_do(c, NULL, NULL,
 				    BTREE_INSERT_LAZY_RW|
 				    BTREE_INSERT_NOFAIL|
@@ -1314,6 +1416,13 @@ int bch2_fs_recovery(struct bch_fs *c)
 		goto err;
 	}
 
+	/*
+	 * Extents written before the rebalance_work btree existed, or by code
+	 * that doesn't maintain it, aren't indexed:
+	 */
+	if (!(c->sb.compat & (1ULL << BCH_COMPAT_rebalance_work_index)))
+		bch2_rebalance_add_work(c, S64_MAX);
+
 	if (c->opts.fsck || !(c->opts.nochanges && c->opts.norecovery))
 		check_version_upgrade(c);
 
@@ -1548,6 +1657,7 @@ int bch2_fs_initialize(struct bch_fs *c)
 	mutex_lock(&c->sb_lock);
 	c->disk_sb.sb->compat[0] |= cpu_to_le64(1ULL << BCH_COMPAT_extents_above_btree_updates_done);
 	c->disk_sb.sb->compat[0] |= cpu_to_le64(1ULL << BCH_COMPAT_bformat_overflow_done);
+	c->disk_sb.sb->compat[0] |= cpu_to_le64(1ULL << BCH_COMPAT_rebalance_work_index);
 
 	bch2_sb_maybe_downgrade(c);
 
@@ -304,7 +304,7 @@ void bch2_fs_read_only(struct bch_fs *c)
 	    !c->opts.norecovery) {
 		BUG_ON(c->journal.last_empty_seq != journal_cur_seq(&c->journal));
 		BUG_ON(atomic_read(&c->btree_cache.dirty));
-		BUG_ON(atomic_long_read(&c->btree_key_cache.nr_dirty));
+		BUG_ON(bch2_btree_key_cache_nr_dirty(&c->btree_key_cache));
 		BUG_ON(c->btree_write_buffer.state.nr);
 
 		bch_verbose(c, "marking filesystem clean");
@@ -777,6 +777,18 @@ static struct bch_fs *bch2_fs_alloc(struct bch_sb *sb, struct bch_opts opts)
 
 	bch2_opts_apply(&c->opts, opts);
 
+	/*
+	 * metadata_compression may have been passed as a mount option: btree
+	 * node writes only compress once the feature bit is set:
+	 */
+	if (c->opts.metadata_compression) {
+		mutex_lock(&c->sb_lock);
+		c->disk_sb.sb->features[0] |=
+			cpu_to_le64(BIT_ULL(BCH_FEATURE_btree_node_compression));
+		c->sb.features |= BIT_ULL(BCH_FEATURE_btree_node_compression);
+		mutex_unlock(&c->sb_lock);
+	}
+
 	c->btree_key_cache_btrees |= 1U << BTREE_ID_alloc;
 	if (c->opts.inodes_use_key_cache)
 		c->btree_key_cache_btrees |= 1U << BTREE_ID_inodes;
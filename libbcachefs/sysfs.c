@@ -274,6 +274,8 @@ static size_t bch2_btree_cache_size(struct bch_fs *c)
 	mutex_lock(&c->btree_cache.lock);
 	list_for_each_entry(b, &c->btree_cache.live, list)
 		ret += btree_bytes(c);
+	list_for_each_entry(b, &c->btree_cache.probation, list)
+		ret += btree_bytes(c);
 
 	mutex_unlock(&c->btree_cache.lock);
 	return ret;
@@ -745,6 +747,9 @@ STORE(bch2_fs_opts_dir)
 		rebalance_wakeup(c);
 	}
 
+	if (id == Opt_journal_max_in_flight)
+		journal_wake(&c->journal);
+
 	ret = size;
 err:
 	bch2_write_ref_put(c, BCH_WRITE_REF_sysfs);
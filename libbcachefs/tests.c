@@ -2,9 +2,14 @@
 #ifdef CONFIG_BCACHEFS_TESTS
 
 #include "bcachefs.h"
+#include "alloc_foreground.h"
 #include "btree_update.h"
+#include "extents.h"
+#include "journal.h"
 #include "journal_reclaim.h"
+#include "move.h"
 #include "subvolume.h"
+#include "super.h"
 #include "tests.h"
 
 #include "linux/kthread.h"
@@ -442,6 +447,101 @@ static int test_peek_end_extents(struct bch_fs *c, u64 nr)
 	return 0;
 }
 
+static int test_peek_many(struct bch_fs *c, u64 nr)
+{
+	struct btree_trans trans;
+	struct btree_iter iter;
+	struct btree *b, *leaf = NULL;
+	struct bkey_s_c k[64];
+	struct bkey u[64];
+	unsigned leaves = 0, leaves_total = 0;
+	bool restarted = false;
+	u64 i;
+	int j, ret = 0;
+
+	bch2_trans_init(&trans, c, 0, 0);
+
+	delete_test_keys(c);
+
+	pr_info("inserting test keys");
+
+	for (i = 0; i < nr; i++) {
+		struct bkey_i_cookie ck;
+
+		bkey_cookie_init(&ck.k_i);
+		ck.k.p.offset = i;
+		ck.k.p.snapshot = U32_MAX;
+
+		ret = bch2_btree_insert(c, BTREE_ID_xattrs, &ck.k_i,
+					NULL, NULL, 0);
+		if (ret) {
+			bch_err_msg(c, ret, "insert error");
+			goto err;
+		}
+	}
+
+	pr_info("iterating in batches");
+
+	i = 0;
+
+	bch2_trans_begin(&trans);
+	bch2_trans_iter_init(&trans, &iter, BTREE_ID_xattrs,
+			     SPOS(0, 0, U32_MAX), 0);
+
+	while (1) {
+		ret = bch2_btree_iter_peek_many_and_restart_outlined(&iter,
+					POS(0, U64_MAX), k, u, ARRAY_SIZE(k));
+		if (ret <= 0)
+			break;
+
+		if (iter.path->l[0].b != leaf) {
+			leaf = iter.path->l[0].b;
+			leaves++;
+		}
+
+		/* a batch never extends past the leaf it started in: */
+		for (j = 0; j < ret; j++) {
+			BUG_ON(k[j].k->p.offset != i++);
+			BUG_ON(bpos_gt(k[j].k->p, leaf->key.k.p));
+		}
+
+		bch2_btree_iter_advance(&iter);
+
+		/* the next batch has to start over from a fresh traverse: */
+		if (!restarted && i >= nr / 2) {
+			btree_trans_restart(&trans, BCH_ERR_transaction_restart_fault_inject);
+			restarted = true;
+		}
+	}
+	bch2_trans_iter_exit(&trans, &iter);
+
+	if (ret) {
+		bch_err_msg(c, ret, "error iterating");
+		goto err;
+	}
+
+	BUG_ON(i != nr);
+	BUG_ON(nr && !restarted);
+
+	bch2_trans_begin(&trans);
+	for_each_btree_node(&trans, iter, BTREE_ID_xattrs, POS_MIN, 0, b, ret)
+		leaves_total++;
+	bch2_trans_iter_exit(&trans, &iter);
+	if (ret) {
+		bch_err_msg(c, ret, "error walking leaves");
+		goto err;
+	}
+
+	pr_info("%llu keys, batches from %u of %u leaves", nr, leaves, leaves_total);
+
+	/* with more than one leaf, iteration had to cross a leaf boundary: */
+	BUG_ON(leaves_total > 1 && leaves < 2);
+err:
+	delete_test_keys(c);
+	bch2_trans_exit(&trans);
+	return ret;
+}
+
 /* extent unit tests */
 
 static u64 test_version;
@@ -567,8 +667,149 @@ static int test_snapshots(struct bch_fs *c, u64 nr)
 	return 0;
 }
 
+struct test_move_seen {
+	struct bpos		pos[4];
+	unsigned		nr;
+};
+
+static bool test_move_pred(struct bch_fs *c, void *arg, struct bkey_s_c k,
+			   struct bch_io_opts *io_opts,
+			   struct data_update_opts *data_opts)
+{
+	struct test_move_seen *s = arg;
+
+	BUG_ON(s->nr >= ARRAY_SIZE(s->pos));
+	s->pos[s->nr++] = k.k->p;
+	return false;
+}
+
+/*
+ * Extents aren't moved, they only need pointers that pass validation - so we
+ * skip the triggers, and there's nothing to account:
+ */
+static int insert_test_move_extent(struct bch_fs *c, u64 start, u64 end,
+				   u32 snapshot, bool delete)
+{
+	struct bch_dev *ca = bch_dev_bkey_exists(c, 0);
+	struct {
+		struct bkey_i_extent	e;
+		struct bch_extent_ptr	ptr;
+	} k;
+
+	if (!delete) {
+		bkey_extent_init(&k.e.k_i);
+		bch2_bkey_append_ptr(&k.e.k_i, (struct bch_extent_ptr) {
+			.offset	= bucket_to_sector(ca, ca->mi.first_bucket),
+		});
+	} else {
+		bkey_init(&k.e.k);
+	}
+
+	k.e.k.p		= SPOS(0, end, snapshot);
+	k.e.k.size	= end - start;
+
+	return bch2_trans_do(c, NULL, NULL, 0,
+			__bch2_btree_insert(&trans, BTREE_ID_extents, &k.e.k_i,
+					    BTREE_TRIGGER_NORUN));
+}
+
+/*
+ * Moves are split into ranges of key positions; with snapshots an extent can
+ * sort after an extent it overlaps in another snapshot, so check that each key
+ * is seen exactly once when the range is split in the middle of one:
+ */
+static int test_move_snapshots(struct bch_fs *c, u64 nr)
+{
+	struct test_move_seen seen = { 0 };
+	struct bch_move_stats stats;
+	u32 snapids[2];
+	u32 snapid_subvols[2] = { 1, 1 };
+	int ret;
+
+	ret = bch2_trans_do(c, NULL, NULL, 0,
+		      bch2_snapshot_node_create(&trans, U32_MAX,
+						snapids,
+						snapid_subvols,
+						2));
+	if (ret)
+		return ret;
+
+	ret   = insert_test_move_extent(c, 10, 100, snapids[0], false) ?:
+		insert_test_move_extent(c, 94, 95,  snapids[1], false);
+	if (ret)
+		goto err;
+
+	bch2_move_stats_init(&stats, "test");
+	ret   = bch2_move_data(c,
+			       BTREE_ID_extents, POS_MIN,
+			       BTREE_ID_extents, POS(0, 50),
+			       NULL, &stats, writepoint_hashed(0), false,
+			       test_move_pred, &seen) ?:
+		bch2_move_data(c,
+			       BTREE_ID_extents, POS(0, 50),
+			       BTREE_ID_extents, SPOS_MAX,
+			       NULL, &stats, writepoint_hashed(0), false,
+			       test_move_pred, &seen);
+	if (ret)
+		goto err;
+
+	BUG_ON(seen.nr != 2);
+	BUG_ON(!bpos_eq(seen.pos[0], SPOS(0, 95, snapids[1])));
+	BUG_ON(!bpos_eq(seen.pos[1], SPOS(0, 100, snapids[0])));
+err:
+	ret   = insert_test_move_extent(c, 10, 100, snapids[0], true) ?:
+		insert_test_move_extent(c, 94, 95,  snapids[1], true) ?: ret;
+	return ret;
+}
+
 /* perf tests */
 
+/*
+ * Per operation latency histogram: buckets are log-linear, 16 per power of two,
+ * so percentiles are accurate to about 6%.
+ */
+#define PERF_HIST_SUB_BITS	BCH_PERF_TEST_HIST_BITS
+
+struct perf_test_thread {
+	u64			last;
+	u64			nr_ops;
+	u64			hist[BCH_PERF_TEST_HIST_NR];
+};
+
+static unsigned perf_hist_idx(u64 v)
+{
+	unsigned e;
+
+	if (v < (1U << PERF_HIST_SUB_BITS))
+		return v;
+
+	e = fls64(v) - 1;
+	return ((e - PERF_HIST_SUB_BITS + 1) << PERF_HIST_SUB_BITS) +
+		((v >> (e - PERF_HIST_SUB_BITS)) & ((1U << PERF_HIST_SUB_BITS) - 1));
+}
+
+static u64 perf_hist_val(unsigned idx)
+{
+	unsigned e = (idx >> PERF_HIST_SUB_BITS) + PERF_HIST_SUB_BITS - 1;
+
+	if (idx < (1U << PERF_HIST_SUB_BITS))
+		return idx;
+
+	return (u64) ((1U << PERF_HIST_SUB_BITS) +
+		      (idx & ((1U << PERF_HIST_SUB_BITS) - 1))) <<
+		(e - PERF_HIST_SUB_BITS);
+}
+
+/* Record the time since the previous operation finished: */
+static void perf_test_op_done(struct perf_test_thread *t)
+{
+	u64 now = local_clock();
+
+	t->hist[perf_hist_idx(now - t->last)]++;
+	t->nr_ops++;
+	t->last = now;
+}
+
 static u64 test_rand(void)
 {
 	u64 v;
@@ -577,7 +818,8 @@ static u64 test_rand(void)
 	return v;
 }
 
-static int rand_insert(struct bch_fs *c, u64 nr)
+static int rand_insert(struct bch_fs *c, u64 nr,
+		       struct perf_test_thread *t)
 {
 	struct btree_trans trans;
 	struct bkey_i_cookie k;
@@ -595,13 +837,16 @@ static int rand_insert(struct bch_fs *c, u64 nr)
 			__bch2_btree_insert(&trans, BTREE_ID_xattrs, &k.k_i, 0));
 		if (ret)
 			break;
+
+		perf_test_op_done(t);
 	}
 
 	bch2_trans_exit(&trans);
 	return ret;
 }
 
-static int rand_insert_multi(struct bch_fs *c, u64 nr)
+static int rand_insert_multi(struct bch_fs *c, u64 nr,
+			     struct perf_test_thread *t)
 {
 	struct btree_trans trans;
 	struct bkey_i_cookie k[8];
@@ -629,13 +874,54 @@ static int rand_insert_multi(struct bch_fs *c, u64 nr)
 			__bch2_btree_insert(&trans, BTREE_ID_xattrs, &k[7].k_i, 0));
 		if (ret)
 			break;
+
+		perf_test_op_done(t);
+	}
+
+	bch2_trans_exit(&trans);
+	return ret;
+}
+
+/*
+ * Like rand_insert, but waits for each commit to be flushed to disk, like an
+ * fsync after every update: latency depends on journal_max_in_flight.
+ */
+static int rand_insert_flush(struct bch_fs *c, u64 nr,
+			     struct perf_test_thread *t)
+{
+	struct btree_trans trans;
+	struct bkey_i_cookie k;
+	u64 i, seq;
+	int ret = 0;
+
+	bch2_trans_init(&trans, c, 0, 0);
+
+	for (i = 0; i < nr; i++) {
+		bkey_cookie_init(&k.k_i);
+		k.k.p.offset = test_rand();
+		k.k.p.snapshot = U32_MAX;
+
+		ret = commit_do(&trans, NULL, &seq, 0,
+			__bch2_btree_insert(&trans, BTREE_ID_xattrs, &k.k_i, 0));
+		if (ret)
+			break;
+
+		/* Don't hold btree locks while waiting on the journal: */
+		bch2_trans_unlock(&trans);
+
+		ret = bch2_journal_flush_seq(&c->journal, seq);
+		if (ret)
+			break;
+
+		perf_test_op_done(t);
 	}
 
 	bch2_trans_exit(&trans);
 	return ret;
 }
 
-static int rand_lookup(struct bch_fs *c, u64 nr)
+static int rand_lookup(struct bch_fs *c, u64 nr,
+		       struct perf_test_thread *t)
 {
 	struct btree_trans trans;
 	struct btree_iter iter;
@@ -654,6 +940,8 @@ static int rand_lookup(struct bch_fs *c, u64 nr)
 		ret = bkey_err(k);
 		if (ret)
 			break;
+
+		perf_test_op_done(t);
 	}
 
 	bch2_trans_iter_exit(&trans, &iter);
@@ -687,7 +975,8 @@ static int rand_mixed_trans(struct btree_trans *trans,
 	return ret;
 }
 
-static int rand_mixed(struct bch_fs *c, u64 nr)
+static int rand_mixed(struct bch_fs *c, u64 nr,
+		      struct perf_test_thread *t)
 {
 	struct btree_trans trans;
 	struct btree_iter iter;
@@ -705,6 +994,8 @@ static int rand_mixed(struct bch_fs *c, u64 nr)
 			rand_mixed_trans(&trans, &iter, &cookie, i, rand));
 		if (ret)
 			break;
+
+		perf_test_op_done(t);
 	}
 
 	bch2_trans_iter_exit(&trans, &iter);
@@ -734,7 +1025,8 @@ err:
 	return ret;
 }
 
-static int rand_delete(struct bch_fs *c, u64 nr)
+static int rand_delete(struct bch_fs *c, u64 nr,
+		       struct perf_test_thread *t)
 {
 	struct btree_trans trans;
 	int ret = 0;
@@ -749,13 +1041,16 @@ static int rand_delete(struct bch_fs *c, u64 nr)
 			__do_delete(&trans, pos));
 		if (ret)
 			break;
+
+		perf_test_op_done(t);
 	}
 
 	bch2_trans_exit(&trans);
 	return ret;
 }
 
-static int seq_insert(struct bch_fs *c, u64 nr)
+static int seq_insert(struct bch_fs *c, u64 nr,
+		      struct perf_test_thread *t)
 {
 	struct btree_iter iter;
 	struct bkey_s_c k;
@@ -771,11 +1066,13 @@ static int seq_insert(struct bch_fs *c, u64 nr)
 			if (iter.pos.offset >= nr)
 				break;
 			insert.k.p = iter.pos;
+			perf_test_op_done(t);
 			bch2_trans_update(&trans, &iter, &insert.k_i, 0);
 		})));
 }
 
-static int seq_lookup(struct bch_fs *c, u64 nr)
+static int seq_lookup(struct bch_fs *c, u64 nr,
+		      struct perf_test_thread *t)
 {
 	struct btree_iter iter;
 	struct bkey_s_c k;
@@ -783,11 +1080,14 @@ static int seq_lookup(struct bch_fs *c, u64 nr)
 	return bch2_trans_run(c,
 		for_each_btree_key2_upto(&trans, iter, BTREE_ID_xattrs,
 				  SPOS(0, 0, U32_MAX), POS(0, U64_MAX),
-				  0, k,
-		0));
+				  0, k, ({
+			perf_test_op_done(t);
+			0;
+		})));
 }
 
-static int seq_overwrite(struct bch_fs *c, u64 nr)
+static int seq_overwrite(struct bch_fs *c, u64 nr,
+			 struct perf_test_thread *t)
 {
 	struct btree_iter iter;
 	struct bkey_s_c k;
@@ -800,25 +1100,34 @@ static int seq_overwrite(struct bch_fs *c, u64 nr)
 			struct bkey_i_cookie u;
 
 			bkey_reassemble(&u.k_i, k);
+			perf_test_op_done(t);
 			bch2_trans_update(&trans, &iter, &u.k_i, 0);
 		})));
 }
 
-static int seq_delete(struct bch_fs *c, u64 nr)
+static int seq_delete(struct bch_fs *c, u64 nr,
+		      struct perf_test_thread *t)
 {
-	return bch2_btree_delete_range(c, BTREE_ID_xattrs,
-				      SPOS(0, 0, U32_MAX),
-				      POS(0, U64_MAX),
-				      0, NULL);
+	int ret = bch2_btree_delete_range(c, BTREE_ID_xattrs,
+					  SPOS(0, 0, U32_MAX),
+					  POS(0, U64_MAX),
+					  0, NULL);
+
+	perf_test_op_done(t);
+	return ret;
 }
 
-typedef int (*perf_test_fn)(struct bch_fs *, u64);
+typedef int (*unit_test_fn)(struct bch_fs *, u64);
+typedef int (*perf_test_fn)(struct bch_fs *, u64, struct perf_test_thread *);
 
 struct test_job {
 	struct bch_fs			*c;
 	u64				nr;
 	unsigned			nr_threads;
+	unit_test_fn			unit_fn;
 	perf_test_fn			fn;
+	struct perf_test_thread		*threads;
+	atomic_t			next_thread;
 
 	atomic_t			ready;
 	wait_queue_head_t		ready_wait;
@@ -834,6 +1143,9 @@ struct test_job {
 static int btree_perf_test_thread(void *data)
 {
 	struct test_job *j = data;
+	struct perf_test_thread *t =
+		&j->threads[atomic_inc_return(&j->next_thread) - 1];
+	u64 nr = div64_u64(j->nr, j->nr_threads);
 	int ret;
 
 	if (atomic_dec_and_test(&j->ready)) {
@@ -843,9 +1155,19 @@ static int btree_perf_test_thread(void *data)
 		wait_event(j->ready_wait, !atomic_read(&j->ready));
 	}
 
-	ret = j->fn(j->c, div64_u64(j->nr, j->nr_threads));
+	t->last = local_clock();
+
+	if (j->fn) {
+		ret = j->fn(j->c, nr, t);
+	} else {
+		/* Unit tests are timed as a single operation: */
+		ret = j->unit_fn(j->c, nr);
+		perf_test_op_done(t);
+	}
+
 	if (ret) {
-		bch_err(j->c, "%ps: error %s", j->fn, bch2_err_str(ret));
+		bch_err(j->c, "%ps: error %s",
+			j->fn ?: (void *) j->unit_fn, bch2_err_str(ret));
 		j->ret = ret;
 	}
 
@@ -857,15 +1179,77 @@ static int btree_perf_test_thread(void *data)
 	return 0;
 }
 
-int bch2_btree_perf_test(struct bch_fs *c, const char *testname,
-			 u64 nr, unsigned nr_threads)
+static u64 perf_test_restarts(struct bch_fs *c)
+{
+	u64 ret = 0;
+
+#define x(t, n)								\
+	if (!strncmp(#t, "trans_restart_", strlen("trans_restart_")))	\
+		ret += percpu_u64_get(&c->counters[BCH_COUNTER_##t]);
+	BCH_PERSISTENT_COUNTERS()
+#undef x
+
+	return ret;
+}
+
+/*
+ * Number of times we blocked on a btree node lock, and total time blocked:
+ * approximate, since time stats buffer recent events percpu:
+ */
+static void perf_test_lock_contended(struct bch_fs *c, u64 *nr, u64 *time)
+{
+	enum bch_time_stats i;
+
+	*nr = *time = 0;
+
+	for (i = BCH_TIME_btree_lock_contended_read;
+	     i <= BCH_TIME_btree_lock_contended_write;
+	     i++) {
+		struct bch2_time_stats *stats = &c->times[i];
+
+		spin_lock_irq(&stats->lock);
+		*nr	+= stats->duration_stats.n;
+		*time	+= stats->duration_stats.sum;
+		spin_unlock_irq(&stats->lock);
+	}
+}
+
+static void perf_test_percentiles(struct bch_perf_test_result *r)
+{
+	static const struct {
+		unsigned	permille;
+		size_t		offset;
+	} p[] = {
+		{ 500, offsetof(struct bch_perf_test_result, latency_p50)  },
+		{ 990, offsetof(struct bch_perf_test_result, latency_p99)  },
+		{ 999, offsetof(struct bch_perf_test_result, latency_p999) },
+	};
+	u64 seen = 0;
+	unsigned i, j = 0;
+
+	for (i = 0; i < BCH_PERF_TEST_HIST_NR; i++) {
+		if (!r->latency_hist[i])
+			continue;
+
+		seen += r->latency_hist[i];
+
+		while (j < ARRAY_SIZE(p) &&
+		       seen * 1000 >= r->nr_ops * p[j].permille)
+			*((u64 *) ((void *) r + p[j++].offset)) = perf_hist_val(i);
+
+		r->latency_max = perf_hist_val(i);
+	}
+}
+
+int bch2_btree_perf_test_run(struct bch_fs *c, const char *testname,
+			     u64 nr, unsigned nr_threads,
+			     struct bch_perf_test_result *r)
 {
 	struct test_job j = { .c = c, .nr = nr, .nr_threads = nr_threads };
-	char name_buf[20];
-	struct printbuf nr_buf = PRINTBUF;
-	struct printbuf per_sec_buf = PRINTBUF;
-	unsigned i;
-	u64 time;
+	u64 restarts, lock_contended, lock_contended_time;
+	unsigned i, k;
+
+	memset(r, 0, sizeof(*r));
 
 	atomic_set(&j.ready, nr_threads);
 	init_waitqueue_head(&j.ready_wait);
@@ -875,9 +1259,12 @@ int bch2_btree_perf_test(struct bch_fs *c, const char *testname,
 
 #define perf_test(_test)				\
 	if (!strcmp(testname, #_test)) j.fn = _test
+#define unit_test(_test)				\
+	if (!strcmp(testname, #_test)) j.unit_fn = _test
 
 	perf_test(rand_insert);
 	perf_test(rand_insert_multi);
+	perf_test(rand_insert_flush);
 	perf_test(rand_lookup);
 	perf_test(rand_mixed);
 	perf_test(rand_delete);
@@ -888,27 +1275,39 @@ int bch2_btree_perf_test(struct bch_fs *c, const char *testname,
 	perf_test(seq_delete);
 
 	/* a unit test, not a perf test: */
-	perf_test(test_delete);
-	perf_test(test_delete_written);
-	perf_test(test_iterate);
-	perf_test(test_iterate_extents);
-	perf_test(test_iterate_slots);
-	perf_test(test_iterate_slots_extents);
-	perf_test(test_peek_end);
-	perf_test(test_peek_end_extents);
-
-	perf_test(test_extent_overwrite_front);
-	perf_test(test_extent_overwrite_back);
-	perf_test(test_extent_overwrite_middle);
-	perf_test(test_extent_overwrite_all);
-
-	perf_test(test_snapshots);
-
-	if (!j.fn) {
+	unit_test(test_delete);
+	unit_test(test_delete_written);
+	unit_test(test_iterate);
+	unit_test(test_iterate_extents);
+	unit_test(test_iterate_slots);
+	unit_test(test_iterate_slots_extents);
+	unit_test(test_peek_end);
+	unit_test(test_peek_end_extents);
+	unit_test(test_peek_many);
+
+	unit_test(test_extent_overwrite_front);
+	unit_test(test_extent_overwrite_back);
+	unit_test(test_extent_overwrite_middle);
+	unit_test(test_extent_overwrite_all);
+
+	unit_test(test_snapshots);
+	unit_test(test_move_snapshots);
+#undef unit_test
+#undef perf_test
+
+	if (!j.fn && !j.unit_fn) {
 		pr_err("unknown test %s", testname);
 		return -EINVAL;
 	}
 
+	j.threads = kvmalloc_array(nr_threads, sizeof(*j.threads),
+				   GFP_KERNEL|__GFP_ZERO);
+	if (!j.threads)
+		return -ENOMEM;
+
+	restarts = perf_test_restarts(c);
+	perf_test_lock_contended(c, &lock_contended, &lock_contended_time);
+
 	//pr_info("running test %s:", testname);
 
 	if (nr_threads == 1)
@@ -921,7 +1320,44 @@ int bch2_btree_perf_test(struct bch_fs *c, const char *testname,
 	while (wait_for_completion_interruptible(&j.done_completion))
 		;
 
-	time = j.finish - j.start;
+	r->nr		= nr;
+	r->nr_threads	= nr_threads;
+	r->time		= j.finish - j.start;
+
+	for (i = 0; i < nr_threads; i++) {
+		r->nr_ops += j.threads[i].nr_ops;
+		for (k = 0; k < BCH_PERF_TEST_HIST_NR; k++)
+			r->latency_hist[k] += j.threads[i].hist[k];
+	}
+	perf_test_percentiles(r);
+
+	r->restarts = perf_test_restarts(c) - restarts;
+	perf_test_lock_contended(c, &r->lock_contended, &r->lock_contended_time);
+	r->lock_contended	-= lock_contended;
+	r->lock_contended_time	-= lock_contended_time;
+
+	kvfree(j.threads);
+	return j.ret;
+}
+
+int bch2_btree_perf_test(struct bch_fs *c, const char *testname,
+			 u64 nr, unsigned nr_threads)
+{
+	struct bch_perf_test_result *r = kvmalloc(sizeof(*r), GFP_KERNEL);
+	char name_buf[20];
+	struct printbuf nr_buf = PRINTBUF;
+	struct printbuf per_sec_buf = PRINTBUF;
+	u64 time;
+	int ret;
+
+	if (!r)
+		return -ENOMEM;
+
+	ret = bch2_btree_perf_test_run(c, testname, nr, nr_threads, r);
+	if (!r->nr)
+		goto out;
+
+	time = r->time;
 
 	scnprintf(name_buf, sizeof(name_buf), "%s:", testname);
 	prt_human_readable_u64(&nr_buf, nr);
@@ -931,9 +1367,14 @@ int bch2_btree_perf_test(struct bch_fs *c, const char *testname,
 		div_u64(time, NSEC_PER_SEC),
 		div_u64(time * nr_threads, nr),
 		per_sec_buf.buf);
+	printk(KERN_INFO "%-12s latency p50 %llu p99 %llu p999 %llu max %llu nsec, %llu restarts, %llu lock waits\n",
+		"", r->latency_p50, r->latency_p99, r->latency_p999,
+		r->latency_max, r->restarts, r->lock_contended);
 	printbuf_exit(&per_sec_buf);
 	printbuf_exit(&nr_buf);
-	return j.ret;
+out:
+	kvfree(r);
+	return ret;
 }
 
 #endif /* CONFIG_BCACHEFS_TESTS */
@@ -6,6 +6,28 @@ struct bch_fs;
 
 #ifdef CONFIG_BCACHEFS_TESTS
 
+/* Latency histogram buckets: log-linear, 1 << BCH_PERF_TEST_HIST_BITS per power of 2 */
+#define BCH_PERF_TEST_HIST_BITS	4
+#define BCH_PERF_TEST_HIST_NR	((64 - BCH_PERF_TEST_HIST_BITS + 1) << BCH_PERF_TEST_HIST_BITS)
+
+struct bch_perf_test_result {
+	u64		nr;
+	unsigned	nr_threads;
+	/* All times in nanoseconds: */
+	u64		time;
+	u64		nr_ops;
+	u64		latency_p50;
+	u64		latency_p99;
+	u64		latency_p999;
+	u64		latency_max;
+	u64		latency_hist[BCH_PERF_TEST_HIST_NR];
+	u64		restarts;
+	u64		lock_contended;
+	u64		lock_contended_time;
+};
+
+int bch2_btree_perf_test_run(struct bch_fs *, const char *, u64, unsigned,
+			     struct bch_perf_test_result *);
 int bch2_btree_perf_test(struct bch_fs *, const char *, u64, unsigned);
 
 #else
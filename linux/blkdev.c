@@ -2,7 +2,9 @@
 #include <alloca.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <sys/ioctl.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/uio.h>
@@ -10,6 +12,10 @@
 
 #include <libaio.h>
 
+#ifdef BCACHEFS_IO_URING
+#include <liburing.h>
+#endif
+
 #ifdef CONFIG_VALGRIND
 #include <valgrind/memcheck.h>
 #endif
@@ -19,50 +25,53 @@
 #include <linux/completion.h>
 #include <linux/fs.h>
 #include <linux/kthread.h>
+#include <linux/sort.h>
 
 #include "tools-util.h"
 
+/*
+ * A single read or write handed to the IO backend: when bios are plugged,
+ * adjacent bios are merged into one request and chained via bi_next.
+ */
+struct blkdev_io {
+	struct bio		*bio;
+	int			fd;
+	unsigned		op;
+	u64			offset;
+	size_t			bytes;
+	struct iovec		*iov;
+	unsigned		nr_iov;
+};
+
 struct fops {
 	void (*init)(void);
 	void (*cleanup)(void);
-	void (*read)(struct bio *bio, struct iovec * iov, unsigned i);
-	void (*write)(struct bio *bio, struct iovec * iov, unsigned i);
+	void (*submit)(struct blkdev_io *ios, unsigned nr);
+	void (*bdev_open)(struct block_device *bdev);
+	void (*bdev_close)(struct block_device *bdev);
 };
 
 static struct fops *fops;
 static io_context_t aio_ctx;
 static atomic_t running_requests;
 
-void generic_make_request(struct bio *bio)
+static inline int bio_fd(struct bio *bio)
+{
+	return bio->bi_opf & REQ_FUA
+		? bio->bi_bdev->bd_sync_fd
+		: bio->bi_bdev->bd_fd;
+}
+
+static struct iovec *bio_to_iovec(struct bio *bio, struct iovec *iov)
 {
-	struct iovec *iov;
 	struct bvec_iter iter;
 	struct bio_vec bv;
-	ssize_t ret;
-	unsigned i;
-
-	if (bio->bi_opf & REQ_PREFLUSH) {
-		ret = fdatasync(bio->bi_bdev->bd_fd);
-		if (ret) {
-			fprintf(stderr, "fsync error: %m\n");
-			bio->bi_status = BLK_STS_IOERR;
-			bio_endio(bio);
-			return;
-		}
-	}
 
-	i = 0;
-	bio_for_each_segment(bv, bio, iter)
-		i++;
-
-	iov = alloca(sizeof(*iov) * i);
-
-	i = 0;
 	bio_for_each_segment(bv, bio, iter) {
 		void *start = page_address(bv.bv_page) + bv.bv_offset;
 		size_t len = bv.bv_len;
 
-		iov[i++] = (struct iovec) {
+		*iov++ = (struct iovec) {
 			.iov_base = start,
 			.iov_len = len,
 		};
@@ -74,12 +83,174 @@ void generic_make_request(struct bio *bio)
 #endif
 	}
 
+	return iov;
+}
+
+/* Complete every bio in a (possibly merged) request: */
+static void blkdev_io_endio(struct bio *bio, ssize_t res)
+{
+	struct bio *next;
+	size_t bytes = 0;
+
+	for (next = bio; next; next = next->bi_next)
+		bytes += next->bi_iter.bi_size;
+
+	while (bio) {
+		next = bio->bi_next;
+		bio->bi_next = NULL;
+
+		if (res != bytes)
+			bio->bi_status = BLK_STS_IOERR;
+
+		bio_endio(bio);
+		bio = next;
+	}
+}
+
+static void blkdev_io_init(struct blkdev_io *io, struct bio *bio,
+			   struct iovec *iov)
+{
+	bio->bi_next = NULL;
+
+	*io = (struct blkdev_io) {
+		.bio		= bio,
+		.fd		= bio_fd(bio),
+		.op		= bio_op(bio),
+		.offset		= bio->bi_iter.bi_sector << 9,
+		.bytes		= bio->bi_iter.bi_size,
+		.iov		= iov,
+		.nr_iov		= bio_to_iovec(bio, iov) - iov,
+	};
+}
+
+static bool blkdev_io_merge(struct blkdev_io *io, struct bio *last,
+			    struct bio *bio)
+{
+	unsigned nr_iov = bio_segments(bio);
+
+	if (io->fd	!= bio_fd(bio) ||
+	    io->op	!= bio_op(bio) ||
+	    io->offset + io->bytes != bio->bi_iter.bi_sector << 9 ||
+	    io->nr_iov + nr_iov > IOV_MAX)
+		return false;
+
+	bio->bi_next	= NULL;
+	last->bi_next	= bio;
+
+	bio_to_iovec(bio, io->iov + io->nr_iov);
+	io->nr_iov	+= nr_iov;
+	io->bytes	+= bio->bi_iter.bi_size;
+	return true;
+}
+
+static int plugged_bio_cmp(const void *_l, const void *_r)
+{
+	struct bio *l = *((struct bio **) _l);
+	struct bio *r = *((struct bio **) _r);
+
+	if (bio_fd(l) != bio_fd(r))
+		return bio_fd(l) < bio_fd(r) ? -1 : 1;
+	if (bio_op(l) != bio_op(r))
+		return bio_op(l) < bio_op(r) ? -1 : 1;
+	if (l->bi_iter.bi_sector != r->bi_iter.bi_sector)
+		return l->bi_iter.bi_sector < r->bi_iter.bi_sector ? -1 : 1;
+	return 0;
+}
+
+void blk_start_plug(struct blk_plug *plug)
+{
+	plug->bios	= NULL;
+	plug->nr	= 0;
+
+	if (current && !current->plug)
+		current->plug = plug;
+}
+
+void blk_flush_plug(struct blk_plug *plug)
+{
+	struct bio *bios[BLK_MAX_REQUEST_COUNT], *bio, *last = NULL;
+	struct blkdev_io ios[BLK_MAX_REQUEST_COUNT];
+	struct iovec *iov, *next_iov;
+	unsigned i, nr = 0, nr_ios = 0, nr_iov = 0;
+
+	if (!plug || !plug->bios)
+		return;
+
+	while ((bio = plug->bios)) {
+		plug->bios = bio->bi_next;
+		bios[nr++] = bio;
+		nr_iov += bio_segments(bio);
+	}
+	plug->nr = 0;
+
+	/* Sort so that bios that can be merged are next to each other: */
+	sort(bios, nr, sizeof(bios[0]), plugged_bio_cmp, NULL);
+
+	next_iov = iov = xmalloc(sizeof(*iov) * max(nr_iov, 1U));
+
+	for (i = 0; i < nr; i++) {
+		bio = bios[i];
+
+		if (!nr_ios ||
+		    !blkdev_io_merge(&ios[nr_ios - 1], last, bio)) {
+			blkdev_io_init(&ios[nr_ios], bio, next_iov);
+			nr_ios++;
+		}
+
+		next_iov = ios[nr_ios - 1].iov + ios[nr_ios - 1].nr_iov;
+		last = bio;
+	}
+
+	/* iovecs only have to live until they've been handed to the kernel: */
+	fops->submit(ios, nr_ios);
+	free(iov);
+}
+
+void blk_finish_plug(struct blk_plug *plug)
+{
+	blk_flush_plug(plug);
+
+	if (current && current->plug == plug)
+		current->plug = NULL;
+}
+
+void generic_make_request(struct bio *bio)
+{
+	struct blk_plug *plug = current ? current->plug : NULL;
+	struct blkdev_io io;
+	ssize_t ret;
+
+	if ((bio_op(bio) == REQ_OP_READ ||
+	     bio_op(bio) == REQ_OP_WRITE) &&
+	    !(bio->bi_opf & REQ_PREFLUSH) &&
+	    plug) {
+		bio->bi_next = plug->bios;
+		plug->bios = bio;
+
+		if (++plug->nr >= BLK_MAX_REQUEST_COUNT)
+			blk_flush_plug(plug);
+		return;
+	}
+
+	/* Flushes must be ordered after IO we're still holding: */
+	blk_flush_plug(plug);
+
+	if (bio->bi_opf & REQ_PREFLUSH) {
+		ret = fdatasync(bio->bi_bdev->bd_fd);
+		if (ret) {
+			fprintf(stderr, "fsync error: %m\n");
+			bio->bi_status = BLK_STS_IOERR;
+			bio_endio(bio);
+			return;
+		}
+	}
+
 	switch (bio_op(bio)) {
 	case REQ_OP_READ:
-		fops->read(bio, iov, i);
-		break;
 	case REQ_OP_WRITE:
-		fops->write(bio, iov, i);
+		blkdev_io_init(&io, bio,
+			       alloca(sizeof(struct iovec) * bio_segments(bio)));
+		fops->submit(&io, 1);
 		break;
 	case REQ_OP_FLUSH:
 		ret = fsync(bio->bi_bdev->bd_fd);
@@ -165,6 +336,8 @@ sector_t get_capacity(struct gendisk *disk)
 void blkdev_put(struct block_device *bdev, fmode_t mode)
 {
 	fdatasync(bdev->bd_fd);
+	if (fops->bdev_close)
+		fops->bdev_close(bdev);
 	close(bdev->bd_sync_fd);
 	close(bdev->bd_fd);
 	free(bdev);
@@ -227,6 +400,9 @@ struct block_device *blkdev_get_by_path(const char *path, fmode_t mode,
 	bdev->bd_disk->bdi	= &bdev->bd_disk->__bdi;
 	bdev->queue.backing_dev_info = bdev->bd_disk->bdi;
 
+	if (fops->bdev_open)
+		fops->bdev_open(bdev);
+
 	return bdev;
 }
 
@@ -248,18 +424,18 @@ static void io_fallback(void)
 	fops->init();
 }
 
-static void sync_check(struct bio *bio, int ret)
+static void sync_check(struct blkdev_io *io, ssize_t ret)
 {
-	if (ret != bio->bi_iter.bi_size) {
+	if (ret != io->bytes) {
 		die("IO error: %s\n", strerror(-ret));
 	}
 
-	if (bio->bi_opf & REQ_FUA) {
-		ret = fdatasync(bio->bi_bdev->bd_fd);
+	if (io->bio->bi_opf & REQ_FUA) {
+		ret = fdatasync(io->bio->bi_bdev->bd_fd);
 		if (ret)
 			die("fsync error: %s\n", strerror(-ret));
 	}
-	bio_endio(bio);
+	blkdev_io_endio(io->bio, io->bytes);
 }
 
 static void sync_init(void) {}
@@ -270,23 +446,17 @@ static void sync_cleanup(void)
 	sync();
 }
 
-static void sync_read(struct bio *bio, struct iovec * iov, unsigned i)
+static void sync_submit(struct blkdev_io *ios, unsigned nr)
 {
+	struct blkdev_io *io;
+	ssize_t ret;
 
-	int fd = bio->bi_opf & REQ_FUA
-			? bio->bi_bdev->bd_sync_fd
-			: bio->bi_bdev->bd_fd;
-	ssize_t ret = preadv(fd, iov, i, bio->bi_iter.bi_sector << 9);
-	sync_check(bio, ret);
-}
-
-static void sync_write(struct bio *bio, struct iovec * iov, unsigned i)
-{
-	int fd = bio->bi_opf & REQ_FUA
-			? bio->bi_bdev->bd_sync_fd
-			: bio->bi_bdev->bd_fd;
-	ssize_t ret = pwritev(fd, iov, i, bio->bi_iter.bi_sector << 9);
-	sync_check(bio, ret);
+	for (io = ios; io < ios + nr; io++) {
+		ret = io->op == REQ_OP_WRITE
+			? pwritev(io->fd, io->iov, io->nr_iov, io->offset)
+			: preadv(io->fd, io->iov, io->nr_iov, io->offset);
+		sync_check(io, ret);
+	}
 }
 
 static int aio_completion_thread(void *arg)
@@ -314,10 +484,7 @@ static int aio_completion_thread(void *arg)
 				continue;
 			}
 
-			if (ev->res != bio->bi_iter.bi_size)
-				bio->bi_status = BLK_STS_IOERR;
-
-			bio_endio(bio);
+			blkdev_io_endio(bio, ev->res);
 			atomic_dec(&running_requests);
 		}
 	}
@@ -378,56 +545,287 @@ static void aio_cleanup(void)
 	close(fds[1]);
 }
 
-static void aio_op(struct bio *bio, struct iovec *iov, unsigned i, int opcode)
+static void aio_submit(struct blkdev_io *ios, unsigned nr)
 {
+	struct iocb *iocbs = alloca(sizeof(*iocbs) * nr);
+	struct iocb **iocbps = alloca(sizeof(*iocbps) * nr);
+	unsigned i;
 	ssize_t ret;
-	struct iocb iocb = {
-		.data		= bio,
-		.aio_fildes	= bio->bi_opf & REQ_FUA
-			? bio->bi_bdev->bd_sync_fd
-			: bio->bi_bdev->bd_fd,
-		.aio_lio_opcode	= opcode,
-		.u.c.buf        = iov,
-		.u.c.nbytes     = i,
-		.u.c.offset     = bio->bi_iter.bi_sector << 9,
 
-	}, *iocbp = &iocb;
+	for (i = 0; i < nr; i++) {
+		iocbs[i] = (struct iocb) {
+			.data		= ios[i].bio,
+			.aio_fildes	= ios[i].fd,
+			.aio_lio_opcode	= ios[i].op == REQ_OP_WRITE
+				? IO_CMD_PWRITEV
+				: IO_CMD_PREADV,
+			.u.c.buf        = ios[i].iov,
+			.u.c.nbytes     = ios[i].nr_iov,
+			.u.c.offset     = ios[i].offset,
+		};
+		iocbps[i] = &iocbs[i];
+	}
 
-	atomic_inc(&running_requests);
-	ret = io_submit(aio_ctx, 1, &iocbp);
-	if (ret != 1)
-		die("io_submit err: %s", strerror(-ret));
+	atomic_add(nr, &running_requests);
+
+	/* io_submit() may take fewer than we asked for: */
+	while (nr) {
+		ret = io_submit(aio_ctx, nr, iocbps);
+		if (ret <= 0)
+			die("io_submit err: %s", strerror(-ret));
+
+		iocbps	+= ret;
+		nr	-= ret;
+	}
+}
+
+#ifdef BCACHEFS_IO_URING
+
+#define URING_ENTRIES		256
+#define URING_MAX_FIXED_FILES	1024
+
+static struct io_uring ring;
+static DEFINE_MUTEX(uring_sq_lock);
+static struct task_struct *uring_task = NULL;
+
+/*
+ * Block device fds are registered with the ring so submission doesn't have to
+ * take a reference on the file for every request: the fixed file table is
+ * indexed by the fd itself, so no separate mapping is needed.
+ */
+static unsigned uring_nr_files;
+static bool uring_file_fixed[URING_MAX_FIXED_FILES];
+
+static void uring_files_init(void)
+{
+	struct rlimit rlim;
+	unsigned i, nr = URING_MAX_FIXED_FILES;
+	int *fds;
+
+	if (!getrlimit(RLIMIT_NOFILE, &rlim))
+		nr = min_t(u64, nr, rlim.rlim_cur);
+
+	fds = alloca(sizeof(*fds) * nr);
+	for (i = 0; i < nr; i++)
+		fds[i] = -1;
+
+	/* Not fatal - we'll just do IO without fixed files: */
+	if (!io_uring_register_files(&ring, fds, nr))
+		uring_nr_files = nr;
+}
+
+static void uring_file_register(int fd)
+{
+	if (fd >= 0 && fd < uring_nr_files &&
+	    io_uring_register_files_update(&ring, fd, &fd, 1) == 1)
+		uring_file_fixed[fd] = true;
+}
+
+static void uring_file_unregister(int fd)
+{
+	int none = -1;
+
+	if (fd >= 0 && fd < uring_nr_files && uring_file_fixed[fd]) {
+		io_uring_register_files_update(&ring, fd, &none, 1);
+		uring_file_fixed[fd] = false;
+	}
+}
+
+static void uring_bdev_open(struct block_device *bdev)
+{
+	uring_file_register(bdev->bd_fd);
+	uring_file_register(bdev->bd_sync_fd);
+}
+
+static void uring_bdev_close(struct block_device *bdev)
+{
+	uring_file_unregister(bdev->bd_sync_fd);
+	uring_file_unregister(bdev->bd_fd);
+}
+
+/* Must be called with uring_sq_lock held: */
+static void uring_submit(void)
+{
+	int ret;
+
+	do {
+		ret = io_uring_submit(&ring);
+	} while (ret == -EINTR || ret == -EAGAIN || ret == -EBUSY);
+
+	if (ret < 0)
+		die("io_uring_submit() error: %s", strerror(-ret));
+}
+
+/* Must be called with uring_sq_lock held: */
+static struct io_uring_sqe *uring_get_sqe(void)
+{
+	struct io_uring_sqe *sqe;
+
+	/* SQ ring full? Flush it to the kernel and retry: */
+	while (!(sqe = io_uring_get_sqe(&ring)))
+		uring_submit();
+
+	return sqe;
+}
+
+static int uring_completion_thread(void *arg)
+{
+	struct io_uring_cqe *cqes[32], *cqe;
+	struct bio *bios[ARRAY_SIZE(cqes)];
+	int res[ARRAY_SIZE(cqes)];
+	unsigned i, nr;
+	bool stop = false;
+	int ret;
+
+	while (!stop) {
+		ret = io_uring_wait_cqe(&ring, &cqe);
+		if (ret == -EINTR || ret == -EAGAIN)
+			continue;
+		if (ret < 0)
+			die("io_uring_wait_cqe() error: %s", strerror(-ret));
+
+		nr = io_uring_peek_batch_cqe(&ring, cqes, ARRAY_SIZE(cqes));
+
+		for (i = 0; i < nr; i++) {
+			bios[i]	= io_uring_cqe_get_data(cqes[i]);
+			res[i]	= cqes[i]->res;
+		}
+
+		/* Release CQ entries before completions can submit more IO: */
+		io_uring_cq_advance(&ring, nr);
+
+		for (i = 0; i < nr; i++) {
+			struct bio *bio = bios[i];
+
+			/* This should only happen during blkdev_cleanup() */
+			if (!bio) {
+				BUG_ON(atomic_read(&running_requests) != 0);
+				stop = true;
+				continue;
+			}
+
+			blkdev_io_endio(bio, res[i]);
+			atomic_dec(&running_requests);
+		}
+	}
+
+	return 0;
+}
+
+static void uring_init(void)
+{
+	struct task_struct *p;
+	int ret = io_uring_queue_init(URING_ENTRIES, &ring, 0);
+
+	/*
+	 * Old kernels, and io_uring being disabled by sysctl or seccomp, all
+	 * show up here - libaio is still there for them:
+	 */
+	if (ret) {
+		io_fallback();
+		return;
+	}
+
+	/*
+	 * The iovecs we submit are freed as soon as io_uring_submit() returns
+	 * - without IORING_FEAT_SUBMIT_STABLE the kernel may still read them
+	 * afterwards:
+	 */
+	if (!(ring.features & IORING_FEAT_SUBMIT_STABLE)) {
+		io_uring_queue_exit(&ring);
+		io_fallback();
+		return;
+	}
+
+	uring_files_init();
+
+	p = kthread_run(uring_completion_thread, NULL, "uring_completion");
+	BUG_ON(IS_ERR(p));
+
+	uring_task = p;
 }
 
-static void aio_read(struct bio *bio, struct iovec *iov, unsigned i)
+static void uring_cleanup(void)
 {
-	aio_op(bio, iov, i, IO_CMD_PREADV);
+	struct task_struct *p = NULL;
+	struct io_uring_sqe *sqe;
+	int ret;
+
+	swap(uring_task, p);
+	get_task_struct(p);
+
+	/* Unlike libaio, we have a real noop to wake up the completion thread: */
+	mutex_lock(&uring_sq_lock);
+	sqe = uring_get_sqe();
+	io_uring_prep_nop(sqe);
+	io_uring_sqe_set_data(sqe, NULL); /* Signal to stop */
+	uring_submit();
+	mutex_unlock(&uring_sq_lock);
+
+	ret = kthread_stop(p);
+	BUG_ON(ret);
+
+	put_task_struct(p);
+
+	io_uring_queue_exit(&ring);
 }
 
-static void aio_write(struct bio *bio, struct iovec * iov, unsigned i)
+static void uring_submit_ios(struct blkdev_io *ios, unsigned nr)
 {
-	aio_op(bio, iov, i, IO_CMD_PWRITEV);
+	struct io_uring_sqe *sqe;
+	struct blkdev_io *io;
+
+	atomic_add(nr, &running_requests);
+
+	mutex_lock(&uring_sq_lock);
+	for (io = ios; io < ios + nr; io++) {
+		sqe = uring_get_sqe();
+
+		if (io->op == REQ_OP_WRITE)
+			io_uring_prep_writev(sqe, io->fd, io->iov, io->nr_iov, io->offset);
+		else
+			io_uring_prep_readv(sqe, io->fd, io->iov, io->nr_iov, io->offset);
+
+		if (io->fd < uring_nr_files && uring_file_fixed[io->fd])
+			io_uring_sqe_set_flags(sqe, IOSQE_FIXED_FILE);
+
+		io_uring_sqe_set_data(sqe, io->bio);
+	}
+
+	/* One io_uring_enter() for the whole batch: */
+	uring_submit();
+	mutex_unlock(&uring_sq_lock);
 }
 
+#else
 
-/* not implemented */
-static void uring_init(void) {
+static void uring_init(void)
+{
 	io_fallback();
 }
 
+#define uring_cleanup		NULL
+#define uring_submit_ios	NULL
+#define uring_bdev_open		NULL
+#define uring_bdev_close	NULL
+
+#endif /* BCACHEFS_IO_URING */
+
 struct fops fops_list[] = {
 	{
 		.init		= uring_init,
+		.cleanup	= uring_cleanup,
+		.submit		= uring_submit_ios,
+		.bdev_open	= uring_bdev_open,
+		.bdev_close	= uring_bdev_close,
 	}, {
 		.init		= aio_init,
 		.cleanup	= aio_cleanup,
-		.read		= aio_read,
-		.write		= aio_write,
+		.submit		= aio_submit,
 	}, {
 		.init		= sync_init,
 		.cleanup	= sync_cleanup,
-		.read		= sync_read,
-		.write		= sync_write,
+		.submit		= sync_submit,
 	}, {
 		/* NULL */
 	}
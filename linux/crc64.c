@@ -26,6 +26,11 @@
  *   Author: Coly Li <colyli@suse.de>
  */
 
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
+
+#include <linux/compiler.h>
 #include <linux/module.h>
 #include <linux/types.h>
 #include "crc64table.h"
@@ -34,13 +39,14 @@ MODULE_DESCRIPTION("CRC64 calculations");
 MODULE_LICENSE("GPL v2");
 
 /**
- * crc64_be - Calculate bitwise big-endian ECMA-182 CRC64
+ * crc64_be_generic - Calculate bitwise big-endian ECMA-182 CRC64, a byte at a
+ * time from a table
  * @crc: seed value for computation. 0 or (u64)~0 for a new CRC calculation,
 	or the previous crc64 value if computing incrementally.
  * @p: pointer to buffer over which CRC64 is run
  * @len: length of buffer @p
  */
-u64 __pure crc64_be(u64 crc, const void *p, size_t len)
+u64 __pure crc64_be_generic(u64 crc, const void *p, size_t len)
 {
 	size_t i, t;
 
@@ -53,4 +59,133 @@ u64 __pure crc64_be(u64 crc, const void *p, size_t len)
 
 	return crc;
 }
+EXPORT_SYMBOL_GPL(crc64_be_generic);
+
+#ifdef __x86_64__
+
+/*
+ * Folding with carryless multiply, from Intel's "Fast CRC Computation for
+ * Generic Polynomials Using PCLMULQDQ Instruction":
+ *
+ * This crc isn't bit reflected, so each 16 bytes of input is byte swapped to
+ * make a 128 bit polynomial, most significant byte first. We keep four of
+ * those and fold each one forward 512 bits onto the next 64 bytes of input -
+ * multiplying its high and low halves by x^576 and x^512 mod P - then fold the
+ * four into one and the remaining 16 byte chunks into that, 128 bits at a time.
+ * What's left is congruent to the crc of the input so far times x^-64; the
+ * table finishes the reduction, and does the tail.
+ */
+#define CRC64_X128	0x05f5c3c7eb52fab6ULL
+#define CRC64_X192	0x4eb938a7d257740eULL
+#define CRC64_X512	0x5f6843ca540df020ULL
+#define CRC64_X576	0xddf4b6981205b83fULL
+
+#define CRC64_PCLMUL_MIN	64
+
+__attribute__((target("pclmul,ssse3")))
+static inline __m128i crc64_load(const void *p, __m128i bswap)
+{
+	return _mm_shuffle_epi8(_mm_loadu_si128(p), bswap);
+}
+
+__attribute__((target("pclmul,ssse3")))
+static inline __m128i crc64_fold(__m128i x, __m128i k, __m128i data)
+{
+	return _mm_xor_si128(data,
+		_mm_xor_si128(_mm_clmulepi64_si128(x, k, 0x00),
+			      _mm_clmulepi64_si128(x, k, 0x11)));
+}
+
+__attribute__((target("pclmul,ssse3")))
+static u64 crc64_be_pclmul(u64 crc, const void *p, size_t len)
+{
+	const __m128i bswap = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7,
+					   8, 9, 10, 11, 12, 13, 14, 15);
+	__m128i k, x0, x1, x2, x3;
+	u8 buf[16] __aligned(16);
+
+	if (len < CRC64_PCLMUL_MIN)
+		return crc64_be_generic(crc, p, len);
+
+	x0 = _mm_xor_si128(crc64_load(p, bswap), _mm_set_epi64x(crc, 0));
+	x1 = crc64_load(p + 16, bswap);
+	x2 = crc64_load(p + 32, bswap);
+	x3 = crc64_load(p + 48, bswap);
+	p	+= 64;
+	len	-= 64;
+
+	k = _mm_set_epi64x(CRC64_X576, CRC64_X512);
+	while (len >= 64) {
+		x0 = crc64_fold(x0, k, crc64_load(p, bswap));
+		x1 = crc64_fold(x1, k, crc64_load(p + 16, bswap));
+		x2 = crc64_fold(x2, k, crc64_load(p + 32, bswap));
+		x3 = crc64_fold(x3, k, crc64_load(p + 48, bswap));
+		p	+= 64;
+		len	-= 64;
+	}
+
+	k = _mm_set_epi64x(CRC64_X192, CRC64_X128);
+	x1 = crc64_fold(x0, k, x1);
+	x2 = crc64_fold(x1, k, x2);
+	x3 = crc64_fold(x2, k, x3);
+
+	while (len >= 16) {
+		x3 = crc64_fold(x3, k, crc64_load(p, bswap));
+		p	+= 16;
+		len	-= 16;
+	}
+
+	_mm_store_si128((void *) buf, _mm_shuffle_epi8(x3, bswap));
+
+	crc = crc64_be_generic(0, buf, sizeof(buf));
+	return crc64_be_generic(crc, p, len);
+}
+
+#endif
+
+static void *resolve_crc64_be(void)
+{
+#ifdef __x86_64__
+	if (__builtin_cpu_supports("pclmul") &&
+	    __builtin_cpu_supports("ssse3"))
+		return crc64_be_pclmul;
+#endif
+	return crc64_be_generic;
+}
+
+/*
+ * Same as crc32c() in tools-util.c:
+ */
+#ifdef HAVE_WORKING_IFUNC
+
+static void *ifunc_resolve_crc64_be(void)
+{
+	__builtin_cpu_init();
+
+	return resolve_crc64_be();
+}
+
+u64 crc64_be(u64, const void *, size_t)
+	__attribute__((ifunc("ifunc_resolve_crc64_be")));
+
+#else
+
+/**
+ * crc64_be - Calculate bitwise big-endian ECMA-182 CRC64
+ * @crc: seed value for computation. 0 or (u64)~0 for a new CRC calculation,
+	or the previous crc64 value if computing incrementally.
+ * @p: pointer to buffer over which CRC64 is run
+ * @len: length of buffer @p
+ */
+u64 __pure crc64_be(u64 crc, const void *p, size_t len)
+{
+	static u64 (*real_crc64_be)(u64, const void *, size_t);
+
+	if (unlikely(!real_crc64_be))
+		real_crc64_be = resolve_crc64_be();
+
+	return real_crc64_be(crc, p, len);
+}
+
+#endif /* HAVE_WORKING_IFUNC */
 EXPORT_SYMBOL_GPL(crc64_be);
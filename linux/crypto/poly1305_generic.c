@@ -21,6 +21,8 @@
 #include <crypto/hash.h>
 #include <crypto/poly1305.h>
 
+#include <sodium/core.h>
+
 static struct shash_alg poly1305_alg;
 
 struct poly1305_desc_ctx {
@@ -84,5 +86,8 @@ static struct shash_alg poly1305_alg = {
 __attribute__((constructor(110)))
 static int poly1305_mod_init(void)
 {
+	/* Picks libsodium's SSE2 implementation, if the CPU has it: */
+	if (sodium_init() < 0)
+		return -ENOMEM;
 	return crypto_register_shash(&poly1305_alg);
 }
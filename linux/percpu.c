@@ -0,0 +1,111 @@
+#include <sys/mman.h>
+
+#include <linux/bitmap.h>
+#include <linux/bitops.h>
+#include <linux/kernel.h>
+#include <linux/mutex.h>
+#include <linux/percpu.h>
+#include <linux/string.h>
+
+/*
+ * Percpu allocator: we reserve one PCPU_UNIT_SIZE unit of address space per
+ * CPU up front (it's only backed by memory as it's touched), and allocate the
+ * same range out of every unit with a simple first fit bitmap allocator.
+ *
+ * Keeping each CPU's copies a unit apart means no false sharing between CPUs,
+ * which is the whole point.
+ */
+
+#define PCPU_MIN_ALLOC_SHIFT	4
+#define PCPU_MIN_ALLOC_SIZE	(1U << PCPU_MIN_ALLOC_SHIFT)
+#define PCPU_UNIT_ALLOCS	(PCPU_UNIT_SIZE >> PCPU_MIN_ALLOC_SHIFT)
+
+static DEFINE_MUTEX(pcpu_lock);
+static void *pcpu_base;
+static unsigned long pcpu_first_free;
+
+/* Allocated chunks: */
+static unsigned long pcpu_alloc_map[BITS_TO_LONGS(PCPU_UNIT_ALLOCS)];
+/* Start of each allocation, so free_percpu() can find the end: */
+static unsigned long pcpu_bound_map[BITS_TO_LONGS(PCPU_UNIT_ALLOCS)];
+
+static int pcpu_init(void)
+{
+	void *p = mmap(NULL, (size_t) nr_cpu_ids << PCPU_UNIT_SHIFT,
+		       PROT_READ|PROT_WRITE,
+		       MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+
+	if (p == MAP_FAILED)
+		return -ENOMEM;
+
+	pcpu_base = p;
+	return 0;
+}
+
+void __percpu *__alloc_percpu_gfp(size_t size, size_t align, gfp_t gfp)
+{
+	unsigned long nr	= DIV_ROUND_UP(max_t(size_t, size, 1), PCPU_MIN_ALLOC_SIZE);
+	unsigned long step	= DIV_ROUND_UP(max_t(size_t, align, 1), PCPU_MIN_ALLOC_SIZE);
+	unsigned long start, end, i;
+	void *ret = NULL;
+	unsigned cpu;
+
+	mutex_lock(&pcpu_lock);
+	if (!pcpu_base && pcpu_init())
+		goto out;
+
+	start = round_up(pcpu_first_free, step);
+	while (start + nr <= PCPU_UNIT_ALLOCS) {
+		end = find_next_bit(pcpu_alloc_map, start + nr, start);
+		if (end == start + nr)
+			goto found;
+
+		start = round_up(find_next_zero_bit(pcpu_alloc_map,
+					PCPU_UNIT_ALLOCS, end), step);
+	}
+	goto out;
+found:
+	for (i = start; i < start + nr; i++)
+		__set_bit(i, pcpu_alloc_map);
+	__set_bit(start, pcpu_bound_map);
+
+	if (start == pcpu_first_free)
+		pcpu_first_free = find_next_zero_bit(pcpu_alloc_map,
+					PCPU_UNIT_ALLOCS, start + nr);
+
+	ret = pcpu_base + (start << PCPU_MIN_ALLOC_SHIFT);
+
+	for_each_possible_cpu(cpu)
+		memset(per_cpu_ptr(ret, cpu), 0, nr << PCPU_MIN_ALLOC_SHIFT);
+out:
+	mutex_unlock(&pcpu_lock);
+	return ret;
+}
+
+void __percpu *__alloc_percpu(size_t size, size_t align)
+{
+	return __alloc_percpu_gfp(size, align, GFP_KERNEL);
+}
+
+void free_percpu(void __percpu *percpu)
+{
+	unsigned long start, end, i;
+
+	if (!percpu)
+		return;
+
+	start = (percpu - pcpu_base) >> PCPU_MIN_ALLOC_SHIFT;
+
+	mutex_lock(&pcpu_lock);
+	BUG_ON(!test_bit(start, pcpu_bound_map));
+
+	end = min(find_next_bit(pcpu_bound_map, PCPU_UNIT_ALLOCS, start + 1),
+		  find_next_zero_bit(pcpu_alloc_map, PCPU_UNIT_ALLOCS, start));
+
+	__clear_bit(start, pcpu_bound_map);
+	for (i = start; i < end; i++)
+		__clear_bit(i, pcpu_alloc_map);
+
+	pcpu_first_free = min(pcpu_first_free, start);
+	mutex_unlock(&pcpu_lock);
+}
@@ -1,6 +1,13 @@
 #include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
 
-#include "linux/preempt.h"
+#include <linux/atomic.h>
+#include <linux/cache.h>
+#include <linux/compiler.h>
+#include <linux/cpumask.h>
+#include <linux/kernel.h>
+#include <linux/preempt.h>
 
 /*
  * In userspace, pthreads are preemptible and can migrate CPUs at any time.
@@ -10,28 +17,69 @@
  * various code paths, critically including the percpu system as it allows for
  * non-atomic reads and writes to CPU-local data structures.
  *
- * The high performance userspace equivalent would be to use thread local
- * storage to replace percpu data, but that would be complicated. It should be
- * correct to instead guarantee mutual exclusion for the critical sections.
+ * We emulate that by having one percpu slot per CPU in the system, and having
+ * preempt_disable() check out a slot - preferably the one for the CPU we're
+ * currently running on - which the thread then owns, exclusively, until
+ * preemption is re-enabled. this_cpu_ptr() returns the copy for the owned slot.
+ *
+ * Percpu data is only ever meaningful summed over all CPUs, so it doesn't
+ * matter which slot we get: if the local one is taken (because its owner was
+ * preempted or migrated) we just take the next free one instead of waiting for
+ * it, which also means preempt_disable() can't deadlock against whatever lock
+ * the owner of a particular slot might be blocked on.
  */
 
-static pthread_mutex_t preempt_lock;
+unsigned nr_cpu_ids = 1;
+__thread unsigned current_pcpu;
+static __thread unsigned preempt_count;
+
+static struct pcpu_slot {
+	int			owned;
+} ____cacheline_aligned pcpu_slots[NR_CPUS];
+
+__attribute__((constructor(101)))
+static void preempt_init(void)
+{
+	long nr = sysconf(_SC_NPROCESSORS_CONF);
+
+	nr_cpu_ids = clamp_t(long, nr, 1, NR_CPUS);
+}
 
-__attribute__((constructor))
-static void preempt_init(void) {
-	pthread_mutexattr_t attr;
-	pthread_mutexattr_init(&attr);
-	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
-	pthread_mutex_init(&preempt_lock, &attr);
-	pthread_mutexattr_destroy(&attr);
+static bool pcpu_slot_trylock(unsigned cpu)
+{
+	return !READ_ONCE(pcpu_slots[cpu].owned) &&
+		!xchg(&pcpu_slots[cpu].owned, 1);
 }
 
 void preempt_disable(void)
 {
-	pthread_mutex_lock(&preempt_lock);
+	int cpu;
+	unsigned i;
+
+	if (preempt_count++)
+		return;
+
+	cpu = sched_getcpu();
+	cpu = cpu >= 0 ? cpu % nr_cpu_ids : current_pcpu;
+
+	while (1) {
+		for (i = 0; i < nr_cpu_ids; i++) {
+			if (pcpu_slot_trylock(cpu)) {
+				current_pcpu = cpu;
+				return;
+			}
+
+			if (++cpu == nr_cpu_ids)
+				cpu = 0;
+		}
+
+		/* More threads with preemption disabled than CPUs: */
+		sched_yield();
+	}
 }
 
 void preempt_enable(void)
 {
-	pthread_mutex_unlock(&preempt_lock);
+	if (!--preempt_count)
+		smp_store_release(&pcpu_slots[current_pcpu].owned, 0);
 }
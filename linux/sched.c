@@ -10,6 +10,8 @@
 
 #include <linux/rcupdate.h>
 #include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/blkdev.h>
 #include <linux/timer.h>
 
 __thread struct task_struct *current;
@@ -35,6 +37,9 @@ void schedule(void)
 {
 	int v;
 
+	/* Don't sleep on IO we're still sitting on: */
+	blk_flush_plug(current->plug);
+
 	rcu_quiescent_state();
 
 	while ((v = READ_ONCE(current->state)) != TASK_RUNNING)
@@ -101,8 +106,12 @@ out:
 	return timeout < 0 ? 0 : timeout;
 }
 
-__attribute__((constructor(101)))
-static void sched_init(void)
+/*
+ * Threads that weren't started with kthread_create() - e.g. the threads of a
+ * multithreaded fuse session - need a task_struct and to be registered with
+ * RCU before they can call into the rest of the code:
+ */
+void sched_thread_init(void)
 {
 	struct task_struct *p = malloc(sizeof(*p));
 
@@ -114,10 +123,26 @@ static void sched_init(void)
 
 	current = p;
 
-	rcu_init();
 	rcu_register_thread();
 }
 
+void sched_thread_exit(void)
+{
+	rcu_unregister_thread();
+
+	/* Not put_task_struct(), there's no pthread to join: */
+	if (atomic_dec_and_test(&current->usage))
+		free(current);
+	current = NULL;
+}
+
+__attribute__((constructor(101)))
+static void sched_init(void)
+{
+	rcu_init();
+	sched_thread_init();
+}
+
 #ifndef SYS_getrandom
 #include <fcntl.h>
 #include <sys/stat.h>
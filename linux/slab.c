@@ -0,0 +1,399 @@
+#include <pthread.h>
+#include <stdio.h>
+
+#include <linux/cache.h>
+#include <linux/kernel.h>
+#include <linux/list.h>
+#include <linux/slab.h>
+
+/*
+ * Userspace slab allocator:
+ *
+ * Objects are carved out of SLAB_SIZE byte slabs, aligned to SLAB_SIZE so that
+ * we can get from an object to its slab by masking; free objects within a slab
+ * are kept on a freelist threaded through the objects (or just past them, if
+ * the cache has a constructor - constructed state must survive being freed).
+ *
+ * In front of the slabs, each thread has a magazine of free objects per cache,
+ * so the common case for alloc and free is a thread local array push/pop; the
+ * cache lock is only taken to refill or flush half a magazine at a time.
+ */
+
+#define SLAB_SIZE		(64U << 10)
+/* Bigger objects than this just use kmalloc(): */
+#define SLAB_MAX_OBJ_SIZE	(SLAB_SIZE / 8)
+
+#define KMEM_MAGAZINE_SIZE	64
+#define KMEM_MAGAZINE_BATCH	(KMEM_MAGAZINE_SIZE / 2)
+
+struct slab {
+	struct list_head	list;
+	void			*freelist;
+	unsigned		inuse;
+};
+
+struct kmem_magazine {
+	struct list_head	list;
+	struct kmem_cache	*cache;
+	unsigned		nr;
+	u64			allocs;
+	u64			frees;
+	void			*objs[KMEM_MAGAZINE_SIZE];
+};
+
+bool kmem_cache_use_kmalloc;
+
+struct kmem_cache {
+	const char		*name;
+	size_t			obj_size;
+	size_t			size;
+	size_t			align;
+	size_t			freeptr_offset;
+	size_t			first_obj_offset;
+	unsigned		objs_per_slab;
+	slab_flags_t		flags;
+	void			(*ctor)(void *);
+
+	pthread_mutex_t		lock;
+	struct list_head	partial;
+	struct list_head	full;
+	/* We keep one empty slab around, to avoid thrashing: */
+	struct slab		*empty;
+	struct list_head	magazines;
+	pthread_key_t		magazine_key;
+
+	/* Stats from exited threads, and from slab operations: */
+	struct kmem_cache_stats	stats;
+};
+
+static inline struct slab *obj_to_slab(void *obj)
+{
+	return (void *) ((unsigned long) obj & ~((unsigned long) SLAB_SIZE - 1));
+}
+
+static inline void **obj_freeptr(struct kmem_cache *c, void *obj)
+{
+	return obj + c->freeptr_offset;
+}
+
+static struct slab *kmem_slab_alloc(struct kmem_cache *c, gfp_t gfp)
+{
+	struct slab *slab = NULL;
+	void **freeptr;
+	unsigned i;
+
+	for (i = 0; i < 10; i++) {
+		slab = aligned_alloc(SLAB_SIZE, SLAB_SIZE);
+		if (slab)
+			break;
+
+		run_shrinkers(gfp, true);
+	}
+
+	if (!slab)
+		return NULL;
+
+	INIT_LIST_HEAD(&slab->list);
+	slab->inuse	= 0;
+	freeptr		= &slab->freelist;
+
+	for (i = 0; i < c->objs_per_slab; i++) {
+		void *obj = (void *) slab + c->first_obj_offset + i * c->size;
+
+		if (c->ctor)
+			c->ctor(obj);
+
+		*freeptr = obj;
+		freeptr = obj_freeptr(c, obj);
+	}
+	*freeptr = NULL;
+
+	return slab;
+}
+
+static void kmem_slab_free(struct kmem_cache *c, struct slab *slab)
+{
+	BUG_ON(slab->inuse);
+	free(slab);
+}
+
+/* Move up to @nr objects from the slabs to @m: */
+static void kmem_magazine_refill(struct kmem_cache *c,
+				 struct kmem_magazine *m,
+				 unsigned nr, gfp_t gfp)
+{
+	struct slab *slab, *new = NULL;
+retry:
+	pthread_mutex_lock(&c->lock);
+	if (new) {
+		list_add(&new->list, &c->partial);
+		c->stats.slabs++;
+		c->stats.slabs_allocated++;
+		new = NULL;
+	}
+
+	while (m->nr < nr) {
+		slab = list_first_entry_or_null(&c->partial, struct slab, list);
+		if (!slab) {
+			slab = c->empty;
+			if (!slab)
+				break;
+
+			c->empty = NULL;
+			list_add(&slab->list, &c->partial);
+		}
+
+		while (m->nr < nr && slab->freelist) {
+			void *obj = slab->freelist;
+
+			slab->freelist = *obj_freeptr(c, obj);
+			slab->inuse++;
+			m->objs[m->nr++] = obj;
+		}
+
+		if (!slab->freelist)
+			list_move(&slab->list, &c->full);
+	}
+	c->stats.refills++;
+	pthread_mutex_unlock(&c->lock);
+
+	/*
+	 * Don't allocate with the lock held: run_shrinkers() may end up freeing
+	 * objects back to this cache:
+	 */
+	if (!m->nr) {
+		new = kmem_slab_alloc(c, gfp);
+		if (new)
+			goto retry;
+	}
+}
+
+/* Return @nr objects from the end of @m to their slabs: */
+static void kmem_magazine_flush(struct kmem_cache *c,
+				struct kmem_magazine *m,
+				unsigned nr)
+{
+	struct slab *to_free[KMEM_MAGAZINE_SIZE];
+	unsigned i, nr_to_free = 0;
+
+	pthread_mutex_lock(&c->lock);
+	while (nr--) {
+		void *obj = m->objs[--m->nr];
+		struct slab *slab = obj_to_slab(obj);
+
+		if (!slab->freelist)
+			list_move(&slab->list, &c->partial);
+
+		*obj_freeptr(c, obj) = slab->freelist;
+		slab->freelist = obj;
+
+		if (!--slab->inuse) {
+			list_del_init(&slab->list);
+
+			if (!c->empty) {
+				c->empty = slab;
+			} else {
+				to_free[nr_to_free++] = slab;
+				c->stats.slabs--;
+			}
+		}
+	}
+	c->stats.flushes++;
+	pthread_mutex_unlock(&c->lock);
+
+	for (i = 0; i < nr_to_free; i++)
+		kmem_slab_free(c, to_free[i]);
+}
+
+static void __kmem_magazine_release(struct kmem_magazine *m)
+{
+	struct kmem_cache *c = m->cache;
+
+	kmem_magazine_flush(c, m, m->nr);
+
+	pthread_mutex_lock(&c->lock);
+	c->stats.allocs	+= m->allocs;
+	c->stats.frees	+= m->frees;
+	list_del(&m->list);
+	pthread_mutex_unlock(&c->lock);
+
+	free(m);
+}
+
+/* Called on thread exit: */
+static void kmem_magazine_release(void *p)
+{
+	__kmem_magazine_release(p);
+}
+
+static struct kmem_magazine *kmem_magazine_get(struct kmem_cache *c)
+{
+	struct kmem_magazine *m = pthread_getspecific(c->magazine_key);
+
+	if (likely(m))
+		return m;
+
+	m = calloc(1, sizeof(*m));
+	if (!m)
+		return NULL;
+
+	m->cache = c;
+
+	if (pthread_setspecific(c->magazine_key, m)) {
+		free(m);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&c->lock);
+	list_add(&m->list, &c->magazines);
+	pthread_mutex_unlock(&c->lock);
+
+	return m;
+}
+
+void *kmem_cache_alloc(struct kmem_cache *c, gfp_t gfp)
+{
+	struct kmem_magazine *m;
+	void *p;
+
+	if (!c->objs_per_slab) {
+		p = kmalloc(c->obj_size, gfp);
+		if (p && c->ctor && !(gfp & __GFP_ZERO))
+			c->ctor(p);
+		return p;
+	}
+
+	m = kmem_magazine_get(c);
+	if (unlikely(!m))
+		return NULL;
+
+	if (unlikely(!m->nr)) {
+		kmem_magazine_refill(c, m, KMEM_MAGAZINE_BATCH, gfp);
+		if (!m->nr)
+			return NULL;
+	}
+
+	p = m->objs[--m->nr];
+	m->allocs++;
+
+	if (gfp & __GFP_ZERO)
+		memset(p, 0, c->obj_size);
+	return p;
+}
+
+void kmem_cache_free(struct kmem_cache *c, void *p)
+{
+	struct kmem_magazine *m;
+
+	if (!p)
+		return;
+
+	if (!c->objs_per_slab) {
+		kfree(p);
+		return;
+	}
+
+	m = kmem_magazine_get(c);
+	if (unlikely(!m)) {
+		/* Can't cache it, but we can still return it to its slab: */
+		struct kmem_magazine tmp = { .nr = 1, .objs[0] = p };
+
+		kmem_magazine_flush(c, &tmp, 1);
+		return;
+	}
+
+	if (unlikely(m->nr == KMEM_MAGAZINE_SIZE))
+		kmem_magazine_flush(c, m, KMEM_MAGAZINE_BATCH);
+
+	m->objs[m->nr++] = p;
+	m->frees++;
+}
+
+void kmem_cache_get_stats(struct kmem_cache *c, struct kmem_cache_stats *stats)
+{
+	struct kmem_magazine *m;
+
+	pthread_mutex_lock(&c->lock);
+	*stats = c->stats;
+	stats->objs_per_slab = c->objs_per_slab;
+
+	list_for_each_entry(m, &c->magazines, list) {
+		stats->allocs	+= READ_ONCE(m->allocs);
+		stats->frees	+= READ_ONCE(m->frees);
+	}
+	pthread_mutex_unlock(&c->lock);
+}
+
+void kmem_cache_destroy(struct kmem_cache *c)
+{
+	struct kmem_magazine *m, *n;
+
+	if (!c)
+		return;
+
+	if (c->objs_per_slab) {
+		pthread_key_delete(c->magazine_key);
+
+		list_for_each_entry_safe(m, n, &c->magazines, list)
+			__kmem_magazine_release(m);
+
+		/* Like the kernel, leak slabs that still have objects in use: */
+		if (!list_empty(&c->full) || !list_empty(&c->partial))
+			fprintf(stderr, "kmem_cache_destroy %s: slab still has objects\n",
+				c->name);
+
+		if (c->empty)
+			kmem_slab_free(c, c->empty);
+	}
+
+	pthread_mutex_destroy(&c->lock);
+	free(c);
+}
+
+struct kmem_cache *kmem_cache_create(const char *name, unsigned size,
+				     unsigned align, slab_flags_t flags,
+				     void (*ctor)(void *))
+{
+	struct kmem_cache *c = kzalloc(sizeof(*c), GFP_KERNEL);
+
+	if (!c)
+		goto err;
+
+	c->name		= name;
+	c->obj_size	= size;
+	c->flags	= flags;
+	c->ctor		= ctor;
+
+	pthread_mutex_init(&c->lock, NULL);
+	INIT_LIST_HEAD(&c->partial);
+	INIT_LIST_HEAD(&c->full);
+	INIT_LIST_HEAD(&c->magazines);
+
+	c->align = max_t(size_t, align, sizeof(void *));
+	if (flags & SLAB_HWCACHE_ALIGN)
+		c->align = max_t(size_t, c->align, L1_CACHE_BYTES);
+
+	/* Objects with a constructor keep the freelist pointer out of line: */
+	c->freeptr_offset = ctor ? round_up(size, sizeof(void *)) : 0;
+	c->size = round_up(max_t(size_t, c->freeptr_offset + sizeof(void *), size),
+			   c->align);
+
+	if (kmem_cache_use_kmalloc ||
+	    c->size > SLAB_MAX_OBJ_SIZE)
+		return c;
+
+	c->first_obj_offset	= round_up(sizeof(struct slab), c->align);
+	c->objs_per_slab	= (SLAB_SIZE - c->first_obj_offset) / c->size;
+
+	if (pthread_key_create(&c->magazine_key, kmem_magazine_release)) {
+		pthread_mutex_destroy(&c->lock);
+		kfree(c);
+		goto err;
+	}
+
+	return c;
+err:
+	if (flags & SLAB_PANIC)
+		panic("kmem_cache_create %s failed\n", name);
+	return NULL;
+}
@@ -1,27 +1,48 @@
 #include <pthread.h>
 
+#include <linux/cpumask.h>
 #include <linux/kthread.h>
 #include <linux/slab.h>
 #include <linux/workqueue.h>
 
 static pthread_mutex_t	wq_lock = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t	work_finished = PTHREAD_COND_INITIALIZER;
 static LIST_HEAD(wq_list);
 
+struct worker {
+	struct list_head	idle;
+	struct task_struct	*task;
+	struct work_struct	*current_work;
+	struct workqueue_struct	*wq;
+};
+
+/* Someone waiting in flush_work()/cancel_work_sync() on a specific item: */
+struct work_flusher {
+	struct list_head	list;
+	struct work_struct	*work;
+	pthread_cond_t		done;
+};
+
 struct workqueue_struct {
 	struct list_head	list;
+	pthread_mutex_t		lock;
 
-	struct work_struct	*current_work;
 	struct list_head	pending_work;
+	struct list_head	flushers;
+	struct list_head	idle_workers;
 
-	struct task_struct	*worker;
+	unsigned		nr_workers;
+	unsigned		max_workers;
 	char			name[24];
+
+	struct worker		workers[];
 };
 
 enum {
 	WORK_PENDING_BIT,
 };
 
+#define WORK_DATA_FLAGS_MASK	((1UL << (WORK_PENDING_BIT + 1)) - 1)
+
 static bool work_pending(struct work_struct *work)
 {
 	return test_bit(WORK_PENDING_BIT, work_data_bits(work));
@@ -37,6 +58,86 @@ static bool set_work_pending(struct work_struct *work)
 	return !test_and_set_bit(WORK_PENDING_BIT, work_data_bits(work));
 }
 
+/*
+ * The workqueue a work item was last queued on lives in the upper bits of
+ * work->data, next to the pending bit; only the owner of the pending bit may
+ * change it:
+ */
+static struct workqueue_struct *get_work_wq(struct work_struct *work)
+{
+	return (void *) (atomic_long_read(&work->data) & ~WORK_DATA_FLAGS_MASK);
+}
+
+static void set_work_wq(struct work_struct *work, struct workqueue_struct *wq)
+{
+	BUG_ON(!work_pending(work));
+
+	atomic_long_set(&work->data, (unsigned long) wq|(1UL << WORK_PENDING_BIT));
+}
+
+static bool work_running(struct workqueue_struct *wq, struct work_struct *work)
+{
+	for (unsigned i = 0; i < wq->nr_workers; i++)
+		if (wq->workers[i].current_work == work)
+			return true;
+
+	return false;
+}
+
+static void wait_on_work(struct workqueue_struct *wq, struct work_struct *work)
+{
+	struct work_flusher f = {
+		.work	= work,
+		.done	= PTHREAD_COND_INITIALIZER,
+	};
+
+	list_add(&f.list, &wq->flushers);
+	pthread_cond_wait(&f.done, &wq->lock);
+	list_del(&f.list);
+	pthread_cond_destroy(&f.done);
+}
+
+static void wake_work_flushers(struct workqueue_struct *wq,
+			       struct work_struct *work)
+{
+	struct work_flusher *f;
+
+	list_for_each_entry(f, &wq->flushers, list)
+		if (f->work == work)
+			pthread_cond_signal(&f->done);
+}
+
+static int worker_thread(void *arg);
+
+static void wake_worker(struct workqueue_struct *wq)
+{
+	struct worker *w =
+		list_first_entry_or_null(&wq->idle_workers, struct worker, idle);
+	struct task_struct *task;
+
+	if (w) {
+		list_del_init(&w->idle);
+		wake_up_process(w->task);
+		return;
+	}
+
+	if (wq->nr_workers == wq->max_workers)
+		return;
+
+	/*
+	 * Workers are started on demand: if we can't start one now, the
+	 * existing workers will get to this item eventually:
+	 */
+	w = &wq->workers[wq->nr_workers];
+	task = kthread_create(worker_thread, w, "%s", wq->name);
+	if (IS_ERR(task))
+		return;
+
+	w->task = task;
+	wq->nr_workers++;
+	wake_up_process(task);
+}
+
 static void __queue_work(struct workqueue_struct *wq,
 			 struct work_struct *work)
 {
@@ -44,17 +145,19 @@ static void __queue_work(struct workqueue_struct *wq,
 	BUG_ON(!list_empty(&work->entry));
 
 	list_add_tail(&work->entry, &wq->pending_work);
-	wake_up_process(wq->worker);
+	wake_worker(wq);
 }
 
 bool queue_work(struct workqueue_struct *wq, struct work_struct *work)
 {
 	bool ret;
 
-	pthread_mutex_lock(&wq_lock);
-	if ((ret = set_work_pending(work)))
+	pthread_mutex_lock(&wq->lock);
+	if ((ret = set_work_pending(work))) {
+		set_work_wq(work, wq);
 		__queue_work(wq, work);
-	pthread_mutex_unlock(&wq_lock);
+	}
+	pthread_mutex_unlock(&wq->lock);
 
 	return ret;
 }
@@ -63,10 +166,11 @@ void delayed_work_timer_fn(struct timer_list *timer)
 {
 	struct delayed_work *dwork =
 		container_of(timer, struct delayed_work, timer);
+	struct workqueue_struct *wq = dwork->wq;
 
-	pthread_mutex_lock(&wq_lock);
-	__queue_work(dwork->wq, &dwork->work);
-	pthread_mutex_unlock(&wq_lock);
+	pthread_mutex_lock(&wq->lock);
+	__queue_work(wq, &dwork->work);
+	pthread_mutex_unlock(&wq->lock);
 }
 
 static void __queue_delayed_work(struct workqueue_struct *wq,
@@ -80,6 +184,8 @@ static void __queue_delayed_work(struct workqueue_struct *wq,
 	BUG_ON(timer_pending(timer));
 	BUG_ON(!list_empty(&work->entry));
 
+	set_work_wq(work, wq);
+
 	if (!delay) {
 		__queue_work(wq, &dwork->work);
 	} else {
@@ -96,21 +202,24 @@ bool queue_delayed_work(struct workqueue_struct *wq,
 	struct work_struct *work = &dwork->work;
 	bool ret;
 
-	pthread_mutex_lock(&wq_lock);
+	pthread_mutex_lock(&wq->lock);
 	if ((ret = set_work_pending(work)))
 		__queue_delayed_work(wq, dwork, delay);
-	pthread_mutex_unlock(&wq_lock);
+	pthread_mutex_unlock(&wq->lock);
 
 	return ret;
 }
 
+/*
+ * Take ownership of the pending bit, stealing the work item off its timer or
+ * workqueue if it was pending; returns true if it was pending:
+ */
 static bool grab_pending(struct work_struct *work, bool is_dwork)
 {
+	struct workqueue_struct *wq;
 retry:
-	if (set_work_pending(work)) {
-		BUG_ON(!list_empty(&work->entry));
+	if (set_work_pending(work))
 		return false;
-	}
 
 	if (is_dwork) {
 		struct delayed_work *dwork = to_delayed_work(work);
@@ -121,66 +230,86 @@ retry:
 		}
 	}
 
-	if (!list_empty(&work->entry)) {
-		list_del_init(&work->entry);
-		return true;
+	wq = get_work_wq(work);
+	if (wq) {
+		pthread_mutex_lock(&wq->lock);
+		if (work_pending(work) &&
+		    get_work_wq(work) == wq &&
+		    !list_empty(&work->entry)) {
+			list_del_init(&work->entry);
+			pthread_mutex_unlock(&wq->lock);
+			return true;
+		}
+		pthread_mutex_unlock(&wq->lock);
 	}
 
-	BUG_ON(!is_dwork);
-
-	pthread_mutex_unlock(&wq_lock);
-	flush_timers();
-	pthread_mutex_lock(&wq_lock);
+	/* Raced with queue_work() or a timer that's firing: */
+	if (is_dwork)
+		flush_timers();
+	else
+		cpu_relax();
 	goto retry;
 }
 
-static bool work_running(struct work_struct *work)
+/* Drop the pending bit taken by grab_pending(): */
+static void release_pending(struct work_struct *work)
 {
-	struct workqueue_struct *wq;
+	struct workqueue_struct *wq = get_work_wq(work);
 
-	list_for_each_entry(wq, &wq_list, list)
-		if (wq->current_work == work)
-			return true;
+	if (!wq) {
+		clear_work_pending(work);
+		return;
+	}
 
-	return false;
+	pthread_mutex_lock(&wq->lock);
+	clear_work_pending(work);
+	wake_work_flushers(wq, work);
+	pthread_mutex_unlock(&wq->lock);
 }
 
 bool flush_work(struct work_struct *work)
 {
+	struct workqueue_struct *wq = get_work_wq(work);
 	bool ret = false;
 
-	pthread_mutex_lock(&wq_lock);
-	while (work_pending(work) || work_running(work)) {
-		pthread_cond_wait(&work_finished, &wq_lock);
+	if (!wq)
+		return false;
+
+	pthread_mutex_lock(&wq->lock);
+	while (get_work_wq(work) == wq &&
+	       (work_pending(work) || work_running(wq, work))) {
+		wait_on_work(wq, work);
 		ret = true;
 	}
-	pthread_mutex_unlock(&wq_lock);
+	pthread_mutex_unlock(&wq->lock);
 
 	return ret;
 }
 
 static bool __flush_work(struct work_struct *work)
 {
+	struct workqueue_struct *wq = get_work_wq(work);
 	bool ret = false;
 
-	while (work_running(work)) {
-		pthread_cond_wait(&work_finished, &wq_lock);
+	if (!wq)
+		return false;
+
+	pthread_mutex_lock(&wq->lock);
+	while (work_running(wq, work)) {
+		wait_on_work(wq, work);
 		ret = true;
 	}
+	pthread_mutex_unlock(&wq->lock);
 
 	return ret;
 }
 
 bool cancel_work_sync(struct work_struct *work)
 {
-	bool ret;
-
-	pthread_mutex_lock(&wq_lock);
-	ret = grab_pending(work, false);
+	bool ret = grab_pending(work, false);
 
 	__flush_work(work);
-	clear_work_pending(work);
-	pthread_mutex_unlock(&wq_lock);
+	release_pending(work);
 
 	return ret;
 }
@@ -190,13 +319,11 @@ bool mod_delayed_work(struct workqueue_struct *wq,
 		      unsigned long delay)
 {
 	struct work_struct *work = &dwork->work;
-	bool ret;
-
-	pthread_mutex_lock(&wq_lock);
-	ret = grab_pending(work, true);
+	bool ret = grab_pending(work, true);
 
+	pthread_mutex_lock(&wq->lock);
 	__queue_delayed_work(wq, dwork, delay);
-	pthread_mutex_unlock(&wq_lock);
+	pthread_mutex_unlock(&wq->lock);
 
 	return ret;
 }
@@ -204,13 +331,9 @@ bool mod_delayed_work(struct workqueue_struct *wq,
 bool cancel_delayed_work(struct delayed_work *dwork)
 {
 	struct work_struct *work = &dwork->work;
-	bool ret;
+	bool ret = grab_pending(work, true);
 
-	pthread_mutex_lock(&wq_lock);
-	ret = grab_pending(work, true);
-
-	clear_work_pending(&dwork->work);
-	pthread_mutex_unlock(&wq_lock);
+	release_pending(work);
 
 	return ret;
 }
@@ -218,68 +341,113 @@ bool cancel_delayed_work(struct delayed_work *dwork)
 bool cancel_delayed_work_sync(struct delayed_work *dwork)
 {
 	struct work_struct *work = &dwork->work;
-	bool ret;
-
-	pthread_mutex_lock(&wq_lock);
-	ret = grab_pending(work, true);
+	bool ret = grab_pending(work, true);
 
 	__flush_work(work);
-	clear_work_pending(work);
-	pthread_mutex_unlock(&wq_lock);
+	release_pending(work);
 
 	return ret;
 }
 
+/*
+ * Like the kernel, never run the same work item concurrently on two workers
+ * of one workqueue: if it was requeued while running, leave it for the worker
+ * that's currently running it.
+ */
+static struct work_struct *next_work(struct workqueue_struct *wq)
+{
+	struct work_struct *work;
+
+	list_for_each_entry(work, &wq->pending_work, entry)
+		if (!work_running(wq, work))
+			return work;
+
+	return NULL;
+}
+
 static int worker_thread(void *arg)
 {
-	struct workqueue_struct *wq = arg;
+	struct worker *w = arg;
+	struct workqueue_struct *wq = w->wq;
 	struct work_struct *work;
 
-	pthread_mutex_lock(&wq_lock);
+	pthread_mutex_lock(&wq->lock);
 	while (1) {
 		__set_current_state(TASK_INTERRUPTIBLE);
-		work = list_first_entry_or_null(&wq->pending_work,
-				struct work_struct, entry);
-		wq->current_work = work;
+		work = next_work(wq);
 
 		if (kthread_should_stop()) {
-			BUG_ON(wq->current_work);
+			BUG_ON(!list_empty(&wq->pending_work));
 			break;
 		}
 
 		if (!work) {
-			pthread_mutex_unlock(&wq_lock);
+			list_add(&w->idle, &wq->idle_workers);
+			pthread_mutex_unlock(&wq->lock);
 			schedule();
-			pthread_mutex_lock(&wq_lock);
+			pthread_mutex_lock(&wq->lock);
+			list_del_init(&w->idle);
 			continue;
 		}
 
+		__set_current_state(TASK_RUNNING);
+
 		BUG_ON(!work_pending(work));
 		list_del_init(&work->entry);
 		clear_work_pending(work);
+		w->current_work = work;
 
-		pthread_mutex_unlock(&wq_lock);
+		pthread_mutex_unlock(&wq->lock);
 		work->func(work);
-		pthread_mutex_lock(&wq_lock);
+		pthread_mutex_lock(&wq->lock);
 
-		pthread_cond_broadcast(&work_finished);
+		w->current_work = NULL;
+		wake_work_flushers(wq, work);
 	}
-	pthread_mutex_unlock(&wq_lock);
+	__set_current_state(TASK_RUNNING);
+	pthread_mutex_unlock(&wq->lock);
 
 	return 0;
 }
 
 void destroy_workqueue(struct workqueue_struct *wq)
 {
-	kthread_stop(wq->worker);
+	unsigned nr_workers;
+
+	pthread_mutex_lock(&wq->lock);
+	nr_workers = wq->nr_workers;
+	pthread_mutex_unlock(&wq->lock);
+
+	for (unsigned i = 0; i < nr_workers; i++)
+		kthread_stop(wq->workers[i].task);
 
 	pthread_mutex_lock(&wq_lock);
 	list_del(&wq->list);
 	pthread_mutex_unlock(&wq_lock);
 
+	pthread_mutex_destroy(&wq->lock);
 	kfree(wq);
 }
 
+/*
+ * In the kernel max_active is per CPU for bound workqueues, and per node for
+ * unbound ones; we only have one pool of workers per workqueue, so a bound
+ * workqueue gets one worker per CPU and an unbound one gets max_active
+ * workers, capped at the number of CPUs:
+ */
+static unsigned wq_max_workers(unsigned flags, int max_active)
+{
+	if (flags & __WQ_ORDERED)
+		return 1;
+
+	max_active = max_active ?: WQ_DFL_ACTIVE;
+
+	if (!(flags & WQ_UNBOUND))
+		return num_possible_cpus();
+
+	return clamp_t(unsigned, max_active, 1, num_possible_cpus());
+}
+
 struct workqueue_struct *alloc_workqueue(const char *fmt,
 					 unsigned flags,
 					 int max_active,
@@ -287,20 +455,35 @@ struct workqueue_struct *alloc_workqueue(const char *fmt,
 {
 	va_list args;
 	struct workqueue_struct *wq;
+	unsigned max_workers = wq_max_workers(flags, max_active);
 
-	wq = kzalloc(sizeof(*wq), GFP_KERNEL);
+	wq = kzalloc(struct_size(wq, workers, max_workers), GFP_KERNEL);
 	if (!wq)
 		return NULL;
 
 	INIT_LIST_HEAD(&wq->list);
+	pthread_mutex_init(&wq->lock, NULL);
 	INIT_LIST_HEAD(&wq->pending_work);
+	INIT_LIST_HEAD(&wq->flushers);
+	INIT_LIST_HEAD(&wq->idle_workers);
+	wq->max_workers = max_workers;
+
+	for (unsigned i = 0; i < max_workers; i++) {
+		INIT_LIST_HEAD(&wq->workers[i].idle);
+		wq->workers[i].wq = wq;
+	}
 
 	va_start(args, max_active);
 	vsnprintf(wq->name, sizeof(wq->name), fmt, args);
 	va_end(args);
 
-	wq->worker = kthread_run(worker_thread, wq, "%s", wq->name);
-	if (IS_ERR(wq->worker)) {
+	/* Start the first worker now, so that queueing work can't fail: */
+	pthread_mutex_lock(&wq->lock);
+	wake_worker(wq);
+	pthread_mutex_unlock(&wq->lock);
+
+	if (!wq->nr_workers) {
+		pthread_mutex_destroy(&wq->lock);
 		kfree(wq);
 		return NULL;
 	}
@@ -311,7 +494,6 @@ struct workqueue_struct *alloc_workqueue(const char *fmt,
 
 	return wq;
 }
-
 struct workqueue_struct *system_wq;
 struct workqueue_struct *system_highpri_wq;
 struct workqueue_struct *system_long_wq;
@@ -53,6 +53,20 @@ bitflags! {
     }
 }
 
+pub const BTREE_ITER_BATCH_NR: usize = 64;
+
+/// Buffer for the keys returned by BtreeIter::peek_many_and_restart()
+pub struct BtreeIterBatch {
+    k:      [c::bkey_s_c; BTREE_ITER_BATCH_NR],
+    u:      [c::bkey; BTREE_ITER_BATCH_NR],
+}
+
+impl BtreeIterBatch {
+    pub fn new() -> Box<BtreeIterBatch> {
+        unsafe { Box::new(MaybeUninit::zeroed().assume_init()) }
+    }
+}
+
 pub struct BtreeIter<'t> {
     raw:    c::btree_iter,
     trans:  PhantomData<&'t BtreeTrans<'t>>,
@@ -95,6 +109,28 @@ impl<'t> BtreeIter<'t> {
         }
     }
 
+    /// Returns the keys up to @end in the current leaf, leaving the iterator
+    /// pointing at the last one; empty at the end of the btree
+    pub fn peek_many_and_restart<'i>(&'i mut self, end: c::bpos,
+        batch: &'i mut BtreeIterBatch) -> Result<Vec<BkeySC<'i>>, bch_errcode> {
+        unsafe {
+            let ret = c::bch2_btree_iter_peek_many_and_restart_outlined(
+                &mut self.raw,
+                end,
+                batch.k.as_mut_ptr(),
+                batch.u.as_mut_ptr(),
+                BTREE_ITER_BATCH_NR as u32);
+
+            if ret < 0 {
+                return Err(std::mem::transmute(-ret));
+            }
+
+            Ok(batch.k[..ret as usize].iter()
+                .map(|k| BkeySC { k: &*k.k, v: &*k.v, iter: PhantomData })
+                .collect())
+        }
+    }
+
     pub fn advance(&mut self) {
         unsafe {
             c::bch2_btree_iter_advance(&mut self.raw);
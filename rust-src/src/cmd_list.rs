@@ -6,6 +6,7 @@ use bch_bindgen::fs::Fs;
 use bch_bindgen::bkey::BkeySC;
 use bch_bindgen::btree::BtreeTrans;
 use bch_bindgen::btree::BtreeIter;
+use bch_bindgen::btree::BtreeIterBatch;
 use bch_bindgen::btree::BtreeNodeIter;
 use bch_bindgen::btree::BtreeIterFlags;
 use clap::Parser;
@@ -18,12 +19,22 @@ fn list_keys(fs: &Fs, opt: Cli) -> anyhow::Result<()> {
         BtreeIterFlags::ALL_SNAPSHOTS|
         BtreeIterFlags::PREFETCH);
 
-    while let Some(k) = iter.peek_and_restart()? {
-        if k.k.p > opt.end {
+    let mut batch = BtreeIterBatch::new();
+
+    loop {
+        let keys = iter.peek_many_and_restart(opt.end, &mut batch)?;
+        if keys.is_empty() {
             break;
         }
 
-        println!("{}", k.to_text(fs));
+        for k in &keys {
+            // peek_upto() compares positions without the snapshot field:
+            if k.k.p > opt.end {
+                return Ok(());
+            }
+
+            println!("{}", k.to_text(fs));
+        }
         iter.advance();
     }
 
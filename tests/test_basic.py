@@ -61,3 +61,53 @@ def test_list_dirent(tmpdir):
     # snap 0 len 0 ver 0: lost+found -> 4097
     last = ret.stdout.splitlines()[-1]
     assert re.match(r'^.*type dirent.*: lost\+found ->.*$', last)
+
+def test_fsck_compressed_replicas(tmpdir):
+    dev0 = util.sparse_file(tmpdir / 'dev0', 1024**3)
+    dev1 = util.sparse_file(tmpdir / 'dev1', 1024**3)
+    util.run_bch('format', '--replicas=2', '--metadata_compression=lz4',
+                 dev0, dev1, check=True)
+
+    ret = util.run_bch('show-super', dev0, valgrind=True)
+    assert ret.returncode == 0
+    assert "btree_node_compression" in ret.stdout
+
+    # A fresh filesystem's nodes are too small to compress - fill some:
+    util.run_bch('bench', 'seq_insert', '-t', '1', '-k', '100000',
+                 dev0, dev1, check=True)
+
+    ret = util.run_bch('list', '-b', 'xattrs', '-m', 'nodes-ondisk',
+                       dev0, dev1)
+    assert ret.returncode == 0
+    assert "compressed" in ret.stdout
+
+    ret = util.run_bch('fsck', '-n', '--verify_replicas', dev0, dev1,
+                       valgrind=True)
+
+    assert ret.returncode == 0
+    assert len(ret.stderr) == 0
+    assert "mismatch" not in ret.stdout
+    assert "found bset signature" not in ret.stdout
+
+def test_peek_many(tmpdir):
+    # Enough keys for several leaves, so batches cross leaf boundaries.
+    dev = util.format_1g(tmpdir)
+
+    ret = util.run_bch('bench', 'test_peek_many', '-t', '1', '-k', '100000',
+                       dev, valgrind=True)
+
+    assert ret.returncode == 0
+    assert len(ret.stderr) == 0
+    assert "test_peek_many" in ret.stdout
+
+def test_move_snapshots(tmpdir):
+    # Device evacuate needs a mounted filesystem; this runs the same range
+    # split data jobs use, over extents that overlap in different snapshots.
+    dev = util.format_1g(tmpdir)
+
+    ret = util.run_bch('bench', 'test_move_snapshots', '-t', '1', dev,
+                       valgrind=True)
+
+    assert ret.returncode == 0
+    assert len(ret.stderr) == 0
+    assert "test_move_snapshots" in ret.stdout
@@ -139,6 +139,7 @@ struct fiemap_extent fiemap_iter_next(struct fiemap_iter *);
 char *strcmp_prefix(char *, const char *);
 
 u32 crc32c(u32, const void *, size_t);
+u32 crc32c_generic(u32, const void *, size_t);
 
 char *dev_to_name(dev_t);
 char *dev_to_path(dev_t);